@@ -2,59 +2,301 @@
 #define CLIENT_HANDLER_H
 
 #include "server.h"
+#include "offload.h"
 
 /**
  * Client handling function prototypes
  */
 
 /**
- * Initialize client information structure
- * @param client Pointer to client_info_t structure
+ * Add a new client to the server's connection table
+ * @param server Pointer to server structure
+ * @param client_fd Client socket file descriptor
+ * @param client_addr Client address, of any family; Unix peers also get
+ *                    their credentials recorded
+ * @param client_addr_len Length of the address
+ * @return The added client, NULL if server is full
  */
-void init_client_info(client_info_t *client);
+client_info_t *add_client(server_t *server, int client_fd, const struct sockaddr *client_addr,
+                          socklen_t client_addr_len);
 
 /**
- * Add a new client to the server's client list
- * @param server Pointer to server structure
- * @param client_fd Client socket file descriptor
- * @param client_addr Client address information
- * @return Index of the added client, -1 if server is full
+ * Describe a client for logs and broadcasts: its address, or for Unix
+ * domain peers the process and user that connected
+ * @param client Client to describe
+ * @param buffer Buffer to store the description
+ * @param buffer_size Size of the buffer
  */
-int add_client(server_t *server, int client_fd, struct sockaddr_in *client_addr);
+void describe_client(const client_info_t *client, char *buffer, size_t buffer_size);
 
 /**
  * Read message from client socket
+ * @param loop Event loop watching the socket
  * @param client_fd Client socket file descriptor
  * @param buffer Buffer to store the message
  * @param buffer_size Size of the buffer
- * @return Number of bytes read, 0 if client disconnected, -1 on error
+ * @return Number of bytes read, 0 if client disconnected, -1 on error,
+ *         -2 if the non-blocking socket has no data available
  */
-int read_client_message(int client_fd, char *buffer, size_t buffer_size);
+int read_client_message(event_loop_t *loop, int client_fd, char *buffer, size_t buffer_size);
 
 /**
- * Send message to client socket
+ * Send message to client socket without blocking
  * @param client_fd Client socket file descriptor
  * @param message Message to send
  * @param message_len Length of the message
- * @return Number of bytes sent, -1 on error
+ * @return Number of bytes sent (may be short, 0 if the socket is full), -1 on error
  */
 int send_client_message(int client_fd, const char *message, size_t message_len);
 
 /**
- * Process and echo client message
- * @param server Pointer to server structure
+ * Gather-write an iovec array to a client socket without blocking
  * @param client_fd Client socket file descriptor
- * @param buffer Message buffer
- * @param bytes_received Number of bytes received
+ * @param iov Array of buffers
+ * @param iovcnt Number of buffers (at most IOV_MAX)
+ * @return Number of bytes sent (may be short, 0 if the socket is full), -1 on error
+ */
+ssize_t send_client_iov(int client_fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Send message to a client, queueing whatever the socket does not accept
+ * immediately. Pauses reading from the client when its queue passes
+ * OUTPUT_HIGH_WATER.
+ * @param server Pointer to server structure
+ * @param client Destination client
+ * @param message Message to send
+ * @param message_len Length of the message
+ * @return 0 on success, -1 if the client should be removed
+ */
+int queue_client_message(server_t *server, client_info_t *client, const char *message, size_t message_len);
+
+/**
+ * Gather-write buffers to a client, queueing whatever the socket does not
+ * accept immediately
+ * @param server Pointer to server structure
+ * @param client Destination client
+ * @param iov Array of buffers
+ * @param iovcnt Number of buffers (at most IOV_MAX)
+ * @param zerocopy The buffers point into the client's input buffer and may
+ *                 be sent with MSG_ZEROCOPY if at least zerocopy_threshold bytes,
+ *                 or straight from where they are by an event loop that
+ *                 makes the sends itself
+ * @return 0 on success, -1 if the client should be removed
+ */
+int queue_client_iov(server_t *server, client_info_t *client, const struct iovec *iov, int iovcnt,
+                     int zerocopy);
+
+/**
+ * Send a shared buffer to a client, queueing a reference to whatever the
+ * socket does not accept immediately. The buffer is never copied.
+ * @param server Pointer to server structure
+ * @param client Destination client
+ * @param buffer Shared buffer; the client's queue takes its own reference
+ * @return 0 on success, -1 if the client should be removed
+ */
+int queue_client_shared(server_t *server, client_info_t *client, shared_buffer_t *buffer);
+
+/**
+ * Send the front of a client's output queue through the event loop, when
+ * it completes sends itself (EVENT_LOOP_COMPLETIONS) and none is in flight
+ * @param server Pointer to server structure
+ * @param client Client with queued output
+ * @return 0 on success, -1 if the client should be removed
+ */
+int start_client_send(server_t *server, client_info_t *client);
+
+/**
+ * Close a client on the next timer tick, where it cannot be removed on
+ * the spot (for example in the middle of a broadcast)
+ * @param server Pointer to server structure
+ * @param client Client to close
+ * @param reason Disconnect reason to record
+ */
+void evict_client(server_t *server, client_info_t *client, disconnect_reason_t reason);
+
+/**
+ * Queue a client at the end of the worker's ready list, to get a turn on
+ * the next pass over it (no-op if it is queued already)
+ * @param server Pointer to server structure
+ * @param client Client with work left over
+ */
+void schedule_client_turn(server_t *server, client_info_t *client);
+
+/**
+ * Take a client off the ready list (no-op if it is not queued)
+ * @param server Pointer to server structure
+ * @param client Client to unqueue
+ */
+void cancel_client_turn(server_t *server, client_info_t *client);
+
+/**
+ * Add the rate-limit tokens a client earned since the last refill
+ * @param server Pointer to server structure
+ * @param client Client to refill
+ */
+void refill_client_tokens(server_t *server, client_info_t *client);
+
+/**
+ * Charge bytes read from a client to its rate limit, throttling it when
+ * its tokens run out
+ * @param server Pointer to server structure
+ * @param client Client that sent the bytes
+ * @param bytes Number of bytes read
+ * @return 0 on success, -1 if the client should be removed
+ */
+int charge_client_tokens(server_t *server, client_info_t *client, size_t bytes);
+
+/**
+ * Register the event interest matching the client's state: readable
+ * unless paused or throttled, writable while output is queued and no
+ * send is in flight
+ * @param server Pointer to server structure
+ * @param client Client to update
+ * @return 0 on success, -1 on error
+ */
+int update_client_interest(server_t *server, client_info_t *client);
+
+/**
+ * Process one client message, adding the request handler's reply to the
+ * server's reply batch
+ * @param server Pointer to server structure
+ * @param client Client that sent the message
+ * @param buffer Message buffer (one frame, NUL-terminated)
+ * @param bytes_received Length of the message
+ * @return 0 on success, -1 on error
+ */
+int process_client_message(server_t *server, client_info_t *client, char *buffer, int bytes_received);
+
+/**
+ * Process one binary frame: PING, JOIN and PUBLISH are answered here, any
+ * other opcode by the request handler. The reply goes into the server's
+ * reply batch.
+ * @param server Pointer to server structure
+ * @param client Client that sent the frame
+ * @param frame The frame's header in the input buffer; the reply header
+ *              is written over it
+ * @param header Decoded frame header
+ * @param payload header->length payload bytes, or NULL if the payload is
+ *                too large to buffer and streams in separately
+ * @return 0 on success, -1 on error
+ */
+int process_binary_frame(server_t *server, client_info_t *client, char *frame,
+                         const binary_header_t *header, const char *payload);
+
+/**
+ * Process every complete frame buffered for a client and send all of
+ * their replies in a single batch. The first byte a client sends picks
+ * newline-delimited text or binary framing (see protocol.h).
+ * @param server Pointer to server structure
+ * @param client Client whose input buffer received data
+ * @return 0 on success, -1 if replies could not be sent, -2 if a message
+ *         exceeded MAX_FRAME_SIZE; the client should be removed on error
+ */
+int process_client_input(server_t *server, client_info_t *client);
+
+/**
+ * Send the replies batched by process_client_message() to a client
+ * @param server Pointer to server structure
+ * @param client Destination client
+ * @return 0 on success, -1 if the client should be removed
+ */
+int flush_client_replies(server_t *server, client_info_t *client);
+
+/**
+ * Send the reply of an offloaded frame, after the replies batched before
+ * it. A binary reply's header is encoded here from the job's status and
+ * reply length.
+ * @param server Pointer to server structure
+ * @param client Destination client
+ * @param job Job that has run
+ * @return 0 on success, -1 if the client should be removed
+ */
+int send_offloaded_reply(server_t *server, client_info_t *client, offload_job_t *job);
+
+/**
+ * Send the first pieces of the reply batch and keep the rest batched, for
+ * a reply that is still being built when the batch fills up
+ * @param server Pointer to server structure
+ * @param client Destination client
+ * @param count Number of iovecs to send
+ * @param scratch_start Scratch bytes the sent pieces use; later bytes belong
+ *                      to the kept pieces
+ * @return 0 on success, -1 if the client should be removed
+ */
+int flush_reply_prefix(server_t *server, client_info_t *client, int count, size_t scratch_start);
+
+/**
+ * Check whether a client's input should go through splice_client_stream():
+ * a bulk echo payload is streaming and nothing is buffered ahead of it
+ * @param server Pointer to server structure
+ * @param client Client to check
+ * @return 1 if the payload should be spliced, 0 otherwise
+ */
+int client_can_splice(server_t *server, client_info_t *client);
+
+/**
+ * Echo a streamed payload socket -> pipe -> socket with splice(), until
+ * it is complete, the socket would block either way or the turn's read
+ * budget is spent
+ * @param server Pointer to server structure
+ * @param client Client whose payload is streaming
+ * @param budget Bytes that may still be read this turn; reduced by the bytes read
+ * @param reason Receives the disconnect reason when -2 is returned
+ * @return 0 when the payload is done and normal reads resume, 1 when the
+ *         socket would block, 2 when the budget is spent, -1 if no pipe was
+ *         available and the payload has to be copied instead, -2 if the
+ *         client should be removed
+ */
+int splice_client_stream(server_t *server, client_info_t *client, size_t *budget,
+                         disconnect_reason_t *reason);
+
+/**
+ * Detach a client's pipe, keeping it for reuse when it is empty
+ * @param server Pointer to server structure
+ * @param client Client holding a pipe
+ */
+void release_client_pipe(server_t *server, client_info_t *client);
+
+/**
+ * Read a client's zero-copy completion notifications from its socket
+ * error queue, returning buffers no send references any more to the pool
+ * @param server Pointer to server structure
+ * @param client Client with zero-copy sends in flight
+ */
+void reap_zerocopy_completions(server_t *server, client_info_t *client);
+
+/**
+ * Return orphaned zero-copy buffers of closed connections to the pool
+ * @param server Pointer to server structure
+ * @param all Release every orphan, not only those whose time is up
+ */
+void release_zerocopy_orphans(server_t *server, int all);
+
+/**
+ * Compute when a client next times out, from its activity ticks
+ * @param server Pointer to server structure
+ * @param client Client to check
+ * @param reason Receives the disconnect reason for that deadline (may be NULL)
+ * @return Deadline tick, 0 if no timeout applies
+ */
+uint64_t client_timeout_deadline(server_t *server, client_info_t *client,
+                                 disconnect_reason_t *reason);
+
+/**
+ * Make sure the client's timer fires no later than its current deadline.
+ * A timer that is already due earlier is left alone and re-armed when it
+ * fires, so activity only updates ticks and never touches the wheel.
+ * @param server Pointer to server structure
+ * @param client Client to schedule
  */
-void process_client_message(server_t *server, int client_fd, char *buffer, int bytes_received);
+void schedule_client_timeout(server_t *server, client_info_t *client);
 
 /**
- * Clean up client resources and remove from server
+ * Close client socket and release its connection table entry
  * @param server Pointer to server structure
- * @param client_index Index of client to remove
+ * @param client Client to clean up
  */
-void cleanup_client(server_t *server, int client_index);
+void cleanup_client(server_t *server, client_info_t *client);
 
 /**
  * Get count of active clients
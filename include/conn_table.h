@@ -0,0 +1,140 @@
+#ifndef CONN_TABLE_H
+#define CONN_TABLE_H
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include "output_queue.h"
+#include "stream_buffer.h"
+#include "mem_pool.h"
+#include "timer_wheel.h"
+#include "protocol.h"
+#include "metrics.h"
+#include "room.h"
+
+// Initial number of descriptor slots in the table
+#define CONN_TABLE_INITIAL_CAPACITY 1024
+
+struct zerocopy_buffer;
+
+/**
+ * Cold per-connection data, only touched on connect, disconnect and logging
+ */
+typedef struct {
+    struct sockaddr_storage address; // Client address, of any family
+    socklen_t address_length;       // Bytes of address in use
+    pid_t peer_pid;                 // Unix peers: credentials when they connected,
+    uid_t peer_uid;                 // from SO_PEERCRED
+    gid_t peer_gid;
+    time_t connected_at;            // When the connection was accepted
+} client_meta_t;
+
+/**
+ * Hot per-connection data, touched on every event. Kept small so that
+ * neighbouring connections in the slab share as few cache lines as possible.
+ */
+typedef struct client_info {
+    client_meta_t *meta;            // Cold data, stored in a separate slab. Holds the slab's
+                                    // free list link once released, so `active` stays valid
+                                    // for events still queued for the connection
+    int socket_fd;                  // Client socket file descriptor
+    int unix_peer;                  // Connected over a Unix domain socket
+    int active;                     // Whether this connection is live (1) or released (0)
+    unsigned interest;              // EVENT_* flags registered with the event loop
+    int read_paused;                // Reading stopped until output drains
+    int throttled;                  // Reading stopped until the rate limit allows more
+    int input_backlog;              // Complete frames left for the next turn
+    struct offload_job *offload;    // Frame being handled on the offload pool, NULL if none
+    int ready;                      // Queued on the worker's ready list
+    struct client_info *ready_next; // Ready list links
+    struct client_info *ready_prev;
+    int64_t tokens;                 // Rate-limit bytes available (negative when in debt)
+    uint64_t tokens_tick;           // Tick tokens were last refilled
+    uint64_t throttle_until;        // Tick reading may resume, while throttled
+    output_queue_t output;          // Bytes waiting for the socket to become writable
+    size_t sending;                 // Queued bytes in a send the event loop has in flight
+    int input_borrowed;             // Queued output points into the input buffer
+    stream_buffer_t input;          // Bytes received but not yet framed
+    size_t scan_offset;             // Input bytes already searched for a newline
+    protocol_t protocol;            // Framing, chosen by the first byte received
+    size_t frame_remaining;         // Payload bytes of a streamed binary frame still to come
+    int frame_discard;              // Drop (rather than echo) the streamed payload
+    int pipe_fds[2];                // Pipe carrying a spliced payload, -1 if none
+    size_t pipe_bytes;              // Bytes in the pipe not yet sent to the socket
+    struct zerocopy_buffer *zerocopy_pending; // Retired buffers zero-copy sends still use
+    uint32_t zerocopy_next_id;      // Id the kernel gives the next MSG_ZEROCOPY send
+    uint32_t input_zerocopy_sends;  // Zero-copy sends that referenced the input buffer
+    room_t *room;                   // Broadcast room, NULL if none
+    struct client_info *room_next;  // Other members of the room
+    struct client_info *room_prev;
+    subscriber_policy_t room_policy; // Handling of broadcasts while backlogged
+    void *handler_state;            // Owned by the request handler, NULL until it sets it
+    int evicting;                   // Closed on the next timer tick, for evict_reason
+    disconnect_reason_t evict_reason;
+    timer_entry_t timer;            // Next timeout check, rescheduled lazily
+    uint64_t last_active;           // Tick of the last read or write progress
+    uint64_t frame_started;         // Tick the pending partial frame began, 0 if none
+    uint64_t write_progress;        // Tick queued output last moved, 0 if none queued
+} client_info_t;
+
+/**
+ * Connection table indexed directly by file descriptor. Hot and cold
+ * halves of each connection come from two slabs, so the hot halves of
+ * all connections are packed together.
+ */
+typedef struct {
+    client_info_t **by_fd;          // Connection per descriptor, NULL if none
+    int capacity;                   // Number of slots in by_fd
+    int count;                      // Number of live connections
+    int max_clients;                // Limit on live connections
+    slab_t hot;                     // client_info_t objects
+    slab_t cold;                    // client_meta_t objects
+    slab_t refs;                    // Output queue references to shared buffers
+    buffer_pool_t *buffers;         // Pool for connection I/O buffers
+} conn_table_t;
+
+/**
+ * Connection table function prototypes
+ */
+
+/**
+ * Initialize an empty connection table
+ * @param table Pointer to conn_table_t structure
+ * @param max_clients Maximum number of live connections
+ * @param buffers Pool that connection input and output buffers come from
+ * @param use_huge_pages Try to back connection slabs with huge pages
+ * @return 0 on success, -1 on error
+ */
+int conn_table_init(conn_table_t *table, int max_clients, buffer_pool_t *buffers,
+                    int use_huge_pages);
+
+/**
+ * Free all memory held by the table (does not close sockets)
+ * @param table Pointer to connection table
+ */
+void conn_table_destroy(conn_table_t *table);
+
+/**
+ * Allocate a connection object from the slabs and index it by descriptor
+ * @param table Pointer to connection table
+ * @param fd Client socket file descriptor
+ * @return Connection, or NULL if the table is full or out of memory
+ */
+client_info_t *conn_table_insert(conn_table_t *table, int fd);
+
+/**
+ * Look up the connection for a descriptor
+ * @param table Pointer to connection table
+ * @param fd Client socket file descriptor
+ * @return Connection, or NULL if none is registered
+ */
+client_info_t *conn_table_lookup(conn_table_t *table, int fd);
+
+/**
+ * Unindex a connection and return it to the slabs
+ * @param table Pointer to connection table
+ * @param client Connection to release
+ */
+void conn_table_remove(conn_table_t *table, client_info_t *client);
+
+#endif // CONN_TABLE_H
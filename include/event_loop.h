@@ -0,0 +1,255 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#if defined(EVENT_BACKEND_SELECT)
+#include <sys/select.h>
+#elif defined(EVENT_BACKEND_URING)
+#include <linux/io_uring.h>
+#else
+#include <sys/epoll.h>
+#endif
+
+// Maximum number of readiness events handled per wakeup
+#define EVENT_BATCH_SIZE 256
+
+// Interest / readiness flags
+#define EVENT_READ   0x01
+#define EVENT_WRITE  0x02
+#define EVENT_HANGUP 0x04   // Error or peer hangup (always reported)
+#define EVENT_SENT   0x08   // A send started with event_loop_send() finished
+
+// Registration modes, given to event_loop_add() with the interest. They
+// tell a completion backend which I/O to do for the descriptor; readiness
+// backends ignore them.
+#define EVENT_ACCEPT 0x10   // Listener: connections are taken with event_loop_accept()
+#define EVENT_STREAM 0x20   // Connection: read with event_loop_recv(), written with event_loop_send()
+
+// Most buffers one event_loop_send() call takes
+#define EVENT_SEND_MAX_IOV 64
+
+/*
+ * Readiness backends (epoll, select) report that a descriptor can be read
+ * or written and the caller makes the system calls. A completion backend
+ * (io_uring) does the socket I/O itself: listeners and connections have
+ * accepts and receives running in the kernel, whose results wait in the
+ * loop for event_loop_accept() and event_loop_recv(), and
+ * event_loop_send() only queues a send, which goes to the kernel with the
+ * next event_loop_wait() and is reported back with EVENT_SENT. Callers
+ * test EVENT_LOOP_COMPLETIONS to pick their output path.
+ */
+#ifdef EVENT_BACKEND_URING
+#define EVENT_LOOP_COMPLETIONS 1
+#else
+#define EVENT_LOOP_COMPLETIONS 0
+#endif
+
+/**
+ * A single notification returned by event_loop_wait()
+ */
+typedef struct {
+    void *data;                     // Pointer registered with the descriptor
+    unsigned events;                // EVENT_* flags that are ready
+    long result;                    // EVENT_SENT: bytes sent, or a negated errno
+} loop_event_t;
+
+#ifdef EVENT_BACKEND_URING
+/**
+ * Per-descriptor registration for the io_uring backend. Generations are
+ * packed into every request's user_data so completions from requests of
+ * an earlier registration, or from a poll that was replaced, are
+ * recognised and dropped.
+ */
+typedef struct {
+    void *data;                     // Pointer handed back with events
+    unsigned events;                // Current EVENT_* interest and mode, 0 if unused
+    unsigned generation;            // Bumped when the descriptor is added or removed
+    unsigned poll_generation;       // Bumped every time the poll is replaced
+    unsigned state;                 // Requests outstanding and lists joined (URING_* flags)
+    unsigned ready;                 // EVENT_* flags not reported yet
+    int ready_next;                 // Next descriptor on the ready list
+    int starved_next;               // Next descriptor waiting for provided buffers
+    long sent;                      // Result of the last send, reported with EVENT_SENT
+    int recv_result;                // Stream: 1 while open, 0 after EOF, -errno after an error
+    int held_head;                  // Stream: oldest provided buffer holding data, -1 if none
+    int held_tail;                  // Stream: newest one
+    unsigned held_count;            // Stream: buffers held
+    unsigned held_offset;           // Stream: bytes of the oldest one already read
+    int accept_head;                // Listener: oldest connection accepted, -1 if none
+    int accept_tail;                // Listener: newest one
+    int accept_error;               // Listener: errno that ended the accept request, 0 if none
+    int accept_next;                // Next connection on its listener's queue
+    struct uring_send *send;        // Message of the current send, allocated on first use
+} uring_registration_t;
+
+/**
+ * A provided receive buffer, while it holds data for a descriptor
+ */
+typedef struct {
+    unsigned length;                // Bytes received into the buffer
+    int next;                       // Next buffer held by the same descriptor, -1 if last
+} uring_buffer_t;
+#endif
+
+/**
+ * Event loop state. The layout depends on the backend selected at build
+ * time (see BACKEND in the Makefile); callers only use the functions below.
+ */
+typedef struct {
+#if defined(EVENT_BACKEND_SELECT)
+    fd_set read_interest;           // Descriptors watched for reading
+    fd_set write_interest;          // Descriptors watched for writing
+    void *data[FD_SETSIZE];         // Registered pointer per descriptor
+    int max_fd;                     // Highest registered descriptor
+    int scan_start;                 // Descriptor the next scan for ready ones starts at
+#elif defined(EVENT_BACKEND_URING)
+    int ring_fd;                    // io_uring instance
+    void *sq_ring;                  // Mapped submission ring
+    void *cq_ring;                  // Mapped completion ring (may alias sq_ring)
+    struct io_uring_sqe *sqes;      // Mapped submission queue entries
+    size_t sq_ring_size;            // Mapping sizes, needed for munmap()
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned *sq_head;              // Ring indices shared with the kernel
+    unsigned *sq_tail;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned sq_mask;
+    unsigned cq_mask;
+    unsigned sq_entries;
+    struct io_uring_cqe *cqes;      // Completion entries
+    uring_registration_t *regs;     // Registrations indexed by descriptor
+    int regs_capacity;              // Number of entries in regs
+    int ready_head;                 // Descriptors with events to report, oldest first
+    int ready_tail;
+    int starved_head;               // Descriptors whose receive ran out of buffers
+    unsigned inflight;              // Requests the kernel has not completed yet
+    int quiesced;                   // Start no more receives, accepts or polls
+    struct io_uring_buf_ring *buf_ring; // Provided buffers receives pick from
+    char *buffers;                  // Memory of the provided buffers
+    size_t buffers_size;            // Mapping size of buf_ring and buffers
+    unsigned buf_ring_tail;         // Next buf_ring slot to fill
+    unsigned buffers_free;          // Buffers currently in buf_ring
+    uring_buffer_t *buffer_info;    // Per buffer id, while held
+#else
+    int epoll_fd;                   // epoll instance
+    struct epoll_event events[EVENT_BATCH_SIZE]; // Batch filled by epoll_wait()
+#endif
+} event_loop_t;
+
+/**
+ * Event loop function prototypes
+ */
+
+/**
+ * Initialize an event loop
+ * @param loop Pointer to event_loop_t structure
+ * @return 0 on success, -1 on error
+ */
+int event_loop_init(event_loop_t *loop);
+
+/**
+ * Release all resources held by an event loop
+ * @param loop Pointer to event_loop_t structure
+ */
+void event_loop_destroy(event_loop_t *loop);
+
+/**
+ * Start watching a descriptor. Readiness is edge-triggered where the
+ * backend supports it, so callers must drain sockets until EAGAIN.
+ * @param loop Pointer to event loop
+ * @param fd File descriptor to watch
+ * @param events EVENT_READ and/or EVENT_WRITE, plus EVENT_ACCEPT or
+ *               EVENT_STREAM for sockets whose I/O goes through the loop
+ * @param data Pointer handed back with every event for this descriptor
+ * @return 0 on success, -1 on error
+ */
+int event_loop_add(event_loop_t *loop, int fd, unsigned events, void *data);
+
+/**
+ * Change the interest set of a watched descriptor. The mode given to
+ * event_loop_add() stays.
+ * @param loop Pointer to event loop
+ * @param fd File descriptor already added to the loop
+ * @param events New EVENT_READ / EVENT_WRITE interest
+ * @param data Pointer handed back with every event for this descriptor
+ * @return 0 on success, -1 on error
+ */
+int event_loop_modify(event_loop_t *loop, int fd, unsigned events, void *data);
+
+/**
+ * Stop watching a descriptor. A queued send goes to the kernel first, so
+ * the descriptor may be closed right after. Connections a listener's
+ * accept already took stay available to event_loop_accept() until the
+ * descriptor is added again.
+ * @param loop Pointer to event loop
+ * @param fd File descriptor to remove
+ */
+void event_loop_remove(event_loop_t *loop, int fd);
+
+/**
+ * Wait for readiness on the watched descriptors, or for completions.
+ * Sends queued since the last call are submitted by the same system call.
+ * @param loop Pointer to event loop
+ * @param events Array receiving ready events
+ * @param max_events Capacity of the events array
+ * @param timeout_ms Timeout in milliseconds, -1 to wait forever
+ * @return Number of events stored, 0 on timeout, -1 on error (errno set)
+ */
+int event_loop_wait(event_loop_t *loop, loop_event_t *events, int max_events, int timeout_ms);
+
+/**
+ * Take one connection from an EVENT_ACCEPT listener, non-blocking and
+ * close-on-exec (accept4() on readiness backends)
+ * @param loop Pointer to event loop
+ * @param listen_fd Listening socket
+ * @param addr Receives the peer address
+ * @param addr_len Size of addr in, length of the address out
+ * @return Connected socket, -1 on error (errno EAGAIN if none is pending)
+ */
+int event_loop_accept(event_loop_t *loop, int listen_fd, struct sockaddr *addr, socklen_t *addr_len);
+
+/**
+ * Read from an EVENT_STREAM socket (recv() on readiness backends)
+ * @param loop Pointer to event loop
+ * @param fd Connected socket
+ * @param buffer Buffer to fill
+ * @param length Size of the buffer
+ * @return Bytes read, 0 at end of stream, -1 on error (errno EAGAIN if no
+ *         data is available)
+ */
+ssize_t event_loop_recv(event_loop_t *loop, int fd, void *buffer, size_t length);
+
+/**
+ * Gather-write to an EVENT_STREAM socket. Readiness backends send at once
+ * and return the bytes sent. Completion backends queue one send per
+ * descriptor, return 0 and report the result with EVENT_SENT; the
+ * buffers must stay unchanged until then, the iovec array need not.
+ * @param loop Pointer to event loop
+ * @param fd Connected socket
+ * @param iov Array of buffers
+ * @param iovcnt Number of buffers, at most EVENT_SEND_MAX_IOV
+ * @return Bytes sent (0 if queued, or if the socket is full), -1 on error
+ */
+ssize_t event_loop_send(event_loop_t *loop, int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Stop every accept, receive and poll the kernel runs for the loop and
+ * wait for all requests to finish, so the descriptors can be handed to
+ * another process. What was accepted or received stays available, and
+ * finished sends are still reported. Nothing to do on readiness backends.
+ * @param loop Pointer to event loop
+ */
+void event_loop_quiesce(event_loop_t *loop);
+
+/**
+ * Get a human readable name for the compiled-in backend
+ * @return Backend name
+ */
+const char *event_loop_backend_name(void);
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,180 @@
+#ifndef HANDLER_H
+#define HANDLER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "protocol.h"
+
+struct server;
+struct client_info;
+struct offload_job;
+
+/*
+ * Request handlers implement the application protocol on top of the
+ * server's framing. The server reads, frames and batches; a handler only
+ * sees complete frames and describes replies. One handler is chosen at
+ * startup (-e NAME) and serves every connection of every worker.
+ *
+ * Text frames are lines without their newline. Binary frames are the
+ * payloads of every opcode the server does not handle itself (PING, JOIN
+ * and PUBLISH); the server writes the reply header, carrying the request
+ * id and opcode, the status set with reply_set_status() and the length of
+ * everything added to the reply.
+ *
+ * Work too heavy for an event loop goes to the offload pool with
+ * reply_offload() (see offload.h): the frame is copied, the reply is built
+ * on a pool thread, and the connection reads no further frames until that
+ * reply has been sent.
+ */
+
+/**
+ * Read-only view of one received frame. The bytes stay valid until the
+ * batch of replies they belong to is sent, so a reply may reference them.
+ */
+typedef struct {
+    const char *data;               // Frame payload (text frames are NUL-terminated)
+    size_t length;                  // Payload bytes
+    protocol_t protocol;            // PROTOCOL_TEXT or PROTOCOL_BINARY
+    uint32_t request_id;            // Binary frames only
+    uint16_t opcode;                // Binary frames only
+} frame_view_t;
+
+/**
+ * Reply being built for one frame. Pieces go into the worker's reply
+ * batch, which is sent with one gather write once the client's input is
+ * processed; only bytes the socket refuses are copied to the output queue.
+ */
+typedef struct {
+    struct server *server;          // Worker serving the connection
+    struct client_info *client;     // Connection the reply goes to
+    char *header;                   // Binary reply header (over the request's), NULL for text
+    int header_iov;                 // Batch index of the header, -1 for text
+    size_t scratch_start;           // Scratch offset where this reply's copies begin
+    size_t length;                  // Payload bytes added so far
+    uint16_t status;                // BINARY_STATUS_* for binary replies
+} reply_builder_t;
+
+/**
+ * Work done for an offloaded frame on a pool thread. It may only touch
+ * the job and the frame, building the reply with offload_write(),
+ * offload_printf() and offload_set_status().
+ * @return 0 on success, -1 to close the connection
+ */
+typedef int (*offload_fn)(struct offload_job *job, const frame_view_t *frame);
+
+/**
+ * Application protocol callbacks. Only on_frame is required. Callbacks
+ * run on the worker's event loop thread and must not block.
+ */
+typedef struct request_handler {
+    const char *name;               // Name selecting the handler on the command line
+    const char *description;        // One line for the usage text
+    int stream_echo;                // Echo binary ECHO frames over MAX_FRAME_SIZE by passing
+                                    // their payload through (or splicing it); otherwise such
+                                    // frames are answered BINARY_STATUS_TOO_LARGE
+
+    /**
+     * A connection was accepted. Per-connection state goes in
+     * client->handler_state.
+     * @return 0 on success, -1 to refuse the connection
+     */
+    int (*on_connect)(struct server *server, struct client_info *client);
+
+    /**
+     * A complete frame arrived. Frames of one connection are delivered in
+     * order, and replies are sent in the order they are built.
+     * @return 0 on success, -1 to close the connection
+     */
+    int (*on_frame)(reply_builder_t *reply, const frame_view_t *frame);
+
+    /**
+     * The connection is closing; release client->handler_state
+     */
+    void (*on_close)(struct server *server, struct client_info *client);
+} request_handler_t;
+
+/**
+ * Handler function prototypes
+ */
+
+/**
+ * Find a built-in handler by name
+ * @param name Handler name
+ * @return Handler, NULL if there is none by that name
+ */
+const request_handler_t *handler_find(const char *name);
+
+/**
+ * Get a built-in handler by position, for listing them
+ * @param index Position, from 0
+ * @return Handler, NULL past the last one
+ */
+const request_handler_t *handler_at(int index);
+
+/**
+ * Add bytes that stay valid until the reply is sent, such as static data
+ * or the frame itself. Nothing is copied.
+ * @param reply Reply being built
+ * @param data Bytes to reference
+ * @param length Number of bytes
+ * @return 0 on success, -1 if replies could not be sent
+ */
+int reply_add(reply_builder_t *reply, const void *data, size_t length);
+
+/**
+ * Copy bytes into the reply, for data that may change or go away before
+ * the reply is sent
+ * @param reply Reply being built
+ * @param data Bytes to copy
+ * @param length Number of bytes, at most REPLY_SCRATCH_SIZE
+ * @return 0 on success, -1 if replies could not be sent or the reply is too large
+ */
+int reply_write(reply_builder_t *reply, const void *data, size_t length);
+
+/**
+ * Make room in the reply batch, sending earlier replies if needed, and
+ * get its free scratch space to fill in place. Nothing is sent until the
+ * next reply function call, so the space can be filled under a lock.
+ * @param reply Reply being built
+ * @param length Scratch bytes needed, at most REPLY_SCRATCH_SIZE
+ * @param available Receives the free scratch bytes, at least length
+ * @return Start of the free scratch, NULL if replies could not be sent or
+ *         length is too large
+ */
+char *reply_reserve(reply_builder_t *reply, size_t length, size_t *available);
+
+/**
+ * Add bytes written into the space from reply_reserve() to the reply
+ * @param reply Reply being built
+ * @param length Bytes written, at most what reply_reserve() made available
+ */
+void reply_commit(reply_builder_t *reply, size_t length);
+
+/**
+ * Format text into the reply (as snprintf)
+ * @param reply Reply being built
+ * @param format printf-style format
+ * @return 0 on success, -1 if replies could not be sent or the text is too long
+ */
+int reply_printf(reply_builder_t *reply, const char *format, ...);
+
+/**
+ * Set the status of a binary reply (ignored for text)
+ * @param reply Reply being built
+ * @param status BINARY_STATUS_* value
+ */
+void reply_set_status(reply_builder_t *reply, uint16_t status);
+
+/**
+ * Build the reply on the offload pool instead. The frame is copied, so it
+ * need not outlive the call; nothing may have been added to the reply, and
+ * nothing may be added after. Without pool threads, or with the worker's
+ * queue full, the job runs here and now.
+ * @param reply Reply being built
+ * @param frame Frame to hand to run
+ * @param run Work to do on the pool thread
+ * @return 0 on success, -1 if the job failed or replies could not be sent
+ */
+int reply_offload(reply_builder_t *reply, const frame_view_t *frame, offload_fn run);
+
+#endif // HANDLER_H
@@ -0,0 +1,76 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+// Sub-buckets per power of two; relative error of a recorded value is below 1/64
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_HALF_COUNT (HISTOGRAM_SUB_COUNT / 2)
+
+// Largest value tracked exactly enough (2^40 ns is about 18 minutes); larger values are clamped
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS \
+    (HISTOGRAM_SUB_COUNT + (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_HALF_COUNT)
+
+/**
+ * Log-linear histogram in the style of HdrHistogram. Values below
+ * HISTOGRAM_SUB_COUNT get a bucket each; above that every power of two is
+ * split into HISTOGRAM_HALF_COUNT equal buckets, so recording is a couple
+ * of shifts and percentiles keep two significant digits at any scale.
+ */
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS]; // Samples per bucket
+    uint64_t count;                 // Total samples
+    uint64_t min;                   // Smallest sample (exact)
+    uint64_t max;                   // Largest sample (exact)
+    uint64_t sum;                   // Sum of samples, for the mean
+} histogram_t;
+
+/**
+ * Histogram function prototypes
+ */
+
+/**
+ * Reset a histogram to empty
+ * @param histogram Pointer to histogram_t structure
+ */
+void histogram_init(histogram_t *histogram);
+
+/**
+ * Record one sample
+ * @param histogram Pointer to histogram
+ * @param value Sample value (typically nanoseconds)
+ */
+void histogram_record(histogram_t *histogram, uint64_t value);
+
+/**
+ * Get the bucket a value is counted in
+ * @param value Sample value
+ * @return Index into histogram_t.counts
+ */
+int histogram_bucket(uint64_t value);
+
+/**
+ * Add every sample of one histogram to another
+ * @param target Histogram receiving the samples
+ * @param source Histogram to add
+ */
+void histogram_merge(histogram_t *target, const histogram_t *source);
+
+/**
+ * Get the value at a percentile
+ * @param histogram Pointer to histogram
+ * @param percentile Percentile between 0 and 100
+ * @return Upper bound of the bucket holding the percentile, 0 if empty
+ */
+uint64_t histogram_percentile(const histogram_t *histogram, double percentile);
+
+/**
+ * Get the mean of all samples
+ * @param histogram Pointer to histogram
+ * @return Mean value, 0 if empty
+ */
+double histogram_mean(const histogram_t *histogram);
+
+#endif // HISTOGRAM_H
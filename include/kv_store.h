@@ -0,0 +1,156 @@
+#ifndef KV_STORE_H
+#define KV_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * In-memory key-value store behind the kv handler. Every worker serves
+ * the same data, so the store is split into KV_SHARDS shards by key hash,
+ * each with its own lock, table and memory budget; a command holds one
+ * shard's lock for one table operation.
+ *
+ * A shard's table is open-addressed with linear probing over 32-byte
+ * slots, two per cache line. A slot holds a 32-bit hash tag and the key
+ * itself when it is up to KV_INLINE_KEY bytes (the first KV_INLINE_KEY
+ * bytes otherwise), so a lookup usually touches only the slot array.
+ * Deletion shifts the following entries back instead of leaving
+ * tombstones, so probes stay short however much churn there is.
+ *
+ * Growing never rehashes everything at once: the old table is kept, and
+ * every operation moves KV_MIGRATE_SLOTS of its slots to the new one
+ * until it is empty. Lookups check both meanwhile.
+ *
+ * When a shard's items would exceed its share of the memory limit, the
+ * CLOCK hand evicts entries that were not used since it last passed them.
+ */
+
+#define KV_SHARDS 16                // Independently locked shards (power of two)
+#define KV_INLINE_KEY 16            // Keys this long are stored in the slot itself
+#define KV_MAX_KEY 250              // Longest key, in bytes
+#define KV_INITIAL_SLOTS 64         // Slots of a shard's first table (power of two)
+#define KV_MIGRATE_SLOTS 32         // Old slots moved per operation while resizing
+#define KV_DEFAULT_MEMORY (64 * 1024 * 1024) // Default memory limit, all shards
+
+/**
+ * Outcome of a store operation
+ */
+typedef enum {
+    KV_OK = 0,
+    KV_NOT_FOUND,                   // No such key
+    KV_NOT_NUMBER,                  // INCR of a value that is not a 64-bit integer, or overflow
+    KV_TOO_LARGE,                   // Key over KV_MAX_KEY, item that does not fit beside
+                                    // the shard's slot arrays in its memory, or value over
+                                    // the kv_get() buffer
+    KV_NO_MEMORY                    // Allocation failed
+} kv_result_t;
+
+/**
+ * Value stored for a key, followed by the key when it is too long for the
+ * slot
+ */
+typedef struct {
+    size_t value_length;            // Bytes of value in use
+    size_t capacity;                // Value bytes allocated, for rewrites in place
+    char data[];                    // Long key, then the value
+} kv_item_t;
+
+/**
+ * One table entry
+ */
+typedef struct {
+    uint32_t tag;                   // Hash bits (also giving the home slot); 0 empty, 1 deleted
+    uint8_t key_length;             // Key bytes
+    uint8_t referenced;             // Used since the CLOCK hand last passed
+    uint16_t reserved;
+    char key[KV_INLINE_KEY];        // The key, or its first KV_INLINE_KEY bytes
+    kv_item_t *item;                // Value, and the rest of a long key
+} kv_slot_t;
+
+/**
+ * Open-addressed table of one shard
+ */
+typedef struct {
+    kv_slot_t *slots;               // Power-of-two array, NULL until first used
+    size_t mask;                    // Number of slots - 1
+    size_t count;                   // Entries in use
+} kv_table_t;
+
+/**
+ * One independently locked part of the store
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    kv_table_t table;               // Table entries are added to
+    kv_table_t old;                 // Table being moved into `table`, slots NULL if none
+    size_t migrate_cursor;          // Next old slot to move
+    size_t clock_hand;              // Next slot the CLOCK hand looks at
+    size_t memory;                  // Bytes of items and slot arrays
+    size_t limit;                   // Items are evicted beyond this many bytes
+    char pad[64];                   // Keeps neighbouring shards' locks apart
+} kv_shard_t;
+
+/**
+ * Key-value store function prototypes
+ */
+
+/**
+ * Set up the empty store; tables are allocated as keys arrive
+ * @param memory_limit Bytes the store may use, split evenly among the shards
+ * @return 0 on success, -1 on error
+ */
+int kv_start(size_t memory_limit);
+
+/**
+ * Free every entry and table
+ */
+void kv_stop(void);
+
+/**
+ * Look a key up and copy its value out. The shard is locked only for the
+ * lookup and the copy, so the buffer must be ready beforehand.
+ * @param key Key bytes
+ * @param key_length Key length
+ * @param buffer Receives the value
+ * @param capacity Size of buffer
+ * @param length Receives the value's length, also when it does not fit
+ * @return KV_OK, KV_NOT_FOUND, or KV_TOO_LARGE if the value is longer than
+ *         capacity (nothing is copied)
+ */
+kv_result_t kv_get(const char *key, size_t key_length, char *buffer, size_t capacity,
+                   size_t *length);
+
+/**
+ * Store a value, replacing any previous one
+ * @param key Key bytes
+ * @param key_length Key length, at most KV_MAX_KEY
+ * @param value Value bytes
+ * @param value_length Value length
+ * @param evicted Receives the number of entries evicted to make room
+ * @return KV_OK, KV_TOO_LARGE or KV_NO_MEMORY
+ */
+kv_result_t kv_set(const char *key, size_t key_length, const char *value, size_t value_length,
+                   size_t *evicted);
+
+/**
+ * Remove a key
+ * @param key Key bytes
+ * @param key_length Key length
+ * @return KV_OK or KV_NOT_FOUND
+ */
+kv_result_t kv_delete(const char *key, size_t key_length);
+
+/**
+ * Add to the decimal integer stored under a key; a missing key counts as 0
+ * @param key Key bytes
+ * @param key_length Key length, at most KV_MAX_KEY
+ * @param delta Amount to add
+ * @param result Receives the new value
+ * @param evicted Receives the number of entries evicted to make room
+ * @return KV_OK, KV_NOT_NUMBER, KV_TOO_LARGE or KV_NO_MEMORY
+ */
+kv_result_t kv_incr(const char *key, size_t key_length, int64_t delta, int64_t *result,
+                    size_t *evicted);
+
+#endif // KV_STORE_H
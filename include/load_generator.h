@@ -0,0 +1,83 @@
+#ifndef LOAD_GENERATOR_H
+#define LOAD_GENERATOR_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include "histogram.h"
+
+#define LOAD_DEFAULT_CONNECTIONS 100
+#define LOAD_DEFAULT_THREADS 1
+#define LOAD_DEFAULT_DURATION 10    // Seconds
+#define LOAD_DEFAULT_DEPTH 1        // Requests in flight per connection
+#define LOAD_DEFAULT_PAYLOAD 64     // Bytes per request, newline excluded
+#define LOAD_MAX_PAYLOAD 65000      // Stays below the server's frame limit
+#define LOAD_MAX_THREADS 256
+
+/**
+ * Load test parameters
+ */
+typedef struct {
+    const char *host;               // Server address
+    int port;                       // Server port
+    const char *unix_path;          // Unix socket instead ('@' for abstract), NULL for TCP
+    int connections;                // Connections, spread across threads
+    int idle_connections;           // Extra connections that stay open but never send
+    int threads;                    // Threads, one event loop each
+    int duration;                   // Measurement time in seconds
+    double rate;                    // Total requests per second, 0 for closed loop
+    int depth;                      // Maximum requests in flight per connection
+    int payload_size;               // Request size in bytes, newline excluded
+} load_config_t;
+
+/**
+ * Results of a load test, summed over all threads
+ */
+typedef struct {
+    uint64_t requests;              // Replies received
+    uint64_t bytes_sent;            // Request bytes written
+    uint64_t bytes_received;        // Reply bytes read
+    uint64_t connect_errors;        // Connections that could not be established
+    uint64_t io_errors;             // Connections lost during the test
+    uint64_t elapsed_ns;            // Measured time
+    histogram_t latency;            // Request to reply latency in nanoseconds
+} load_result_t;
+
+/**
+ * Load generator function prototypes
+ */
+
+/**
+ * Fill a configuration with defaults
+ * @param config Pointer to load_config_t structure
+ */
+void load_config_init(load_config_t *config);
+
+/**
+ * Build the address of the server: the Unix socket when a path is given,
+ * host and port otherwise
+ * @param host Server IPv4 address
+ * @param port Server port
+ * @param unix_path Unix socket path ('@' for abstract), NULL for TCP
+ * @param addr Receives the address
+ * @param addr_length Receives the length to pass to connect()
+ * @return 0 on success, -1 if the address is invalid
+ */
+int load_server_address(const char *host, int port, const char *unix_path,
+                        struct sockaddr_storage *addr, socklen_t *addr_length);
+
+/**
+ * Connect, drive traffic for the configured duration and collect results
+ * @param config Load test parameters
+ * @param result Receives the merged results
+ * @return 0 on success, -1 if the test could not run
+ */
+int run_load_test(const load_config_t *config, load_result_t *result);
+
+/**
+ * Print a human readable summary of a load test
+ * @param config Load test parameters
+ * @param result Results from run_load_test()
+ */
+void print_load_result(const load_config_t *config, const load_result_t *result);
+
+#endif // LOAD_GENERATOR_H
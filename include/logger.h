@@ -0,0 +1,78 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <time.h>
+#include "socket_utils.h"
+
+// Size of one log record, including its header
+#define LOG_RECORD_SIZE 512
+
+// Records per producer ring (power of two)
+#define LOG_RING_SIZE 4096
+
+// Maximum number of threads with their own ring
+#define LOG_MAX_RINGS 264
+
+// How long the logger thread sleeps when every ring is empty
+#define LOG_IDLE_SLEEP_MS 5
+
+/**
+ * Fixed-size log record copied into a producer ring
+ */
+typedef struct {
+    long long timestamp_ns;         // Cached clock at submission time
+    unsigned char type;             // log_type_t of the message
+    unsigned char to_stderr;        // Error message (printed to stderr)
+    char message[LOG_RECORD_SIZE - sizeof(long long) - 2]; // NUL-terminated text
+} log_record_t;
+
+/**
+ * Asynchronous logger function prototypes
+ *
+ * Each thread that logs gets its own lock-free single-producer ring. A
+ * background thread drains all rings, merging them by timestamp, formats
+ * the records and writes them out in batches, so logging never blocks an
+ * event loop. When a ring is full the record is dropped and counted instead.
+ */
+
+/**
+ * Start the background logger thread. Until it runs (and after
+ * logger_stop()), log functions write synchronously.
+ * @return 0 on success, -1 on error
+ */
+int logger_start(void);
+
+/**
+ * Write out every queued record and stop the logger thread
+ */
+void logger_stop(void);
+
+/**
+ * Queue a message for the logger thread
+ * @param type Type of log message
+ * @param to_stderr Non-zero for error messages
+ * @param message Message text (truncated to fit a record)
+ * @return 0 if queued or dropped, -1 if the logger is not running
+ */
+int logger_submit(log_type_t type, int to_stderr, const char *message);
+
+/**
+ * Refresh the calling thread's cached clock. Event loops call this once
+ * per iteration so that logging does not read the clock per message.
+ */
+void logger_update_clock(void);
+
+/**
+ * Current time for log timestamps: the cached clock on event loop
+ * threads, the real clock elsewhere
+ * @return Current time in nanoseconds since the epoch
+ */
+long long logger_now_ns(void);
+
+/**
+ * Current time for log timestamps in seconds (see logger_now_ns())
+ * @return Current time in seconds
+ */
+time_t logger_now(void);
+
+#endif // LOGGER_H
@@ -0,0 +1,130 @@
+#ifndef MEM_POOL_H
+#define MEM_POOL_H
+
+#include <stddef.h>
+
+// Size of each region carved into objects (one 2 MB huge page on x86-64)
+#define SLAB_REGION_SIZE (2 * 1024 * 1024)
+
+// Buffer size classes served by buffer_pool_t
+#define POOL_CLASS_COUNT 4
+#define POOL_MIN_CLASS_SIZE 4096    // Classes are 4 KB, 16 KB, 64 KB, 256 KB
+#define POOL_MAX_CLASS_SIZE (POOL_MIN_CLASS_SIZE << (2 * (POOL_CLASS_COUNT - 1)))
+
+/**
+ * Region of memory owned by a slab
+ */
+typedef struct slab_region {
+    struct slab_region *next;       // Next region of the same slab
+    size_t size;                    // Mapped size
+    int huge;                       // Backed by explicit huge pages
+} slab_region_t;
+
+/**
+ * Statistics kept by every slab
+ */
+typedef struct {
+    size_t object_size;             // Size of each object
+    size_t in_use;                  // Objects handed out
+    size_t free;                    // Objects on the free list
+    size_t regions;                 // Regions mapped
+    size_t huge_regions;            // Regions backed by explicit huge pages
+    size_t bytes_mapped;            // Total bytes mapped
+    size_t allocs;                  // Lifetime slab_alloc() calls
+} slab_stats_t;
+
+/**
+ * Fixed-size object allocator. Objects are carved out of large mmap()ed
+ * regions and recycled through a LIFO free list; memory is only returned
+ * to the system when the slab is destroyed. Not thread-safe: each event
+ * loop owns its slabs.
+ */
+typedef struct {
+    void *free_list;                // Free objects, linked through their first word
+    slab_region_t *regions;         // Mapped regions
+    int use_huge_pages;             // Try MAP_HUGETLB for new regions
+    slab_stats_t stats;             // Usage statistics
+} slab_t;
+
+/**
+ * Size-classed pool of I/O buffers, one slab per class. Requests larger
+ * than the biggest class fall back to malloc() and are counted.
+ */
+typedef struct {
+    slab_t classes[POOL_CLASS_COUNT]; // 4 KB, 16 KB, 64 KB, 256 KB buffers
+    size_t fallback_allocs;         // Oversized buffers served by malloc()
+    size_t fallback_in_use;         // Oversized buffers currently allocated
+} buffer_pool_t;
+
+/**
+ * Memory pool function prototypes
+ */
+
+/**
+ * Initialize an empty slab
+ * @param slab Pointer to slab_t structure
+ * @param object_size Size of each object (rounded up to 16 bytes)
+ * @param use_huge_pages Try to back regions with explicit huge pages
+ */
+void slab_init(slab_t *slab, size_t object_size, int use_huge_pages);
+
+/**
+ * Release every region of a slab (invalidates all its objects)
+ * @param slab Pointer to slab
+ */
+void slab_destroy(slab_t *slab);
+
+/**
+ * Take an object from the slab, mapping a new region when it is empty
+ * @param slab Pointer to slab
+ * @return Object (contents undefined), NULL if out of memory
+ */
+void *slab_alloc(slab_t *slab);
+
+/**
+ * Return an object to its slab. Only the object's first pointer-sized
+ * word is overwritten; the rest keeps its contents until reused.
+ * @param slab Pointer to slab the object came from
+ * @param object Object to free (NULL is ignored)
+ */
+void slab_free(slab_t *slab, void *object);
+
+/**
+ * Initialize a buffer pool
+ * @param pool Pointer to buffer_pool_t structure
+ * @param use_huge_pages Try to back buffers with explicit huge pages
+ */
+void buffer_pool_init(buffer_pool_t *pool, int use_huge_pages);
+
+/**
+ * Release all memory held by a buffer pool
+ * @param pool Pointer to buffer pool
+ */
+void buffer_pool_destroy(buffer_pool_t *pool);
+
+/**
+ * Get a buffer of at least size bytes
+ * @param pool Pointer to buffer pool
+ * @param size Minimum size required
+ * @param capacity Receives the actual buffer size (pass it back to buffer_pool_free)
+ * @return Buffer, NULL if out of memory
+ */
+void *buffer_pool_alloc(buffer_pool_t *pool, size_t size, size_t *capacity);
+
+/**
+ * Return a buffer to the pool
+ * @param pool Pointer to buffer pool
+ * @param buffer Buffer from buffer_pool_alloc() (NULL is ignored)
+ * @param capacity Capacity reported by buffer_pool_alloc()
+ */
+void buffer_pool_free(buffer_pool_t *pool, void *buffer, size_t capacity);
+
+/**
+ * Format a one-line summary of pool usage
+ * @param pool Pointer to buffer pool
+ * @param buffer Buffer receiving the text
+ * @param buffer_size Size of the buffer
+ */
+void buffer_pool_describe(const buffer_pool_t *pool, char *buffer, size_t buffer_size);
+
+#endif // MEM_POOL_H
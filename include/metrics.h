@@ -0,0 +1,108 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "histogram.h"
+
+/**
+ * Why a connection was closed
+ */
+typedef enum {
+    DISCONNECT_PEER_CLOSED,         // Orderly shutdown by the client
+    DISCONNECT_READ_ERROR,          // recv() failed (reset, timeout, ...)
+    DISCONNECT_WRITE_ERROR,         // Reply could not be sent or queued
+    DISCONNECT_FRAME_TOO_LARGE,     // Message exceeded MAX_FRAME_SIZE
+    DISCONNECT_INTERNAL_ERROR,      // Server-side failure (memory, event loop)
+    DISCONNECT_IDLE_TIMEOUT,        // No traffic within the idle timeout
+    DISCONNECT_READ_TIMEOUT,        // Partial frame not completed in time
+    DISCONNECT_WRITE_TIMEOUT,       // Queued output stopped draining
+    DISCONNECT_SLOW_CONSUMER,       // Broadcast subscriber fell too far behind
+    DISCONNECT_DRAIN_TIMEOUT,       // Still open when the drain after an upgrade ended
+    DISCONNECT_REASON_COUNT
+} disconnect_reason_t;
+
+/**
+ * Metrics owned by one worker. Only the owning thread writes them, so
+ * updates are plain load + add + store (METRIC_ADD), never locked
+ * read-modify-write instructions. Readers merge every worker's copy with
+ * relaxed loads; a snapshot may be a few updates stale, never torn.
+ */
+typedef struct {
+    uint64_t accepts;               // Connections accepted
+    uint64_t rejects;               // Connections refused because the worker was full
+    uint64_t connections;           // Connections currently open
+    uint64_t bytes_in;              // Bytes received from clients
+    uint64_t bytes_out;             // Bytes written to client sockets
+    uint64_t bytes_spliced;         // Echoed bytes moved with splice(), in neither copy
+    uint64_t zerocopy_sends;        // Sends made with MSG_ZEROCOPY
+    uint64_t zerocopy_copied;       // Completions where the kernel copied anyway
+    uint64_t messages_in;           // Frames received
+    uint64_t messages_out;          // Replies sent or queued
+    uint64_t broadcasts;            // Messages fanned out to a room
+    uint64_t broadcast_deliveries;  // Copies of them sent or queued to subscribers
+    uint64_t broadcast_drops;       // Copies skipped for backlogged subscribers
+    uint64_t partial_writes;        // Writes the socket only partly accepted
+    uint64_t budget_yields;         // Turns cut short by the read or frame budget
+    uint64_t rate_limited;          // Times a client ran out of rate-limit tokens
+    uint64_t offload_jobs;          // Frames handed to the offload pool
+    uint64_t offload_inline;        // Offloaded frames run on the event loop (no pool, or queue full)
+    uint64_t kv_hits;               // Key-value GETs that found their key
+    uint64_t kv_misses;             // Key-value GETs that did not
+    uint64_t kv_evictions;          // Key-value entries evicted by this worker's commands
+    uint64_t loop_iterations;       // Event loop wakeups
+    uint64_t disconnects[DISCONNECT_REASON_COUNT];
+    histogram_t loop_time;          // Time spent handling one wakeup, ns
+    histogram_t reply_latency;      // Wakeup to reply written or queued, ns
+    uint64_t iteration_start;       // Start of the current wakeup (not exported)
+} worker_metrics_t;
+
+/**
+ * Add to a counter owned by the calling thread. Relaxed atomic accesses
+ * compile to ordinary loads and stores but keep concurrent readers
+ * well-defined.
+ */
+#define METRIC_ADD(counter, amount) \
+    __atomic_store_n(&(counter), __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (amount), \
+                     __ATOMIC_RELAXED)
+
+/**
+ * Metrics function prototypes
+ */
+
+/**
+ * Reset a worker's metrics and make them visible to metrics_format()
+ * @param metrics Pointer to the worker's metrics
+ * @return 0 on success, -1 if too many workers are registered
+ */
+int metrics_register(worker_metrics_t *metrics);
+
+/**
+ * Stop reporting a worker's metrics
+ * @param metrics Pointer to metrics passed to metrics_register()
+ */
+void metrics_unregister(worker_metrics_t *metrics);
+
+/**
+ * Monotonic clock used for metric durations
+ * @return Nanoseconds from an arbitrary starting point
+ */
+uint64_t metrics_now_ns(void);
+
+/**
+ * Record a sample in a histogram owned by the calling thread
+ * @param histogram Histogram inside the caller's worker_metrics_t
+ * @param value Sample in nanoseconds
+ */
+void metrics_record(histogram_t *histogram, uint64_t value);
+
+/**
+ * Merge the metrics of every registered worker and render them as text,
+ * one "name value" pair per line
+ * @param buffer Buffer receiving the text
+ * @param buffer_size Size of the buffer
+ * @return Length of the text (truncated to fit the buffer)
+ */
+size_t metrics_format(char *buffer, size_t buffer_size);
+
+#endif // METRICS_H
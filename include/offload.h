@@ -0,0 +1,137 @@
+#ifndef OFFLOAD_H
+#define OFFLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "handler.h"
+#include "protocol.h"
+
+/*
+ * Offload pool for CPU-heavy handler work. A handler hands a frame to the
+ * pool with reply_offload(); the job runs on a pool thread and its reply
+ * comes back to the worker that owns the connection:
+ *
+ *   worker  -> pool    each worker's bounded submission ring, which pool
+ *                      threads take from with CAS; a thread serves its
+ *                      home ring first and steals from the others when
+ *                      that is empty
+ *   pool    -> worker  a lock-free completion stack per worker, and its
+ *                      eventfd written only by the push that finds the
+ *                      worker not yet signalled
+ *
+ * A connection has at most one job in flight and reads no further frames
+ * until its reply is out, so replies keep the order of the requests. The
+ * event loops never take a lock: submitting is one ring slot and a
+ * semaphore post, collecting is one atomic exchange.
+ */
+
+// Jobs waiting per worker (power of two); beyond that they run inline
+#define OFFLOAD_QUEUE_SIZE 1024
+
+// Largest pool
+#define OFFLOAD_MAX_THREADS 256
+
+/**
+ * One offloaded frame. The worker creates it with a copy of the frame;
+ * the pool thread runs it and builds the reply; the worker sends the reply
+ * and frees it.
+ */
+typedef struct offload_job {
+    struct offload_job *next;       // Completion stack link
+    struct server *server;          // Worker that submitted the job and sends the reply
+    struct client_info *client;     // Connection waiting for the reply, NULL once it closed
+    offload_fn run;                 // Work done on the pool thread
+    frame_view_t frame;             // The request; data points at the copy below
+    uint64_t submitted_ns;          // When the job was submitted (metrics_now_ns())
+    char *output;                   // Reply payload, malloc'd as it grows
+    size_t output_length;           // Payload bytes
+    size_t output_capacity;         // Size of output
+    uint16_t status;                // BINARY_STATUS_* of a binary reply
+    int result;                     // What run returned: -1 closes the connection
+    char header[BINARY_HEADER_SIZE]; // Binary reply header, encoded by the worker
+    char data[];                    // Copy of the request payload, NUL-terminated
+} offload_job_t;
+
+/**
+ * Offload pool function prototypes
+ */
+
+/**
+ * Start the pool threads. Until it runs (and with 0 threads), offloaded
+ * frames are handled inline on the event loop.
+ * @param threads Number of pool threads, 0 for none
+ * @param workers Number of workers submitting jobs
+ * @return 0 on success, -1 on error
+ */
+int offload_start(int threads, int workers);
+
+/**
+ * Stop the pool threads. Every worker must have collected its jobs
+ * already (run_server() does before it returns).
+ */
+void offload_stop(void);
+
+/**
+ * Copy a frame into a new job for a worker's connection
+ * @param server Worker submitting the job
+ * @param client Connection the reply goes to
+ * @param frame Frame to copy
+ * @param run Work to do on the pool thread
+ * @return New job, NULL if out of memory
+ */
+offload_job_t *offload_job_create(struct server *server, struct client_info *client,
+                                  const frame_view_t *frame, offload_fn run);
+
+/**
+ * Release a job and its reply
+ * @param job Job from offload_job_create()
+ */
+void offload_job_free(offload_job_t *job);
+
+/**
+ * Queue a job on the submitting worker's ring. Called by the owning
+ * worker only.
+ * @param job Job from offload_job_create()
+ * @return 0 if queued, -1 if the pool is not running or the ring is full
+ */
+int offload_submit(offload_job_t *job);
+
+/**
+ * Run a job on the calling thread
+ * @param job Job to run
+ */
+void offload_run(offload_job_t *job);
+
+/**
+ * Take every job the pool finished for a worker, oldest first. Clears the
+ * worker's eventfd first, so a job finished meanwhile signals it again.
+ * @param server Worker collecting its jobs
+ * @return Finished jobs linked through next, NULL if none
+ */
+offload_job_t *offload_collect(struct server *server);
+
+/**
+ * Append bytes to a job's reply. For use by the job's run function.
+ * @param job Job being run
+ * @param data Bytes to copy
+ * @param length Number of bytes
+ * @return 0 on success, -1 if out of memory
+ */
+int offload_write(offload_job_t *job, const void *data, size_t length);
+
+/**
+ * Format text into a job's reply (as snprintf)
+ * @param job Job being run
+ * @param format printf-style format
+ * @return 0 on success, -1 if out of memory
+ */
+int offload_printf(offload_job_t *job, const char *format, ...);
+
+/**
+ * Set the status of a job's binary reply (ignored for text)
+ * @param job Job being run
+ * @param status BINARY_STATUS_* value
+ */
+void offload_set_status(offload_job_t *job, uint16_t status);
+
+#endif // OFFLOAD_H
@@ -0,0 +1,164 @@
+#ifndef OUTPUT_QUEUE_H
+#define OUTPUT_QUEUE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "mem_pool.h"
+
+// Allocation size of one output chunk, header included (one pool size class)
+#define OUTPUT_CHUNK_SIZE 16384
+
+// Maximum number of chunks written by one sendmsg() call
+#define OUTPUT_MAX_IOV 64
+
+/**
+ * Immutable message queued for many connections at once. Each queue holds
+ * a reference instead of a copy; the last release frees it.
+ */
+typedef struct shared_buffer {
+    unsigned refs;                  // Holders, the creator included
+    size_t length;                  // Bytes stored in data
+    size_t capacity;                // Allocation size, for returning it to the pool
+    buffer_pool_t *pool;            // Pool it came from, NULL for malloc()
+    char data[];                    // Message bytes
+} shared_buffer_t;
+
+/**
+ * One buffer of pending output: bytes copied into the chunk itself, or a
+ * reference to a shared buffer or to bytes the caller keeps in place
+ */
+typedef struct out_chunk {
+    struct out_chunk *next;         // Next chunk in the queue
+    size_t capacity;                // Bytes available in data (0 for a reference)
+    size_t length;                  // Bytes stored in data, or referenced
+    size_t offset;                  // Bytes already sent
+    shared_buffer_t *shared;        // Referenced shared buffer, NULL otherwise
+    const char *base;               // Referenced bytes, NULL if the bytes are in data
+    char *held;                     // Storage released with the chunk (output_queue_hold())
+    size_t held_capacity;           // Size of held
+    char data[];                    // Chunk payload
+} out_chunk_t;
+
+/**
+ * FIFO of unsent bytes for one connection. Chunks are taken from a buffer
+ * pool when one is attached and returned to it as soon as they are sent;
+ * reference chunks come from a slab of their own.
+ */
+typedef struct {
+    out_chunk_t *head;              // Oldest chunk (being sent)
+    out_chunk_t *tail;              // Newest chunk (being filled)
+    size_t bytes;                   // Total unsent bytes
+    buffer_pool_t *pool;            // Pool supplying chunks, NULL for malloc()
+    slab_t *refs;                   // Slab supplying reference chunks, NULL for malloc()
+} output_queue_t;
+
+/**
+ * Output queue function prototypes
+ */
+
+/**
+ * Allocate a shared buffer holding one reference (the caller's)
+ * @param pool Buffer pool to allocate from, NULL to use malloc()
+ * @param length Bytes the buffer will hold; the caller fills data
+ * @return Buffer, NULL if out of memory
+ */
+shared_buffer_t *shared_buffer_create(buffer_pool_t *pool, size_t length);
+
+/**
+ * Drop one reference, freeing the buffer with the last
+ * @param buffer Shared buffer (NULL is ignored)
+ */
+void shared_buffer_release(shared_buffer_t *buffer);
+
+/**
+ * Initialize an empty output queue
+ * @param queue Pointer to output_queue_t structure
+ * @param pool Buffer pool to allocate chunks from, NULL to use malloc()
+ * @param refs Slab of sizeof(out_chunk_t) objects for reference chunks,
+ *             NULL to use malloc()
+ */
+void output_queue_init(output_queue_t *queue, buffer_pool_t *pool, slab_t *refs);
+
+/**
+ * Copy data to the end of the queue, filling the tail chunk first
+ * @param queue Pointer to output queue
+ * @param data Bytes to append
+ * @param length Number of bytes to append
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+int output_queue_append(output_queue_t *queue, const char *data, size_t length);
+
+/**
+ * Copy the contents of an iovec array to the end of the queue
+ * @param queue Pointer to output queue
+ * @param iov Array of buffers
+ * @param iovcnt Number of buffers
+ * @param skip Number of leading bytes (already sent) to leave out
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+int output_queue_append_iov(output_queue_t *queue, const struct iovec *iov, int iovcnt, size_t skip);
+
+/**
+ * Queue a reference to a shared buffer, without copying it
+ * @param queue Pointer to output queue
+ * @param buffer Shared buffer; the queue takes a reference of its own
+ * @param skip Number of leading bytes (already sent) to leave out
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+int output_queue_append_shared(output_queue_t *queue, shared_buffer_t *buffer, size_t skip);
+
+/**
+ * Queue references to an iovec array's bytes, without copying them. The
+ * bytes must stay in place until they are sent; output_queue_hold() can
+ * take care of the storage they are in.
+ * @param queue Pointer to output queue
+ * @param iov Array of buffers
+ * @param iovcnt Number of buffers
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+int output_queue_append_borrowed(output_queue_t *queue, const struct iovec *iov, int iovcnt);
+
+/**
+ * Take over storage that queued references point into, and return it to
+ * the queue's pool once everything queued so far has been sent. Something
+ * must have been queued since the previous call.
+ * @param queue Pointer to output queue
+ * @param storage Storage from the queue's pool (NULL is ignored)
+ * @param capacity Size of storage
+ */
+void output_queue_hold(output_queue_t *queue, char *storage, size_t capacity);
+
+/**
+ * Describe the oldest queued bytes as an iovec array, for a send made
+ * elsewhere. Appending more leaves the described bytes in place.
+ * @param queue Pointer to output queue
+ * @param iov Array receiving one buffer per chunk
+ * @param max_iov Capacity of the array
+ * @param bytes Receives the number of bytes described
+ * @return Number of buffers stored, 0 if the queue is empty
+ */
+int output_queue_gather(const output_queue_t *queue, struct iovec *iov, int max_iov, size_t *bytes);
+
+/**
+ * Drop bytes that were sent from the front of the queue
+ * @param queue Pointer to output queue
+ * @param bytes Number of bytes sent, at most the queued bytes
+ */
+void output_queue_consume(output_queue_t *queue, size_t bytes);
+
+/**
+ * Send as much queued data as the socket accepts without blocking
+ * @param queue Pointer to output queue
+ * @param socket_fd Non-blocking socket to write to
+ * @return Number of bytes sent (0 if the socket is full), -1 on error
+ */
+ssize_t output_queue_flush(output_queue_t *queue, int socket_fd);
+
+/**
+ * Free all queued chunks
+ * @param queue Pointer to output queue
+ */
+void output_queue_clear(output_queue_t *queue);
+
+#endif // OUTPUT_QUEUE_H
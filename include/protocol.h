@@ -0,0 +1,98 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Wire protocols. A connection speaks newline-delimited text unless its
+ * first byte is PROTOCOL_BINARY_MAGIC, which switches it to binary framing
+ * for the rest of its life. Binary frames are a fixed header followed by
+ * `length` payload bytes:
+ *
+ *   0       4            8        10       12
+ *   | length | request_id | opcode | status | payload ...
+ *
+ * All header fields are big-endian. Replies carry the request's id and
+ * opcode, so a client can match them even if they arrive out of order.
+ */
+
+// First byte a binary client sends (never the start of a text message)
+#define PROTOCOL_BINARY_MAGIC 0xB1
+#define BINARY_HEADER_SIZE 12
+
+// Opcodes
+#define BINARY_OP_ECHO 1            // Reply with the payload unchanged
+#define BINARY_OP_PING 2            // Reply with an empty payload
+#define BINARY_OP_JOIN 3            // Join the room named by the payload (see below)
+#define BINARY_OP_PUBLISH 4         // Send the payload to the rest of the sender's room
+#define BINARY_OP_DIGEST 5          // Reply with the 8-byte digest of the payload (digest handler)
+#define BINARY_OP_GET 6             // Reply with the value of the key in the payload (kv handler)
+#define BINARY_OP_SET 7             // Store a value (kv handler, see below)
+#define BINARY_OP_DEL 8             // Remove the key in the payload (kv handler)
+#define BINARY_OP_INCR 9            // Add to an integer value (kv handler, see below)
+
+// Reply status codes (always 0 in requests)
+#define BINARY_STATUS_OK 0
+#define BINARY_STATUS_UNKNOWN_OPCODE 1
+#define BINARY_STATUS_TOO_LARGE 2   // Payload over MAX_FRAME_SIZE for an opcode that needs it whole
+#define BINARY_STATUS_BAD_REQUEST 3 // Malformed payload (e.g. room name too long)
+#define BINARY_STATUS_NOT_FOUND 4   // GET or DEL of a key that is not stored
+
+/*
+ * A JOIN payload is one policy byte followed by the room name; an empty
+ * name is the lobby. The policy byte picks what happens to this
+ * subscriber's broadcasts while its output is backlogged. PUBLISH is
+ * answered with an empty reply; the other members receive a PUBLISH
+ * frame carrying the sender's request id and the payload.
+ */
+#define BINARY_JOIN_DEFAULT 0       // The server's policy
+#define BINARY_JOIN_DROP 1          // Skip messages
+#define BINARY_JOIN_DISCONNECT 2    // Close the connection
+
+/*
+ * GET and DEL payloads are the key. A SET payload is one key length byte,
+ * the key and the value; an INCR payload is the same with an optional
+ * 8-byte big-endian signed delta (1 if absent) in place of the value, and
+ * its reply is the new value, 8 bytes big-endian. GET replies with the
+ * value, SET and DEL with an empty payload.
+ */
+
+/**
+ * Connection protocol, decided by the first byte received
+ */
+typedef enum {
+    PROTOCOL_UNKNOWN,               // Nothing received yet
+    PROTOCOL_TEXT,                  // Newline-delimited text
+    PROTOCOL_BINARY                 // Length-prefixed binary frames
+} protocol_t;
+
+/**
+ * Binary frame header in host byte order
+ */
+typedef struct {
+    uint32_t length;                // Payload bytes following the header
+    uint32_t request_id;            // Chosen by the client, copied into the reply
+    uint16_t opcode;                // BINARY_OP_*
+    uint16_t status;                // BINARY_STATUS_* in replies
+} binary_header_t;
+
+/**
+ * Protocol function prototypes
+ */
+
+/**
+ * Decode a frame header from the wire
+ * @param data BINARY_HEADER_SIZE bytes, no alignment required
+ * @param header Receives the decoded header
+ */
+void binary_header_decode(const void *data, binary_header_t *header);
+
+/**
+ * Encode a frame header for the wire
+ * @param header Header to encode
+ * @param data Receives BINARY_HEADER_SIZE bytes
+ */
+void binary_header_encode(const binary_header_t *header, void *data);
+
+#endif // PROTOCOL_H
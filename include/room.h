@@ -0,0 +1,82 @@
+#ifndef ROOM_H
+#define ROOM_H
+
+#include <stddef.h>
+#include "mem_pool.h"
+
+// Longest room name, in bytes
+#define ROOM_NAME_MAX 64
+
+// Hash buckets of a room table (rooms are few; chains stay short)
+#define ROOM_BUCKETS 256
+
+struct client_info;
+
+/**
+ * What to do with a subscriber whose output queue is over the broadcast
+ * limit when a message for it arrives
+ */
+typedef enum {
+    SUBSCRIBER_DEFAULT,             // Use the server's policy
+    SUBSCRIBER_DROP,                // Skip the message for this subscriber
+    SUBSCRIBER_DISCONNECT           // Close the subscriber's connection
+} subscriber_policy_t;
+
+/**
+ * Named group of connections that receive each other's broadcasts.
+ * Members are linked through their connection objects, so joining and
+ * leaving are O(1) and never allocate.
+ */
+typedef struct room {
+    struct room *next;              // Next room in the same hash bucket
+    struct client_info *members;    // First member, NULL if empty
+    int count;                      // Number of members
+    size_t name_length;
+    char name[ROOM_NAME_MAX];       // Not NUL-terminated
+} room_t;
+
+/**
+ * Rooms of one worker, found by name. Empty rooms are freed.
+ */
+typedef struct {
+    room_t *buckets[ROOM_BUCKETS];  // Hash chains
+    slab_t rooms;                   // room_t objects
+    int count;                      // Number of rooms
+} room_table_t;
+
+/**
+ * Room function prototypes
+ */
+
+/**
+ * Initialize an empty room table
+ * @param table Pointer to room_table_t structure
+ */
+void room_table_init(room_table_t *table);
+
+/**
+ * Free all rooms (members must have left already)
+ * @param table Pointer to room table
+ */
+void room_table_destroy(room_table_t *table);
+
+/**
+ * Move a connection into a room, creating the room if needed and leaving
+ * the connection's current room
+ * @param table Pointer to room table
+ * @param client Connection joining
+ * @param name Room name (need not be NUL-terminated)
+ * @param name_length Length of the name, at most ROOM_NAME_MAX
+ * @return 0 on success, -1 if the name is too long or memory ran out
+ */
+int room_join(room_table_t *table, struct client_info *client, const char *name, size_t name_length);
+
+/**
+ * Take a connection out of its room, freeing the room once it is empty
+ * (no-op if the connection is in no room)
+ * @param table Pointer to room table
+ * @param client Connection leaving
+ */
+void room_leave(room_table_t *table, struct client_info *client);
+
+#endif // ROOM_H
@@ -1,45 +1,202 @@
 #ifndef SERVER_H
 #define SERVER_H
 
-#include <sys/select.h>
 #include <netinet/in.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include "event_loop.h"
+#include "conn_table.h"
+#include "mem_pool.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "room.h"
+#include "handler.h"
 
-#define MAX_CLIENTS 30
+#define DEFAULT_MAX_CLIENTS 100000
 #define BUFFER_SIZE 1024
+#define READ_CHUNK_SIZE 16384       // Free input space ensured before each recv()
+#define MAX_FRAME_SIZE 65536        // Longest message accepted without a newline
+
+// Stop reading from a client once this many reply bytes are queued for it,
+// and resume when the queue drains below the low-water mark
+#define OUTPUT_HIGH_WATER (1024 * 1024)
+#define OUTPUT_LOW_WATER (256 * 1024)
 #define DEFAULT_PORT 8080
+#define DEFAULT_WORKERS 1
+#define MAX_WORKERS 256
+#define DEFAULT_BACKLOG 4096        // Pending connections per listener (capped by somaxconn)
+
+// Connections accepted per wakeup before existing clients get a turn
+#define ACCEPT_BATCH_LIMIT 64
+
+// What one connection may consume per turn before the others are served;
+// the rest waits on the ready list for the next turn
+#define DEFAULT_READ_BUDGET (64 * 1024) // Bytes read from the socket
+#define DEFAULT_FRAME_BUDGET 1024       // Frames processed
+
+// A client that used up its rate-limit tokens is read again after at least
+// this long, so it is woken for a worthwhile read rather than every tick
+#define RATE_LIMIT_WAIT_MS 100
+
+// Connection timeouts in seconds (0 disables one): no traffic at all, a
+// partial frame not completed, queued output not moving
+#define DEFAULT_IDLE_TIMEOUT 300
+#define DEFAULT_READ_TIMEOUT 30
+#define DEFAULT_WRITE_TIMEOUT 60
+
+// Seconds an upgraded-away process serves its remaining connections
+#define DEFAULT_DRAIN_TIMEOUT 60
+
+// Streamed echo payloads with at least this much left move socket -> pipe
+// -> socket with splice() and never enter user space
+#define SPLICE_MIN_BYTES 16384
+#define SPLICE_PIPE_SIZE (256 * 1024) // Requested pipe capacity (F_SETPIPE_SZ)
+#define SPLICE_PIPE_CACHE 16        // Idle pipes kept per worker for reuse
+
+// Buffers still referenced by zero-copy sends when their connection closes
+// are kept this long before reuse, in case the kernel retransmits from them
+#define ZEROCOPY_ORPHAN_SECONDS 30
 
 /**
- * Structure to track connected clients
+ * Input buffer the kernel may still read from after MSG_ZEROCOPY sends.
+ * The sends that referenced it have consecutive ids; it goes back to the
+ * pool once the socket's completion notifications have covered them all.
+ */
+typedef struct zerocopy_buffer {
+    struct zerocopy_buffer *next;
+    char *data;                     // Storage from the worker's buffer pool
+    size_t capacity;                // Size of data
+    uint32_t first_id;              // Id of the first send that referenced it
+    uint32_t sends;                 // Number of sends that referenced it
+    uint32_t outstanding;           // Sends not yet reported complete
+    uint64_t release_tick;          // When an orphaned buffer may be reused
+} zerocopy_buffer_t;
+
+// A broadcast subscriber with more than this many bytes queued gets its
+// slow-subscriber policy applied to further messages
+#define DEFAULT_BROADCAST_LIMIT (256 * 1024)
+
+// Largest stats report served on the admin port
+#define ADMIN_RESPONSE_SIZE 8192
+
+// iovecs gathered before replies are written (3 per echoed text frame,
+// 2 per binary frame, below IOV_MAX)
+#define REPLY_BATCH_IOV 1020
+
+// Bytes handlers may copy into one batch of replies (see reply_write())
+#define REPLY_SCRATCH_SIZE 65536
+
+/**
+ * Replies gathered for one client as iovecs. Pieces are static, inside the
+ * client's input buffer or in the batch's scratch space: payloads are
+ * echoed in place and binary reply headers are written over the request
+ * headers they answer. Only what a handler generates is copied, once,
+ * into scratch.
  */
 typedef struct {
-    int socket_fd;                  // Client socket file descriptor
-    struct sockaddr_in address;     // Client address information
-    int active;                     // Whether this slot is active (1) or free (0)
-} client_info_t;
+    struct iovec iov[REPLY_BATCH_IOV]; // Reply pieces in send order
+    int count;                      // Number of iovecs used
+    int frames;                     // Number of replies completed
+    size_t scratch_used;            // Bytes of scratch the pieces use
+    char scratch[REPLY_SCRATCH_SIZE]; // Reply bytes copied by handlers
+} reply_batch_t;
 
 /**
- * Server configuration and state
+ * Command line configuration shared by all workers
  */
 typedef struct {
+    int port;                       // Server port number
+    int workers;                    // Number of event loop threads
+    int pin_cpus;                   // Pin each worker thread to one CPU
+    int max_clients;                // Connection limit per worker
+    int huge_pages;                 // Back memory pools with huge pages
+    int admin_port;                 // Loopback port serving metrics, 0 to disable
+    int backlog;                    // listen() backlog
+    int defer_accept;               // TCP_DEFER_ACCEPT seconds, 0 to disable
+    int idle_timeout;               // Seconds without traffic before closing, 0 to disable
+    int read_timeout;               // Seconds to complete a started frame, 0 to disable
+    int write_timeout;              // Seconds queued output may stall, 0 to disable
+    int splice;                     // Echo bulk payloads with splice()
+    size_t zerocopy_threshold;      // Send replies this large with MSG_ZEROCOPY, 0 to disable
+    int broadcast;                  // Text lines go to the sender's room instead of being echoed
+    size_t broadcast_limit;         // Queued bytes beyond which a subscriber is backlogged
+    subscriber_policy_t slow_policy; // Default handling of backlogged subscribers
+    const request_handler_t *handler; // Application protocol served to every connection
+    size_t read_budget;             // Bytes read from one connection per turn
+    int frame_budget;               // Frames processed for one connection per turn
+    size_t rate_limit;              // Bytes per second accepted from each client, 0 to disable
+    size_t rate_burst;              // Bytes a client may send at once under the rate limit
+    int handoff;                    // Pass connections to the new process on upgrade
+    int drain_timeout;              // Seconds to drain connections after an upgrade otherwise
+    int offload_threads;            // Offload pool threads, 0 to run offloaded work inline
+    size_t kv_memory;               // Bytes the key-value store may use
+    const int *listen_fds;          // Listeners inherited on upgrade, by worker (NULL if none)
+    int listen_fd_count;            // Number of inherited listeners
+    int admin_fd;                   // Inherited admin listener, -1 if none
+    const char *unix_path;          // Unix socket path ('@' for abstract), NULL if none
+    int unix_fd;                    // Unix listener shared by the workers, -1 if none
+} server_config_t;
+
+/**
+ * Server configuration and state (one instance per worker)
+ */
+typedef struct server {
     int server_socket;              // Server socket file descriptor
     int port;                       // Server port number
-    client_info_t clients[MAX_CLIENTS]; // Array of client connections
-    fd_set master_set;              // Master file descriptor set
-    fd_set read_set;                // Working file descriptor set for select()
-    int max_fd;                     // Highest file descriptor number
-    int running;                    // Server running flag
+    int worker_id;                  // Index of the owning worker
+    const server_config_t *config;  // Shared configuration
+    const request_handler_t *handler; // Application protocol (config->handler)
+    buffer_pool_t buffers;          // I/O buffers for this worker's connections
+    conn_table_t clients;           // Connections indexed by descriptor
+    event_loop_t loop;              // Readiness notification backend
+    timer_wheel_t timers;           // Connection timeouts
+    uint64_t now_tick;              // Timer tick at the start of this loop iteration
+    loop_event_t events[EVENT_BATCH_SIZE]; // Batch of ready events
+    reply_batch_t replies;          // Replies batched for the client being served
+    int wakeup_fd;                  // eventfd used to interrupt the loop
+    int offload_fd;                 // eventfd the offload pool signals finished jobs on
+    struct offload_job *offload_done; // Jobs the pool finished, newest first (lock-free stack)
+    int offload_signalled;          // offload_fd written since the jobs were last collected
+    int offload_pending;            // Jobs submitted and not yet collected
+    int admin_socket;               // Metrics listener (worker 0 only), -1 if none
+    int unix_socket;                // This worker's duplicate of the Unix listener, -1 if none
+    int reserve_fd;                 // Spare descriptor released to shed load on EMFILE
+    int accept_pending;             // Accept batch hit its limit; more may be queued
+    int unix_accept_pending;        // The same for the Unix listener
+    client_info_t *ready_head;      // Connections with work left over, served round-robin
+    client_info_t *ready_tail;
+    int turn_frames;                // Frames processed in the current connection's turn
+    int pipe_cache[SPLICE_PIPE_CACHE][2]; // Empty pipes ready for the next spliced payload
+    int pipe_cache_count;           // Number of cached pipes
+    slab_t zerocopy_records;        // zerocopy_buffer_t objects
+    zerocopy_buffer_t *orphans;     // Buffers of closed connections, oldest first
+    zerocopy_buffer_t *orphans_tail;
+    timer_entry_t orphan_timer;     // Fires when the oldest orphan may be reused
+    room_table_t rooms;             // Broadcast rooms of this worker's connections
+    worker_metrics_t metrics;       // Counters written only by this worker
+    timer_entry_t drain_timer;      // Ends the drain after an upgrade
+    volatile sig_atomic_t running;  // Server running flag
+    volatile sig_atomic_t draining; // Stop accepting; exit once connections are gone
+    volatile sig_atomic_t handoff;  // Keep connections open on exit, for the upgrade
 } server_t;
 
 /**
  * Function prototypes
  */
-int initialize_server(server_t *server, int port);
+int initialize_server(server_t *server, const server_config_t *config, int worker_id);
 void run_server(server_t *server);
+void stop_server(server_t *server);
+void drain_server(server_t *server);
 void shutdown_server(server_t *server);
-void handle_new_connection(server_t *server);
-void handle_client_message(server_t *server, int client_fd);
-int find_client_index(server_t *server, int socket_fd);
-void remove_client(server_t *server, int client_index);
+void handle_new_connection(server_t *server, int listen_fd);
+void handle_admin_connection(server_t *server);
+void handle_client_message(server_t *server, client_info_t *client);
+void handle_client_writable(server_t *server, client_info_t *client);
+void handle_client_sent(server_t *server, client_info_t *client, long result);
+void handle_client_timeout(timer_entry_t *timer, void *arg);
+void run_ready_clients(server_t *server);
+client_info_t *find_client(server_t *server, int socket_fd);
+void remove_client(server_t *server, client_info_t *client, disconnect_reason_t reason);
 void cleanup_server_resources(server_t *server);
 
 #endif // SERVER_H
\ No newline at end of file
@@ -2,6 +2,10 @@
 #define SOCKET_UTILS_H
 
 #include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
 
 // ANSI Color Codes
 #define COLOR_RESET     "\033[0m"
@@ -30,6 +34,41 @@ typedef enum {
     LOG_SERVER
 } log_type_t;
 
+// Log severity levels. LOG_MESSAGE traffic logs are LOG_LEVEL_DEBUG, error
+// messages LOG_LEVEL_ERROR and everything else LOG_LEVEL_INFO.
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO  1
+#define LOG_LEVEL_ERROR 2
+#define LOG_LEVEL_NONE  3
+
+// Lowest level compiled in; the release build raises it to LOG_LEVEL_INFO,
+// which removes per-message traffic logging entirely
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// Runtime log level and traffic sampling (log 1 in log_sample_rate messages)
+extern int log_level;
+extern unsigned log_sample_rate;
+extern __thread unsigned log_sample_counter;
+
+/**
+ * Decide whether the current message's traffic logs should be produced.
+ * Call before building any traffic log text so that filtered messages
+ * cost nothing; compiles to 0 when traffic logging is compiled out.
+ * @return 1 if this message should be logged, 0 otherwise
+ */
+static inline int log_traffic_enabled(void) {
+#if LOG_COMPILE_LEVEL > LOG_LEVEL_DEBUG
+    return 0;
+#else
+    if (log_level > LOG_LEVEL_DEBUG) {
+        return 0;
+    }
+    return log_sample_rate <= 1 || ++log_sample_counter % log_sample_rate == 0;
+#endif
+}
+
 /**
  * Socket utility function prototypes
  */
@@ -37,9 +76,40 @@ typedef enum {
 /**
  * Create and configure a TCP server socket
  * @param port Port number to bind to
+ * @param reuse_port Set SO_REUSEPORT so several sockets can share the port
+ * @param backlog Length of the pending connection queue (capped by net.core.somaxconn)
+ * @return Socket file descriptor on success, -1 on error
+ */
+int create_server_socket(int port, int reuse_port, int backlog);
+
+/**
+ * Create a TCP listening socket reachable from the local host only
+ * @param port Port number to bind to on 127.0.0.1
+ * @return Socket file descriptor on success, -1 on error
+ */
+int create_loopback_socket(int port);
+
+/**
+ * Create a listening Unix domain stream socket. A path starting with '@'
+ * names a socket in the abstract namespace, which needs no file and goes
+ * away with its last descriptor. A socket file left behind by a server
+ * that is gone is replaced.
+ * @param path Socket file path, or '@' followed by an abstract name
+ * @param backlog Length of the pending connection queue
  * @return Socket file descriptor on success, -1 on error
  */
-int create_server_socket(int port);
+int create_unix_socket(const char *path, int backlog);
+
+/**
+ * Read the credentials of the process that connected a Unix socket, as
+ * they were when it connected (SO_PEERCRED)
+ * @param socket_fd Connected Unix domain socket
+ * @param pid Receives the peer's process ID
+ * @param uid Receives the peer's user ID
+ * @param gid Receives the peer's group ID
+ * @return 0 on success, -1 on error
+ */
+int get_peer_credentials(int socket_fd, pid_t *pid, uid_t *uid, gid_t *gid);
 
 /**
  * Set socket to be reusable (SO_REUSEADDR)
@@ -48,6 +118,36 @@ int create_server_socket(int port);
  */
 int set_socket_reusable(int socket_fd);
 
+/**
+ * Allow several sockets to bind the same port (SO_REUSEPORT). The kernel
+ * load-balances incoming connections across them.
+ * @param socket_fd Socket file descriptor
+ * @return 0 on success, -1 on error
+ */
+int set_socket_reuseport(int socket_fd);
+
+/**
+ * Only report connections once the client has sent data (TCP_DEFER_ACCEPT)
+ * @param socket_fd Listening socket
+ * @param seconds How long the kernel waits for the first data
+ * @return 0 on success, -1 on error
+ */
+int set_socket_defer_accept(int socket_fd, int seconds);
+
+/**
+ * Allow MSG_ZEROCOPY sends (SO_ZEROCOPY); accepted sockets inherit it
+ * @param socket_fd Socket file descriptor
+ * @return 0 on success, -1 on error
+ */
+int set_socket_zerocopy(int socket_fd);
+
+/**
+ * Put socket into non-blocking mode (O_NONBLOCK)
+ * @param socket_fd Socket file descriptor
+ * @return 0 on success, -1 on error
+ */
+int set_socket_nonblocking(int socket_fd);
+
 /**
  * Configure server address structure
  * @param addr Pointer to sockaddr_in structure to configure
@@ -55,6 +155,15 @@ int set_socket_reusable(int socket_fd);
  */
 void setup_server_address(struct sockaddr_in *addr, int port);
 
+/**
+ * Configure a Unix domain socket address
+ * @param addr Address structure to configure
+ * @param path Socket file path, or '@' followed by an abstract name
+ * @param addr_length Receives the address length to pass to bind() or connect()
+ * @return 0 on success, -1 if the path is empty or too long
+ */
+int setup_unix_address(struct sockaddr_un *addr, const char *path, socklen_t *addr_length);
+
 /**
  * Check if terminal supports colors
  * @return 1 if colors are supported, 0 otherwise
@@ -62,11 +171,32 @@ void setup_server_address(struct sockaddr_in *addr, int port);
 int terminal_supports_colors(void);
 
 /**
- * Print error message with system error description
+ * Print error message with system error description. Like all log
+ * functions, it hands the message to the asynchronous logger when it runs.
  * @param message Custom error message
  */
 void print_error(const char *message);
 
+/**
+ * Parse a log level name (debug, info, error, none)
+ * @param name Level name
+ * @return LOG_LEVEL_* value, -1 if the name is unknown
+ */
+int parse_log_level(const char *name);
+
+/**
+ * Format one log line exactly as it is printed
+ * @param buffer Buffer receiving the line (including trailing newline)
+ * @param buffer_size Size of the buffer
+ * @param type Type of log message (determines color and prefix)
+ * @param to_stderr Non-zero for error messages, which carry no timestamp
+ * @param timestamp Time the message was logged
+ * @param message Log message
+ * @return Number of characters that would have been written (as snprintf)
+ */
+int format_log_line(char *buffer, size_t buffer_size, log_type_t type, int to_stderr,
+                    time_t timestamp, const char *message);
+
 /**
  * Print colored log message with timestamp
  * @param type Type of log message (determines color)
@@ -99,11 +229,14 @@ void print_connection_info(const char *message);
 void print_message_info(const char *message);
 
 /**
- * Convert socket address to readable string
+ * Convert socket address to readable string: "ip:port" for IPv4,
+ * "[ip]:port" for IPv6, "unix:path", "unix:@name" or "unix" (unnamed)
+ * for Unix domain sockets
  * @param addr Socket address structure
+ * @param addr_length Length of the address, as returned by accept()
  * @param buffer Buffer to store the string
  * @param buffer_size Size of the buffer
  */
-void addr_to_string(struct sockaddr_in *addr, char *buffer, size_t buffer_size);
+void addr_to_string(const struct sockaddr *addr, socklen_t addr_length, char *buffer, size_t buffer_size);
 
 #endif // SOCKET_UTILS_H
\ No newline at end of file
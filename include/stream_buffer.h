@@ -0,0 +1,97 @@
+#ifndef STREAM_BUFFER_H
+#define STREAM_BUFFER_H
+
+#include <stddef.h>
+#include "mem_pool.h"
+
+/**
+ * Growable byte buffer with a consumed prefix. Used for per-connection
+ * input (bytes received but not yet framed) and for batching replies.
+ *
+ *   data: [ consumed | readable (start..end) | free (end..capacity) ]
+ *
+ * Storage comes from a buffer pool when one is attached, so buffers are
+ * recycled instead of going through malloc()/free().
+ */
+typedef struct {
+    char *data;                     // Storage, NULL until first use
+    size_t start;                   // Offset of the first unconsumed byte
+    size_t end;                     // Offset one past the last stored byte
+    size_t capacity;                // Size of data
+    buffer_pool_t *pool;            // Pool supplying data, NULL for malloc()
+} stream_buffer_t;
+
+/**
+ * Stream buffer function prototypes
+ */
+
+/**
+ * Initialize an empty buffer (no memory is allocated)
+ * @param buffer Pointer to stream_buffer_t structure
+ * @param pool Buffer pool to allocate from, NULL to use malloc()
+ */
+void stream_buffer_init(stream_buffer_t *buffer, buffer_pool_t *pool);
+
+/**
+ * Make room for at least min_free bytes after the stored data, moving
+ * unconsumed bytes to the front or growing the allocation as needed
+ * @param buffer Pointer to stream buffer
+ * @param min_free Number of free bytes required
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+int stream_buffer_reserve(stream_buffer_t *buffer, size_t min_free);
+
+/**
+ * Append bytes to the buffer
+ * @param buffer Pointer to stream buffer
+ * @param data Bytes to append
+ * @param length Number of bytes to append
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+int stream_buffer_append(stream_buffer_t *buffer, const char *data, size_t length);
+
+/**
+ * Mark bytes at the front of the buffer as consumed
+ * @param buffer Pointer to stream buffer
+ * @param length Number of bytes consumed
+ */
+void stream_buffer_consume(stream_buffer_t *buffer, size_t length);
+
+/**
+ * Hand the buffer's storage to the caller, who must release it to the
+ * buffer's pool. Unconsumed bytes are copied to new storage first, so the
+ * buffer keeps its contents.
+ * @param buffer Pointer to stream buffer
+ * @param data Receives the old storage (NULL if there was none)
+ * @param capacity Receives the old storage's size
+ * @return 0 on success, -1 if memory could not be allocated (nothing changes)
+ */
+int stream_buffer_detach(stream_buffer_t *buffer, char **data, size_t *capacity);
+
+/**
+ * Release the buffer's memory (the buffer stays usable and empty)
+ * @param buffer Pointer to stream buffer
+ */
+void stream_buffer_free(stream_buffer_t *buffer);
+
+/**
+ * Number of unconsumed bytes
+ */
+#define stream_buffer_length(buffer) ((buffer)->end - (buffer)->start)
+
+/**
+ * Pointer to the first unconsumed byte
+ */
+#define stream_buffer_begin(buffer) ((buffer)->data + (buffer)->start)
+
+/**
+ * Pointer to the free space after the stored bytes
+ */
+#define stream_buffer_tail(buffer) ((buffer)->data + (buffer)->end)
+
+/**
+ * Number of free bytes after the stored bytes
+ */
+#define stream_buffer_space(buffer) ((buffer)->capacity - (buffer)->end)
+
+#endif // STREAM_BUFFER_H
@@ -0,0 +1,105 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+// Wheel resolution: timers fire on a TIMER_TICK_MS boundary, never early
+#define TIMER_TICK_MS 10
+#define TIMER_TICK_NS (TIMER_TICK_MS * 1000000ULL)
+#define TIMER_SECONDS_TO_TICKS(seconds) ((uint64_t)(seconds) * (1000 / TIMER_TICK_MS))
+
+// Four levels of 64 slots cover 64^4 ticks (about 46 hours at 10 ms);
+// later expiries are clamped to the end of the wheel, and fire early
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 4
+
+/**
+ * Timer embedded in the object it times. The wheel links it into a slot
+ * list, so scheduling and cancelling never allocate.
+ */
+typedef struct timer_entry {
+    struct timer_entry *next;       // Slot list links, NULL when not scheduled
+    struct timer_entry *prev;
+    uint64_t expires;               // Tick the timer fires at
+    unsigned slot;                  // Index into the wheel's slot lists
+} timer_entry_t;
+
+/**
+ * Hierarchical timing wheel. Level 0 has one slot per tick; each slot of
+ * level N covers a whole turn of level N-1, and is cascaded down when the
+ * lower level wraps around. Insert and cancel are O(1), and advancing
+ * costs O(1) per tick plus the timers that expire or cascade.
+ */
+typedef struct {
+    timer_entry_t slots[TIMER_LEVELS * TIMER_SLOTS]; // List heads, one per slot
+    uint64_t occupied[TIMER_LEVELS]; // Bit per non-empty slot, per level
+    uint64_t current;               // Last tick processed
+    int count;                      // Scheduled timers
+} timer_wheel_t;
+
+/**
+ * Called for every expired timer. The timer is already unscheduled and
+ * may be scheduled again from the callback.
+ */
+typedef void (*timer_callback_t)(timer_entry_t *timer, void *arg);
+
+/**
+ * Timer wheel function prototypes
+ */
+
+/**
+ * Initialize an empty wheel
+ * @param wheel Pointer to timer_wheel_t structure
+ * @param now Current tick
+ */
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now);
+
+/**
+ * Mark a timer as not scheduled (call once before first use)
+ * @param timer Pointer to timer_entry_t structure
+ */
+void timer_entry_init(timer_entry_t *timer);
+
+/**
+ * Check whether a timer is scheduled
+ * @param timer Pointer to timer
+ * @return 1 if scheduled, 0 otherwise
+ */
+int timer_pending(const timer_entry_t *timer);
+
+/**
+ * Schedule (or reschedule) a timer
+ * @param wheel Pointer to timer wheel
+ * @param timer Timer to schedule; cancelled first if already scheduled
+ * @param expires Tick to fire at; past ticks fire on the next tick
+ */
+void timer_wheel_schedule(timer_wheel_t *wheel, timer_entry_t *timer, uint64_t expires);
+
+/**
+ * Unschedule a timer (no-op if it is not scheduled)
+ * @param wheel Pointer to timer wheel
+ * @param timer Timer to cancel
+ */
+void timer_wheel_cancel(timer_wheel_t *wheel, timer_entry_t *timer);
+
+/**
+ * Process every tick up to now, firing the timers that expire
+ * @param wheel Pointer to timer wheel
+ * @param now Current tick
+ * @param callback Function called for each expired timer
+ * @param arg Argument passed to the callback
+ */
+void timer_wheel_advance(timer_wheel_t *wheel, uint64_t now, timer_callback_t callback, void *arg);
+
+/**
+ * Find the next tick the wheel has work at. This is the earliest expiry,
+ * or an earlier cascade of a higher level, so waiting until then never
+ * makes a timer fire late.
+ * @param wheel Pointer to timer wheel
+ * @param tick Receives the tick
+ * @return 0 on success, -1 if no timers are scheduled
+ */
+int timer_wheel_next_tick(const timer_wheel_t *wheel, uint64_t *tick);
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,135 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include "room.h"
+#include "worker.h"
+
+/*
+ * Hot upgrade. On SIGUSR2 the running process execs its own binary again
+ * (argv[0], so a binary replaced on disk is picked up) and talks to the new
+ * process over an AF_UNIX SOCK_SEQPACKET pair whose descriptor it finds in
+ * UPGRADE_ENV:
+ *
+ *   old -> new  HELLO, then one LISTENER message per listening socket
+ *   new -> old  READY once every worker has its listener and event loop
+ *   old -> new  CLIENT per connection when handing them over, each
+ *               followed by its buffered bytes in raw messages
+ *   old -> new  END
+ *
+ * The listening sockets themselves are passed with SCM_RIGHTS, so their
+ * accept queues carry over and no connection is refused. Until READY the
+ * old process keeps serving as before; if the new process fails to start,
+ * nothing changes. After READY the old process either hands every
+ * connection over with its buffered input and output (-U), or stops
+ * accepting and drains its connections for up to the drain timeout.
+ */
+
+// Environment variable carrying the upgrade socket to the new process
+#define UPGRADE_ENV "TCP_SERVER_UPGRADE_FD"
+
+// Bumped whenever the messages below change; processes of different
+// versions refuse to upgrade into each other
+#define UPGRADE_VERSION 2
+
+// How long either side waits for the other before giving up
+#define UPGRADE_TIMEOUT_SECONDS 30
+
+// Largest message of buffered connection bytes; the socket buffer must
+// hold one
+#define UPGRADE_DATA_SIZE 65536
+
+/**
+ * Upgrade message types
+ */
+typedef enum {
+    UPGRADE_HELLO = 1,              // Old -> new: version and number of listeners
+    UPGRADE_LISTENER,               // Old -> new: one listening socket
+    UPGRADE_READY,                  // New -> old: listeners in use
+    UPGRADE_CLIENT,                 // Old -> new: one connection, its bytes follow
+    UPGRADE_END                     // Old -> new: nothing more follows
+} upgrade_type_t;
+
+/**
+ * What a LISTENER message carries
+ */
+typedef enum {
+    UPGRADE_LISTENER_WORKER = 0,    // TCP listener of one worker
+    UPGRADE_LISTENER_ADMIN,         // Metrics listener
+    UPGRADE_LISTENER_UNIX           // Unix listener shared by the workers
+} upgrade_listener_t;
+
+/**
+ * Fixed part of every upgrade message. Both processes run on the same
+ * machine, so fields are in host byte order.
+ */
+typedef struct {
+    uint32_t type;                  // UPGRADE_* message type
+    uint32_t version;               // HELLO: UPGRADE_VERSION of the old process
+    uint32_t worker;                // LISTENER, CLIENT: worker index of the old process
+    uint32_t count;                 // HELLO: LISTENER messages that follow
+    uint32_t listener;              // LISTENER: upgrade_listener_t
+    uint32_t protocol;              // CLIENT: protocol_t of the connection
+    uint32_t frame_discard;         // CLIENT: streamed payload is being dropped
+    uint64_t frame_remaining;       // CLIENT: streamed payload bytes still to come
+    uint64_t input_length;          // CLIENT: unframed input bytes that follow
+    uint64_t output_length;         // CLIENT: unsent reply bytes that follow the input
+    uint32_t zerocopy_next_id;      // CLIENT: id the kernel gives the next MSG_ZEROCOPY send
+    uint32_t room_policy;           // CLIENT: subscriber_policy_t in the room
+    int32_t in_room;                // CLIENT: the connection is in a room
+    uint32_t room_length;           // CLIENT: bytes of room
+    char room[ROOM_NAME_MAX];       // CLIENT: broadcast room name
+    int64_t connected_at;           // CLIENT: time the connection was accepted
+    uint32_t address_length;        // CLIENT: bytes of address in use
+    struct sockaddr_storage address; // CLIENT: peer address, of any family
+} upgrade_message_t;
+
+/**
+ * Upgrade function prototypes
+ */
+
+/**
+ * Take the upgrade socket passed by a previous process, if any, and clear
+ * UPGRADE_ENV so it is not passed on. Call before any thread starts.
+ * @return Upgrade socket, -1 if the process was started normally
+ */
+int upgrade_inherited_socket(void);
+
+/**
+ * Receive the previous process's listening sockets into the configuration,
+ * for the workers to use instead of binding their own
+ * @param socket_fd Upgrade socket from upgrade_inherited_socket()
+ * @param config Configuration receiving listen_fds, admin_fd and unix_fd
+ * @return 0 on success, -1 on error
+ */
+int upgrade_receive_listeners(int socket_fd, server_config_t *config);
+
+/**
+ * Tell the previous process that every worker is initialized, then adopt
+ * the connections it hands over until it is done. Runs before the worker
+ * threads start, so workers are touched from this thread only. Closes the
+ * upgrade socket and inherited listeners no worker took.
+ * @param socket_fd Upgrade socket
+ * @param workers Initialized workers
+ * @param config Server configuration
+ * @return 0 on success, -1 if the previous process failed (already adopted
+ *         connections are kept)
+ */
+int upgrade_adopt_clients(int socket_fd, worker_t *workers, server_config_t *config);
+
+/**
+ * Start a new process from the same command line and hand over to it. On
+ * success the workers have handed over or drained their connections and
+ * been stopped, and the caller should exit.
+ * @param argv Command line of this process
+ * @param workers Running workers
+ * @param config Server configuration
+ * @param signals Signals that end a drain early, as for sigwait()
+ * @return 0 if the new process took over, -1 if this one keeps serving
+ */
+int upgrade_server(char *argv[], worker_t *workers, const server_config_t *config,
+                   const sigset_t *signals);
+
+#endif // UPGRADE_H
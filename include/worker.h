@@ -0,0 +1,56 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <pthread.h>
+#include "server.h"
+
+/**
+ * One event loop thread. Each worker owns its listening socket (bound with
+ * SO_REUSEPORT), its event loop and its client table, so workers never
+ * share connection state.
+ */
+typedef struct {
+    int id;                         // Worker index
+    int cpu;                        // CPU the thread is pinned to, -1 if not pinned
+    int initialized;                // Whether the server is initialized
+    int started;                    // Whether the thread is running
+    pthread_t thread;               // Thread handle
+    server_t server;                // Per-worker server state
+} worker_t;
+
+/**
+ * Worker function prototypes
+ */
+
+/**
+ * Initialize every worker's server, without starting the threads
+ * @param workers Array of config->workers zeroed worker_t structures
+ * @param config Server configuration
+ * @return 0 on success, -1 on error (already initialized workers are cleaned up)
+ */
+int init_workers(worker_t *workers, const server_config_t *config);
+
+/**
+ * Start the thread of every initialized worker
+ * @param workers Array of workers
+ * @param count Number of workers in the array
+ * @return 0 on success, -1 on error (every worker is stopped)
+ */
+int start_workers(worker_t *workers, int count);
+
+/**
+ * Stop all workers and wait for their threads to exit. Workers whose
+ * thread never started are cleaned up here.
+ * @param workers Array of workers
+ * @param count Number of workers in the array
+ */
+void stop_workers(worker_t *workers, int count);
+
+/**
+ * Wait for the threads of all workers to exit on their own
+ * @param workers Array of workers
+ * @param count Number of workers in the array
+ */
+void wait_workers(worker_t *workers, int count);
+
+#endif // WORKER_H
@@ -0,0 +1,1003 @@
+#define _GNU_SOURCE
+#include "../include/server.h"
+#include "../include/client_handler.h"
+#include "../include/socket_utils.h"
+#include "../include/logger.h"
+#include "../include/load_generator.h"
+#include "../include/histogram.h"
+#include "../include/kv_store.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+
+#define BENCH_DEFAULT_DURATION 3    // Seconds per end-to-end scenario
+#define BENCH_DEFAULT_THRESHOLD 10.0 // Percent change flagged as a regression
+#define BENCH_MICRO_ROUNDS 5        // Best of this many timed rounds
+#define BENCH_MICRO_TARGET_NS 100000000ULL // Length of one timed round
+#define BENCH_ZEROCOPY_BYTES (256UL << 20) // Sent per size and mode
+#define BENCH_KV_KEYS 65536         // Keys the timed GETs and SETs cycle through
+#define BENCH_KV_KEY_LENGTH 12      // "key:" and eight digits
+#define BENCH_KV_CHECK_KEYS 100000  // Keys written by the store checks
+#define BENCH_KV_SMALL_MEMORY (1UL << 20) // Store limit of the eviction check
+#define BENCH_KV_PIPELINE 64        // Commands per pipelined batch
+#define BENCH_MAX_RESULTS 64
+#define BENCH_NAME_SIZE 64
+
+/**
+ * One measured value
+ */
+typedef struct {
+    char name[BENCH_NAME_SIZE];     // Dotted metric name, unique per run
+    char unit[16];                  // Unit shown to humans
+    double value;
+    int lower_is_better;            // Direction used when comparing to a baseline
+} bench_result_t;
+
+/**
+ * Benchmark run state
+ */
+typedef struct {
+    const char *host;               // Server used by end-to-end scenarios
+    int port;                       // 0 to skip end-to-end scenarios
+    int kv_port;                    // Server running the kv handler, 0 to skip
+    int duration;                   // Seconds per end-to-end scenario
+    bench_result_t results[BENCH_MAX_RESULTS];
+    int count;
+} bench_t;
+
+/**
+ * Operation timed by run_micro(); returns nothing, works on its context
+ */
+typedef void (*bench_op_t)(void *context, long iterations);
+
+/**
+ * Monotonic time in nanoseconds
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Record one result
+ */
+static void add_result(bench_t *bench, const char *name, const char *unit, double value,
+                       int lower_is_better) {
+    bench_result_t *result;
+
+    if (bench->count == BENCH_MAX_RESULTS) {
+        return;
+    }
+    result = &bench->results[bench->count++];
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    snprintf(result->unit, sizeof(result->unit), "%s", unit);
+    result->value = value;
+    result->lower_is_better = lower_is_better;
+    fprintf(stderr, "  %-40s %14.2f %s\n", name, value, unit);
+}
+
+/**
+ * Time an operation: calibrate the iteration count to about 100 ms,
+ * then keep the fastest of several rounds
+ */
+static void run_micro(bench_t *bench, const char *name, bench_op_t op, void *context) {
+    long iterations = 1000;
+    double best = 0;
+    uint64_t start, elapsed;
+    int round;
+
+    // Grow the iteration count until one round takes long enough to time
+    for (;;) {
+        start = now_ns();
+        op(context, iterations);
+        elapsed = now_ns() - start;
+        if (elapsed >= BENCH_MICRO_TARGET_NS / 10) {
+            break;
+        }
+        iterations *= 10;
+    }
+    iterations = (long)((double)iterations * BENCH_MICRO_TARGET_NS / (double)elapsed) + 1;
+
+    for (round = 0; round < BENCH_MICRO_ROUNDS; round++) {
+        double per_op;
+
+        start = now_ns();
+        op(context, iterations);
+        per_op = (double)(now_ns() - start) / (double)iterations;
+        if (round == 0 || per_op < best) {
+            best = per_op;
+        }
+    }
+
+    add_result(bench, name, "ns/op", best, 1);
+}
+
+/**
+ * Server state shared by the message processing microbenchmark
+ */
+typedef struct {
+    server_t *server;
+    client_info_t *client;
+    char message[64];
+} message_context_t;
+
+static void bench_process_message(void *context, long iterations) {
+    message_context_t *ctx = context;
+    long i;
+
+    for (i = 0; i < iterations; i++) {
+        // Replies are discarded before the batch would be written
+        if (ctx->server->replies.count + 3 > REPLY_BATCH_IOV) {
+            ctx->server->replies.count = 0;
+            ctx->server->replies.frames = 0;
+        }
+        process_client_message(ctx->server, ctx->client, ctx->message, (int)sizeof(ctx->message) - 1);
+    }
+}
+
+static void bench_print_log(void *context, long iterations) {
+    long i;
+
+    (void)context;
+    for (i = 0; i < iterations; i++) {
+        print_connection_info("New client connected from 127.0.0.1:54321 (clients: 1/100000)");
+    }
+}
+
+static void bench_conn_table(void *context, long iterations) {
+    conn_table_t *table = context;
+    long i;
+
+    // Insert, look up and release, cycling through 1024 descriptors
+    for (i = 0; i < iterations; i++) {
+        int fd = (int)(i & 1023) + 16;
+        client_info_t *client = conn_table_insert(table, fd);
+
+        if (client == NULL || conn_table_lookup(table, fd) != client) {
+            abort();
+        }
+        conn_table_remove(table, client);
+    }
+}
+
+static void bench_addr_to_string(void *context, long iterations) {
+    struct sockaddr_in *addr = context;
+    char buffer[64];
+    long i;
+
+    for (i = 0; i < iterations; i++) {
+        addr_to_string((const struct sockaddr *)addr, sizeof(*addr), buffer, sizeof(buffer));
+    }
+}
+
+/**
+ * Microbenchmarks of the per-message and per-connection hot paths
+ */
+static int run_micro_benchmarks(bench_t *bench) {
+    static server_t server;
+    static server_config_t config;
+    message_context_t message;
+    conn_table_t table;
+    buffer_pool_t pool;
+    struct sockaddr_in addr;
+    int pair[2], saved_stdout, saved_stderr, null_fd;
+
+    fprintf(stderr, "Microbenchmarks:\n");
+
+    // process_client_message(), with traffic logging off as in production
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+    server.config = &config;
+    server.handler = handler_find("echo");
+    buffer_pool_init(&server.buffers, 0);
+    conn_table_init(&server.clients, 16, &server.buffers, 0);
+    message.server = &server;
+    message.client = conn_table_insert(&server.clients, pair[0]);
+    memset(message.message, 'x', sizeof(message.message) - 1);
+    message.message[sizeof(message.message) - 1] = '\0';
+    log_level = LOG_LEVEL_INFO;
+    run_micro(bench, "micro.process_client_message", bench_process_message, &message);
+    conn_table_destroy(&server.clients);
+    buffer_pool_destroy(&server.buffers);
+    close(pair[0]);
+    close(pair[1]);
+
+    // print_log() through the asynchronous logger, output discarded
+    fflush(stdout);
+    fflush(stderr);
+    saved_stdout = dup(STDOUT_FILENO);
+    saved_stderr = dup(STDERR_FILENO);
+    null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    close(null_fd);
+    logger_start();
+    run_micro(bench, "micro.print_log", bench_print_log, NULL);
+    logger_stop();
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_stdout, STDOUT_FILENO);
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stdout);
+    close(saved_stderr);
+    // The result line was printed while stderr was discarded
+    fprintf(stderr, "  %-40s %14.2f %s\n", bench->results[bench->count - 1].name,
+            bench->results[bench->count - 1].value, bench->results[bench->count - 1].unit);
+
+    // Connection table insert + lookup + remove
+    buffer_pool_init(&pool, 0);
+    conn_table_init(&table, 100000, &pool, 0);
+    run_micro(bench, "micro.conn_table_cycle", bench_conn_table, &table);
+    conn_table_destroy(&table);
+    buffer_pool_destroy(&pool);
+
+    // addr_to_string()
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(54321);
+    inet_pton(AF_INET, "192.168.100.200", &addr.sin_addr);
+    run_micro(bench, "micro.addr_to_string", bench_addr_to_string, &addr);
+
+    return 0;
+}
+
+/**
+ * Key number n of the key-value microbenchmarks and store checks, always
+ * BENCH_KV_KEY_LENGTH bytes
+ */
+static size_t kv_bench_key(char *key, long n) {
+    return (size_t)snprintf(key, 16, "key:%08ld", n);
+}
+
+/**
+ * Keys the timed GETs and SETs cycle through, formatted beforehand
+ */
+typedef struct {
+    char keys[BENCH_KV_KEYS][16];
+    char value[32];
+} kv_context_t;
+
+static void bench_kv_get(void *context, long iterations) {
+    kv_context_t *ctx = context;
+    char value[64];
+    size_t length;
+    long i;
+
+    for (i = 0; i < iterations; i++) {
+        const char *key = ctx->keys[i & (BENCH_KV_KEYS - 1)];
+
+        if (kv_get(key, BENCH_KV_KEY_LENGTH, value, sizeof(value), &length) != KV_OK) {
+            abort();
+        }
+    }
+}
+
+static void bench_kv_set(void *context, long iterations) {
+    kv_context_t *ctx = context;
+    size_t evicted;
+    long i;
+
+    // Same-sized values, so every SET rewrites its item in place
+    for (i = 0; i < iterations; i++) {
+        const char *key = ctx->keys[i & (BENCH_KV_KEYS - 1)];
+
+        if (kv_set(key, BENCH_KV_KEY_LENGTH, ctx->value, sizeof(ctx->value), &evicted) != KV_OK) {
+            abort();
+        }
+    }
+}
+
+/**
+ * Report a failed store check
+ * @return 0 if the check held, 1 otherwise
+ */
+static int kv_check(int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "  kv store check failed: %s\n", what);
+    }
+    return !ok;
+}
+
+/**
+ * Drive the store through its slow paths and check what comes back:
+ * growth with lookups and updates across a migration, backward-shift
+ * deletes, INCR limits, and CLOCK eviction past a small memory limit
+ * @return Number of failed checks
+ */
+static int check_kv_store(void) {
+    char key[16], value[64], buffer[64], *large;
+    size_t length, evicted, total_evicted = 0;
+    int64_t number;
+    long i;
+    int failures = 0, ok;
+
+    // Grow from the initial table through several migrations. Every SET
+    // also rewrites an older key with a longer value, which moves it out
+    // of the old table when a migration is under way.
+    kv_start(KV_DEFAULT_MEMORY);
+    ok = 1;
+    for (i = 0; i < BENCH_KV_CHECK_KEYS; i++) {
+        ok &= kv_set(key, kv_bench_key(key, i), "v", 1, &evicted) == KV_OK;
+        length = (size_t)snprintf(value, sizeof(value), "updated value %ld", i / 2);
+        ok &= kv_set(key, kv_bench_key(key, i / 2), value, length, &evicted) == KV_OK;
+    }
+    failures += kv_check(ok, "SET while growing");
+    ok = 1;
+    for (i = 0; i < BENCH_KV_CHECK_KEYS; i++) {
+        size_t expected = (size_t)snprintf(value, sizeof(value), "updated value %ld", i);
+
+        if (i >= (BENCH_KV_CHECK_KEYS + 1) / 2) {
+            expected = 1;
+            value[0] = 'v';
+        }
+        ok &= kv_get(key, kv_bench_key(key, i), buffer, sizeof(buffer), &length) == KV_OK &&
+              length == expected && memcmp(buffer, value, length) == 0;
+    }
+    failures += kv_check(ok, "GET after migrations");
+
+    // Delete every other key; the rest must still be found past the holes
+    ok = 1;
+    for (i = 0; i < BENCH_KV_CHECK_KEYS; i += 2) {
+        ok &= kv_delete(key, kv_bench_key(key, i)) == KV_OK;
+    }
+    for (i = 0; i < BENCH_KV_CHECK_KEYS; i++) {
+        kv_result_t expected = i % 2 == 0 ? KV_NOT_FOUND : KV_OK;
+
+        ok &= kv_get(key, kv_bench_key(key, i), buffer, sizeof(buffer), &length) == expected;
+    }
+    failures += kv_check(ok, "GET after deletes");
+
+    // INCR of a missing key, up to the limit and past it, and of text
+    failures += kv_check(kv_incr("counter", 7, 5, &number, &evicted) == KV_OK && number == 5,
+                         "INCR of a missing key");
+    kv_set("counter", 7, "9223372036854775806", 19, &evicted);
+    failures += kv_check(kv_incr("counter", 7, 1, &number, &evicted) == KV_OK && number == INT64_MAX,
+                         "INCR up to INT64_MAX");
+    failures += kv_check(kv_incr("counter", 7, 1, &number, &evicted) == KV_NOT_NUMBER,
+                         "INCR past INT64_MAX");
+    failures += kv_check(kv_get("counter", 7, buffer, sizeof(buffer), &length) == KV_OK && length == 19 &&
+                         memcmp(buffer, "9223372036854775807", 19) == 0, "value kept after overflow");
+    kv_set("text", 4, "12abc", 5, &evicted);
+    failures += kv_check(kv_incr("text", 4, 1, &number, &evicted) == KV_NOT_NUMBER,
+                         "INCR of a non-numeric value");
+    kv_stop();
+
+    // Write far more than fits: CLOCK must keep every shard in budget
+    kv_start(BENCH_KV_SMALL_MEMORY);
+    memset(value, 'e', sizeof(value));
+    ok = 1;
+    for (i = 0; i < BENCH_KV_CHECK_KEYS; i++) {
+        ok &= kv_set(key, kv_bench_key(key, i), value, sizeof(value), &evicted) == KV_OK;
+        total_evicted += evicted;
+    }
+    failures += kv_check(ok, "SET past the memory limit");
+    failures += kv_check(total_evicted > 0, "eviction past the memory limit");
+    failures += kv_check(kv_get(key, kv_bench_key(key, BENCH_KV_CHECK_KEYS - 1), buffer, sizeof(buffer),
+                                &length) == KV_OK, "GET of the newest key after eviction");
+
+    // An item under a shard's share that doesn't fit beside its slot array
+    large = malloc(BENCH_KV_SMALL_MEMORY / KV_SHARDS);
+    memset(large, 'l', BENCH_KV_SMALL_MEMORY / KV_SHARDS);
+    failures += kv_check(kv_set("large", 5, large, BENCH_KV_SMALL_MEMORY / KV_SHARDS - 256, &evicted) ==
+                         KV_TOO_LARGE && evicted == 0, "SET of an item that cannot fit");
+    free(large);
+    kv_stop();
+
+    return failures;
+}
+
+/**
+ * Key-value store checks, then GET and SET timed against a warm store
+ * @return 0 on success, -1 if a check failed
+ */
+static int run_kv_benchmarks(bench_t *bench) {
+    static kv_context_t context;
+    size_t evicted;
+    long i;
+
+    fprintf(stderr, "Key-value store:\n");
+    if (check_kv_store() > 0) {
+        return -1;
+    }
+
+    kv_start(KV_DEFAULT_MEMORY);
+    memset(context.value, 'v', sizeof(context.value));
+    for (i = 0; i < BENCH_KV_KEYS; i++) {
+        kv_bench_key(context.keys[i], i);
+        kv_set(context.keys[i], BENCH_KV_KEY_LENGTH, context.value, sizeof(context.value), &evicted);
+    }
+    run_micro(bench, "micro.kv_get", bench_kv_get, &context);
+    run_micro(bench, "micro.kv_set", bench_kv_set, &context);
+    kv_stop();
+    return 0;
+}
+
+/**
+ * Receiver side of the zero-copy benchmark: read and discard until EOF
+ */
+static void *drain_socket(void *arg) {
+    static char buffer[1 << 18];
+    int fd = *(int *)arg;
+
+    while (recv(fd, buffer, sizeof(buffer), 0) > 0) {
+    }
+    return NULL;
+}
+
+/**
+ * Connect a TCP socket pair over loopback
+ */
+static int connect_loopback_pair(int fds[2]) {
+    struct sockaddr_in addr;
+    socklen_t length = sizeof(addr);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fds[0] = fds[1] = -1;
+    if (listener == -1 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listener, 1) == -1 || getsockname(listener, (struct sockaddr *)&addr, &length) == -1) {
+        perror("loopback listener");
+        if (listener != -1) {
+            close(listener);
+        }
+        return -1;
+    }
+
+    fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if (fds[0] == -1 || connect(fds[0], (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        (fds[1] = accept(listener, NULL, NULL)) == -1) {
+        perror("loopback connect");
+        if (fds[0] != -1) {
+            close(fds[0]);
+        }
+        close(listener);
+        return -1;
+    }
+    close(listener);
+    return 0;
+}
+
+/**
+ * Read zero-copy completions without blocking
+ * @return Number of sends they cover
+ */
+static uint32_t reap_completions(int fd, long *copied) {
+    char control[128];
+    uint32_t completed = 0;
+
+    for (;;) {
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            return completed;
+        }
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            struct sock_extended_err err;
+
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR &&
+                err.ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+                completed += err.ee_data - err.ee_info + 1;
+                *copied += (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0;
+            }
+        }
+    }
+}
+
+/**
+ * Send BENCH_ZEROCOPY_BYTES in writes of one size, copying or with
+ * MSG_ZEROCOPY, and return the rate in MB/s (0 on error). Zero-copy
+ * time includes waiting for the last completion.
+ */
+static double measure_send_rate(int fd, const char *data, size_t size, int zerocopy, long *copied) {
+    long writes = (long)(BENCH_ZEROCOPY_BYTES / size), i;
+    uint32_t sends = 0, completed = 0;
+    struct pollfd pfd = {fd, 0, 0};
+    uint64_t start = now_ns();
+
+    for (i = 0; i < writes; i++) {
+        size_t sent = 0;
+
+        while (sent < size) {
+            ssize_t result = send(fd, data + sent, size - sent, zerocopy ? MSG_ZEROCOPY : 0);
+
+            if (result == -1 && errno == ENOBUFS) {
+                // Too many pages pinned: wait for completions
+                poll(&pfd, 1, 100);
+                completed += reap_completions(fd, copied);
+                continue;
+            }
+            if (result <= 0) {
+                perror("send");
+                return 0;
+            }
+            sent += (size_t)result;
+            sends += zerocopy;
+        }
+        if (zerocopy) {
+            completed += reap_completions(fd, copied);
+        }
+    }
+
+    while (completed < sends) {
+        poll(&pfd, 1, 100);
+        completed += reap_completions(fd, copied);
+    }
+    return (double)BENCH_ZEROCOPY_BYTES / 1e6 / ((double)(now_ns() - start) / 1e9);
+}
+
+/**
+ * Copying sends vs MSG_ZEROCOPY over loopback, per write size, and the
+ * smallest size from which zero-copy is faster. Loopback delivery copies
+ * zero-copy pages anyway, so this shows only the bookkeeping cost; the
+ * crossover on a real NIC has to be measured there.
+ */
+static void run_zerocopy_benchmarks(bench_t *bench) {
+    static const size_t sizes[] = {4096, 16384, 65536, 262144, 1048576};
+    char metric[BENCH_NAME_SIZE];
+    pthread_t receiver;
+    size_t crossover = 0;
+    long copied = 0;
+    char *data;
+    int fds[2], one = 1;
+    unsigned i;
+
+    fprintf(stderr, "Zero-copy sends over loopback:\n");
+    if (connect_loopback_pair(fds) == -1) {
+        return;
+    }
+    if (setsockopt(fds[0], SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1) {
+        perror("SO_ZEROCOPY");
+        close(fds[0]);
+        close(fds[1]);
+        return;
+    }
+    data = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+    memset(data, 'z', sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+    pthread_create(&receiver, NULL, drain_socket, &fds[1]);
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        double copy = measure_send_rate(fds[0], data, sizes[i], 0, &copied);
+        double zerocopy = measure_send_rate(fds[0], data, sizes[i], 1, &copied);
+
+        snprintf(metric, sizeof(metric), "zerocopy.copy.%zu", sizes[i]);
+        add_result(bench, metric, "MB/s", copy, 0);
+        snprintf(metric, sizeof(metric), "zerocopy.zc.%zu", sizes[i]);
+        add_result(bench, metric, "MB/s", zerocopy, 0);
+        if (crossover == 0 && zerocopy > copy) {
+            crossover = sizes[i];
+        }
+    }
+
+    if (crossover > 0) {
+        fprintf(stderr, "  zero-copy faster from %zu-byte writes", crossover);
+    } else {
+        fprintf(stderr, "  zero-copy never faster");
+    }
+    fprintf(stderr, " (%ld completions reported a kernel copy)\n", copied);
+
+    shutdown(fds[0], SHUT_WR);
+    pthread_join(receiver, NULL);
+    close(fds[0]);
+    close(fds[1]);
+    free(data);
+}
+
+/**
+ * Run one load generator scenario and record throughput and tail latency
+ */
+static void run_scenario(bench_t *bench, const char *name, load_config_t *config) {
+    load_result_t result;
+    char metric[BENCH_NAME_SIZE];
+    double seconds;
+
+    config->host = bench->host;
+    config->port = bench->port;
+    config->duration = bench->duration;
+
+    if (run_load_test(config, &result) == -1 || result.requests == 0) {
+        fprintf(stderr, "  %s: no replies received\n", name);
+        return;
+    }
+    seconds = (double)result.elapsed_ns / 1e9;
+
+    snprintf(metric, sizeof(metric), "e2e.%s.throughput", name);
+    add_result(bench, metric, "req/s", (double)result.requests / seconds, 0);
+    snprintf(metric, sizeof(metric), "e2e.%s.p50", name);
+    add_result(bench, metric, "us", (double)histogram_percentile(&result.latency, 50.0) / 1e3, 1);
+    snprintf(metric, sizeof(metric), "e2e.%s.p99", name);
+    add_result(bench, metric, "us", (double)histogram_percentile(&result.latency, 99.0) / 1e3, 1);
+    if (result.connect_errors + result.io_errors > 0) {
+        snprintf(metric, sizeof(metric), "e2e.%s.errors", name);
+        add_result(bench, metric, "count", (double)(result.connect_errors + result.io_errors), 1);
+    }
+}
+
+/**
+ * Connection storm: connect, do one round trip, close, as fast as possible
+ */
+static void run_connection_storm(bench_t *bench) {
+    struct sockaddr_in addr;
+    struct linger linger = {1, 0};
+    histogram_t latency;
+    uint64_t start, end, now;
+    long connections = 0, failures = 0;
+    char reply[64];
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)bench->port);
+    inet_pton(AF_INET, bench->host, &addr.sin_addr);
+    histogram_init(&latency);
+
+    start = now_ns();
+    end = start + (uint64_t)bench->duration * 1000000000ULL;
+    while ((now = now_ns()) < end) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int ok;
+
+        if (fd == -1) {
+            failures++;
+            continue;
+        }
+        // Reset on close so client ports don't pile up in TIME_WAIT
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+        ok = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+             send(fd, "x\n", 2, MSG_NOSIGNAL) == 2 &&
+             recv(fd, reply, sizeof(reply), 0) > 0;
+        close(fd);
+
+        if (ok) {
+            histogram_record(&latency, now_ns() - now);
+            connections++;
+        } else {
+            failures++;
+        }
+    }
+
+    if (connections == 0) {
+        fprintf(stderr, "  connection_storm: no connections succeeded\n");
+        return;
+    }
+    add_result(bench, "e2e.connection_storm.rate", "conn/s",
+               (double)connections / ((double)(now_ns() - start) / 1e9), 0);
+    add_result(bench, "e2e.connection_storm.p99", "us",
+               (double)histogram_percentile(&latency, 99.0) / 1e3, 1);
+    if (failures > 0) {
+        add_result(bench, "e2e.connection_storm.errors", "count", (double)failures, 1);
+    }
+}
+
+/**
+ * Pipelined key-value traffic over loopback: batches of alternating SETs
+ * and GETs over a fixed key set, written at once and read back in full
+ */
+static void run_kv_pipeline(bench_t *bench) {
+    static char request[BENCH_KV_PIPELINE * 64], reply[1 << 16];
+    struct sockaddr_in addr;
+    histogram_t latency;
+    uint64_t start, end, now;
+    long operations = 0, errors = 0, batch = 0;
+    int fd, i, line_start = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)bench->kv_port);
+    inet_pton(AF_INET, bench->host, &addr.sin_addr);
+    histogram_init(&latency);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "  kv_pipeline: cannot connect to port %d\n", bench->kv_port);
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    start = now_ns();
+    end = start + (uint64_t)bench->duration * 1000000000ULL;
+    while ((now = now_ns()) < end) {
+        size_t length = 0;
+        int lines = 0;
+        ssize_t n;
+
+        for (i = 0; i < BENCH_KV_PIPELINE; i++) {
+            long key = (batch * BENCH_KV_PIPELINE + i / 2) % BENCH_KV_KEYS;
+
+            length += (size_t)snprintf(request + length, sizeof(request) - length,
+                                       i % 2 == 0 ? "SET key:%08ld value-%08ld\n" : "GET key:%08ld\n",
+                                       key, key);
+        }
+        batch++;
+        if (send(fd, request, length, MSG_NOSIGNAL) != (ssize_t)length) {
+            errors++;
+            break;
+        }
+        while (lines < BENCH_KV_PIPELINE && (n = recv(fd, reply, sizeof(reply), 0)) > 0) {
+            for (i = 0; i < n; i++) {
+                // Every reply line starts with STORED, VALUE, NOT_FOUND or ERROR
+                if (line_start && reply[i] == 'E') {
+                    errors++;
+                }
+                line_start = reply[i] == '\n';
+                lines += line_start;
+            }
+        }
+        if (lines < BENCH_KV_PIPELINE) {
+            errors++;
+            break;
+        }
+        histogram_record(&latency, now_ns() - now);
+        operations += BENCH_KV_PIPELINE;
+    }
+    close(fd);
+
+    if (operations == 0) {
+        fprintf(stderr, "  kv_pipeline: no replies received\n");
+        return;
+    }
+    add_result(bench, "e2e.kv_pipeline.throughput", "ops/s",
+               (double)operations / ((double)(now_ns() - start) / 1e9), 0);
+    add_result(bench, "e2e.kv_pipeline.batch_p99", "us",
+               (double)histogram_percentile(&latency, 99.0) / 1e3, 1);
+    if (errors > 0) {
+        add_result(bench, "e2e.kv_pipeline.errors", "count", (double)errors, 1);
+    }
+}
+
+/**
+ * End-to-end scenarios against a running server
+ */
+static void run_e2e_benchmarks(bench_t *bench) {
+    load_config_t config;
+
+    fprintf(stderr, "End-to-end scenarios against %s:%d (%d s each):\n",
+            bench->host, bench->port, bench->duration);
+
+    run_connection_storm(bench);
+
+    // Small-message ping-pong: one request in flight per connection
+    load_config_init(&config);
+    config.connections = 32;
+    config.payload_size = 32;
+    run_scenario(bench, "ping_pong", &config);
+
+    // Large-payload streaming: big frames, deeply pipelined
+    load_config_init(&config);
+    config.connections = 4;
+    config.payload_size = 60000;
+    config.depth = 8;
+    run_scenario(bench, "streaming", &config);
+
+    // Many idle connections plus a few active ones
+    load_config_init(&config);
+    config.connections = 8;
+    config.idle_connections = 5000;
+    run_scenario(bench, "idle_plus_active", &config);
+
+    if (bench->kv_port > 0) {
+        run_kv_pipeline(bench);
+    }
+}
+
+/**
+ * Write results as JSON, one result per line
+ */
+static int write_results(const bench_t *bench, const char *path) {
+    FILE *file = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    int i;
+
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    fprintf(file, "{\n  \"backend\": \"%s\",\n  \"results\": [\n", event_loop_backend_name());
+    for (i = 0; i < bench->count; i++) {
+        const bench_result_t *result = &bench->results[i];
+        fprintf(file, "    {\"name\": \"%s\", \"unit\": \"%s\", \"value\": %.3f, \"better\": \"%s\"}%s\n",
+                result->name, result->unit, result->value,
+                result->lower_is_better ? "lower" : "higher", i + 1 < bench->count ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+
+    if (file != stdout) {
+        fclose(file);
+    }
+    return 0;
+}
+
+/**
+ * Read results written by write_results()
+ */
+static int read_results(bench_t *bench, const char *path) {
+    FILE *file = fopen(path, "r");
+    char line[512];
+
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    bench->count = 0;
+    while (fgets(line, sizeof(line), file) != NULL && bench->count < BENCH_MAX_RESULTS) {
+        bench_result_t *result = &bench->results[bench->count];
+        char better[16];
+
+        if (sscanf(line, " {\"name\": \"%63[^\"]\", \"unit\": \"%15[^\"]\", \"value\": %lf, \"better\": \"%15[^\"]\"",
+                   result->name, result->unit, &result->value, better) == 4) {
+            result->lower_is_better = strcmp(better, "lower") == 0;
+            bench->count++;
+        }
+    }
+
+    fclose(file);
+    return 0;
+}
+
+/**
+ * Compare results against a baseline
+ * @return Number of regressions beyond the threshold
+ */
+static int compare_results(const bench_t *baseline, const bench_t *current, double threshold) {
+    int i, j, regressions = 0;
+
+    fprintf(stderr, "\nComparison with baseline (threshold %.1f%%):\n", threshold);
+    for (i = 0; i < current->count; i++) {
+        const bench_result_t *now = &current->results[i];
+        const bench_result_t *base = NULL;
+        double change;
+        int worse;
+
+        for (j = 0; j < baseline->count; j++) {
+            if (strcmp(baseline->results[j].name, now->name) == 0) {
+                base = &baseline->results[j];
+                break;
+            }
+        }
+        if (base == NULL || base->value == 0) {
+            fprintf(stderr, "  %-40s %14.2f %-6s (no baseline)\n", now->name, now->value, now->unit);
+            continue;
+        }
+
+        change = (now->value - base->value) / base->value * 100.0;
+        worse = now->lower_is_better ? change > threshold : change < -threshold;
+        regressions += worse;
+        fprintf(stderr, "  %-40s %14.2f %-6s %+7.1f%%%s\n", now->name, now->value, now->unit, change,
+                worse ? "  REGRESSION" : "");
+    }
+
+    return regressions;
+}
+
+/**
+ * Print usage information
+ */
+static void print_usage(const char *program_name) {
+    fprintf(stderr, "Usage: %s [options]\n", program_name);
+    fprintf(stderr, "       %s -C BASELINE RESULTS\n", program_name);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -h HOST      Server for end-to-end scenarios (default: 127.0.0.1)\n");
+    fprintf(stderr, "  -p PORT      Server port; end-to-end scenarios are skipped without it\n");
+    fprintf(stderr, "  -k PORT      Server running '-e kv' for the pipelined key-value scenario\n");
+    fprintf(stderr, "  -d SECONDS   Duration of each end-to-end scenario (default: %d)\n", BENCH_DEFAULT_DURATION);
+    fprintf(stderr, "  -o FILE      Write JSON results to FILE (default: stdout)\n");
+    fprintf(stderr, "  -b FILE      Compare results against a baseline JSON file\n");
+    fprintf(stderr, "  -T PERCENT   Change flagged as a regression (default: %.0f)\n", BENCH_DEFAULT_THRESHOLD);
+    fprintf(stderr, "  -C           Only compare two existing result files\n");
+    fprintf(stderr, "  -?           Show this help message\n");
+    fprintf(stderr, "Exit status is 2 when a regression is flagged.\n");
+}
+
+/**
+ * Main function
+ */
+int main(int argc, char *argv[]) {
+    static bench_t bench, baseline;
+    const char *output = "-";
+    const char *baseline_path = NULL;
+    double threshold = BENCH_DEFAULT_THRESHOLD;
+    int compare_only = 0;
+    int opt;
+
+    bench.host = "127.0.0.1";
+    bench.duration = BENCH_DEFAULT_DURATION;
+
+    while ((opt = getopt(argc, argv, "h:p:k:d:o:b:T:C?")) != -1) {
+        switch (opt) {
+            case 'h':
+                bench.host = optarg;
+                break;
+            case 'p':
+                bench.port = atoi(optarg);
+                if (bench.port <= 0 || bench.port > 65535) {
+                    fprintf(stderr, "Port must be between 1 and 65535\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'k':
+                bench.kv_port = atoi(optarg);
+                if (bench.kv_port <= 0 || bench.kv_port > 65535) {
+                    fprintf(stderr, "Port must be between 1 and 65535\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'd':
+                bench.duration = atoi(optarg);
+                if (bench.duration <= 0) {
+                    fprintf(stderr, "Duration must be positive\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'b':
+                baseline_path = optarg;
+                break;
+            case 'T':
+                threshold = atof(optarg);
+                break;
+            case 'C':
+                compare_only = 1;
+                break;
+            case '?':
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (compare_only) {
+        if (argc - optind != 2) {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        if (read_results(&baseline, argv[optind]) == -1 || read_results(&bench, argv[optind + 1]) == -1) {
+            return EXIT_FAILURE;
+        }
+        return compare_results(&baseline, &bench, threshold) > 0 ? 2 : EXIT_SUCCESS;
+    }
+
+    if (run_micro_benchmarks(&bench) == -1 || run_kv_benchmarks(&bench) == -1) {
+        return EXIT_FAILURE;
+    }
+    run_zerocopy_benchmarks(&bench);
+    if (bench.port > 0) {
+        run_e2e_benchmarks(&bench);
+    }
+
+    if (write_results(&bench, output) == -1) {
+        return EXIT_FAILURE;
+    }
+
+    if (baseline_path != NULL) {
+        if (read_results(&baseline, baseline_path) == -1) {
+            return EXIT_FAILURE;
+        }
+        return compare_results(&baseline, &bench, threshold) > 0 ? 2 : EXIT_SUCCESS;
+    }
+    return EXIT_SUCCESS;
+}
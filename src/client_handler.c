@@ -1,54 +1,102 @@
+#define _GNU_SOURCE
 #include "../include/client_handler.h"
 #include "../include/socket_utils.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
 #include <errno.h>
 
 /**
- * Initialize client information structure
+ * Add a new client to the server's connection table
  */
-void init_client_info(client_info_t *client) {
-    client->socket_fd = -1;
-    client->active = 0;
-    memset(&client->address, 0, sizeof(client->address));
+client_info_t *add_client(server_t *server, int client_fd, const struct sockaddr *client_addr,
+                          socklen_t client_addr_len) {
+    client_info_t *client;
+    client_meta_t *meta;
+    
+    client = conn_table_insert(&server->clients, client_fd);
+    if (client == NULL) {
+        // Table full (or out of memory)
+        return NULL;
+    }
+    
+    meta = client->meta;
+    if (client_addr_len > sizeof(meta->address)) {
+        client_addr_len = sizeof(meta->address);
+    }
+    memcpy(&meta->address, client_addr, client_addr_len);
+    meta->address_length = client_addr_len;
+    meta->connected_at = time(NULL);
+    
+    // Local peers are identified by process rather than address
+    if (client_addr->sa_family == AF_UNIX) {
+        client->unix_peer = 1;
+        if (get_peer_credentials(client_fd, &meta->peer_pid, &meta->peer_uid, &meta->peer_gid) == -1) {
+            meta->peer_pid = 0;
+        }
+    }
+    
+    // In broadcast mode everyone starts out in the lobby
+    if (server->config->broadcast && room_join(&server->rooms, client, "", 0) == -1) {
+        conn_table_remove(&server->clients, client);
+        return NULL;
+    }
+    
+    // The handler may set up per-connection state, or refuse the connection
+    if (server->handler->on_connect != NULL && server->handler->on_connect(server, client) == -1) {
+        room_leave(&server->rooms, client);
+        conn_table_remove(&server->clients, client);
+        return NULL;
+    }
+    
+    // Rate-limited clients start with a full bucket
+    client->tokens = (int64_t)server->config->rate_burst;
+    client->tokens_tick = server->now_tick;
+    
+    // The idle clock starts at accept
+    client->last_active = server->now_tick;
+    schedule_client_timeout(server, client);
+    return client;
 }
 
 /**
- * Add a new client to the server's client list
+ * Describe a client for logs and broadcasts
  */
-int add_client(server_t *server, int client_fd, struct sockaddr_in *client_addr) {
-    int i;
+void describe_client(const client_info_t *client, char *buffer, size_t buffer_size) {
+    const client_meta_t *meta = client->meta;
     
-    // Find first available slot
-    for (i = 0; i < MAX_CLIENTS; i++) {
-        if (!server->clients[i].active) {
-            server->clients[i].socket_fd = client_fd;
-            server->clients[i].address = *client_addr;
-            server->clients[i].active = 1;
-            return i;
-        }
+    if (client->unix_peer && meta->peer_pid > 0) {
+        snprintf(buffer, buffer_size, "unix pid %d uid %u", (int)meta->peer_pid, (unsigned)meta->peer_uid);
+        return;
     }
-    
-    // No available slots
-    return -1;
+    addr_to_string((const struct sockaddr *)&meta->address, meta->address_length, buffer, buffer_size);
 }
 
 /**
- * Read message from client socket
+ * Read message from client socket, through the event loop
  */
-int read_client_message(int client_fd, char *buffer, size_t buffer_size) {
+int read_client_message(event_loop_t *loop, int client_fd, char *buffer, size_t buffer_size) {
     int bytes_received;
     
-    bytes_received = recv(client_fd, buffer, buffer_size - 1, 0);
+    do {
+        bytes_received = (int)event_loop_recv(loop, client_fd, buffer, buffer_size - 1);
+    } while (bytes_received == -1 && errno == EINTR);
     
     if (bytes_received > 0) {
         buffer[bytes_received] = '\0';  // Null-terminate the string
     } else if (bytes_received == 0) {
         // Client closed connection gracefully
         return 0;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // Nothing left to read on the non-blocking socket
+        return -2;
     } else {
         // Error occurred
         if (errno != ECONNRESET) {
@@ -61,14 +109,39 @@ int read_client_message(int client_fd, char *buffer, size_t buffer_size) {
 }
 
 /**
- * Send message to client socket
+ * Send message to client socket without blocking
  */
 int send_client_message(int client_fd, const char *message, size_t message_len) {
-    int bytes_sent;
+    struct iovec iov;
+    
+    iov.iov_base = (void *)message;
+    iov.iov_len = message_len;
+    return (int)send_client_iov(client_fd, &iov, 1);
+}
+
+/**
+ * Gather-write with the given sendmsg() flags. Returns -2 without logging
+ * when a MSG_ZEROCOPY send is refused for lack of option memory.
+ */
+static ssize_t send_iov(int client_fd, const struct iovec *iov, int iovcnt, int flags) {
+    struct msghdr msg;
+    ssize_t bytes_sent;
     
-    bytes_sent = send(client_fd, message, message_len, 0);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = (size_t)iovcnt;
+    
+    do {
+        bytes_sent = sendmsg(client_fd, &msg, flags);
+    } while (bytes_sent == -1 && errno == EINTR);
     
     if (bytes_sent == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+            return -2;
+        }
         if (errno != EPIPE && errno != ECONNRESET) {
             print_error("Failed to send data to client");
         }
@@ -79,22 +152,525 @@ int send_client_message(int client_fd, const char *message, size_t message_len)
 }
 
 /**
- * Process and echo client message
+ * Gather-write an iovec array to a client socket without blocking
  */
-void process_client_message(server_t *server, int client_fd, char *buffer, int bytes_received) {
-    char response[BUFFER_SIZE + 64];  // Extra space for response formatting
-    char addr_str[64];
-    char log_msg[512];
-    int client_index;
+ssize_t send_client_iov(int client_fd, const struct iovec *iov, int iovcnt) {
+    return send_iov(client_fd, iov, iovcnt, MSG_NOSIGNAL);
+}
+
+/**
+ * Gather-write with MSG_ZEROCOPY: the kernel sends straight from the
+ * buffers, reading them after the call returns. The input buffer they
+ * point into is therefore retired rather than reused once the replies
+ * are out (see retire_input_buffer()).
+ */
+static ssize_t send_client_iov_zerocopy(server_t *server, client_info_t *client,
+                                        const struct iovec *iov, int iovcnt) {
+    ssize_t bytes_sent = send_iov(client->socket_fd, iov, iovcnt, MSG_NOSIGNAL | MSG_ZEROCOPY);
+    
+    // Too many pages pinned already: copy this one
+    if (bytes_sent == -2) {
+        return send_client_iov(client->socket_fd, iov, iovcnt);
+    }
+    
+    // Every send that takes data gets the next notification id
+    if (bytes_sent > 0) {
+        client->zerocopy_next_id++;
+        client->input_zerocopy_sends++;
+        METRIC_ADD(server->metrics.zerocopy_sends, 1);
+    }
+    return bytes_sent;
+}
+
+/**
+ * Send message to a client, queueing whatever the socket does not accept
+ */
+int queue_client_message(server_t *server, client_info_t *client, const char *message, size_t message_len) {
+    struct iovec iov;
+    
+    iov.iov_base = (void *)message;
+    iov.iov_len = message_len;
+    return queue_client_iov(server, client, &iov, 1, 0);
+}
+
+/**
+ * Gather-write buffers to a client, queueing whatever the socket does not
+ * accept immediately. Only unsent bytes are ever copied, and under an
+ * event loop that makes the sends itself, replies pointing into the input
+ * buffer are not copied at all (see hold_borrowed_input()).
+ */
+int queue_client_iov(server_t *server, client_info_t *client, const struct iovec *iov, int iovcnt,
+                     int zerocopy) {
+    size_t threshold = server->config->zerocopy_threshold;
+    ssize_t bytes_sent = 0;
+    
+    // The event loop sends from the queue once this iteration is over
+    if (EVENT_LOOP_COMPLETIONS) {
+        if (zerocopy) {
+            if (output_queue_append_borrowed(&client->output, iov, iovcnt) == -1) {
+                return -1;
+            }
+            client->input_borrowed = 1;
+        } else if (output_queue_append_iov(&client->output, iov, iovcnt, 0) == -1) {
+            return -1;
+        }
+        if (client->output.bytes > OUTPUT_HIGH_WATER) {
+            client->read_paused = 1;
+        }
+        return start_client_send(server, client);
+    }
+    
+    // Write straight to the socket unless earlier output is still pending
+    if (client->output.bytes == 0) {
+        size_t total = 0;
+        int i;
+        
+        for (i = 0; i < iovcnt; i++) {
+            total += iov[i].iov_len;
+        }
+        
+        // Pinning pages only pays off for large sends, and only TCP
+        // sockets report completions
+        if (zerocopy && threshold > 0 && total >= threshold && !client->unix_peer) {
+            bytes_sent = send_client_iov_zerocopy(server, client, iov, iovcnt);
+        } else {
+            bytes_sent = send_client_iov(client->socket_fd, iov, iovcnt);
+        }
+        if (bytes_sent == -1) {
+            return -1;
+        }
+        METRIC_ADD(server->metrics.bytes_out, (uint64_t)bytes_sent);
+        if ((size_t)bytes_sent == total) {
+            return 0;
+        }
+        METRIC_ADD(server->metrics.partial_writes, 1);
+        
+        // Output is queued from now on; it has to keep draining
+        client->write_progress = server->now_tick;
+        schedule_client_timeout(server, client);
+    }
+    
+    if (output_queue_append_iov(&client->output, iov, iovcnt, (size_t)bytes_sent) == -1) {
+        return -1;
+    }
+    
+    // Slow consumer: stop reading its requests until it catches up
+    if (client->output.bytes > OUTPUT_HIGH_WATER) {
+        client->read_paused = 1;
+    }
+    
+    return update_client_interest(server, client);
+}
+
+/**
+ * Send a shared buffer to a client, queueing a reference to whatever the
+ * socket does not accept immediately. The message is never copied.
+ */
+int queue_client_shared(server_t *server, client_info_t *client, shared_buffer_t *buffer) {
+    ssize_t bytes_sent = 0;
+    
+    if (EVENT_LOOP_COMPLETIONS) {
+        if (output_queue_append_shared(&client->output, buffer, 0) == -1) {
+            return -1;
+        }
+        return start_client_send(server, client);
+    }
+    
+    if (client->output.bytes == 0) {
+        struct iovec iov;
+        
+        iov.iov_base = buffer->data;
+        iov.iov_len = buffer->length;
+        bytes_sent = send_client_iov(client->socket_fd, &iov, 1);
+        if (bytes_sent == -1) {
+            return -1;
+        }
+        METRIC_ADD(server->metrics.bytes_out, (uint64_t)bytes_sent);
+        if ((size_t)bytes_sent == buffer->length) {
+            return 0;
+        }
+        METRIC_ADD(server->metrics.partial_writes, 1);
+        
+        client->write_progress = server->now_tick;
+        schedule_client_timeout(server, client);
+    }
+    
+    if (output_queue_append_shared(&client->output, buffer, (size_t)bytes_sent) == -1) {
+        return -1;
+    }
+    return update_client_interest(server, client);
+}
+
+/**
+ * Hand the front of a client's output queue to the event loop, unless a
+ * send is in flight already. The queued bytes stay in place until the
+ * send is reported (see handle_client_sent()).
+ */
+int start_client_send(server_t *server, client_info_t *client) {
+    struct iovec iov[OUTPUT_MAX_IOV];
+    int count;
+    
+    if (client->sending > 0 || client->output.bytes == 0) {
+        return 0;
+    }
+    
+    count = output_queue_gather(&client->output, iov, OUTPUT_MAX_IOV, &client->sending);
+    if (event_loop_send(&server->loop, client->socket_fd, iov, count) == -1) {
+        print_error("Failed to queue send to client");
+        client->sending = 0;
+        return -1;
+    }
+    return update_client_interest(server, client);
+}
+
+/**
+ * Mark a client to be closed on the next timer tick
+ */
+void evict_client(server_t *server, client_info_t *client, disconnect_reason_t reason) {
+    if (client->evicting) {
+        return;
+    }
+    client->evicting = 1;
+    client->evict_reason = reason;
+    timer_wheel_schedule(&server->timers, &client->timer, server->now_tick);
+}
+
+/**
+ * Encode a broadcast once for all recipients speaking one protocol: a
+ * PUBLISH frame for binary clients, "address: message" for text clients
+ */
+static shared_buffer_t *encode_broadcast(server_t *server, client_info_t *sender, int binary,
+                                         const char *message, size_t length, uint32_t request_id) {
+    shared_buffer_t *buffer;
+    
+    if (binary) {
+        binary_header_t header;
+        
+        buffer = shared_buffer_create(&server->buffers, BINARY_HEADER_SIZE + length);
+        if (buffer == NULL) {
+            return NULL;
+        }
+        header.length = (uint32_t)length;
+        header.request_id = request_id;
+        header.opcode = BINARY_OP_PUBLISH;
+        header.status = BINARY_STATUS_OK;
+        binary_header_encode(&header, buffer->data);
+        memcpy(buffer->data + BINARY_HEADER_SIZE, message, length);
+    } else {
+        char addr_str[64];
+        size_t prefix;
+        
+        describe_client(sender, addr_str, sizeof(addr_str));
+        prefix = strlen(addr_str);
+        buffer = shared_buffer_create(&server->buffers, prefix + 2 + length + 1);
+        if (buffer == NULL) {
+            return NULL;
+        }
+        memcpy(buffer->data, addr_str, prefix);
+        memcpy(buffer->data + prefix, ": ", 2);
+        memcpy(buffer->data + prefix + 2, message, length);
+        buffer->data[prefix + 2 + length] = '\n';
+    }
+    return buffer;
+}
+
+/**
+ * Fan a message out to every other member of the sender's room. Each wire
+ * format is encoded at most once, and every recipient's queue references
+ * that buffer. A subscriber that is backlogged, or in the middle of a
+ * streamed reply that nothing may interleave with, gets its policy
+ * applied instead, so a slow subscriber never holds up the others.
+ */
+static int broadcast_message(server_t *server, client_info_t *sender, const char *message,
+                             size_t length, uint32_t request_id) {
+    const server_config_t *config = server->config;
+    shared_buffer_t *text = NULL, *binary = NULL;
+    client_info_t *member;
+    
+    if (sender->room == NULL) {
+        return 0;
+    }
+    METRIC_ADD(server->metrics.broadcasts, 1);
+    
+    for (member = sender->room->members; member != NULL; member = member->room_next) {
+        shared_buffer_t **encoded;
+        
+        if (member == sender || member->evicting) {
+            continue;
+        }
+        
+        if (member->output.bytes > config->broadcast_limit || member->pipe_bytes > 0 ||
+            (member->frame_remaining > 0 && !member->frame_discard)) {
+            subscriber_policy_t policy = member->room_policy != SUBSCRIBER_DEFAULT ?
+                                         member->room_policy : config->slow_policy;
+            
+            if (policy == SUBSCRIBER_DISCONNECT) {
+                evict_client(server, member, DISCONNECT_SLOW_CONSUMER);
+            } else {
+                METRIC_ADD(server->metrics.broadcast_drops, 1);
+            }
+            continue;
+        }
+        
+        encoded = member->protocol == PROTOCOL_BINARY ? &binary : &text;
+        if (*encoded == NULL) {
+            *encoded = encode_broadcast(server, sender, member->protocol == PROTOCOL_BINARY,
+                                        message, length, request_id);
+            if (*encoded == NULL) {
+                shared_buffer_release(text);
+                shared_buffer_release(binary);
+                return -1;
+            }
+        }
+        
+        // The member can't be removed while the room is being walked
+        if (queue_client_shared(server, member, *encoded) == -1) {
+            evict_client(server, member, DISCONNECT_WRITE_ERROR);
+            continue;
+        }
+        METRIC_ADD(server->metrics.broadcast_deliveries, 1);
+    }
     
-    // Find client information for logging
-    client_index = find_client_index(server, client_fd);
-    if (client_index == -1) {
-        return;  // Client not found
+    shared_buffer_release(text);
+    shared_buffer_release(binary);
+    return 0;
+}
+
+/**
+ * Move a client to a room with the given slow-subscriber policy
+ */
+static int join_client_room(server_t *server, client_info_t *client, const char *name,
+                            size_t name_length, subscriber_policy_t policy) {
+    if (room_join(&server->rooms, client, name, name_length) == -1) {
+        return -1;
+    }
+    client->room_policy = policy;
+    return 0;
+}
+
+/**
+ * Handle one text line in broadcast mode. "/join NAME [drop|disconnect]"
+ * moves the client to a room (an empty name is the lobby); any other line
+ * goes to the rest of the client's room.
+ */
+static int process_broadcast_line(server_t *server, client_info_t *client, char *line, int length) {
+    subscriber_policy_t policy = SUBSCRIBER_DEFAULT;
+    char *name, *option, *end = line + length;
+    size_t name_length;
+    int valid = 1;
+    char reply[ROOM_NAME_MAX + 64];
+    
+    if (length < 5 || memcmp(line, "/join", 5) != 0 || (length > 5 && line[5] != ' ')) {
+        return broadcast_message(server, client, line, (size_t)length, 0);
     }
     
-    // Get client address string for logging
-    addr_to_string(&server->clients[client_index].address, addr_str, sizeof(addr_str));
+    name = line + 5;
+    while (name < end && *name == ' ') {
+        name++;
+    }
+    option = memchr(name, ' ', (size_t)(end - name));
+    name_length = (size_t)((option != NULL ? option : end) - name);
+    if (option != NULL) {
+        while (option < end && *option == ' ') {
+            option++;
+        }
+        if (strcmp(option, "drop") == 0) {
+            policy = SUBSCRIBER_DROP;
+        } else if (strcmp(option, "disconnect") == 0) {
+            policy = SUBSCRIBER_DISCONNECT;
+        } else if (*option != '\0') {
+            valid = 0;
+        }
+    }
+    
+    if (!valid || join_client_room(server, client, name, name_length, policy) == -1) {
+        snprintf(reply, sizeof(reply), "Usage: /join NAME [drop|disconnect] (NAME up to %d bytes)\n",
+                 ROOM_NAME_MAX);
+    } else {
+        snprintf(reply, sizeof(reply), "Joined %.*s\n", (int)name_length, name);
+    }
+    return queue_client_message(server, client, reply, strlen(reply));
+}
+
+/**
+ * Queue a client at the end of the ready list
+ */
+void schedule_client_turn(server_t *server, client_info_t *client) {
+    if (client->ready) {
+        return;
+    }
+    client->ready = 1;
+    client->ready_next = NULL;
+    client->ready_prev = server->ready_tail;
+    if (server->ready_tail != NULL) {
+        server->ready_tail->ready_next = client;
+    } else {
+        server->ready_head = client;
+    }
+    server->ready_tail = client;
+}
+
+/**
+ * Take a client off the ready list
+ */
+void cancel_client_turn(server_t *server, client_info_t *client) {
+    if (!client->ready) {
+        return;
+    }
+    if (client->ready_prev != NULL) {
+        client->ready_prev->ready_next = client->ready_next;
+    } else {
+        server->ready_head = client->ready_next;
+    }
+    if (client->ready_next != NULL) {
+        client->ready_next->ready_prev = client->ready_prev;
+    } else {
+        server->ready_tail = client->ready_prev;
+    }
+    client->ready = 0;
+    client->ready_next = NULL;
+    client->ready_prev = NULL;
+}
+
+/**
+ * Add the tokens earned since the last refill, up to the burst size.
+ * The refill tick only moves once a whole token is earned, so slow rates
+ * lose nothing to rounding.
+ */
+void refill_client_tokens(server_t *server, client_info_t *client) {
+    const server_config_t *config = server->config;
+    uint64_t earned;
+    
+    if (config->rate_limit == 0) {
+        return;
+    }
+    earned = (server->now_tick - client->tokens_tick) * config->rate_limit / TIMER_SECONDS_TO_TICKS(1);
+    if (earned == 0) {
+        return;
+    }
+    client->tokens_tick = server->now_tick;
+    if (earned >= config->rate_burst || client->tokens + (int64_t)earned > (int64_t)config->rate_burst) {
+        client->tokens = (int64_t)config->rate_burst;
+    } else {
+        client->tokens += (int64_t)earned;
+    }
+}
+
+/**
+ * Charge bytes read to the client's rate limit. Turns never read more than
+ * the tokens left, so an empty bucket means the client stops being read
+ * until tokens are back.
+ */
+int charge_client_tokens(server_t *server, client_info_t *client, size_t bytes) {
+    const server_config_t *config = server->config;
+    uint64_t wait;
+    
+    if (config->rate_limit == 0) {
+        return 0;
+    }
+    client->tokens -= (int64_t)bytes;
+    if (client->tokens > 0) {
+        return 0;
+    }
+    
+    // Sleep until at least one token is back, and no less than RATE_LIMIT_WAIT_MS
+    wait = ((uint64_t)(1 - client->tokens) * TIMER_SECONDS_TO_TICKS(1) + config->rate_limit - 1) /
+           config->rate_limit;
+    if (wait < RATE_LIMIT_WAIT_MS / TIMER_TICK_MS) {
+        wait = RATE_LIMIT_WAIT_MS / TIMER_TICK_MS;
+    }
+    client->throttled = 1;
+    client->throttle_until = server->now_tick + wait;
+    METRIC_ADD(server->metrics.rate_limited, 1);
+    schedule_client_timeout(server, client);
+    return update_client_interest(server, client);
+}
+
+/**
+ * Register the event interest matching the client's state
+ */
+int update_client_interest(server_t *server, client_info_t *client) {
+    unsigned interest = 0;
+    
+    if (!client->read_paused && !client->throttled) {
+        interest |= EVENT_READ;
+    }
+    // A send in flight reports back by itself
+    if ((client->output.bytes > 0 && client->sending == 0) || client->pipe_bytes > 0) {
+        interest |= EVENT_WRITE;
+    }
+    
+    if (interest == client->interest) {
+        return 0;
+    }
+    
+    if (event_loop_modify(&server->loop, client->socket_fd, interest, client) == -1) {
+        print_error("Failed to update client event interest");
+        return -1;
+    }
+    client->interest = interest;
+    return 0;
+}
+
+/**
+ * Start a reply to one frame. A binary reply begins with its header,
+ * written over the request's header once the reply is complete.
+ */
+static int begin_reply(server_t *server, client_info_t *client, reply_builder_t *reply,
+                       char *header) {
+    reply_batch_t *replies = &server->replies;
+    
+    reply->server = server;
+    reply->client = client;
+    reply->header = header;
+    reply->header_iov = -1;
+    reply->length = 0;
+    reply->status = BINARY_STATUS_OK;
+    
+    if (header != NULL) {
+        if (replies->count + 1 > REPLY_BATCH_IOV && flush_client_replies(server, client) == -1) {
+            return -1;
+        }
+        reply->header_iov = replies->count;
+        replies->iov[replies->count].iov_base = header;
+        replies->iov[replies->count].iov_len = BINARY_HEADER_SIZE;
+        replies->count++;
+    }
+    reply->scratch_start = replies->scratch_used;
+    return 0;
+}
+
+/**
+ * Complete a reply: encode a binary header now that the length is known
+ */
+static void finish_reply(server_t *server, reply_builder_t *reply, const frame_view_t *frame) {
+    if (reply->header != NULL) {
+        binary_header_t header;
+        
+        header.length = (uint32_t)reply->length;
+        header.request_id = frame->request_id;
+        header.opcode = frame->opcode;
+        header.status = reply->status;
+        binary_header_encode(&header, reply->header);
+    } else if (reply->length == 0) {
+        // A handler may leave a text frame unanswered
+        return;
+    }
+    server->replies.frames++;
+}
+
+/**
+ * Process one client message: the request handler's reply is added to
+ * the server's reply batch, and flush_client_replies() sends it
+ */
+int process_client_message(server_t *server, client_info_t *client, char *buffer, int bytes_received) {
+    reply_builder_t reply;
+    frame_view_t frame;
+    char addr_str[64];
+    char log_msg[512];
+    int log_this = log_traffic_enabled();
+    
+    METRIC_ADD(server->metrics.messages_in, 1);
     
     // Remove trailing newline/carriage return from received message
     while (bytes_received > 0 && 
@@ -103,54 +679,863 @@ void process_client_message(server_t *server, int client_fd, char *buffer, int b
         bytes_received--;
     }
     
-    // Log received message
-    snprintf(log_msg, sizeof(log_msg), "Received from %s: \"%s\"", addr_str, buffer);
-    print_message_info(log_msg);
+    // Log received message (only for sampled messages)
+    if (log_this) {
+        describe_client(client, addr_str, sizeof(addr_str));
+        snprintf(log_msg, sizeof(log_msg), "Received from %s: \"%s\"", addr_str, buffer);
+        print_message_info(log_msg);
+    }
+    
+    if (server->config->broadcast) {
+        return process_broadcast_line(server, client, buffer, bytes_received);
+    }
     
-    // Create echo response
-    snprintf(response, sizeof(response), "Echo: %s\n", buffer);
+    frame.data = buffer;
+    frame.length = (size_t)bytes_received;
+    frame.protocol = PROTOCOL_TEXT;
+    frame.request_id = 0;
+    frame.opcode = 0;
     
-    // Send echo response back to client
-    if (send_client_message(client_fd, response, strlen(response)) == -1) {
-        // Failed to send response, client likely disconnected
-        remove_client(server, client_index);
-        return;
+    if (begin_reply(server, client, &reply, NULL) == -1 ||
+        server->handler->on_frame(&reply, &frame) == -1) {
+        return -1;
     }
+    finish_reply(server, &reply, &frame);
     
     // Log sent response
-    snprintf(log_msg, sizeof(log_msg), "Sent to %s: \"Echo: %s\"", addr_str, buffer);
-    print_message_info(log_msg);
+    if (log_this) {
+        snprintf(log_msg, sizeof(log_msg), "Sent to %s: %zu-byte reply", addr_str, reply.length);
+        print_message_info(log_msg);
+    }
+    return 0;
 }
 
 /**
- * Clean up client resources and remove from server
+ * Add a binary reply to the batch: the header, encoded over the request's
+ * header, then the payload in place. A NULL payload means the reply's
+ * payload is added later, as it is received (see process_binary_input()).
  */
-void cleanup_client(server_t *server, int client_index) {
-    if (client_index < 0 || client_index >= MAX_CLIENTS) {
-        return;
+static int add_binary_reply(server_t *server, client_info_t *client, char *frame,
+                            const binary_header_t *reply, const char *payload) {
+    reply_batch_t *replies = &server->replies;
+    
+    if (replies->count + 2 > REPLY_BATCH_IOV && flush_client_replies(server, client) == -1) {
+        return -1;
+    }
+    
+    binary_header_encode(reply, frame);
+    replies->iov[replies->count].iov_base = frame;
+    replies->iov[replies->count].iov_len = BINARY_HEADER_SIZE;
+    replies->count++;
+    replies->frames++;
+    
+    if (payload != NULL && reply->length > 0) {
+        replies->iov[replies->count].iov_base = (void *)payload;
+        replies->iov[replies->count].iov_len = reply->length;
+        replies->count++;
+    }
+    return 0;
+}
+
+/**
+ * Process one binary frame, adding the reply to the server's reply batch
+ */
+int process_binary_frame(server_t *server, client_info_t *client, char *frame,
+                         const binary_header_t *header, const char *payload) {
+    binary_header_t reply;
+    reply_builder_t builder;
+    frame_view_t view;
+    char addr_str[64];
+    char log_msg[256];
+    
+    METRIC_ADD(server->metrics.messages_in, 1);
+    
+    if (log_traffic_enabled()) {
+        describe_client(client, addr_str, sizeof(addr_str));
+        snprintf(log_msg, sizeof(log_msg), "Received from %s: %u-byte frame (opcode %u, id %u)",
+                 addr_str, (unsigned)header->length, (unsigned)header->opcode,
+                 (unsigned)header->request_id);
+        print_message_info(log_msg);
     }
     
-    // Close client socket
-    if (server->clients[client_index].socket_fd != -1) {
-        close(server->clients[client_index].socket_fd);
+    reply.request_id = header->request_id;
+    reply.opcode = header->opcode;
+    reply.status = BINARY_STATUS_OK;
+    reply.length = 0;
+    
+    switch (header->opcode) {
+        case BINARY_OP_PING:
+            return add_binary_reply(server, client, frame, &reply, NULL);
+        case BINARY_OP_JOIN:
+            if (payload == NULL) {
+                reply.status = BINARY_STATUS_TOO_LARGE;
+            } else if (header->length == 0 || (unsigned char)payload[0] > BINARY_JOIN_DISCONNECT ||
+                       join_client_room(server, client, payload + 1, header->length - 1,
+                                        (subscriber_policy_t)payload[0]) == -1) {
+                reply.status = BINARY_STATUS_BAD_REQUEST;
+            }
+            return add_binary_reply(server, client, frame, &reply, NULL);
+        case BINARY_OP_PUBLISH:
+            if (payload == NULL) {
+                reply.status = BINARY_STATUS_TOO_LARGE;
+            } else if (broadcast_message(server, client, payload, header->length,
+                                         header->request_id) == -1) {
+                return -1;
+            }
+            return add_binary_reply(server, client, frame, &reply, NULL);
+        default:
+            break;
     }
     
-    // Reset client information
-    init_client_info(&server->clients[client_index]);
+    // Everything else belongs to the request handler, which needs the
+    // whole payload unless it echoes oversized frames as they stream in
+    if (payload == NULL) {
+        if (server->handler->stream_echo && header->opcode == BINARY_OP_ECHO) {
+            reply.length = header->length;
+        } else {
+            reply.status = BINARY_STATUS_TOO_LARGE;
+        }
+        return add_binary_reply(server, client, frame, &reply, NULL);
+    }
+    
+    view.data = payload;
+    view.length = header->length;
+    view.protocol = PROTOCOL_BINARY;
+    view.request_id = header->request_id;
+    view.opcode = header->opcode;
+    
+    if (begin_reply(server, client, &builder, frame) == -1 ||
+        server->handler->on_frame(&builder, &view) == -1) {
+        return -1;
+    }
+    finish_reply(server, &builder, &view);
+    return 0;
 }
 
 /**
- * Get count of active clients
+ * Return a retired buffer to the pool
  */
-int get_active_client_count(server_t *server) {
+static void release_zerocopy_buffer(server_t *server, zerocopy_buffer_t *buffer) {
+    buffer_pool_free(&server->buffers, buffer->data, buffer->capacity);
+    slab_free(&server->zerocopy_records, buffer);
+}
+
+/**
+ * Count the zero-copy sends first..last as complete, releasing every
+ * retired buffer none of whose sends is outstanding any more. Ids wrap.
+ */
+static void complete_zerocopy_sends(server_t *server, client_info_t *client,
+                                    uint32_t first, uint32_t last) {
+    zerocopy_buffer_t **link = &client->zerocopy_pending;
+    
+    while (*link != NULL) {
+        zerocopy_buffer_t *buffer = *link;
+        int32_t start = (int32_t)(first - buffer->first_id);
+        int32_t end = (int32_t)(last - buffer->first_id);
+        
+        if (start < 0) {
+            start = 0;
+        }
+        if (end > (int32_t)buffer->sends - 1) {
+            end = (int32_t)buffer->sends - 1;
+        }
+        if (end >= start) {
+            buffer->outstanding -= (uint32_t)(end - start + 1);
+        }
+        
+        if (buffer->outstanding == 0) {
+            *link = buffer->next;
+            release_zerocopy_buffer(server, buffer);
+        } else {
+            link = &buffer->next;
+        }
+    }
+}
+
+/**
+ * Read the zero-copy completion notifications queued on a client's socket
+ */
+void reap_zerocopy_completions(server_t *server, client_info_t *client) {
+    char control[128];
+    
+    while (client->zerocopy_pending != NULL) {
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        
+        if (recvmsg(client->socket_fd, &msg, MSG_ERRQUEUE) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                print_error("Failed to read socket error queue");
+            }
+            return;
+        }
+        
+        // Each notification covers a range of send ids, coalesced by the kernel
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            struct sock_extended_err err;
+            
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                METRIC_ADD(server->metrics.zerocopy_copied, 1);
+            }
+            complete_zerocopy_sends(server, client, err.ee_info, err.ee_data);
+        }
+    }
+}
+
+/**
+ * Hand the input buffer that queued replies point into to the output
+ * queue, which keeps its storage until they are sent. The input continues
+ * in new storage.
+ */
+static int hold_borrowed_input(client_info_t *client) {
+    char *storage;
+    size_t capacity;
+    
+    if (stream_buffer_detach(&client->input, &storage, &capacity) == -1) {
+        print_error("Failed to hold input buffer for queued replies");
+        return -1;
+    }
+    output_queue_hold(&client->output, storage, capacity);
+    client->input_borrowed = 0;
+    return 0;
+}
+
+/**
+ * Retire the input buffer that zero-copy sends referenced: its storage
+ * waits on the client's pending list for the sends to complete, and the
+ * input continues in new storage
+ */
+static int retire_input_buffer(server_t *server, client_info_t *client) {
+    zerocopy_buffer_t *buffer = slab_alloc(&server->zerocopy_records);
+    
+    if (buffer == NULL ||
+        stream_buffer_detach(&client->input, &buffer->data, &buffer->capacity) == -1) {
+        print_error("Failed to retire zero-copy buffer");
+        if (buffer != NULL) {
+            slab_free(&server->zerocopy_records, buffer);
+        }
+        return -1;
+    }
+    
+    buffer->sends = client->input_zerocopy_sends;
+    buffer->outstanding = buffer->sends;
+    buffer->first_id = client->zerocopy_next_id - buffer->sends;
+    buffer->release_tick = 0;
+    buffer->next = client->zerocopy_pending;
+    client->zerocopy_pending = buffer;
+    client->input_zerocopy_sends = 0;
+    
+    // Completions of earlier sends are often queued by now. Reading them
+    // here also keeps memory bounded on backends that report no errors.
+    reap_zerocopy_completions(server, client);
+    return 0;
+}
+
+/**
+ * Hand a closing client's retired buffers over to the server. The kernel
+ * has nothing left to read from them once all output is acknowledged;
+ * otherwise they are kept as orphans for ZEROCOPY_ORPHAN_SECONDS.
+ */
+static void orphan_zerocopy_buffers(server_t *server, client_info_t *client) {
+    int unsent = 0;
+    
+    // The input buffer itself joins the others; its unconsumed bytes are
+    // dropped anyway. Out of memory, its storage is leaked rather than reused.
+    if (client->input_zerocopy_sends > 0) {
+        stream_buffer_consume(&client->input, stream_buffer_length(&client->input));
+        if (retire_input_buffer(server, client) == -1) {
+            stream_buffer_init(&client->input, client->input.pool);
+        }
+    }
+    reap_zerocopy_completions(server, client);
+    
+    if (ioctl(client->socket_fd, SIOCOUTQ, &unsent) == 0 && unsent == 0) {
+        while (client->zerocopy_pending != NULL) {
+            zerocopy_buffer_t *buffer = client->zerocopy_pending;
+            
+            client->zerocopy_pending = buffer->next;
+            release_zerocopy_buffer(server, buffer);
+        }
+    }
+    
+    while (client->zerocopy_pending != NULL) {
+        zerocopy_buffer_t *buffer = client->zerocopy_pending;
+        
+        client->zerocopy_pending = buffer->next;
+        buffer->next = NULL;
+        buffer->release_tick = server->now_tick + TIMER_SECONDS_TO_TICKS(ZEROCOPY_ORPHAN_SECONDS);
+        if (server->orphans_tail != NULL) {
+            server->orphans_tail->next = buffer;
+        } else {
+            server->orphans = buffer;
+            timer_wheel_schedule(&server->timers, &server->orphan_timer, buffer->release_tick);
+        }
+        server->orphans_tail = buffer;
+    }
+}
+
+/**
+ * Return orphaned zero-copy buffers to the pool once they are due
+ */
+void release_zerocopy_orphans(server_t *server, int all) {
+    while (server->orphans != NULL && (all || server->orphans->release_tick <= server->now_tick)) {
+        zerocopy_buffer_t *buffer = server->orphans;
+        
+        server->orphans = buffer->next;
+        release_zerocopy_buffer(server, buffer);
+    }
+    
+    if (server->orphans == NULL) {
+        server->orphans_tail = NULL;
+        timer_wheel_cancel(&server->timers, &server->orphan_timer);
+    } else {
+        timer_wheel_schedule(&server->timers, &server->orphan_timer, server->orphans->release_tick);
+    }
+}
+
+/**
+ * Extract and process every complete binary frame in the client's input
+ * buffer. Headers give each frame's length, so nothing is scanned. Frames
+ * over MAX_FRAME_SIZE are never buffered whole: an echo's reply header is
+ * sent at once and its payload passed through as it arrives, and any
+ * other opcode's payload is skipped.
+ */
+static int process_binary_input(server_t *server, client_info_t *client) {
+    stream_buffer_t *input = &client->input;
+    reply_batch_t *replies = &server->replies;
+    binary_header_t header;
+    
+    for (;;) {
+        char *data = stream_buffer_begin(input);
+        size_t length = stream_buffer_length(input);
+        
+        // Continue a frame that is streamed through
+        if (client->frame_remaining > 0) {
+            size_t piece = length < client->frame_remaining ? length : client->frame_remaining;
+            
+            if (piece == 0) {
+                break;
+            }
+            if (!client->frame_discard) {
+                if (replies->count + 1 > REPLY_BATCH_IOV && flush_client_replies(server, client) == -1) {
+                    return -1;
+                }
+                replies->iov[replies->count].iov_base = data;
+                replies->iov[replies->count].iov_len = piece;
+                replies->count++;
+            }
+            stream_buffer_consume(input, piece);
+            client->frame_remaining -= piece;
+            continue;
+        }
+        
+        // Frames after one on the offload pool wait for its reply
+        if (length < BINARY_HEADER_SIZE || client->offload != NULL) {
+            break;
+        }
+        if (server->turn_frames >= server->config->frame_budget) {
+            client->input_backlog = 1;
+            break;
+        }
+        binary_header_decode(data, &header);
+        server->turn_frames++;
+        
+        if (header.length > MAX_FRAME_SIZE) {
+            stream_buffer_consume(input, BINARY_HEADER_SIZE);
+            client->frame_remaining = header.length;
+            client->frame_discard = !server->handler->stream_echo || header.opcode != BINARY_OP_ECHO;
+            if (process_binary_frame(server, client, data, &header, NULL) == -1) {
+                return -1;
+            }
+            continue;
+        }
+        
+        // Wait until the whole frame is buffered
+        if (length - BINARY_HEADER_SIZE < header.length) {
+            break;
+        }
+        if (process_binary_frame(server, client, data, &header, data + BINARY_HEADER_SIZE) == -1) {
+            return -1;
+        }
+        stream_buffer_consume(input, BINARY_HEADER_SIZE + header.length);
+    }
+    
+    return 0;
+}
+
+/**
+ * Extract and process every complete newline-delimited frame in the
+ * client's input buffer. A trailing partial frame stays buffered until
+ * the rest of it arrives.
+ */
+static int process_text_input(server_t *server, client_info_t *client) {
+    stream_buffer_t *input = &client->input;
+    char addr_str[64];
+    char log_msg[256];
+    
+    for (;;) {
+        char *frame = stream_buffer_begin(input);
+        size_t length = stream_buffer_length(input);
+        char *newline;
+        
+        // Nothing more is read past a frame on the offload pool, so
+        // replies keep their order
+        if (client->offload != NULL) {
+            break;
+        }
+        
+        // Out of frames for this turn: the rest waits for the next one
+        if (server->turn_frames >= server->config->frame_budget && length > 0) {
+            client->input_backlog = 1;
+            break;
+        }
+        
+        // Only scan bytes that arrived since the last search
+        newline = memchr(frame + client->scan_offset, '\n', length - client->scan_offset);
+        if (newline == NULL) {
+            client->scan_offset = length;
+            if (length > MAX_FRAME_SIZE) {
+                describe_client(client, addr_str, sizeof(addr_str));
+                snprintf(log_msg, sizeof(log_msg), "Client %s sent a message over %d bytes",
+                         addr_str, MAX_FRAME_SIZE);
+                print_connection_info(log_msg);
+                return -2;
+            }
+            break;
+        }
+        
+        // The newline is consumed with the frame, so it can terminate it
+        *newline = '\0';
+        if (process_client_message(server, client, frame, (int)(newline - frame)) == -1) {
+            return -1;
+        }
+        stream_buffer_consume(input, (size_t)(newline - frame) + 1);
+        client->scan_offset = 0;
+        server->turn_frames++;
+    }
+    
+    return 0;
+}
+
+/**
+ * Process every complete frame buffered for a client, in the protocol
+ * its first byte selected, and send the replies in one batch
+ */
+int process_client_input(server_t *server, client_info_t *client) {
+    stream_buffer_t *input = &client->input;
+    int result;
+    
+    // The first byte received picks the protocol for the whole connection
+    if (client->protocol == PROTOCOL_UNKNOWN && stream_buffer_length(input) > 0) {
+        if ((unsigned char)stream_buffer_begin(input)[0] == PROTOCOL_BINARY_MAGIC) {
+            stream_buffer_consume(input, 1);
+            client->protocol = PROTOCOL_BINARY;
+        } else {
+            client->protocol = PROTOCOL_TEXT;
+        }
+    }
+    
+    if (client->protocol == PROTOCOL_BINARY) {
+        result = process_binary_input(server, client);
+    } else {
+        result = process_text_input(server, client);
+    }
+    if (result < 0) {
+        return result;
+    }
+    
+    if (flush_client_replies(server, client) == -1) {
+        return -1;
+    }
+    
+    // The kernel may still be reading zero-copy replies from the input
+    if (client->input_zerocopy_sends > 0 && retire_input_buffer(server, client) == -1) {
+        return -1;
+    }
+    
+    // Queued replies still point into the input until the loop sends them
+    if (client->input_borrowed && hold_borrowed_input(client) == -1) {
+        return -1;
+    }
+    
+    // Replies no longer point into the input, so an empty buffer can go
+    // back to the pool; idle connections then hold no input memory
+    if (stream_buffer_length(input) == 0) {
+        stream_buffer_free(input);
+    }
+    return 0;
+}
+
+/**
+ * Send every reply batched for a client in one gather write. Must run
+ * before the client's input buffer is modified again, since batched
+ * payloads point into it.
+ */
+int flush_client_replies(server_t *server, client_info_t *client) {
+    reply_batch_t *replies = &server->replies;
+    
+    return flush_reply_prefix(server, client, replies->count, replies->scratch_used);
+}
+
+/**
+ * Send the reply of an offloaded frame after everything batched before it
+ */
+int send_offloaded_reply(server_t *server, client_info_t *client, offload_job_t *job) {
+    struct iovec iov[2];
     int count = 0;
+    
+    if (flush_client_replies(server, client) == -1) {
+        return -1;
+    }
+    
+    if (job->frame.protocol == PROTOCOL_BINARY) {
+        binary_header_t header;
+        
+        header.length = (uint32_t)job->output_length;
+        header.request_id = job->frame.request_id;
+        header.opcode = job->frame.opcode;
+        header.status = job->status;
+        binary_header_encode(&header, job->header);
+        iov[count].iov_base = job->header;
+        iov[count].iov_len = BINARY_HEADER_SIZE;
+        count++;
+    } else if (job->output_length == 0) {
+        // A handler may leave a text frame unanswered
+        return 0;
+    }
+    if (job->output_length > 0) {
+        iov[count].iov_base = job->output;
+        iov[count].iov_len = job->output_length;
+        count++;
+    }
+    
+    METRIC_ADD(server->metrics.messages_out, 1);
+    metrics_record(&server->metrics.reply_latency, metrics_now_ns() - job->submitted_ns);
+    return queue_client_iov(server, client, iov, count, 0);
+}
+
+/**
+ * Send the first `count` batched pieces and keep the rest batched. Kept
+ * pieces' scratch copies move to the front of scratch. Only a batch that
+ * references no scratch may go out with MSG_ZEROCOPY, since scratch is
+ * reused as soon as the send returns.
+ */
+int flush_reply_prefix(server_t *server, client_info_t *client, int count, size_t scratch_start) {
+    reply_batch_t *replies = &server->replies;
+    char *moved_begin = replies->scratch + scratch_start;
+    char *moved_end = replies->scratch + replies->scratch_used;
+    int kept = replies->count - count;
+    int result = 0;
     int i;
     
-    for (i = 0; i < MAX_CLIENTS; i++) {
-        if (server->clients[i].active) {
-            count++;
+    if (count > 0) {
+        result = queue_client_iov(server, client, replies->iov, count, scratch_start == 0);
+        METRIC_ADD(server->metrics.messages_out, (uint64_t)replies->frames);
+        metrics_record(&server->metrics.reply_latency,
+                       metrics_now_ns() - server->metrics.iteration_start);
+    }
+    
+    if (kept > 0) {
+        memmove(replies->iov, replies->iov + count, (size_t)kept * sizeof(struct iovec));
+        for (i = 0; i < kept; i++) {
+            char *base = replies->iov[i].iov_base;
+            
+            if (base >= moved_begin && base < moved_end) {
+                replies->iov[i].iov_base = base - scratch_start;
+            }
+        }
+        memmove(replies->scratch, moved_begin, (size_t)(moved_end - moved_begin));
+    }
+    replies->count = kept;
+    replies->frames = 0;
+    replies->scratch_used = (size_t)(moved_end - moved_begin);
+    
+    return result;
+}
+
+/**
+ * Check whether a client's input should be spliced
+ */
+int client_can_splice(server_t *server, client_info_t *client) {
+    // Once a pipe is attached, the rest of the payload goes through it
+    if (client->pipe_fds[0] != -1) {
+        return 1;
+    }
+    return server->config->splice && client->protocol == PROTOCOL_BINARY &&
+           !client->frame_discard && client->frame_remaining >= SPLICE_MIN_BYTES &&
+           stream_buffer_length(&client->input) == 0 && client->output.bytes == 0;
+}
+
+/**
+ * Attach a pipe to a client, from the worker's cache when one is idle
+ */
+static int acquire_client_pipe(server_t *server, client_info_t *client) {
+    int size = SPLICE_PIPE_SIZE;
+    
+    if (server->pipe_cache_count > 0) {
+        server->pipe_cache_count--;
+        client->pipe_fds[0] = server->pipe_cache[server->pipe_cache_count][0];
+        client->pipe_fds[1] = server->pipe_cache[server->pipe_cache_count][1];
+        return 0;
+    }
+    
+    if (pipe2(client->pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        client->pipe_fds[0] = -1;
+        client->pipe_fds[1] = -1;
+        return -1;
+    }
+    
+    // A bigger pipe means fewer splice() calls; the default 64 KB still works
+    (void)fcntl(client->pipe_fds[1], F_SETPIPE_SZ, size);
+    return 0;
+}
+
+/**
+ * Detach a client's pipe, keeping it for reuse when it is empty
+ */
+void release_client_pipe(server_t *server, client_info_t *client) {
+    if (client->pipe_fds[0] == -1) {
+        return;
+    }
+    
+    if (client->pipe_bytes == 0 && server->pipe_cache_count < SPLICE_PIPE_CACHE) {
+        server->pipe_cache[server->pipe_cache_count][0] = client->pipe_fds[0];
+        server->pipe_cache[server->pipe_cache_count][1] = client->pipe_fds[1];
+        server->pipe_cache_count++;
+    } else {
+        close(client->pipe_fds[0]);
+        close(client->pipe_fds[1]);
+    }
+    client->pipe_fds[0] = -1;
+    client->pipe_fds[1] = -1;
+    client->pipe_bytes = 0;
+}
+
+/**
+ * Echo a streamed payload with splice(). Bytes already in the pipe are
+ * owed to the client, so the pipe is always drained before more is read;
+ * reading therefore only stops when the socket is empty, never because
+ * the pipe is full.
+ */
+int splice_client_stream(server_t *server, client_info_t *client, size_t *budget,
+                         disconnect_reason_t *reason) {
+    ssize_t moved;
+    size_t want;
+    int progressed;
+    
+    if (client->pipe_fds[0] == -1 && acquire_client_pipe(server, client) == -1) {
+        return -1;
+    }
+    
+    for (;;) {
+        progressed = 0;
+        while (client->pipe_bytes > 0) {
+            moved = splice(client->pipe_fds[0], NULL, client->socket_fd, NULL, client->pipe_bytes,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    // Socket full: wait for writability, which counts as stalled output
+                    if (progressed || client->write_progress == 0) {
+                        client->write_progress = server->now_tick;
+                        schedule_client_timeout(server, client);
+                    }
+                    if (update_client_interest(server, client) == -1) {
+                        *reason = DISCONNECT_INTERNAL_ERROR;
+                        return -2;
+                    }
+                    return 1;
+                }
+                if (errno != EPIPE && errno != ECONNRESET) {
+                    print_error("Failed to splice data to client");
+                }
+                *reason = DISCONNECT_WRITE_ERROR;
+                return -2;
+            }
+            client->pipe_bytes -= (size_t)moved;
+            client->last_active = server->now_tick;
+            progressed = 1;
+            METRIC_ADD(server->metrics.bytes_out, (uint64_t)moved);
+            METRIC_ADD(server->metrics.bytes_spliced, (uint64_t)moved);
+        }
+        client->write_progress = 0;
+        
+        // Payload complete: the pipe goes back to the cache
+        if (client->frame_remaining == 0) {
+            release_client_pipe(server, client);
+            if (update_client_interest(server, client) == -1) {
+                *reason = DISCONNECT_INTERNAL_ERROR;
+                return -2;
+            }
+            return 0;
+        }
+        
+        // The pipe is empty, so stopping here leaves nothing owed to the client
+        if (*budget == 0) {
+            return 2;
+        }
+        want = client->frame_remaining < SPLICE_PIPE_SIZE ? client->frame_remaining : SPLICE_PIPE_SIZE;
+        if (want > *budget) {
+            want = *budget;
+        }
+        moved = splice(client->socket_fd, NULL, client->pipe_fds[1], NULL, want,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved == 0) {
+            *reason = DISCONNECT_PEER_CLOSED;
+            return -2;
+        }
+        if (moved == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // The pipe is empty here, so the socket is drained
+                if (update_client_interest(server, client) == -1) {
+                    *reason = DISCONNECT_INTERNAL_ERROR;
+                    return -2;
+                }
+                return 1;
+            }
+            if (errno != ECONNRESET) {
+                print_error("Failed to splice data from client");
+            }
+            *reason = DISCONNECT_READ_ERROR;
+            return -2;
+        }
+        client->pipe_bytes += (size_t)moved;
+        client->frame_remaining -= (size_t)moved;
+        *budget -= (size_t)moved;
+        client->last_active = server->now_tick;
+        METRIC_ADD(server->metrics.bytes_in, (uint64_t)moved);
+    }
+}
+
+/**
+ * Compute when a client next times out, from its activity ticks
+ */
+uint64_t client_timeout_deadline(server_t *server, client_info_t *client,
+                                 disconnect_reason_t *reason) {
+    const server_config_t *config = server->config;
+    disconnect_reason_t earliest = DISCONNECT_IDLE_TIMEOUT;
+    uint64_t deadline = 0, candidate;
+    
+    // Evicted clients are due at once
+    if (client->evicting) {
+        if (reason != NULL) {
+            *reason = client->evict_reason;
+        }
+        return server->now_tick;
+    }
+    
+    if (config->idle_timeout > 0) {
+        deadline = client->last_active + TIMER_SECONDS_TO_TICKS(config->idle_timeout);
+    }
+    
+    // A paused or throttled client isn't being read, so its partial frame can't progress
+    if (config->read_timeout > 0 && client->frame_started != 0 && !client->read_paused &&
+        !client->throttled) {
+        candidate = client->frame_started + TIMER_SECONDS_TO_TICKS(config->read_timeout);
+        if (deadline == 0 || candidate < deadline) {
+            deadline = candidate;
+            earliest = DISCONNECT_READ_TIMEOUT;
+        }
+    }
+    
+    if (config->write_timeout > 0 && client->write_progress != 0) {
+        candidate = client->write_progress + TIMER_SECONDS_TO_TICKS(config->write_timeout);
+        if (deadline == 0 || candidate < deadline) {
+            deadline = candidate;
+            earliest = DISCONNECT_WRITE_TIMEOUT;
         }
     }
     
-    return count;
-}
\ No newline at end of file
+    // The timer also ends a throttle; that is never a reason to disconnect
+    // and fires before it could be mistaken for one
+    if (client->throttled && (deadline == 0 || client->throttle_until < deadline)) {
+        deadline = client->throttle_until;
+    }
+    
+    if (reason != NULL) {
+        *reason = earliest;
+    }
+    return deadline;
+}
+
+/**
+ * Make sure the client's timer fires no later than its current deadline
+ */
+void schedule_client_timeout(server_t *server, client_info_t *client) {
+    uint64_t deadline = client_timeout_deadline(server, client, NULL);
+    
+    if (deadline == 0) {
+        return;
+    }
+    if (!timer_pending(&client->timer) || deadline < client->timer.expires) {
+        timer_wheel_schedule(&server->timers, &client->timer, deadline);
+    }
+}
+
+/**
+ * Close client socket and release its connection table entry
+ */
+void cleanup_client(server_t *server, client_info_t *client) {
+    if (!client->active) {
+        return;
+    }
+    
+    // No timeout may fire for a released connection
+    timer_wheel_cancel(&server->timers, &client->timer);
+    
+    // The kernel may still read buffers of zero-copy sends
+    if (client->zerocopy_pending != NULL || client->input_zerocopy_sends > 0) {
+        orphan_zerocopy_buffers(server, client);
+    }
+    
+    room_leave(&server->rooms, client);
+    cancel_client_turn(server, client);
+    
+    // A job still on the offload pool is freed when its worker collects it
+    if (client->offload != NULL) {
+        client->offload->client = NULL;
+        client->offload = NULL;
+    }
+    
+    // Let the handler release its per-connection state
+    if (server->handler->on_close != NULL) {
+        server->handler->on_close(server, client);
+    }
+    
+    // Close client socket and drop unsent output
+    if (client->socket_fd != -1) {
+        close(client->socket_fd);
+    }
+    output_queue_clear(&client->output);
+    stream_buffer_free(&client->input);
+    release_client_pipe(server, client);
+    
+    // Return the connection to the table's free list
+    conn_table_remove(&server->clients, client);
+}
+
+/**
+ * Get count of active clients
+ */
+int get_active_client_count(server_t *server) {
+    return server->clients.count;
+}
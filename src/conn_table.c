@@ -0,0 +1,159 @@
+#include "../include/conn_table.h"
+#include "../include/socket_utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Grow the descriptor index so that fd is a valid slot
+ */
+static int conn_table_reserve(conn_table_t *table, int fd) {
+    client_info_t **by_fd;
+    int capacity = table->capacity;
+
+    while (capacity <= fd) {
+        capacity *= 2;
+    }
+
+    by_fd = realloc(table->by_fd, (size_t)capacity * sizeof(*by_fd));
+    if (by_fd == NULL) {
+        print_error("Failed to grow connection table");
+        return -1;
+    }
+
+    memset(by_fd + table->capacity, 0, (size_t)(capacity - table->capacity) * sizeof(*by_fd));
+    table->by_fd = by_fd;
+    table->capacity = capacity;
+    return 0;
+}
+
+/**
+ * Initialize an empty connection table
+ */
+int conn_table_init(conn_table_t *table, int max_clients, buffer_pool_t *buffers,
+                    int use_huge_pages) {
+    memset(table, 0, sizeof(*table));
+    table->max_clients = max_clients;
+    table->buffers = buffers;
+    slab_init(&table->hot, sizeof(client_info_t), use_huge_pages);
+    slab_init(&table->cold, sizeof(client_meta_t), use_huge_pages);
+    slab_init(&table->refs, sizeof(out_chunk_t), 0);
+
+    table->by_fd = calloc(CONN_TABLE_INITIAL_CAPACITY, sizeof(*table->by_fd));
+    if (table->by_fd == NULL) {
+        print_error("Failed to allocate connection table");
+        return -1;
+    }
+    table->capacity = CONN_TABLE_INITIAL_CAPACITY;
+    return 0;
+}
+
+/**
+ * Free all memory held by the table
+ */
+void conn_table_destroy(conn_table_t *table) {
+    slab_destroy(&table->hot);
+    slab_destroy(&table->cold);
+    slab_destroy(&table->refs);
+    free(table->by_fd);
+    memset(table, 0, sizeof(*table));
+}
+
+/**
+ * Allocate a connection from the slabs and index it by descriptor
+ */
+client_info_t *conn_table_insert(conn_table_t *table, int fd) {
+    client_info_t *client;
+
+    if (fd < 0 || table->count >= table->max_clients) {
+        return NULL;
+    }
+
+    if (fd >= table->capacity && conn_table_reserve(table, fd) == -1) {
+        return NULL;
+    }
+
+    client = slab_alloc(&table->hot);
+    if (client == NULL) {
+        return NULL;
+    }
+    client->meta = slab_alloc(&table->cold);
+    if (client->meta == NULL) {
+        slab_free(&table->hot, client);
+        return NULL;
+    }
+
+    client->socket_fd = fd;
+    client->unix_peer = 0;
+    client->active = 1;
+    client->interest = 0;
+    client->read_paused = 0;
+    client->throttled = 0;
+    client->input_backlog = 0;
+    client->offload = NULL;
+    client->ready = 0;
+    client->ready_next = NULL;
+    client->ready_prev = NULL;
+    client->tokens = 0;
+    client->tokens_tick = 0;
+    client->throttle_until = 0;
+    output_queue_init(&client->output, table->buffers, &table->refs);
+    client->sending = 0;
+    client->input_borrowed = 0;
+    stream_buffer_init(&client->input, table->buffers);
+    client->scan_offset = 0;
+    client->protocol = PROTOCOL_UNKNOWN;
+    client->frame_remaining = 0;
+    client->frame_discard = 0;
+    client->pipe_fds[0] = -1;
+    client->pipe_fds[1] = -1;
+    client->pipe_bytes = 0;
+    client->zerocopy_pending = NULL;
+    client->zerocopy_next_id = 0;
+    client->input_zerocopy_sends = 0;
+    client->room = NULL;
+    client->room_next = NULL;
+    client->room_prev = NULL;
+    client->room_policy = SUBSCRIBER_DEFAULT;
+    client->handler_state = NULL;
+    client->evicting = 0;
+    client->evict_reason = DISCONNECT_INTERNAL_ERROR;
+    timer_entry_init(&client->timer);
+    client->last_active = 0;
+    client->frame_started = 0;
+    client->write_progress = 0;
+    memset(client->meta, 0, sizeof(*client->meta));
+
+    table->by_fd[fd] = client;
+    table->count++;
+    return client;
+}
+
+/**
+ * Look up the connection for a descriptor
+ */
+client_info_t *conn_table_lookup(conn_table_t *table, int fd) {
+    if (fd < 0 || fd >= table->capacity) {
+        return NULL;
+    }
+    return table->by_fd[fd];
+}
+
+/**
+ * Unindex a connection and return it to the slabs
+ */
+void conn_table_remove(conn_table_t *table, client_info_t *client) {
+    if (!client->active) {
+        return;
+    }
+
+    if (client->socket_fd >= 0 && client->socket_fd < table->capacity &&
+        table->by_fd[client->socket_fd] == client) {
+        table->by_fd[client->socket_fd] = NULL;
+    }
+
+    client->socket_fd = -1;
+    client->active = 0;
+    slab_free(&table->cold, client->meta);
+    slab_free(&table->hot, client);
+    table->count--;
+}
@@ -0,0 +1,159 @@
+#define _GNU_SOURCE
+#include "../include/event_loop.h"
+#include "../include/socket_utils.h"
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+/**
+ * Translate EVENT_* interest flags into an edge-triggered epoll mask
+ */
+static unsigned to_epoll_mask(unsigned events) {
+    unsigned mask = EPOLLET | EPOLLRDHUP;
+
+    if (events & EVENT_READ) {
+        mask |= EPOLLIN;
+    }
+    if (events & EVENT_WRITE) {
+        mask |= EPOLLOUT;
+    }
+    return mask;
+}
+
+/**
+ * Initialize an epoll based event loop
+ */
+int event_loop_init(event_loop_t *loop) {
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1) {
+        print_error("Failed to create epoll instance");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Release the epoll instance
+ */
+void event_loop_destroy(event_loop_t *loop) {
+    if (loop->epoll_fd != -1) {
+        close(loop->epoll_fd);
+        loop->epoll_fd = -1;
+    }
+}
+
+/**
+ * Register a descriptor, storing the caller's pointer in epoll_event.data
+ */
+int event_loop_add(event_loop_t *loop, int fd, unsigned events, void *data) {
+    struct epoll_event ev;
+
+    ev.events = to_epoll_mask(events);
+    ev.data.ptr = data;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/**
+ * Change the interest set of a registered descriptor
+ */
+int event_loop_modify(event_loop_t *loop, int fd, unsigned events, void *data) {
+    struct epoll_event ev;
+
+    ev.events = to_epoll_mask(events);
+    ev.data.ptr = data;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/**
+ * Unregister a descriptor
+ */
+void event_loop_remove(event_loop_t *loop, int fd) {
+    // Kernels before 2.6.9 require a non-NULL event even for EPOLL_CTL_DEL
+    struct epoll_event ev = {0, {0}};
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+/**
+ * Wait for a batch of ready descriptors. Cost is proportional to the
+ * number of ready sockets, not the number registered.
+ */
+int event_loop_wait(event_loop_t *loop, loop_event_t *events, int max_events, int timeout_ms) {
+    int i, count;
+
+    if (max_events > EVENT_BATCH_SIZE) {
+        max_events = EVENT_BATCH_SIZE;
+    }
+
+    count = epoll_wait(loop->epoll_fd, loop->events, max_events, timeout_ms);
+    if (count <= 0) {
+        return count;
+    }
+
+    for (i = 0; i < count; i++) {
+        unsigned ready = loop->events[i].events;
+
+        events[i].data = loop->events[i].data.ptr;
+        events[i].events = 0;
+        events[i].result = 0;
+        if (ready & EPOLLIN) {
+            events[i].events |= EVENT_READ;
+        }
+        if (ready & EPOLLOUT) {
+            events[i].events |= EVENT_WRITE;
+        }
+        if (ready & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+            events[i].events |= EVENT_HANGUP;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Accept a pending connection, already non-blocking
+ */
+int event_loop_accept(event_loop_t *loop, int listen_fd, struct sockaddr *addr, socklen_t *addr_len) {
+    (void)loop;
+    return accept4(listen_fd, addr, addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+/**
+ * Read what the socket has buffered
+ */
+ssize_t event_loop_recv(event_loop_t *loop, int fd, void *buffer, size_t length) {
+    (void)loop;
+    return recv(fd, buffer, length, 0);
+}
+
+/**
+ * Gather-write as much as the socket takes right now
+ */
+ssize_t event_loop_send(event_loop_t *loop, int fd, const struct iovec *iov, int iovcnt) {
+    struct msghdr msg;
+    ssize_t sent;
+
+    (void)loop;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = (size_t)iovcnt;
+
+    sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    return sent;
+}
+
+/**
+ * The caller makes every system call itself, so nothing is in flight
+ */
+void event_loop_quiesce(event_loop_t *loop) {
+    (void)loop;
+}
+
+/**
+ * Get backend name
+ */
+const char *event_loop_backend_name(void) {
+    return "epoll";
+}
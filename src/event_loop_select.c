@@ -0,0 +1,182 @@
+#define _GNU_SOURCE
+#include "../include/event_loop.h"
+#include <string.h>
+#include <errno.h>
+
+/**
+ * Initialize a select() based event loop (fallback backend)
+ */
+int event_loop_init(event_loop_t *loop) {
+    FD_ZERO(&loop->read_interest);
+    FD_ZERO(&loop->write_interest);
+    memset(loop->data, 0, sizeof(loop->data));
+    loop->max_fd = -1;
+    loop->scan_start = 0;
+    return 0;
+}
+
+/**
+ * Nothing to release for select()
+ */
+void event_loop_destroy(event_loop_t *loop) {
+    FD_ZERO(&loop->read_interest);
+    FD_ZERO(&loop->write_interest);
+    loop->max_fd = -1;
+}
+
+/**
+ * Register a descriptor. select() cannot watch descriptors >= FD_SETSIZE.
+ */
+int event_loop_add(event_loop_t *loop, int fd, unsigned events, void *data) {
+    if (fd < 0 || fd >= FD_SETSIZE) {
+        errno = EMFILE;
+        return -1;
+    }
+
+    if (fd > loop->max_fd) {
+        loop->max_fd = fd;
+    }
+    return event_loop_modify(loop, fd, events, data);
+}
+
+/**
+ * Change the interest set of a registered descriptor
+ */
+int event_loop_modify(event_loop_t *loop, int fd, unsigned events, void *data) {
+    if (fd < 0 || fd >= FD_SETSIZE) {
+        errno = EBADF;
+        return -1;
+    }
+
+    loop->data[fd] = data;
+
+    if (events & EVENT_READ) {
+        FD_SET(fd, &loop->read_interest);
+    } else {
+        FD_CLR(fd, &loop->read_interest);
+    }
+
+    if (events & EVENT_WRITE) {
+        FD_SET(fd, &loop->write_interest);
+    } else {
+        FD_CLR(fd, &loop->write_interest);
+    }
+
+    return 0;
+}
+
+/**
+ * Unregister a descriptor and recompute the highest watched descriptor
+ */
+void event_loop_remove(event_loop_t *loop, int fd) {
+    if (fd < 0 || fd >= FD_SETSIZE) {
+        return;
+    }
+
+    FD_CLR(fd, &loop->read_interest);
+    FD_CLR(fd, &loop->write_interest);
+    loop->data[fd] = NULL;
+
+    while (loop->max_fd >= 0 && loop->data[loop->max_fd] == NULL) {
+        loop->max_fd--;
+    }
+}
+
+/**
+ * Wait for readiness. Level-triggered and O(max_fd) per wakeup. When more
+ * descriptors are ready than fit in the batch, the next scan starts after
+ * the last one reported, so low descriptors aren't always served first.
+ */
+int event_loop_wait(event_loop_t *loop, loop_event_t *events, int max_events, int timeout_ms) {
+    fd_set read_set, write_set;
+    struct timeval tv, *tvp = NULL;
+    int i, fd, activity, count = 0;
+
+    // select() modifies the sets it receives, so work on copies
+    read_set = loop->read_interest;
+    write_set = loop->write_interest;
+
+    if (timeout_ms >= 0) {
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        tvp = &tv;
+    }
+
+    activity = select(loop->max_fd + 1, &read_set, &write_set, NULL, tvp);
+    if (activity <= 0) {
+        return activity;
+    }
+
+    for (i = 0; i <= loop->max_fd && count < max_events; i++) {
+        unsigned ready = 0;
+
+        fd = (loop->scan_start + i) % (loop->max_fd + 1);
+
+        if (FD_ISSET(fd, &read_set)) {
+            ready |= EVENT_READ;
+        }
+        if (FD_ISSET(fd, &write_set)) {
+            ready |= EVENT_WRITE;
+        }
+        if (ready) {
+            events[count].data = loop->data[fd];
+            events[count].events = ready;
+            events[count].result = 0;
+            count++;
+            if (count == max_events) {
+                loop->scan_start = fd + 1;
+            }
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Accept a pending connection, already non-blocking
+ */
+int event_loop_accept(event_loop_t *loop, int listen_fd, struct sockaddr *addr, socklen_t *addr_len) {
+    (void)loop;
+    return accept4(listen_fd, addr, addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+/**
+ * Read what the socket has buffered
+ */
+ssize_t event_loop_recv(event_loop_t *loop, int fd, void *buffer, size_t length) {
+    (void)loop;
+    return recv(fd, buffer, length, 0);
+}
+
+/**
+ * Gather-write as much as the socket takes right now
+ */
+ssize_t event_loop_send(event_loop_t *loop, int fd, const struct iovec *iov, int iovcnt) {
+    struct msghdr msg;
+    ssize_t sent;
+
+    (void)loop;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = (size_t)iovcnt;
+
+    sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    return sent;
+}
+
+/**
+ * The caller makes every system call itself, so nothing is in flight
+ */
+void event_loop_quiesce(event_loop_t *loop) {
+    (void)loop;
+}
+
+/**
+ * Get backend name
+ */
+const char *event_loop_backend_name(void) {
+    return "select";
+}
@@ -0,0 +1,1151 @@
+#define _GNU_SOURCE
+#include "../include/event_loop.h"
+#include "../include/socket_utils.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Submission queue size; the completion queue is twice as large
+#define URING_ENTRIES 4096
+
+// Initial size of the descriptor registration table
+#define URING_INITIAL_REGS 1024
+
+// Provided receive buffers per loop (a power of two) and their size
+#define URING_BUFFER_COUNT 512
+#define URING_BUFFER_SIZE 16384
+
+// Buffer group the receives pick from
+#define URING_BUFFER_GROUP 0
+
+// Buffers one connection may hold before its receive is stopped, so a
+// connection that isn't being read can't starve the others
+#define URING_HELD_MAX 16
+
+// Registration state: requests outstanding, which are also the operation
+// codes in user_data, and list membership
+#define URING_POLL     0x01
+#define URING_RECV     0x02
+#define URING_ACCEPT   0x04
+#define URING_SEND     0x08
+#define URING_CANCEL   0x10         // Cancellation of the receive or accept queued
+#define URING_LISTED   0x20         // On the ready list
+#define URING_STARVED  0x40         // On the starved list
+
+/**
+ * io_uring backend. Listeners have a multishot ACCEPT outstanding and
+ * connections a multishot RECV that picks buffers from a provided buffer
+ * ring; what they produce waits in the loop until the caller takes it
+ * with event_loop_accept() and event_loop_recv(). Sends are queued as
+ * SENDMSG SQEs. Other descriptors, and connections waiting for the socket
+ * to take more output, have a multishot POLL_ADD. Nothing is submitted
+ * until event_loop_wait(), where one io_uring_enter() call hands the
+ * kernel every send, re-arm and cancellation of the iteration and reaps
+ * the completions, so a busy iteration costs one syscall no matter how
+ * many messages it received and replied to.
+ *
+ * Completions update the registrations and put them on a ready list,
+ * which event_loop_wait() reports from; a descriptor with many
+ * completions is reported once, and completions can be reaped whenever
+ * the loop has to wait for the kernel.
+ */
+
+/**
+ * Message of a descriptor's send. It outlives the call that queued it,
+ * since the kernel reads it when the SQE is submitted.
+ */
+typedef struct uring_send {
+    struct msghdr msg;
+    struct iovec iov[EVENT_SEND_MAX_IOV];
+} uring_send_t;
+
+/**
+ * Pack operation, descriptor and generation into a request's user_data.
+ * user_data 0 marks internal requests (cancellations) whose completions
+ * are ignored.
+ */
+static uint64_t pack_user_data(unsigned op, int fd, unsigned generation) {
+    return ((uint64_t)op << 56) | ((uint64_t)(generation & 0xffffff) << 32) | (uint32_t)(fd + 1);
+}
+
+/**
+ * poll(2) mask a registration's poll request waits for, 0 if it needs none
+ */
+static unsigned to_poll_mask(const uring_registration_t *reg) {
+    unsigned mask = POLLRDHUP;
+
+    // A listener's accept and a connection's receive report data themselves
+    if (reg->events & EVENT_ACCEPT) {
+        return 0;
+    }
+    if (reg->events & EVENT_STREAM) {
+        return reg->events & EVENT_WRITE ? POLLOUT : 0;
+    }
+
+    if (reg->events & EVENT_READ) {
+        mask |= POLLIN;
+    }
+    if (reg->events & EVENT_WRITE) {
+        mask |= POLLOUT;
+    }
+    return mask;
+}
+
+/**
+ * Thin wrapper around the io_uring_enter system call
+ */
+static int uring_enter(event_loop_t *loop, unsigned to_submit, unsigned min_complete,
+                       unsigned flags, void *arg, size_t arg_size) {
+    return (int)syscall(__NR_io_uring_enter, loop->ring_fd, to_submit, min_complete,
+                        flags, arg, arg_size);
+}
+
+/**
+ * Number of queued SQEs the kernel has not consumed yet
+ */
+static unsigned pending_submissions(event_loop_t *loop) {
+    return *loop->sq_tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Get the next free submission queue entry, flushing the queue if full
+ */
+static struct io_uring_sqe *get_sqe(event_loop_t *loop) {
+    struct io_uring_sqe *sqe;
+
+    while (pending_submissions(loop) >= loop->sq_entries) {
+        if (uring_enter(loop, pending_submissions(loop), 0, 0, NULL, 0) == -1 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return NULL;
+        }
+    }
+
+    sqe = &loop->sqes[*loop->sq_tail & loop->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/**
+ * Publish the entry returned by get_sqe() to the kernel
+ */
+static void push_sqe(event_loop_t *loop) {
+    __atomic_store_n(loop->sq_tail, *loop->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Queue a multishot poll for a registered descriptor
+ */
+static int queue_poll_add(event_loop_t *loop, int fd) {
+    uring_registration_t *reg = &loop->regs[fd];
+    struct io_uring_sqe *sqe = get_sqe(loop);
+
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = to_poll_mask(reg);
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = pack_user_data(URING_POLL, fd, reg->poll_generation);
+    push_sqe(loop);
+    reg->state |= URING_POLL;
+    loop->inflight++;
+    return 0;
+}
+
+/**
+ * Queue cancellation of a descriptor's current poll request
+ */
+static int queue_poll_remove(event_loop_t *loop, int fd) {
+    uring_registration_t *reg = &loop->regs[fd];
+    struct io_uring_sqe *sqe = get_sqe(loop);
+
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = pack_user_data(URING_POLL, fd, reg->poll_generation);
+    sqe->user_data = 0;
+    push_sqe(loop);
+    reg->state &= ~URING_POLL;
+    return 0;
+}
+
+/**
+ * Give a descriptor the poll request its interest needs, replacing the
+ * current one when the mask changed
+ */
+static int update_poll(event_loop_t *loop, int fd, unsigned old_mask) {
+    uring_registration_t *reg = &loop->regs[fd];
+    unsigned mask = to_poll_mask(reg);
+
+    if (mask == old_mask && ((reg->state & URING_POLL) || mask == 0 || loop->quiesced)) {
+        return 0;
+    }
+
+    if ((reg->state & URING_POLL) && queue_poll_remove(loop, fd) == -1) {
+        return -1;
+    }
+    reg->poll_generation++;
+    if (mask == 0 || loop->quiesced) {
+        return 0;
+    }
+    return queue_poll_add(loop, fd);
+}
+
+/**
+ * Queue cancellation of the request with the given user_data
+ */
+static int queue_cancel(event_loop_t *loop, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(loop);
+
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = 0;
+    push_sqe(loop);
+    return 0;
+}
+
+/**
+ * Start or stop a connection's multishot receive to match its interest,
+ * the buffers it holds and the buffers left. A receive being cancelled is
+ * re-armed once its last completion is in.
+ */
+static int update_recv(event_loop_t *loop, int fd) {
+    uring_registration_t *reg = &loop->regs[fd];
+    struct io_uring_sqe *sqe;
+    int wanted = (reg->events & EVENT_READ) && reg->recv_result > 0 &&
+                 reg->held_count < URING_HELD_MAX && !(reg->state & URING_STARVED) &&
+                 !loop->quiesced;
+
+    if (!wanted) {
+        if ((reg->state & (URING_RECV | URING_CANCEL)) == URING_RECV) {
+            if (queue_cancel(loop, pack_user_data(URING_RECV, fd, reg->generation)) == -1) {
+                return -1;
+            }
+            reg->state |= URING_CANCEL;
+        }
+        return 0;
+    }
+    if (reg->state & URING_RECV) {
+        return 0;
+    }
+
+    sqe = get_sqe(loop);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = pack_user_data(URING_RECV, fd, reg->generation);
+    push_sqe(loop);
+    reg->state |= URING_RECV;
+    loop->inflight++;
+    return 0;
+}
+
+/**
+ * Queue a listener's multishot accept
+ */
+static int queue_accept(event_loop_t *loop, int fd) {
+    uring_registration_t *reg = &loop->regs[fd];
+    struct io_uring_sqe *sqe;
+
+    if ((reg->state & URING_ACCEPT) || !(reg->events & EVENT_READ) || loop->quiesced) {
+        return 0;
+    }
+
+    sqe = get_sqe(loop);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = pack_user_data(URING_ACCEPT, fd, reg->generation);
+    push_sqe(loop);
+    reg->state |= URING_ACCEPT;
+    loop->inflight++;
+    return 0;
+}
+
+/**
+ * Give a provided buffer back to the ring
+ */
+static void recycle_buffer(event_loop_t *loop, unsigned bid) {
+    struct io_uring_buf *buf = &loop->buf_ring->bufs[loop->buf_ring_tail & (URING_BUFFER_COUNT - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(loop->buffers + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = (uint16_t)bid;
+    loop->buf_ring_tail++;
+    __atomic_store_n(&loop->buf_ring->tail, (uint16_t)loop->buf_ring_tail, __ATOMIC_RELEASE);
+    loop->buffers_free++;
+}
+
+/**
+ * Reset the list links and queues of unused registration entries
+ */
+static void init_registrations(uring_registration_t *regs, int from, int to) {
+    int fd;
+
+    memset(regs + from, 0, (size_t)(to - from) * sizeof(*regs));
+    for (fd = from; fd < to; fd++) {
+        regs[fd].held_head = -1;
+        regs[fd].held_tail = -1;
+        regs[fd].accept_head = -1;
+        regs[fd].accept_tail = -1;
+    }
+}
+
+/**
+ * Grow the registration table so that fd is a valid index
+ */
+static int ensure_capacity(event_loop_t *loop, int fd) {
+    uring_registration_t *regs;
+    int capacity = loop->regs_capacity;
+
+    if (fd < capacity) {
+        return 0;
+    }
+
+    while (capacity <= fd) {
+        capacity *= 2;
+    }
+
+    regs = realloc(loop->regs, (size_t)capacity * sizeof(*regs));
+    if (regs == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    init_registrations(regs, loop->regs_capacity, capacity);
+    loop->regs = regs;
+    loop->regs_capacity = capacity;
+    return 0;
+}
+
+/**
+ * Queue a descriptor for event_loop_wait() to report
+ */
+static void mark_ready(event_loop_t *loop, int fd, unsigned events) {
+    uring_registration_t *reg = &loop->regs[fd];
+
+    reg->ready |= events;
+    if (reg->state & URING_LISTED) {
+        return;
+    }
+    reg->state |= URING_LISTED;
+    reg->ready_next = -1;
+    if (loop->ready_tail != -1) {
+        loop->regs[loop->ready_tail].ready_next = fd;
+    } else {
+        loop->ready_head = fd;
+    }
+    loop->ready_tail = fd;
+}
+
+/**
+ * Translate a poll completion into EVENT_* flags
+ */
+static unsigned from_poll_result(int res) {
+    unsigned events = 0;
+
+    if (res < 0) {
+        return EVENT_HANGUP;
+    }
+    if (res & POLLIN) {
+        events |= EVENT_READ;
+    }
+    if (res & POLLOUT) {
+        events |= EVENT_WRITE;
+    }
+    if (res & (POLLERR | POLLHUP | POLLRDHUP)) {
+        events |= EVENT_HANGUP;
+    }
+    return events;
+}
+
+/**
+ * A multishot accept took a connection: queue it on the listener
+ */
+static void queue_accepted(event_loop_t *loop, int listen_fd, int fd) {
+    uring_registration_t *reg;
+
+    if (ensure_capacity(loop, fd) == -1) {
+        close(fd);
+        return;
+    }
+
+    reg = &loop->regs[listen_fd];
+    loop->regs[fd].accept_next = -1;
+    if (reg->accept_tail != -1) {
+        loop->regs[reg->accept_tail].accept_next = fd;
+    } else {
+        reg->accept_head = fd;
+    }
+    reg->accept_tail = fd;
+}
+
+/**
+ * A multishot receive filled a buffer: hold it for event_loop_recv()
+ */
+static void hold_buffer(event_loop_t *loop, int fd, unsigned bid, unsigned length) {
+    uring_registration_t *reg = &loop->regs[fd];
+
+    loop->buffer_info[bid].length = length;
+    loop->buffer_info[bid].next = -1;
+    if (reg->held_tail != -1) {
+        loop->buffer_info[reg->held_tail].next = (int)bid;
+    } else {
+        reg->held_head = (int)bid;
+        reg->held_offset = 0;
+    }
+    reg->held_tail = (int)bid;
+    reg->held_count++;
+}
+
+/**
+ * Apply one completion to its registration. Completions of requests that
+ * belong to an earlier registration only give back what they hold.
+ */
+static void handle_completion(event_loop_t *loop, const struct io_uring_cqe *cqe) {
+    uint64_t user_data = cqe->user_data;
+    unsigned op = (unsigned)(user_data >> 56);
+    unsigned generation = (unsigned)(user_data >> 32) & 0xffffff;
+    int fd = (int)(uint32_t)user_data - 1;
+    int res = cqe->res;
+    int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    uring_registration_t *reg;
+    int current, rearm = 0;
+
+    // Cancellations and poll removals
+    if (user_data == 0) {
+        return;
+    }
+    if (!more) {
+        loop->inflight--;
+    }
+
+    // The kernel took a provided buffer; it counts as free again once recycled
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        loop->buffers_free--;
+    }
+
+    if (fd < 0 || fd >= loop->regs_capacity) {
+        return;
+    }
+    reg = &loop->regs[fd];
+    current = reg->events != 0 &&
+              ((op == URING_POLL ? reg->poll_generation : reg->generation) & 0xffffff) == generation;
+
+    switch (op) {
+        case URING_POLL:
+            if (!current) {
+                return;
+            }
+            if (!more) {
+                reg->state &= ~URING_POLL;
+            }
+            if (res == -ECANCELED) {
+                return;
+            }
+            // The kernel may end a healthy multishot poll (e.g. on CQ
+            // overflow); re-arm it. Failed polls are reported as hangups.
+            if (res >= 0 && !more && !loop->quiesced) {
+                queue_poll_add(loop, fd);
+            }
+            mark_ready(loop, fd, from_poll_result(res));
+            return;
+
+        case URING_RECV:
+            if (!current) {
+                if (cqe->flags & IORING_CQE_F_BUFFER) {
+                    recycle_buffer(loop, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                }
+                return;
+            }
+            if (!more) {
+                reg->state &= ~(URING_RECV | URING_CANCEL);
+            }
+            if (res > 0) {
+                hold_buffer(loop, fd, cqe->flags >> IORING_CQE_BUFFER_SHIFT, (unsigned)res);
+                mark_ready(loop, fd, EVENT_READ);
+            } else if (res == -ENOBUFS) {
+                // Re-armed by event_loop_wait() once buffers come back
+                if (!(reg->state & URING_STARVED)) {
+                    reg->state |= URING_STARVED;
+                    reg->starved_next = loop->starved_head;
+                    loop->starved_head = fd;
+                }
+            } else if (res != -ECANCELED) {
+                // End of stream or an error, reported after the data held
+                reg->recv_result = res;
+                mark_ready(loop, fd, EVENT_READ);
+            }
+            // Stops the receive at URING_HELD_MAX, or re-arms one that ended
+            update_recv(loop, fd);
+            return;
+
+        case URING_ACCEPT:
+            if (!current) {
+                if (res >= 0) {
+                    close(res);
+                }
+                return;
+            }
+            if (!more) {
+                rearm = !(reg->state & URING_CANCEL);
+                reg->state &= ~(URING_ACCEPT | URING_CANCEL);
+            }
+            if (res >= 0) {
+                queue_accepted(loop, fd, res);
+                // queue_accepted() may have moved the table
+                loop->regs[fd].accept_error = 0;
+                mark_ready(loop, fd, EVENT_READ);
+                if (rearm) {
+                    queue_accept(loop, fd);
+                }
+            } else if (res != -ECANCELED) {
+                // Reported, and the accept re-armed, by event_loop_accept()
+                reg->accept_error = -res;
+                mark_ready(loop, fd, EVENT_READ);
+            }
+            return;
+
+        case URING_SEND:
+            if (!current) {
+                return;
+            }
+            reg->state &= ~URING_SEND;
+            reg->sent = res;
+            mark_ready(loop, fd, EVENT_SENT);
+            return;
+
+        default:
+            return;
+    }
+}
+
+/**
+ * Apply every completion the kernel has posted
+ */
+static void reap_completions(event_loop_t *loop) {
+    unsigned head = *loop->cq_head;
+    unsigned tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+
+    // Handling a completion may flush the submission queue, and what that
+    // submits may complete at once
+    while (head != tail) {
+        while (head != tail) {
+            handle_completion(loop, &loop->cqes[head & loop->cq_mask]);
+            head++;
+        }
+        __atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+        tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+    }
+}
+
+/**
+ * Submit everything queued and wait until the requests in the given state
+ * bits of fd, or every request if fd is -1, have completed
+ */
+static void wait_for_requests(event_loop_t *loop, int fd, unsigned state) {
+    for (;;) {
+        reap_completions(loop);
+        if (fd == -1 ? loop->inflight == 0 : !(loop->regs[fd].state & state)) {
+            return;
+        }
+        if (uring_enter(loop, pending_submissions(loop), 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            print_error("Failed to wait for io_uring requests");
+            return;
+        }
+    }
+}
+
+/**
+ * Set up the provided buffer ring receives pick from
+ */
+static int setup_buffers(event_loop_t *loop) {
+    struct io_uring_buf_reg reg;
+    size_t ring_size = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    unsigned bid;
+
+    loop->buffer_info = calloc(URING_BUFFER_COUNT, sizeof(*loop->buffer_info));
+    if (loop->buffer_info == NULL) {
+        return -1;
+    }
+
+    // The ring must be page aligned; the buffers follow it
+    loop->buffers_size = ring_size + (size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE;
+    loop->buf_ring = mmap(NULL, loop->buffers_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (loop->buf_ring == MAP_FAILED) {
+        loop->buf_ring = NULL;
+        return -1;
+    }
+    loop->buffers = (char *)loop->buf_ring + ring_size;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)loop->buf_ring;
+    reg.ring_entries = URING_BUFFER_COUNT;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, loop->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        return -1;
+    }
+
+    for (bid = 0; bid < URING_BUFFER_COUNT; bid++) {
+        recycle_buffer(loop, bid);
+    }
+    return 0;
+}
+
+/**
+ * Initialize an io_uring based event loop
+ */
+int event_loop_init(event_loop_t *loop) {
+    struct io_uring_params params;
+    unsigned *sq_array;
+    unsigned i;
+
+    memset(loop, 0, sizeof(*loop));
+    memset(&params, 0, sizeof(params));
+    loop->ready_head = -1;
+    loop->ready_tail = -1;
+    loop->starved_head = -1;
+
+    loop->ring_fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (loop->ring_fd == -1) {
+        print_error("Failed to create io_uring instance");
+        return -1;
+    }
+
+    // Timed waits need IORING_ENTER_EXT_ARG (Linux 5.11)
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        errno = ENOSYS;
+        print_error("io_uring lacks IORING_FEAT_EXT_ARG");
+        close(loop->ring_fd);
+        loop->ring_fd = -1;
+        return -1;
+    }
+
+    loop->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    loop->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (loop->cq_ring_size > loop->sq_ring_size) {
+            loop->sq_ring_size = loop->cq_ring_size;
+        }
+        loop->cq_ring_size = loop->sq_ring_size;
+    }
+
+    loop->sq_ring = mmap(NULL, loop->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_SQ_RING);
+    if (loop->sq_ring == MAP_FAILED) {
+        loop->sq_ring = NULL;
+        print_error("Failed to map io_uring submission ring");
+        event_loop_destroy(loop);
+        return -1;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        loop->cq_ring = loop->sq_ring;
+    } else {
+        loop->cq_ring = mmap(NULL, loop->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_CQ_RING);
+        if (loop->cq_ring == MAP_FAILED) {
+            loop->cq_ring = NULL;
+            print_error("Failed to map io_uring completion ring");
+            event_loop_destroy(loop);
+            return -1;
+        }
+    }
+
+    loop->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    loop->sqes = mmap(NULL, loop->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_SQES);
+    if (loop->sqes == MAP_FAILED) {
+        loop->sqes = NULL;
+        print_error("Failed to map io_uring submission entries");
+        event_loop_destroy(loop);
+        return -1;
+    }
+
+    loop->sq_head = (unsigned *)((char *)loop->sq_ring + params.sq_off.head);
+    loop->sq_tail = (unsigned *)((char *)loop->sq_ring + params.sq_off.tail);
+    loop->sq_mask = *(unsigned *)((char *)loop->sq_ring + params.sq_off.ring_mask);
+    loop->sq_entries = params.sq_entries;
+    loop->cq_head = (unsigned *)((char *)loop->cq_ring + params.cq_off.head);
+    loop->cq_tail = (unsigned *)((char *)loop->cq_ring + params.cq_off.tail);
+    loop->cq_mask = *(unsigned *)((char *)loop->cq_ring + params.cq_off.ring_mask);
+    loop->cqes = (struct io_uring_cqe *)((char *)loop->cq_ring + params.cq_off.cqes);
+
+    // SQ slots map one-to-one onto SQE indices
+    sq_array = (unsigned *)((char *)loop->sq_ring + params.sq_off.array);
+    for (i = 0; i < params.sq_entries; i++) {
+        sq_array[i] = i;
+    }
+
+    loop->regs = malloc(URING_INITIAL_REGS * sizeof(*loop->regs));
+    if (loop->regs == NULL) {
+        print_error("Failed to allocate io_uring registrations");
+        event_loop_destroy(loop);
+        return -1;
+    }
+    init_registrations(loop->regs, 0, URING_INITIAL_REGS);
+    loop->regs_capacity = URING_INITIAL_REGS;
+
+    // Provided buffer rings need Linux 5.19
+    if (setup_buffers(loop) == -1) {
+        print_error("Failed to set up io_uring provided buffers");
+        event_loop_destroy(loop);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Unmap the rings and close the io_uring instance, with the connections
+ * accepted but never taken
+ */
+void event_loop_destroy(event_loop_t *loop) {
+    int fd;
+
+    if (loop->sqes != NULL) {
+        munmap(loop->sqes, loop->sqes_size);
+        loop->sqes = NULL;
+    }
+    if (loop->cq_ring != NULL && loop->cq_ring != loop->sq_ring) {
+        munmap(loop->cq_ring, loop->cq_ring_size);
+    }
+    loop->cq_ring = NULL;
+    if (loop->sq_ring != NULL) {
+        munmap(loop->sq_ring, loop->sq_ring_size);
+        loop->sq_ring = NULL;
+    }
+    if (loop->ring_fd != -1) {
+        close(loop->ring_fd);
+        loop->ring_fd = -1;
+    }
+
+    // The kernel keeps the pages of a registered buffer ring until the
+    // ring is gone, so unmapping after the close is safe
+    if (loop->buf_ring != NULL) {
+        munmap(loop->buf_ring, loop->buffers_size);
+        loop->buf_ring = NULL;
+        loop->buffers = NULL;
+    }
+    free(loop->buffer_info);
+    loop->buffer_info = NULL;
+
+    for (fd = 0; fd < loop->regs_capacity; fd++) {
+        uring_registration_t *reg = &loop->regs[fd];
+
+        while (reg->accept_head != -1) {
+            int next = loop->regs[reg->accept_head].accept_next;
+
+            close(reg->accept_head);
+            reg->accept_head = next;
+        }
+        free(reg->send);
+    }
+    free(loop->regs);
+    loop->regs = NULL;
+    loop->regs_capacity = 0;
+}
+
+/**
+ * Register a descriptor. Its requests are submitted on the next wait.
+ */
+int event_loop_add(event_loop_t *loop, int fd, unsigned events, void *data) {
+    uring_registration_t *reg;
+
+    if (fd < 0 || ensure_capacity(loop, fd) == -1) {
+        return -1;
+    }
+    reg = &loop->regs[fd];
+
+    // Connections a listener by this number took before are someone
+    // else's by now
+    while (reg->accept_head != -1) {
+        int next = loop->regs[reg->accept_head].accept_next;
+
+        close(reg->accept_head);
+        reg->accept_head = next;
+    }
+    reg->accept_tail = -1;
+    reg->accept_error = 0;
+
+    // List memberships outlive the registration; lists skip stale entries
+    reg->data = data;
+    reg->events = events | EVENT_HANGUP;
+    reg->generation++;
+    reg->poll_generation++;
+    reg->state &= URING_LISTED | URING_STARVED;
+    reg->ready = 0;
+    reg->sent = 0;
+    reg->recv_result = 1;
+
+    if (events & EVENT_ACCEPT) {
+        return queue_accept(loop, fd);
+    }
+    if (events & EVENT_STREAM) {
+        if (update_recv(loop, fd) == -1) {
+            return -1;
+        }
+    }
+    return update_poll(loop, fd, 0);
+}
+
+/**
+ * Change a descriptor's interest: replace its poll request if the mask
+ * changed, and start or stop a connection's receive
+ */
+int event_loop_modify(event_loop_t *loop, int fd, unsigned events, void *data) {
+    uring_registration_t *reg;
+    unsigned old_mask;
+
+    if (fd < 0 || fd >= loop->regs_capacity || loop->regs[fd].events == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    reg = &loop->regs[fd];
+
+    reg->data = data;
+    events = (events & (EVENT_READ | EVENT_WRITE)) | (reg->events & (EVENT_ACCEPT | EVENT_STREAM));
+    if (reg->events == (events | EVENT_HANGUP)) {
+        return 0;
+    }
+
+    old_mask = to_poll_mask(reg);
+    reg->events = events | EVENT_HANGUP;
+    if (events & EVENT_ACCEPT) {
+        return queue_accept(loop, fd);
+    }
+    if ((events & EVENT_STREAM) && update_recv(loop, fd) == -1) {
+        return -1;
+    }
+    return update_poll(loop, fd, old_mask);
+}
+
+/**
+ * Unregister a descriptor. Cancellations reach the kernel with the next
+ * submission and find their requests by user_data, so the descriptor may
+ * be closed and reused meanwhile. A queued send names the descriptor, so
+ * it is submitted now; a listener's accept is cancelled synchronously, so
+ * every connection it took is on the queue.
+ */
+void event_loop_remove(event_loop_t *loop, int fd) {
+    uring_registration_t *reg;
+
+    if (fd < 0 || fd >= loop->regs_capacity || loop->regs[fd].events == 0) {
+        return;
+    }
+    reg = &loop->regs[fd];
+
+    if ((reg->state & (URING_ACCEPT | URING_CANCEL)) == URING_ACCEPT &&
+        queue_cancel(loop, pack_user_data(URING_ACCEPT, fd, reg->generation)) == 0) {
+        reg->state |= URING_CANCEL;
+        wait_for_requests(loop, fd, URING_ACCEPT);
+        reg = &loop->regs[fd];
+    }
+    if (reg->state & URING_SEND) {
+        while (uring_enter(loop, pending_submissions(loop), 0, 0, NULL, 0) == -1 && errno == EINTR) {
+            continue;
+        }
+    }
+    if (reg->state & URING_POLL) {
+        queue_poll_remove(loop, fd);
+    }
+    if ((reg->state & (URING_RECV | URING_CANCEL)) == URING_RECV) {
+        queue_cancel(loop, pack_user_data(URING_RECV, fd, reg->generation));
+    }
+
+    // Data nobody will read goes back to the ring
+    while (reg->held_head != -1) {
+        int bid = reg->held_head;
+
+        reg->held_head = loop->buffer_info[bid].next;
+        recycle_buffer(loop, (unsigned)bid);
+    }
+    reg->held_tail = -1;
+    reg->held_count = 0;
+    reg->held_offset = 0;
+
+    reg->data = NULL;
+    reg->events = 0;
+    reg->generation++;
+    reg->poll_generation++;
+    reg->state &= URING_LISTED | URING_STARVED;
+    reg->ready = 0;
+}
+
+/**
+ * Submit queued requests, wait for completions and report the
+ * descriptors they made ready
+ */
+int event_loop_wait(event_loop_t *loop, loop_event_t *events, int max_events, int timeout_ms) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    unsigned min_complete = 1;
+    int count = 0;
+
+    // Receives that ran out of buffers start again once some are back
+    while (loop->starved_head != -1 && loop->buffers_free > 0) {
+        int fd = loop->starved_head;
+
+        loop->starved_head = loop->regs[fd].starved_next;
+        loop->regs[fd].state &= ~URING_STARVED;
+        if (loop->regs[fd].events & EVENT_STREAM) {
+            update_recv(loop, fd);
+        }
+    }
+
+    // Completions already queued: only flush submissions, don't block
+    reap_completions(loop);
+    if (loop->ready_head != -1 || timeout_ms == 0) {
+        min_complete = 0;
+    }
+
+    if (min_complete > 0 || pending_submissions(loop) > 0) {
+        void *argp = NULL;
+        size_t arg_size = 0;
+
+        if (min_complete > 0 && timeout_ms > 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+            memset(&arg, 0, sizeof(arg));
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+            argp = &arg;
+            arg_size = sizeof(arg);
+            flags |= IORING_ENTER_EXT_ARG;
+        }
+
+        if (uring_enter(loop, pending_submissions(loop), min_complete, flags, argp, arg_size) == -1 &&
+            errno != ETIME && errno != EBUSY) {
+            return -1;
+        }
+        reap_completions(loop);
+    }
+
+    while (loop->ready_head != -1 && count < max_events) {
+        int fd = loop->ready_head;
+        uring_registration_t *reg = &loop->regs[fd];
+
+        loop->ready_head = reg->ready_next;
+        if (loop->ready_head == -1) {
+            loop->ready_tail = -1;
+        }
+        reg->state &= ~URING_LISTED;
+
+        // Removed since it was queued
+        if (reg->ready == 0 || reg->events == 0) {
+            continue;
+        }
+        events[count].data = reg->data;
+        events[count].events = reg->ready;
+        events[count].result = reg->sent;
+        reg->ready = 0;
+        count++;
+    }
+
+    return count;
+}
+
+/**
+ * Take a connection the listener's multishot accept queued. Completions
+ * carry no address, so it is looked up here.
+ */
+int event_loop_accept(event_loop_t *loop, int listen_fd, struct sockaddr *addr, socklen_t *addr_len) {
+    uring_registration_t *reg;
+    int fd;
+
+    if (listen_fd < 0 || listen_fd >= loop->regs_capacity) {
+        errno = EBADF;
+        return -1;
+    }
+    reg = &loop->regs[listen_fd];
+
+    if (reg->accept_head == -1) {
+        if (reg->accept_error != 0) {
+            // The error ended the accept; report it once and start again
+            errno = reg->accept_error;
+            reg->accept_error = 0;
+            if (reg->events != 0) {
+                queue_accept(loop, listen_fd);
+            }
+            return -1;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+
+    fd = reg->accept_head;
+    reg->accept_head = loop->regs[fd].accept_next;
+    if (reg->accept_head == -1) {
+        reg->accept_tail = -1;
+    }
+
+    // A peer that already reset has no address left; treat it as aborted
+    if (addr != NULL && getpeername(fd, addr, addr_len) == -1) {
+        close(fd);
+        errno = ECONNABORTED;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Copy out data the connection's multishot receive put in provided
+ * buffers, giving every emptied buffer back to the ring
+ */
+ssize_t event_loop_recv(event_loop_t *loop, int fd, void *buffer, size_t length) {
+    uring_registration_t *reg;
+    size_t copied = 0;
+
+    if (fd < 0 || fd >= loop->regs_capacity || loop->regs[fd].events == 0) {
+        errno = EBADF;
+        return -1;
+    }
+    reg = &loop->regs[fd];
+
+    while (copied < length && reg->held_head != -1) {
+        int bid = reg->held_head;
+        size_t available = loop->buffer_info[bid].length - reg->held_offset;
+        size_t piece = length - copied < available ? length - copied : available;
+
+        memcpy((char *)buffer + copied,
+               loop->buffers + (size_t)bid * URING_BUFFER_SIZE + reg->held_offset, piece);
+        copied += piece;
+        reg->held_offset += (unsigned)piece;
+
+        if (reg->held_offset == loop->buffer_info[bid].length) {
+            reg->held_head = loop->buffer_info[bid].next;
+            if (reg->held_head == -1) {
+                reg->held_tail = -1;
+            }
+            reg->held_count--;
+            reg->held_offset = 0;
+            recycle_buffer(loop, (unsigned)bid);
+        }
+    }
+
+    // Below URING_HELD_MAX again: a stopped receive starts again
+    if (update_recv(loop, fd) == -1) {
+        return -1;
+    }
+
+    if (copied > 0) {
+        return (ssize_t)copied;
+    }
+    if (reg->recv_result == 0) {
+        return 0;
+    }
+    errno = reg->recv_result < 0 ? -reg->recv_result : EAGAIN;
+    return -1;
+}
+
+/**
+ * Queue a SENDMSG for the next submission. MSG_DONTWAIT makes the kernel
+ * complete it during that io_uring_enter() call with whatever the socket
+ * takes (-EAGAIN if nothing) instead of keeping it in flight, so the
+ * buffers are free again once it is reported.
+ */
+ssize_t event_loop_send(event_loop_t *loop, int fd, const struct iovec *iov, int iovcnt) {
+    uring_registration_t *reg;
+    struct io_uring_sqe *sqe;
+    uring_send_t *send;
+
+    if (fd < 0 || fd >= loop->regs_capacity || loop->regs[fd].events == 0) {
+        errno = EBADF;
+        return -1;
+    }
+    reg = &loop->regs[fd];
+    if (reg->state & URING_SEND) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if (reg->send == NULL) {
+        reg->send = malloc(sizeof(*reg->send));
+        if (reg->send == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    send = reg->send;
+    if (iovcnt > EVENT_SEND_MAX_IOV) {
+        iovcnt = EVENT_SEND_MAX_IOV;
+    }
+    memcpy(send->iov, iov, (size_t)iovcnt * sizeof(*iov));
+    memset(&send->msg, 0, sizeof(send->msg));
+    send->msg.msg_iov = send->iov;
+    send->msg.msg_iovlen = (size_t)iovcnt;
+
+    sqe = get_sqe(loop);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)&send->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+    sqe->user_data = pack_user_data(URING_SEND, fd, reg->generation);
+    push_sqe(loop);
+    reg->state |= URING_SEND;
+    loop->inflight++;
+    return 0;
+}
+
+/**
+ * Cancel every multishot request and wait until nothing is in flight.
+ * Sends queued later still go out with the next wait.
+ */
+void event_loop_quiesce(event_loop_t *loop) {
+    int fd;
+
+    loop->quiesced = 1;
+    for (fd = 0; fd < loop->regs_capacity; fd++) {
+        uring_registration_t *reg = &loop->regs[fd];
+
+        if (reg->events == 0) {
+            continue;
+        }
+        if (reg->state & URING_POLL) {
+            queue_poll_remove(loop, fd);
+        }
+        if ((reg->state & (URING_RECV | URING_ACCEPT)) && !(reg->state & URING_CANCEL) &&
+            queue_cancel(loop, pack_user_data(reg->state & (URING_RECV | URING_ACCEPT), fd,
+                                              reg->generation)) == 0) {
+            reg->state |= URING_CANCEL;
+        }
+    }
+    wait_for_requests(loop, -1, 0);
+}
+
+/**
+ * Get backend name
+ */
+const char *event_loop_backend_name(void) {
+    return "io_uring";
+}
@@ -0,0 +1,577 @@
+#include "../include/handler.h"
+#include "../include/client_handler.h"
+#include "../include/offload.h"
+#include "../include/kv_store.h"
+#include "../include/socket_utils.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/**
+ * Echo handler: text lines come back prefixed with "Echo: ", binary ECHO
+ * payloads unchanged. Both reference the frame in place.
+ */
+static int echo_frame(reply_builder_t *reply, const frame_view_t *frame) {
+    static const char echo_prefix[] = "Echo: ";
+    static const char echo_trailer[] = "\n";
+
+    if (frame->protocol == PROTOCOL_BINARY) {
+        if (frame->opcode != BINARY_OP_ECHO) {
+            reply_set_status(reply, BINARY_STATUS_UNKNOWN_OPCODE);
+            return 0;
+        }
+        return reply_add(reply, frame->data, frame->length);
+    }
+
+    if (reply_add(reply, echo_prefix, sizeof(echo_prefix) - 1) == -1 ||
+        reply_add(reply, frame->data, frame->length) == -1 ||
+        reply_add(reply, echo_trailer, sizeof(echo_trailer) - 1) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+static const request_handler_t echo_handler = {
+    "echo",
+    "Reply to every message with its own contents",
+    1,
+    NULL,
+    echo_frame,
+    NULL
+};
+
+// Passes of the digest over the payload; enough that a reply takes far
+// longer to compute than to send, like a real CPU-heavy request
+#define DIGEST_ROUNDS 4096
+
+/**
+ * Iterated FNV-1a: each pass hashes the payload again, starting from the
+ * previous pass's result
+ */
+static uint64_t digest_bytes(const char *data, size_t length) {
+    uint64_t digest = 14695981039346656037ULL;
+    size_t i;
+    int round;
+
+    for (round = 0; round < DIGEST_ROUNDS; round++) {
+        for (i = 0; i < length; i++) {
+            digest ^= (unsigned char)data[i];
+            digest *= 1099511628211ULL;
+        }
+        digest ^= digest >> 29;
+    }
+    return digest;
+}
+
+/**
+ * Digest handler work, on a pool thread: "Digest: HEX" for text, the
+ * digest as 8 big-endian bytes for binary
+ */
+static int digest_run(offload_job_t *job, const frame_view_t *frame) {
+    uint64_t digest = digest_bytes(frame->data, frame->length);
+    unsigned char bytes[8];
+    int i;
+
+    if (frame->protocol == PROTOCOL_BINARY) {
+        for (i = 0; i < 8; i++) {
+            bytes[i] = (unsigned char)(digest >> (56 - 8 * i));
+        }
+        return offload_write(job, bytes, sizeof(bytes));
+    }
+    return offload_printf(job, "Digest: %016llx\n", (unsigned long long)digest);
+}
+
+/**
+ * Digest handler: every text line and binary DIGEST payload is hashed on
+ * the offload pool, keeping the event loop free for other connections
+ */
+static int digest_frame(reply_builder_t *reply, const frame_view_t *frame) {
+    if (frame->protocol == PROTOCOL_BINARY && frame->opcode != BINARY_OP_DIGEST) {
+        reply_set_status(reply, BINARY_STATUS_UNKNOWN_OPCODE);
+        return 0;
+    }
+    return reply_offload(reply, frame, digest_run);
+}
+
+static const request_handler_t digest_handler = {
+    "digest",
+    "Reply with a digest of each message, computed on the offload pool (-j)",
+    0,
+    NULL,
+    digest_frame,
+    NULL
+};
+
+/**
+ * Count a command's hits, misses and evictions. A GET whose value could
+ * not be returned is neither.
+ */
+static void kv_count(server_t *server, int get, kv_result_t result, size_t evicted) {
+    if (get && result == KV_OK) {
+        METRIC_ADD(server->metrics.kv_hits, 1);
+    } else if (get && result == KV_NOT_FOUND) {
+        METRIC_ADD(server->metrics.kv_misses, 1);
+    }
+    if (evicted > 0) {
+        METRIC_ADD(server->metrics.kv_evictions, evicted);
+    }
+}
+
+/**
+ * Look a key up and copy its value into the reply between a prefix and a
+ * trailer. The room is made before the shard is locked, so nothing is
+ * sent while the lock is held; a value too long for the room is looked up
+ * again once there is enough.
+ * @param status Receives KV_OK, KV_NOT_FOUND, or KV_TOO_LARGE if the value
+ *               can't fit in one reply batch
+ * @return 0 on success, -1 if replies could not be sent
+ */
+static int kv_reply_value(reply_builder_t *reply, const char *key, size_t key_length,
+                          const char *prefix, const char *trailer, kv_result_t *status) {
+    size_t prefix_length = strlen(prefix), overhead = prefix_length + strlen(trailer);
+    size_t needed = 0, available, length;
+    char *space;
+
+    for (;;) {
+        if (needed > REPLY_SCRATCH_SIZE - overhead) {
+            *status = KV_TOO_LARGE;
+            return 0;
+        }
+        space = reply_reserve(reply, needed + overhead, &available);
+        if (space == NULL) {
+            return -1;
+        }
+        *status = kv_get(key, key_length, space + prefix_length, available - overhead, &length);
+        if (*status != KV_TOO_LARGE) {
+            break;
+        }
+        needed = length;
+    }
+
+    if (*status == KV_OK) {
+        memcpy(space, prefix, prefix_length);
+        memcpy(space + prefix_length + length, trailer, overhead - prefix_length);
+        reply_commit(reply, overhead + length);
+    }
+    return 0;
+}
+
+/**
+ * Run a binary key-value command: GET, SET, DEL or INCR
+ */
+static int kv_binary_frame(reply_builder_t *reply, const frame_view_t *frame) {
+    const char *key = frame->data, *value = NULL;
+    size_t key_length = frame->length, value_length = 0, evicted = 0;
+    int64_t delta = 1, result;
+    unsigned char bytes[8];
+    kv_result_t status;
+    int i;
+
+    // SET and INCR start with the key's length
+    if (frame->opcode == BINARY_OP_SET || frame->opcode == BINARY_OP_INCR) {
+        if (frame->length == 0 || frame->length - 1 < (unsigned char)frame->data[0]) {
+            reply_set_status(reply, BINARY_STATUS_BAD_REQUEST);
+            return 0;
+        }
+        key_length = (unsigned char)frame->data[0];
+        key = frame->data + 1;
+        value = key + key_length;
+        value_length = frame->length - 1 - key_length;
+    }
+    if (frame->opcode < BINARY_OP_GET || frame->opcode > BINARY_OP_INCR) {
+        reply_set_status(reply, BINARY_STATUS_UNKNOWN_OPCODE);
+        return 0;
+    }
+    if (key_length == 0 || key_length > KV_MAX_KEY ||
+        (frame->opcode == BINARY_OP_INCR && value_length != 0 && value_length != 8)) {
+        reply_set_status(reply, BINARY_STATUS_BAD_REQUEST);
+        return 0;
+    }
+
+    switch (frame->opcode) {
+        case BINARY_OP_GET:
+            if (kv_reply_value(reply, key, key_length, "", "", &status) == -1) {
+                return -1;
+            }
+            break;
+        case BINARY_OP_SET:
+            status = kv_set(key, key_length, value, value_length, &evicted);
+            break;
+        case BINARY_OP_DEL:
+            status = kv_delete(key, key_length);
+            break;
+        default:
+            if (value_length == 8) {
+                uint64_t raw = 0;
+
+                for (i = 0; i < 8; i++) {
+                    raw = (raw << 8) | (unsigned char)value[i];
+                }
+                delta = (int64_t)raw;
+            }
+            status = kv_incr(key, key_length, delta, &result, &evicted);
+            if (status == KV_OK) {
+                for (i = 0; i < 8; i++) {
+                    bytes[i] = (unsigned char)((uint64_t)result >> (56 - 8 * i));
+                }
+                if (reply_write(reply, bytes, sizeof(bytes)) == -1) {
+                    return -1;
+                }
+            }
+            break;
+    }
+    kv_count(reply->server, frame->opcode == BINARY_OP_GET, status, evicted);
+
+    switch (status) {
+        case KV_OK:
+            break;
+        case KV_NOT_FOUND:
+            reply_set_status(reply, BINARY_STATUS_NOT_FOUND);
+            break;
+        case KV_NOT_NUMBER:
+            reply_set_status(reply, BINARY_STATUS_BAD_REQUEST);
+            break;
+        case KV_TOO_LARGE:
+        case KV_NO_MEMORY:
+            reply_set_status(reply, BINARY_STATUS_TOO_LARGE);
+            break;
+    }
+    return 0;
+}
+
+/**
+ * End of the space-separated word starting at start
+ */
+static const char *kv_word_end(const char *start, const char *end) {
+    const char *space = memchr(start, ' ', (size_t)(end - start));
+
+    return space != NULL ? space : end;
+}
+
+/**
+ * Run a text key-value command line:
+ *
+ *   GET key               VALUE value | NOT_FOUND
+ *   SET key value         STORED (the value is the rest of the line)
+ *   DEL key               DELETED | NOT_FOUND
+ *   INCR key [delta]      the new value
+ *
+ * Command names are case-insensitive; anything else is answered "ERROR ...".
+ */
+static int kv_text_frame(reply_builder_t *reply, const frame_view_t *frame) {
+    const char *end = frame->data + frame->length;
+    const char *command = frame->data, *command_end = kv_word_end(command, end);
+    const char *key = command_end < end ? command_end + 1 : end;
+    const char *key_end = kv_word_end(key, end);
+    const char *rest = key_end < end ? key_end + 1 : NULL;
+    size_t command_length = (size_t)(command_end - command);
+    size_t key_length = (size_t)(key_end - key), evicted = 0;
+    int64_t delta = 1, result;
+    kv_result_t status;
+    char *number_end;
+
+    if (command_length == 3 && strncasecmp(command, "GET", 3) == 0 && key_length > 0 && rest == NULL) {
+        if (kv_reply_value(reply, key, key_length, "VALUE ", "\n", &status) == -1) {
+            return -1;
+        }
+        kv_count(reply->server, 1, status, 0);
+        if (status == KV_NOT_FOUND) {
+            return reply_printf(reply, "NOT_FOUND\n");
+        }
+        return status == KV_OK ? 0 : reply_printf(reply, "ERROR value too large for a text reply\n");
+    }
+    if (command_length == 3 && strncasecmp(command, "SET", 3) == 0 && key_length > 0 && rest != NULL) {
+        if (key_length > KV_MAX_KEY) {
+            return reply_printf(reply, "ERROR key too long\n");
+        }
+        status = kv_set(key, key_length, rest, (size_t)(end - rest), &evicted);
+        kv_count(reply->server, 0, status, evicted);
+        if (status == KV_TOO_LARGE) {
+            return reply_printf(reply, "ERROR value too large\n");
+        }
+        return reply_printf(reply, status == KV_OK ? "STORED\n" : "ERROR out of memory\n");
+    }
+    if (command_length == 3 && strncasecmp(command, "DEL", 3) == 0 && key_length > 0 && rest == NULL) {
+        status = kv_delete(key, key_length);
+        return reply_printf(reply, status == KV_OK ? "DELETED\n" : "NOT_FOUND\n");
+    }
+    if (command_length == 4 && strncasecmp(command, "INCR", 4) == 0 && key_length > 0) {
+        if (key_length > KV_MAX_KEY) {
+            return reply_printf(reply, "ERROR key too long\n");
+        }
+        // The line is NUL-terminated, so the delta ends with it
+        if (rest != NULL) {
+            errno = 0;
+            delta = strtoll(rest, &number_end, 10);
+            if (errno != 0 || number_end == rest || number_end != end) {
+                return reply_printf(reply, "ERROR delta is not an integer\n");
+            }
+        }
+        status = kv_incr(key, key_length, delta, &result, &evicted);
+        kv_count(reply->server, 0, status, evicted);
+        if (status == KV_NOT_NUMBER) {
+            return reply_printf(reply, "ERROR value is not an integer or would overflow\n");
+        }
+        if (status != KV_OK) {
+            return reply_printf(reply, "ERROR out of memory\n");
+        }
+        return reply_printf(reply, "%lld\n", (long long)result);
+    }
+    return reply_printf(reply, "ERROR expected GET key, SET key value, DEL key or INCR key [delta]\n");
+}
+
+/**
+ * Key-value handler: GET, SET, DEL and INCR against the shared store,
+ * answered on the event loop
+ */
+static int kv_frame(reply_builder_t *reply, const frame_view_t *frame) {
+    if (frame->protocol == PROTOCOL_BINARY) {
+        return kv_binary_frame(reply, frame);
+    }
+    return kv_text_frame(reply, frame);
+}
+
+static const request_handler_t kv_handler = {
+    "kv",
+    "In-memory key-value store: GET, SET, DEL and INCR (memory limit -M)",
+    0,
+    NULL,
+    kv_frame,
+    NULL
+};
+
+// Built-in handlers, the default first
+static const request_handler_t *const handlers[] = {
+    &echo_handler,
+    &digest_handler,
+    &kv_handler
+};
+
+#define HANDLER_COUNT ((int)(sizeof(handlers) / sizeof(handlers[0])))
+
+/**
+ * Find a built-in handler by name
+ */
+const request_handler_t *handler_find(const char *name) {
+    int i;
+
+    for (i = 0; i < HANDLER_COUNT; i++) {
+        if (strcmp(handlers[i]->name, name) == 0) {
+            return handlers[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Get a built-in handler by position
+ */
+const request_handler_t *handler_at(int index) {
+    if (index < 0 || index >= HANDLER_COUNT) {
+        return NULL;
+    }
+    return handlers[index];
+}
+
+/**
+ * Make sure the batch has room for more pieces and scratch bytes. Text
+ * replies can be split anywhere, so the whole batch is sent. A binary
+ * reply's header is only final once the reply is, so the replies before
+ * it are sent and its own pieces stay batched.
+ * @return 0 on success, -1 if sending failed or the reply alone is too large
+ */
+static int reply_make_room(reply_builder_t *reply, int iovs, size_t bytes) {
+    reply_batch_t *replies = &reply->server->replies;
+
+    if (replies->count + iovs <= REPLY_BATCH_IOV && replies->scratch_used + bytes <= REPLY_SCRATCH_SIZE) {
+        return 0;
+    }
+
+    if (reply->header == NULL) {
+        if (flush_client_replies(reply->server, reply->client) == -1) {
+            return -1;
+        }
+    } else if (reply->header_iov > 0 || reply->scratch_start > 0) {
+        if (flush_reply_prefix(reply->server, reply->client, reply->header_iov,
+                               reply->scratch_start) == -1) {
+            return -1;
+        }
+        reply->header_iov = 0;
+    }
+    reply->scratch_start = 0;
+
+    if (replies->count + iovs > REPLY_BATCH_IOV || replies->scratch_used + bytes > REPLY_SCRATCH_SIZE) {
+        print_log(LOG_ERROR, "Reply too large for the reply batch");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Add the length bytes just stored at the end of scratch to the reply,
+ * extending the previous piece when it ends right there
+ */
+static void reply_commit_scratch(reply_builder_t *reply, size_t length) {
+    reply_batch_t *replies = &reply->server->replies;
+    char *data = replies->scratch + replies->scratch_used;
+
+    if (replies->count > 0 &&
+        (char *)replies->iov[replies->count - 1].iov_base + replies->iov[replies->count - 1].iov_len == data) {
+        replies->iov[replies->count - 1].iov_len += length;
+    } else {
+        replies->iov[replies->count].iov_base = data;
+        replies->iov[replies->count].iov_len = length;
+        replies->count++;
+    }
+    replies->scratch_used += length;
+    reply->length += length;
+}
+
+/**
+ * Add bytes that stay valid until the reply is sent
+ */
+int reply_add(reply_builder_t *reply, const void *data, size_t length) {
+    reply_batch_t *replies = &reply->server->replies;
+
+    if (length == 0) {
+        return 0;
+    }
+    if (reply_make_room(reply, 1, 0) == -1) {
+        return -1;
+    }
+
+    replies->iov[replies->count].iov_base = (void *)data;
+    replies->iov[replies->count].iov_len = length;
+    replies->count++;
+    reply->length += length;
+    return 0;
+}
+
+/**
+ * Copy bytes into the reply
+ */
+int reply_write(reply_builder_t *reply, const void *data, size_t length) {
+    reply_batch_t *replies = &reply->server->replies;
+
+    if (length == 0) {
+        return 0;
+    }
+    if (length > REPLY_SCRATCH_SIZE || reply_make_room(reply, 1, length) == -1) {
+        return -1;
+    }
+
+    memcpy(replies->scratch + replies->scratch_used, data, length);
+    reply_commit_scratch(reply, length);
+    return 0;
+}
+
+/**
+ * Make room in the reply batch and get its free scratch space
+ */
+char *reply_reserve(reply_builder_t *reply, size_t length, size_t *available) {
+    reply_batch_t *replies = &reply->server->replies;
+
+    if (length > REPLY_SCRATCH_SIZE || reply_make_room(reply, 1, length) == -1) {
+        return NULL;
+    }
+    *available = REPLY_SCRATCH_SIZE - replies->scratch_used;
+    return replies->scratch + replies->scratch_used;
+}
+
+/**
+ * Add bytes written into the reserved space to the reply
+ */
+void reply_commit(reply_builder_t *reply, size_t length) {
+    if (length > 0) {
+        reply_commit_scratch(reply, length);
+    }
+}
+
+/**
+ * Format text into the reply. The text is formatted straight into scratch
+ * and only formatted again when it did not fit.
+ */
+int reply_printf(reply_builder_t *reply, const char *format, ...) {
+    reply_batch_t *replies = &reply->server->replies;
+    va_list args;
+    int length;
+
+    if (reply_make_room(reply, 1, 0) == -1) {
+        return -1;
+    }
+
+    va_start(args, format);
+    length = vsnprintf(replies->scratch + replies->scratch_used,
+                       REPLY_SCRATCH_SIZE - replies->scratch_used, format, args);
+    va_end(args);
+    if (length < 0 || (size_t)length >= REPLY_SCRATCH_SIZE) {
+        return -1;
+    }
+
+    // vsnprintf() needs room for the terminating NUL as well
+    if (replies->scratch_used + (size_t)length >= REPLY_SCRATCH_SIZE) {
+        if (reply_make_room(reply, 1, (size_t)length + 1) == -1) {
+            return -1;
+        }
+        va_start(args, format);
+        vsnprintf(replies->scratch + replies->scratch_used,
+                  REPLY_SCRATCH_SIZE - replies->scratch_used, format, args);
+        va_end(args);
+    }
+
+    if (length > 0) {
+        reply_commit_scratch(reply, (size_t)length);
+    }
+    return 0;
+}
+
+/**
+ * Set the status of a binary reply
+ */
+void reply_set_status(reply_builder_t *reply, uint16_t status) {
+    reply->status = status;
+}
+
+/**
+ * Hand the frame to the offload pool, or run its job here when the pool
+ * can't take it
+ */
+int reply_offload(reply_builder_t *reply, const frame_view_t *frame, offload_fn run) {
+    server_t *server = reply->server;
+    client_info_t *client = reply->client;
+    offload_job_t *job;
+    int result;
+
+    if (reply->length > 0) {
+        print_log(LOG_ERROR, "Reply offloaded after bytes were added to it");
+        return -1;
+    }
+    job = offload_job_create(server, client, frame, run);
+    if (job == NULL) {
+        return -1;
+    }
+
+    // The job's reply gets its own header, so the batched one goes. It is
+    // the last piece, since nothing was added after it.
+    if (reply->header != NULL) {
+        server->replies.count = reply->header_iov;
+        reply->header = NULL;
+    }
+
+    if (offload_submit(job) == 0) {
+        client->offload = job;
+        server->offload_pending++;
+        METRIC_ADD(server->metrics.offload_jobs, 1);
+        return 0;
+    }
+
+    // No pool, or this worker's ring is full
+    METRIC_ADD(server->metrics.offload_inline, 1);
+    offload_run(job);
+    result = job->result == -1 ? -1 : send_offloaded_reply(server, client, job);
+    offload_job_free(job);
+    return result;
+}
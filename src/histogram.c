@@ -0,0 +1,127 @@
+#include "../include/histogram.h"
+#include <string.h>
+
+/**
+ * Map a value to its bucket
+ */
+int histogram_bucket(uint64_t value) {
+    int msb, shift;
+
+    if (value < HISTOGRAM_SUB_COUNT) {
+        return (int)value;
+    }
+    if (value >> HISTOGRAM_MAX_BITS) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+
+    // Keep the top HISTOGRAM_SUB_BITS bits of the value
+    msb = 63 - __builtin_clzll(value);
+    shift = msb - (HISTOGRAM_SUB_BITS - 1);
+    return HISTOGRAM_SUB_COUNT + (shift - 1) * HISTOGRAM_HALF_COUNT +
+           (int)(value >> shift) - HISTOGRAM_HALF_COUNT;
+}
+
+/**
+ * Largest value that maps to a bucket
+ */
+static uint64_t bucket_upper_bound(int index) {
+    int shift;
+    uint64_t sub;
+
+    if (index < HISTOGRAM_SUB_COUNT) {
+        return (uint64_t)index;
+    }
+
+    index -= HISTOGRAM_SUB_COUNT;
+    shift = index / HISTOGRAM_HALF_COUNT + 1;
+    sub = (uint64_t)(index % HISTOGRAM_HALF_COUNT + HISTOGRAM_HALF_COUNT);
+    return ((sub + 1) << shift) - 1;
+}
+
+/**
+ * Reset a histogram to empty
+ */
+void histogram_init(histogram_t *histogram) {
+    memset(histogram, 0, sizeof(*histogram));
+    histogram->min = UINT64_MAX;
+}
+
+/**
+ * Record one sample
+ */
+void histogram_record(histogram_t *histogram, uint64_t value) {
+    histogram->counts[histogram_bucket(value)]++;
+    histogram->count++;
+    histogram->sum += value;
+    if (value < histogram->min) {
+        histogram->min = value;
+    }
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+/**
+ * Add every sample of one histogram to another
+ */
+void histogram_merge(histogram_t *target, const histogram_t *source) {
+    int i;
+
+    if (source->count == 0) {
+        return;
+    }
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        target->counts[i] += source->counts[i];
+    }
+    target->count += source->count;
+    target->sum += source->sum;
+    if (source->min < target->min) {
+        target->min = source->min;
+    }
+    if (source->max > target->max) {
+        target->max = source->max;
+    }
+}
+
+/**
+ * Get the value at a percentile
+ */
+uint64_t histogram_percentile(const histogram_t *histogram, double percentile) {
+    uint64_t rank, seen = 0;
+    int i;
+
+    if (histogram->count == 0) {
+        return 0;
+    }
+
+    // Rank of the sample at the percentile, counting from 1
+    rank = (uint64_t)(percentile / 100.0 * (double)histogram->count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank >= histogram->count) {
+        return histogram->max;
+    }
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            uint64_t bound = bucket_upper_bound(i);
+            // Never report more than was actually seen
+            return bound < histogram->max ? bound : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+/**
+ * Get the mean of all samples
+ */
+double histogram_mean(const histogram_t *histogram) {
+    if (histogram->count == 0) {
+        return 0.0;
+    }
+    return (double)histogram->sum / (double)histogram->count;
+}
@@ -0,0 +1,574 @@
+#define _GNU_SOURCE
+#include "../include/kv_store.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Slot tags; every hash maps to a tag of at least KV_TAG_FIRST
+#define KV_TAG_EMPTY 0
+#define KV_TAG_DELETED 1            // Only ever in a table being moved away from
+#define KV_TAG_FIRST 2
+
+// Value bytes are allocated in these steps, so small rewrites (an INCR
+// gaining a digit) happen in place
+#define KV_VALUE_ALIGN 16
+
+static kv_shard_t shards[KV_SHARDS];
+static int store_running = 0;
+
+/**
+ * 64-bit FNV-1a with MurmurHash3's finalizer, so that the shard (low
+ * bits) and the tag (high bits) both depend on every key byte
+ */
+static uint64_t hash_key(const char *key, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/**
+ * Tag stored in a slot; its low bits are also the home slot
+ */
+static uint32_t hash_tag(uint64_t hash) {
+    uint32_t tag = (uint32_t)(hash >> 32);
+
+    return tag < KV_TAG_FIRST ? tag + KV_TAG_FIRST : tag;
+}
+
+/**
+ * Bytes an item takes: header, a key too long for its slot, value space
+ */
+static size_t item_size(size_t key_length, size_t capacity) {
+    return sizeof(kv_item_t) + (key_length > KV_INLINE_KEY ? key_length : 0) + capacity;
+}
+
+/**
+ * Start of an item's value
+ */
+static char *item_value(kv_item_t *item, size_t key_length) {
+    return item->data + (key_length > KV_INLINE_KEY ? key_length : 0);
+}
+
+/**
+ * Compare a slot with a key. The tag and the inline bytes reject almost
+ * every other key without touching the item.
+ */
+static int slot_matches(const kv_slot_t *slot, uint32_t tag, const char *key, size_t key_length) {
+    size_t inline_length = key_length < KV_INLINE_KEY ? key_length : KV_INLINE_KEY;
+
+    return slot->tag == tag && slot->key_length == key_length &&
+           memcmp(slot->key, key, inline_length) == 0 &&
+           (key_length <= KV_INLINE_KEY || memcmp(slot->item->data, key, key_length) == 0);
+}
+
+/**
+ * Find a key in one table. Probing stops at the first empty slot; deleted
+ * slots of an old table are passed over.
+ */
+static kv_slot_t *table_find(kv_table_t *table, uint32_t tag, const char *key, size_t key_length) {
+    size_t i;
+
+    if (table->slots == NULL) {
+        return NULL;
+    }
+    for (i = tag & table->mask; table->slots[i].tag != KV_TAG_EMPTY; i = (i + 1) & table->mask) {
+        if (slot_matches(&table->slots[i], tag, key, key_length)) {
+            return &table->slots[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Claim the first empty slot on a tag's probe path in the current table
+ */
+static kv_slot_t *table_place(kv_table_t *table, uint32_t tag) {
+    size_t i = tag & table->mask;
+
+    while (table->slots[i].tag != KV_TAG_EMPTY) {
+        i = (i + 1) & table->mask;
+    }
+    table->count++;
+    return &table->slots[i];
+}
+
+/**
+ * Empty a slot of the current table by shifting back every following
+ * entry whose probe path passes the hole, so no tombstone is left
+ */
+static void table_remove(kv_table_t *table, kv_slot_t *slot) {
+    size_t hole = (size_t)(slot - table->slots);
+    size_t next = hole;
+
+    for (;;) {
+        kv_slot_t *candidate;
+        size_t home;
+
+        next = (next + 1) & table->mask;
+        candidate = &table->slots[next];
+        if (candidate->tag == KV_TAG_EMPTY) {
+            break;
+        }
+        // It may move unless its home lies after the hole
+        home = candidate->tag & table->mask;
+        if (((next - home) & table->mask) >= ((next - hole) & table->mask)) {
+            table->slots[hole] = *candidate;
+            hole = next;
+        }
+    }
+    table->slots[hole].tag = KV_TAG_EMPTY;
+    table->count--;
+}
+
+/**
+ * Free an entry's item and empty its slot. Slots of the old table become
+ * deleted rather than shifting entries the migration has not reached.
+ */
+static void remove_entry(kv_shard_t *shard, kv_table_t *table, kv_slot_t *slot) {
+    shard->memory -= item_size(slot->key_length, slot->item->capacity);
+    free(slot->item);
+    if (table == &shard->old) {
+        slot->tag = KV_TAG_DELETED;
+        table->count--;
+    } else {
+        table_remove(table, slot);
+    }
+}
+
+/**
+ * Move up to `slots` slots of the old table to the current one, freeing
+ * the old table once nothing is left in it
+ */
+static void migrate_step(kv_shard_t *shard, size_t slots) {
+    kv_table_t *old = &shard->old;
+
+    while (old->slots != NULL) {
+        kv_slot_t *slot;
+
+        if (old->count == 0 || shard->migrate_cursor > old->mask) {
+            shard->memory -= (old->mask + 1) * sizeof(kv_slot_t);
+            free(old->slots);
+            old->slots = NULL;
+            old->count = 0;
+            break;
+        }
+        if (slots == 0) {
+            break;
+        }
+        slots--;
+
+        slot = &old->slots[shard->migrate_cursor++];
+        if (slot->tag >= KV_TAG_FIRST) {
+            *table_place(&shard->table, slot->tag) = *slot;
+            slot->tag = KV_TAG_DELETED;
+            old->count--;
+        }
+    }
+}
+
+/**
+ * Make sure the current table can take one more entry below 75% load. A
+ * full table is replaced by one twice its size, and its entries move over
+ * a few at a time (see migrate_step()).
+ * @return 0 on success, -1 if out of memory
+ */
+static int ensure_capacity(kv_shard_t *shard) {
+    kv_table_t *table = &shard->table;
+    kv_slot_t *slots;
+    size_t count;
+
+    if (table->slots != NULL && (table->count + 1) * 4 <= (table->mask + 1) * 3) {
+        return 0;
+    }
+    count = table->slots == NULL ? KV_INITIAL_SLOTS : (table->mask + 1) * 2;
+
+    // The old table holds at most 3/8 of the new one's slots and moves
+    // KV_MIGRATE_SLOTS per operation, so it is gone long before the new
+    // one fills up; finishing it here is only a safeguard
+    migrate_step(shard, (size_t)-1);
+
+    slots = calloc(count, sizeof(kv_slot_t));
+    if (slots == NULL) {
+        return -1;
+    }
+    shard->memory += count * sizeof(kv_slot_t);
+    if (table->slots != NULL) {
+        shard->old = *table;
+        shard->migrate_cursor = 0;
+    }
+    table->slots = slots;
+    table->mask = count - 1;
+    table->count = 0;
+    shard->clock_hand = 0;
+    return 0;
+}
+
+/**
+ * Advance the CLOCK hand over slots first..mask of a table to the next
+ * entry not referenced since the hand last passed it, clearing the bits
+ * of those that were. Two sweeps always find one.
+ */
+static kv_slot_t *clock_victim(kv_shard_t *shard, kv_table_t *table, size_t first) {
+    size_t span = table->mask + 1 - first;
+    size_t steps;
+
+    if (shard->clock_hand < first || shard->clock_hand > table->mask) {
+        shard->clock_hand = first;
+    }
+    for (steps = 0; steps < 2 * span; steps++) {
+        kv_slot_t *slot = &table->slots[shard->clock_hand];
+
+        shard->clock_hand = shard->clock_hand == table->mask ? first : shard->clock_hand + 1;
+        if (slot->tag < KV_TAG_FIRST) {
+            continue;
+        }
+        if (slot->referenced) {
+            slot->referenced = 0;
+            continue;
+        }
+        return slot;
+    }
+    return NULL;
+}
+
+/**
+ * Evict entries until an item of `bytes` fits in the shard's budget.
+ * Entries still in the old table go first: they are the ones the hand
+ * has not seen in the current table yet. Slot arrays count toward the
+ * budget but eviction never shrinks them, so an item that would not fit
+ * beside them in an empty shard is refused before anything is evicted.
+ * @return 0 if it fits, -1 if it never could
+ */
+static int make_room(kv_shard_t *shard, size_t bytes, size_t *evicted) {
+    size_t slot_memory = (shard->table.mask + 1) * sizeof(kv_slot_t);
+
+    if (shard->old.slots != NULL) {
+        slot_memory += (shard->old.mask + 1) * sizeof(kv_slot_t);
+    }
+    if (bytes > shard->limit || slot_memory > shard->limit - bytes) {
+        return -1;
+    }
+    while (shard->memory + bytes > shard->limit && shard->table.count + shard->old.count > 0) {
+        kv_table_t *table = shard->old.count > 0 ? &shard->old : &shard->table;
+        kv_slot_t *victim = clock_victim(shard, table, table == &shard->old ? shard->migrate_cursor : 0);
+
+        if (victim == NULL) {
+            break;
+        }
+        remove_entry(shard, table, victim);
+        (*evicted)++;
+    }
+    return shard->memory + bytes > shard->limit ? -1 : 0;
+}
+
+/**
+ * Find a key in either table
+ */
+static kv_slot_t *find_entry(kv_shard_t *shard, uint32_t tag, const char *key, size_t key_length,
+                             kv_table_t **table) {
+    kv_slot_t *slot = table_find(&shard->table, tag, key, key_length);
+
+    *table = &shard->table;
+    if (slot == NULL && shard->old.slots != NULL) {
+        slot = table_find(&shard->old, tag, key, key_length);
+        *table = &shard->old;
+    }
+    return slot;
+}
+
+/**
+ * Find a key to modify, moving it out of the old table first so that it
+ * can be removed from wherever it is without leaving a tombstone behind
+ * in the current table. The current table must have room for one more
+ * entry (ensure_capacity()).
+ */
+static kv_slot_t *find_entry_for_update(kv_shard_t *shard, uint32_t tag, const char *key,
+                                        size_t key_length) {
+    kv_table_t *table;
+    kv_slot_t *slot = find_entry(shard, tag, key, key_length, &table), *moved;
+
+    if (slot != NULL && table == &shard->old) {
+        moved = table_place(&shard->table, tag);
+        *moved = *slot;
+        slot->tag = KV_TAG_DELETED;
+        shard->old.count--;
+        slot = moved;
+    }
+    return slot;
+}
+
+/**
+ * Add a key that is in neither table
+ */
+static kv_result_t insert_entry(kv_shard_t *shard, uint32_t tag, const char *key, size_t key_length,
+                                const char *value, size_t value_length, size_t *evicted) {
+    size_t capacity = (value_length + KV_VALUE_ALIGN - 1) & ~(size_t)(KV_VALUE_ALIGN - 1);
+    size_t bytes = item_size(key_length, capacity);
+    kv_item_t *item;
+    kv_slot_t *slot;
+
+    if (make_room(shard, bytes, evicted) == -1) {
+        return KV_TOO_LARGE;
+    }
+    item = malloc(bytes);
+    if (item == NULL) {
+        return KV_NO_MEMORY;
+    }
+    item->value_length = value_length;
+    item->capacity = capacity;
+    if (key_length > KV_INLINE_KEY) {
+        memcpy(item->data, key, key_length);
+    }
+    memcpy(item_value(item, key_length), value, value_length);
+    shard->memory += bytes;
+
+    slot = table_place(&shard->table, tag);
+    slot->tag = tag;
+    slot->key_length = (uint8_t)key_length;
+    slot->referenced = 1;
+    slot->reserved = 0;
+    memcpy(slot->key, key, key_length < KV_INLINE_KEY ? key_length : KV_INLINE_KEY);
+    slot->item = item;
+    return KV_OK;
+}
+
+/**
+ * Replace an entry's value: in place when it fits, otherwise as a new item
+ */
+static kv_result_t update_entry(kv_shard_t *shard, kv_slot_t *slot, uint32_t tag, const char *key,
+                                size_t key_length, const char *value, size_t value_length,
+                                size_t *evicted) {
+    if (value_length <= slot->item->capacity) {
+        memcpy(item_value(slot->item, key_length), value, value_length);
+        slot->item->value_length = value_length;
+        slot->referenced = 1;
+        return KV_OK;
+    }
+    remove_entry(shard, &shard->table, slot);
+    return insert_entry(shard, tag, key, key_length, value, value_length, evicted);
+}
+
+/**
+ * Parse a whole value as a decimal 64-bit integer
+ * @return 0 on success, -1 if it is not one
+ */
+static int parse_integer(const char *text, size_t length, int64_t *value) {
+    char buffer[24];
+    char *end;
+    long long parsed;
+
+    if (length == 0 || length >= sizeof(buffer) || (text[0] != '-' && (text[0] < '0' || text[0] > '9'))) {
+        return -1;
+    }
+    memcpy(buffer, text, length);
+    buffer[length] = '\0';
+    errno = 0;
+    parsed = strtoll(buffer, &end, 10);
+    if (errno != 0 || *end != '\0' || end == buffer) {
+        return -1;
+    }
+    *value = (int64_t)parsed;
+    return 0;
+}
+
+/**
+ * Set up the empty store
+ */
+int kv_start(size_t memory_limit) {
+    int i;
+
+    for (i = 0; i < KV_SHARDS; i++) {
+        kv_shard_t *shard = &shards[i];
+
+        if (pthread_mutex_init(&shard->lock, NULL) != 0) {
+            while (--i >= 0) {
+                pthread_mutex_destroy(&shards[i].lock);
+            }
+            return -1;
+        }
+        shard->table.slots = NULL;
+        shard->table.mask = 0;
+        shard->table.count = 0;
+        shard->old = shard->table;
+        shard->migrate_cursor = 0;
+        shard->clock_hand = 0;
+        shard->memory = 0;
+        shard->limit = memory_limit / KV_SHARDS;
+    }
+    store_running = 1;
+    return 0;
+}
+
+/**
+ * Free every entry and table
+ */
+void kv_stop(void) {
+    kv_table_t *tables[2];
+    size_t i;
+    int s, t;
+
+    if (!store_running) {
+        return;
+    }
+    for (s = 0; s < KV_SHARDS; s++) {
+        tables[0] = &shards[s].table;
+        tables[1] = &shards[s].old;
+        for (t = 0; t < 2; t++) {
+            if (tables[t]->slots == NULL) {
+                continue;
+            }
+            for (i = 0; i <= tables[t]->mask; i++) {
+                if (tables[t]->slots[i].tag >= KV_TAG_FIRST) {
+                    free(tables[t]->slots[i].item);
+                }
+            }
+            free(tables[t]->slots);
+            tables[t]->slots = NULL;
+        }
+        pthread_mutex_destroy(&shards[s].lock);
+    }
+    store_running = 0;
+}
+
+/**
+ * Look a key up and copy its value out
+ */
+kv_result_t kv_get(const char *key, size_t key_length, char *buffer, size_t capacity,
+                   size_t *length) {
+    uint64_t hash = hash_key(key, key_length);
+    kv_shard_t *shard = &shards[hash & (KV_SHARDS - 1)];
+    kv_table_t *table;
+    kv_slot_t *slot;
+    kv_result_t result = KV_NOT_FOUND;
+
+    // No such key could have been stored
+    if (key_length > KV_MAX_KEY) {
+        return KV_NOT_FOUND;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    migrate_step(shard, KV_MIGRATE_SLOTS);
+    slot = find_entry(shard, hash_tag(hash), key, key_length, &table);
+    if (slot != NULL) {
+        slot->referenced = 1;
+        *length = slot->item->value_length;
+        result = KV_TOO_LARGE;
+        if (*length <= capacity) {
+            memcpy(buffer, item_value(slot->item, key_length), *length);
+            result = KV_OK;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+/**
+ * Store a value, replacing any previous one
+ */
+kv_result_t kv_set(const char *key, size_t key_length, const char *value, size_t value_length,
+                   size_t *evicted) {
+    uint64_t hash = hash_key(key, key_length);
+    uint32_t tag = hash_tag(hash);
+    kv_shard_t *shard = &shards[hash & (KV_SHARDS - 1)];
+    kv_slot_t *slot;
+    kv_result_t result;
+
+    *evicted = 0;
+    if (key_length > KV_MAX_KEY) {
+        return KV_TOO_LARGE;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    migrate_step(shard, KV_MIGRATE_SLOTS);
+    if (ensure_capacity(shard) == -1) {
+        pthread_mutex_unlock(&shard->lock);
+        return KV_NO_MEMORY;
+    }
+    slot = find_entry_for_update(shard, tag, key, key_length);
+    if (slot != NULL) {
+        result = update_entry(shard, slot, tag, key, key_length, value, value_length, evicted);
+    } else {
+        result = insert_entry(shard, tag, key, key_length, value, value_length, evicted);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+/**
+ * Remove a key
+ */
+kv_result_t kv_delete(const char *key, size_t key_length) {
+    uint64_t hash = hash_key(key, key_length);
+    kv_shard_t *shard = &shards[hash & (KV_SHARDS - 1)];
+    kv_table_t *table;
+    kv_slot_t *slot;
+
+    // No such key could have been stored
+    if (key_length > KV_MAX_KEY) {
+        return KV_NOT_FOUND;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    migrate_step(shard, KV_MIGRATE_SLOTS);
+    slot = find_entry(shard, hash_tag(hash), key, key_length, &table);
+    if (slot != NULL) {
+        remove_entry(shard, table, slot);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return slot != NULL ? KV_OK : KV_NOT_FOUND;
+}
+
+/**
+ * Add to the integer stored under a key
+ */
+kv_result_t kv_incr(const char *key, size_t key_length, int64_t delta, int64_t *result,
+                    size_t *evicted) {
+    uint64_t hash = hash_key(key, key_length);
+    uint32_t tag = hash_tag(hash);
+    kv_shard_t *shard = &shards[hash & (KV_SHARDS - 1)];
+    kv_slot_t *slot;
+    kv_result_t status;
+    int64_t value = 0;
+    char text[24];
+    int length;
+
+    *evicted = 0;
+    if (key_length > KV_MAX_KEY) {
+        return KV_TOO_LARGE;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    migrate_step(shard, KV_MIGRATE_SLOTS);
+    if (ensure_capacity(shard) == -1) {
+        pthread_mutex_unlock(&shard->lock);
+        return KV_NO_MEMORY;
+    }
+    slot = find_entry_for_update(shard, tag, key, key_length);
+    if ((slot != NULL &&
+         parse_integer(item_value(slot->item, key_length), slot->item->value_length, &value) == -1) ||
+        __builtin_add_overflow(value, delta, &value)) {
+        pthread_mutex_unlock(&shard->lock);
+        return KV_NOT_NUMBER;
+    }
+
+    length = snprintf(text, sizeof(text), "%lld", (long long)value);
+    if (slot != NULL) {
+        status = update_entry(shard, slot, tag, key, key_length, text, (size_t)length, evicted);
+    } else {
+        status = insert_entry(shard, tag, key, key_length, text, (size_t)length, evicted);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    *result = value;
+    return status;
+}
@@ -0,0 +1,686 @@
+#define _GNU_SOURCE
+#include "../include/load_generator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// Events handled per epoll_wait() call
+#define LOAD_EVENT_BATCH 256
+
+// Size of the receive buffer shared by a thread's connections
+#define LOAD_READ_SIZE 65536
+
+// Upper bound on the prebuilt run of requests written in one send()
+#define LOAD_SEND_BUFFER_LIMIT (1024 * 1024)
+
+// Time allowed for every connection to be established
+#define LOAD_CONNECT_TIMEOUT_MS 5000
+
+/**
+ * One client connection
+ */
+typedef struct {
+    int fd;                         // Socket, -1 once closed
+    int connected;                  // Handshake finished
+    uint32_t events;                // epoll interest currently registered
+    uint64_t *sent_at;              // Ring of issue times of requests in flight
+    unsigned head;                  // Oldest request in flight
+    unsigned tail;                  // Next free ring slot
+    size_t unsent;                  // Issued request bytes not yet written
+} load_conn_t;
+
+/**
+ * Per-thread state. Every thread runs its own epoll loop over its share
+ * of the connections and keeps private results, merged at the end.
+ */
+typedef struct {
+    const load_config_t *config;
+    const char *requests;           // Back-to-back copies of the request
+    size_t request_len;             // Length of one request
+    size_t requests_len;            // Length of the whole run of copies
+    int conn_count;                 // Active connections owned by this thread
+    int idle_count;                 // Idle connections, stored after the active ones
+    load_conn_t *conns;
+    uint64_t *ring_storage;         // Backing memory for every sent_at ring
+    unsigned ring_mask;             // Ring size - 1 (ring size is a power of two)
+    int epoll_fd;
+    int alive;                      // Connections still open
+    uint64_t interval_ns;           // Open loop: time between two requests
+    uint64_t next_send;             // Open loop: when the next request is due
+    int next_conn;                  // Open loop: round-robin position
+    pthread_t thread;
+    struct load_start *start;       // Releases all threads at once after connecting
+    load_result_t result;
+} load_thread_t;
+
+/**
+ * Start gate: measurement begins once every thread has connected
+ */
+typedef struct load_start {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int ready;                      // Threads done connecting
+    int go;                         // Set by run_load_test() to start measuring
+} load_start_t;
+
+/**
+ * Monotonic time in nanoseconds
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Report this thread as connected and wait for the start signal
+ */
+static void wait_for_start(load_start_t *start) {
+    pthread_mutex_lock(&start->lock);
+    start->ready++;
+    pthread_cond_broadcast(&start->changed);
+    while (!start->go) {
+        pthread_cond_wait(&start->changed, &start->lock);
+    }
+    pthread_mutex_unlock(&start->lock);
+}
+
+/**
+ * Change the epoll interest of a connection if it differs
+ */
+static void set_interest(load_thread_t *thread, load_conn_t *conn, uint32_t events) {
+    struct epoll_event ev;
+
+    if (conn->events == events) {
+        return;
+    }
+    ev.events = events;
+    ev.data.ptr = conn;
+    epoll_ctl(thread->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+    conn->events = events;
+}
+
+/**
+ * Close a connection, dropping whatever it had in flight
+ */
+static void close_conn(load_thread_t *thread, load_conn_t *conn) {
+    if (conn->fd == -1) {
+        return;
+    }
+    close(conn->fd);
+    conn->fd = -1;
+    conn->connected = 0;
+    thread->alive--;
+}
+
+/**
+ * Start a non-blocking connect
+ */
+static int open_conn(load_thread_t *thread, load_conn_t *conn, const struct sockaddr_storage *addr,
+                     socklen_t addr_length) {
+    struct epoll_event ev;
+    int one = 1;
+
+    conn->fd = socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd == -1) {
+        return -1;
+    }
+
+    // Requests are small and latency is what is measured
+    if (addr->ss_family == AF_INET) {
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    // Unix sockets connect at once or fail with EAGAIN when the server's
+    // queue is full
+    if (connect(conn->fd, (const struct sockaddr *)addr, addr_length) == -1 &&
+        errno != EINPROGRESS) {
+        close(conn->fd);
+        conn->fd = -1;
+        return -1;
+    }
+
+    conn->events = EPOLLOUT;
+    ev.events = conn->events;
+    ev.data.ptr = conn;
+    if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) == -1) {
+        close(conn->fd);
+        conn->fd = -1;
+        return -1;
+    }
+
+    thread->alive++;
+    return 0;
+}
+
+/**
+ * Connect every connection of a thread, waiting for the handshakes
+ */
+static void connect_all(load_thread_t *thread, const struct sockaddr_storage *addr,
+                        socklen_t addr_length) {
+    struct epoll_event events[LOAD_EVENT_BATCH];
+    uint64_t deadline = now_ns() + (uint64_t)LOAD_CONNECT_TIMEOUT_MS * 1000000ULL;
+    int pending = 0, i, count;
+
+    for (i = 0; i < thread->conn_count + thread->idle_count; i++) {
+        if (open_conn(thread, &thread->conns[i], addr, addr_length) == 0) {
+            pending++;
+        } else {
+            thread->result.connect_errors++;
+        }
+    }
+
+    while (pending > 0 && now_ns() < deadline) {
+        count = epoll_wait(thread->epoll_fd, events, LOAD_EVENT_BATCH, 100);
+        for (i = 0; i < count; i++) {
+            load_conn_t *conn = events[i].data.ptr;
+            socklen_t len = sizeof(int);
+            int error = 0;
+
+            if (conn->connected || conn->fd == -1) {
+                continue;
+            }
+            pending--;
+            if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0) {
+                thread->result.connect_errors++;
+                close_conn(thread, conn);
+                continue;
+            }
+            conn->connected = 1;
+            set_interest(thread, conn, EPOLLIN);
+        }
+    }
+
+    // Whatever is still pending timed out
+    for (i = 0; i < thread->conn_count + thread->idle_count; i++) {
+        if (thread->conns[i].fd != -1 && !thread->conns[i].connected) {
+            thread->result.connect_errors++;
+            close_conn(thread, &thread->conns[i]);
+        }
+    }
+}
+
+/**
+ * Write as many issued request bytes as the socket accepts
+ */
+static void flush_conn(load_thread_t *thread, load_conn_t *conn) {
+    while (conn->unsent > 0) {
+        // Issued bytes always end on a request boundary, so they start at
+        // a fixed offset into the run of identical requests
+        size_t offset = (thread->request_len - conn->unsent % thread->request_len) %
+                        thread->request_len;
+        size_t length = thread->requests_len - offset;
+        ssize_t sent;
+
+        if (length > conn->unsent) {
+            length = conn->unsent;
+        }
+
+        sent = send(conn->fd, thread->requests + offset, length, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                set_interest(thread, conn, EPOLLIN | EPOLLOUT);
+                return;
+            }
+            thread->result.io_errors++;
+            close_conn(thread, conn);
+            return;
+        }
+
+        conn->unsent -= (size_t)sent;
+        thread->result.bytes_sent += (uint64_t)sent;
+    }
+
+    set_interest(thread, conn, EPOLLIN);
+}
+
+/**
+ * Queue one request on a connection, stamped with the time it was due
+ */
+static void issue_request(load_thread_t *thread, load_conn_t *conn, uint64_t due) {
+    conn->sent_at[conn->tail & thread->ring_mask] = due;
+    conn->tail++;
+    conn->unsent += thread->request_len;
+}
+
+/**
+ * Read replies, recording the latency of each completed request
+ */
+static void read_conn(load_thread_t *thread, load_conn_t *conn, char *buffer, int closed_loop) {
+    for (;;) {
+        ssize_t received = recv(conn->fd, buffer, LOAD_READ_SIZE, 0);
+        uint64_t now;
+        char *cursor, *end;
+
+        if (received == -1 && errno == EINTR) {
+            continue;
+        }
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (received <= 0) {
+            thread->result.io_errors++;
+            close_conn(thread, conn);
+            return;
+        }
+
+        thread->result.bytes_received += (uint64_t)received;
+        now = now_ns();
+
+        // Every reply ends with the only newline it contains
+        cursor = buffer;
+        end = buffer + received;
+        while ((cursor = memchr(cursor, '\n', (size_t)(end - cursor))) != NULL) {
+            cursor++;
+            if (conn->head == conn->tail) {
+                continue;   // More replies than requests; ignore the extra
+            }
+            histogram_record(&thread->result.latency,
+                             now - conn->sent_at[conn->head & thread->ring_mask]);
+            conn->head++;
+            thread->result.requests++;
+
+            // Closed loop: every reply immediately frees a slot for a new request
+            if (closed_loop) {
+                issue_request(thread, conn, now);
+            }
+        }
+    }
+}
+
+/**
+ * Open loop: issue every request that has become due. A request that
+ * finds every connection at full depth stays due, and is stamped with
+ * the time it should have been sent so queueing delay is not hidden.
+ */
+static void issue_due_requests(load_thread_t *thread, uint64_t now) {
+    while (thread->next_send <= now) {
+        load_conn_t *conn = NULL;
+        int tries;
+
+        for (tries = 0; tries < thread->conn_count; tries++) {
+            load_conn_t *candidate = &thread->conns[thread->next_conn];
+
+            thread->next_conn = (thread->next_conn + 1) % thread->conn_count;
+            if (candidate->connected &&
+                candidate->tail - candidate->head < (unsigned)thread->config->depth) {
+                conn = candidate;
+                break;
+            }
+        }
+        if (conn == NULL) {
+            return;
+        }
+
+        issue_request(thread, conn, thread->next_send);
+        thread->next_send += thread->interval_ns;
+        flush_conn(thread, conn);
+    }
+}
+
+/**
+ * Thread body: connect, wait for the other threads, then drive traffic
+ */
+static void *load_thread_main(void *arg) {
+    load_thread_t *thread = arg;
+    const load_config_t *config = thread->config;
+    struct epoll_event events[LOAD_EVENT_BATCH];
+    int closed_loop = config->rate <= 0;
+    uint64_t start, end, now;
+    struct sockaddr_storage addr;
+    socklen_t addr_length;
+    char *buffer;
+    int i, j, count;
+
+    buffer = malloc(LOAD_READ_SIZE);
+    if (buffer == NULL) {
+        wait_for_start(thread->start);
+        return NULL;
+    }
+
+    // Checked by run_load_test() already
+    load_server_address(config->host, config->port, config->unix_path, &addr, &addr_length);
+
+    connect_all(thread, &addr, addr_length);
+    wait_for_start(thread->start);
+
+    start = now_ns();
+    end = start + (uint64_t)config->duration * 1000000000ULL;
+    thread->next_send = start;
+
+    // Closed loop: fill every connection to the pipelining depth
+    if (closed_loop) {
+        for (i = 0; i < thread->conn_count; i++) {
+            load_conn_t *conn = &thread->conns[i];
+            if (!conn->connected) {
+                continue;
+            }
+            for (j = 0; j < config->depth; j++) {
+                issue_request(thread, conn, start);
+            }
+            flush_conn(thread, conn);
+        }
+    }
+
+    while ((now = now_ns()) < end && thread->alive > 0) {
+        int timeout_ms = (int)((end - now) / 1000000ULL);
+
+        if (!closed_loop) {
+            issue_due_requests(thread, now);
+            if (thread->next_send > now && (thread->next_send - now) / 1000000ULL < (uint64_t)timeout_ms) {
+                timeout_ms = (int)((thread->next_send - now) / 1000000ULL);
+            } else if (thread->next_send <= now) {
+                timeout_ms = 0;     // Backlogged: poll without sleeping
+            }
+        }
+
+        count = epoll_wait(thread->epoll_fd, events, LOAD_EVENT_BATCH, timeout_ms);
+        for (i = 0; i < count; i++) {
+            load_conn_t *conn = events[i].data.ptr;
+
+            if (conn->fd != -1 && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                read_conn(thread, conn, buffer, closed_loop);
+            }
+            if (conn->fd != -1 && conn->unsent > 0) {
+                flush_conn(thread, conn);
+            }
+        }
+    }
+
+    thread->result.elapsed_ns = now_ns() - start;
+
+    for (i = 0; i < thread->conn_count + thread->idle_count; i++) {
+        close_conn(thread, &thread->conns[i]);
+    }
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Fill a configuration with defaults
+ */
+void load_config_init(load_config_t *config) {
+    config->host = "127.0.0.1";
+    config->port = 8080;
+    config->unix_path = NULL;
+    config->connections = LOAD_DEFAULT_CONNECTIONS;
+    config->idle_connections = 0;
+    config->threads = LOAD_DEFAULT_THREADS;
+    config->duration = LOAD_DEFAULT_DURATION;
+    config->rate = 0;
+    config->depth = LOAD_DEFAULT_DEPTH;
+    config->payload_size = LOAD_DEFAULT_PAYLOAD;
+}
+
+/**
+ * Build the address of the server
+ */
+int load_server_address(const char *host, int port, const char *unix_path,
+                        struct sockaddr_storage *addr, socklen_t *addr_length) {
+    struct sockaddr_in *in = (struct sockaddr_in *)addr;
+    struct sockaddr_un *un = (struct sockaddr_un *)addr;
+
+    memset(addr, 0, sizeof(*addr));
+
+    if (unix_path != NULL) {
+        size_t path_length = strlen(unix_path);
+
+        if (path_length == 0 || path_length >= sizeof(un->sun_path)) {
+            fprintf(stderr, "[ERROR] Invalid Unix socket path: %s\n", unix_path);
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, unix_path, path_length);
+
+        // Abstract names start with a NUL byte and are not NUL-terminated
+        if (unix_path[0] == '@') {
+            un->sun_path[0] = '\0';
+        } else {
+            path_length++;
+        }
+        *addr_length = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path_length);
+        return 0;
+    }
+
+    in->sin_family = AF_INET;
+    in->sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, host, &in->sin_addr) <= 0) {
+        fprintf(stderr, "[ERROR] Invalid address: %s\n", host);
+        return -1;
+    }
+    *addr_length = sizeof(*in);
+    return 0;
+}
+
+/**
+ * Build the run of identical newline-terminated requests written by every thread
+ */
+static char *build_requests(const load_config_t *config, size_t *request_len, size_t *requests_len) {
+    size_t copies, i;
+    char *requests;
+
+    *request_len = (size_t)config->payload_size + 1;
+    copies = LOAD_SEND_BUFFER_LIMIT / *request_len;
+    if (copies > (size_t)config->depth + 1) {
+        copies = (size_t)config->depth + 1;
+    }
+    if (copies < 2) {
+        copies = 2;
+    }
+
+    *requests_len = copies * *request_len;
+    requests = malloc(*requests_len);
+    if (requests == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < *requests_len; i++) {
+        requests[i] = (char)('a' + i % *request_len % 26);
+    }
+    for (i = 1; i <= copies; i++) {
+        requests[i * *request_len - 1] = '\n';
+    }
+    return requests;
+}
+
+/**
+ * Release a thread's connection and ring storage
+ */
+static void free_thread(load_thread_t *thread) {
+    if (thread->epoll_fd != -1) {
+        close(thread->epoll_fd);
+    }
+    free(thread->conns);
+    free(thread->ring_storage);
+}
+
+/**
+ * Allocate a thread's share of connections and its epoll instance
+ */
+static int setup_thread(load_thread_t *thread, unsigned ring_size) {
+    int total = thread->conn_count + thread->idle_count;
+    int i;
+
+    thread->ring_mask = ring_size - 1;
+    thread->conns = calloc((size_t)total, sizeof(load_conn_t));
+    thread->ring_storage = calloc((size_t)total * ring_size, sizeof(uint64_t));
+    thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (thread->conns == NULL || thread->ring_storage == NULL || thread->epoll_fd == -1) {
+        return -1;
+    }
+
+    for (i = 0; i < total; i++) {
+        thread->conns[i].fd = -1;
+        thread->conns[i].sent_at = thread->ring_storage + (size_t)i * ring_size;
+    }
+    return 0;
+}
+
+/**
+ * Connect, drive traffic for the configured duration and collect results
+ */
+int run_load_test(const load_config_t *config, load_result_t *result) {
+    load_thread_t *threads;
+    load_start_t start;
+    size_t request_len, requests_len;
+    unsigned ring_size = 1;
+    char *requests;
+    int thread_count = config->threads < config->connections ? config->threads : config->connections;
+    int i, started = 0, failed = 0;
+    struct sockaddr_storage probe;
+    socklen_t probe_length;
+
+    memset(result, 0, sizeof(*result));
+    histogram_init(&result->latency);
+
+    if (load_server_address(config->host, config->port, config->unix_path, &probe, &probe_length) == -1) {
+        return -1;
+    }
+
+    while (ring_size < (unsigned)config->depth) {
+        ring_size *= 2;
+    }
+
+    requests = build_requests(config, &request_len, &requests_len);
+    threads = calloc((size_t)thread_count, sizeof(*threads));
+    if (requests == NULL || threads == NULL) {
+        fprintf(stderr, "[ERROR] Failed to allocate load generator state\n");
+        free(requests);
+        free(threads);
+        return -1;
+    }
+
+    pthread_mutex_init(&start.lock, NULL);
+    pthread_cond_init(&start.changed, NULL);
+    start.ready = 0;
+    start.go = 0;
+
+    for (i = 0; i < thread_count; i++) {
+        load_thread_t *thread = &threads[i];
+
+        thread->config = config;
+        thread->requests = requests;
+        thread->request_len = request_len;
+        thread->requests_len = requests_len;
+        thread->start = &start;
+        thread->epoll_fd = -1;
+        histogram_init(&thread->result.latency);
+
+        // Spread connections and the request rate evenly
+        thread->conn_count = config->connections / thread_count +
+                             (i < config->connections % thread_count);
+        thread->idle_count = config->idle_connections / thread_count +
+                             (i < config->idle_connections % thread_count);
+        if (config->rate > 0) {
+            thread->interval_ns = (uint64_t)(1e9 * config->connections /
+                                             (config->rate * thread->conn_count));
+        }
+
+        if (setup_thread(thread, ring_size) == -1) {
+            fprintf(stderr, "[ERROR] Failed to set up load generator thread\n");
+            failed = 1;
+            break;
+        }
+        if (pthread_create(&thread->thread, NULL, load_thread_main, thread) != 0) {
+            fprintf(stderr, "[ERROR] Failed to start load generator thread\n");
+            failed = 1;
+            break;
+        }
+        started++;
+    }
+
+    // Start measuring once every thread has connected; after a setup
+    // failure the threads are released with a zero-length test
+    pthread_mutex_lock(&start.lock);
+    while (start.ready < started) {
+        pthread_cond_wait(&start.changed, &start.lock);
+    }
+    start.go = 1;
+    pthread_cond_broadcast(&start.changed);
+    pthread_mutex_unlock(&start.lock);
+
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+
+    for (i = 0; i < thread_count; i++) {
+        load_result_t *part = &threads[i].result;
+
+        result->requests += part->requests;
+        result->bytes_sent += part->bytes_sent;
+        result->bytes_received += part->bytes_received;
+        result->connect_errors += part->connect_errors;
+        result->io_errors += part->io_errors;
+        if (part->elapsed_ns > result->elapsed_ns) {
+            result->elapsed_ns = part->elapsed_ns;
+        }
+        histogram_merge(&result->latency, &part->latency);
+        free_thread(&threads[i]);
+    }
+
+    pthread_cond_destroy(&start.changed);
+    pthread_mutex_destroy(&start.lock);
+    free(threads);
+    free(requests);
+    return failed ? -1 : 0;
+}
+
+/**
+ * Print a human readable summary of a load test
+ */
+void print_load_result(const load_config_t *config, const load_result_t *result) {
+    double seconds = (double)result->elapsed_ns / 1e9;
+    const histogram_t *latency = &result->latency;
+
+    if (seconds <= 0) {
+        seconds = 1e-9;
+    }
+
+    printf("\n--- Load test: %d connections", config->connections);
+    if (config->idle_connections > 0) {
+        printf(" (+%d idle)", config->idle_connections);
+    }
+    printf(", %d thread(s), %d s, ", config->threads, config->duration);
+    if (config->rate > 0) {
+        printf("open loop at %.0f req/s", config->rate);
+    } else {
+        printf("closed loop");
+    }
+    printf(", depth %d, %d byte payload ---\n", config->depth, config->payload_size);
+
+    printf("Requests:    %llu (%.0f req/s)\n",
+           (unsigned long long)result->requests, (double)result->requests / seconds);
+    printf("Throughput:  %.2f MB/s sent, %.2f MB/s received\n",
+           (double)result->bytes_sent / seconds / 1e6, (double)result->bytes_received / seconds / 1e6);
+    printf("Errors:      %llu connect, %llu I/O\n",
+           (unsigned long long)result->connect_errors, (unsigned long long)result->io_errors);
+
+    if (latency->count == 0) {
+        printf("Latency:     no replies received\n");
+        return;
+    }
+    printf("Latency (us): min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f  mean %.1f\n",
+           (double)latency->min / 1e3,
+           (double)histogram_percentile(latency, 50.0) / 1e3,
+           (double)histogram_percentile(latency, 90.0) / 1e3,
+           (double)histogram_percentile(latency, 99.0) / 1e3,
+           (double)histogram_percentile(latency, 99.9) / 1e3,
+           (double)latency->max / 1e3,
+           histogram_mean(latency) / 1e3);
+}
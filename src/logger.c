@@ -0,0 +1,305 @@
+#define _GNU_SOURCE
+#include "../include/logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// Output gathered per stream before it is written
+#define LOG_OUTPUT_BUFFER 65536
+
+/**
+ * Single-producer single-consumer ring. The producer only writes tail and
+ * the consumer only writes head; each sits on its own cache line.
+ */
+typedef struct {
+    unsigned tail;                  // Next slot to fill (producer)
+    unsigned long dropped;          // Records dropped because the ring was full
+    char pad1[64 - sizeof(unsigned) - sizeof(unsigned long)];
+    unsigned head;                  // Next slot to drain (consumer)
+    unsigned long reported;         // Drops already reported (consumer)
+    char pad2[64 - sizeof(unsigned) - sizeof(unsigned long)];
+    log_record_t records[LOG_RING_SIZE];
+} log_ring_t;
+
+/**
+ * Buffered output for one stream
+ */
+typedef struct {
+    FILE *stream;
+    size_t length;
+    char data[LOG_OUTPUT_BUFFER];
+} log_output_t;
+
+static log_ring_t *rings[LOG_MAX_RINGS];
+static int ring_count = 0;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t logger_thread;
+static int logger_running = 0;      // Accepting records
+static int logger_stopping = 0;     // Asked to drain and exit
+
+static __thread log_ring_t *thread_ring = NULL;
+static __thread int thread_has_no_ring = 0;
+static __thread long long cached_clock = 0;
+static __thread int clock_cached = 0;
+
+static log_output_t stdout_output;
+static log_output_t stderr_output;
+
+/**
+ * Get (creating on first use) the calling thread's ring
+ */
+static log_ring_t *get_thread_ring(void) {
+    log_ring_t *ring;
+
+    if (thread_ring != NULL || thread_has_no_ring) {
+        return thread_ring;
+    }
+
+    ring = calloc(1, sizeof(*ring));
+    pthread_mutex_lock(&ring_lock);
+    if (ring != NULL && ring_count < LOG_MAX_RINGS) {
+        rings[ring_count] = ring;
+        // Publish the ring before the consumer can see the new count
+        __atomic_store_n(&ring_count, ring_count + 1, __ATOMIC_RELEASE);
+        thread_ring = ring;
+    } else {
+        free(ring);
+        thread_has_no_ring = 1;
+    }
+    pthread_mutex_unlock(&ring_lock);
+
+    return thread_ring;
+}
+
+/**
+ * Write buffered output to its stream
+ */
+static void output_flush(log_output_t *output) {
+    if (output->length > 0) {
+        fwrite(output->data, 1, output->length, output->stream);
+        fflush(output->stream);
+        output->length = 0;
+    }
+}
+
+/**
+ * Format one record into the buffered output for its stream
+ */
+static void output_record(const log_record_t *record) {
+    log_output_t *output = record->to_stderr ? &stderr_output : &stdout_output;
+    int length;
+
+    if (LOG_OUTPUT_BUFFER - output->length < LOG_RECORD_SIZE + 128) {
+        output_flush(output);
+    }
+
+    length = format_log_line(output->data + output->length, LOG_OUTPUT_BUFFER - output->length,
+                             (log_type_t)record->type, record->to_stderr,
+                             (time_t)(record->timestamp_ns / 1000000000LL), record->message);
+    if (length > 0) {
+        output->length += (size_t)length;
+        if (output->length > LOG_OUTPUT_BUFFER - 1) {
+            output->length = LOG_OUTPUT_BUFFER - 1;
+        }
+    }
+}
+
+/**
+ * Drain every ring once, merging records from different threads in
+ * timestamp order
+ * @return Number of records written
+ */
+static int drain_rings(void) {
+    unsigned heads[LOG_MAX_RINGS], tails[LOG_MAX_RINGS];
+    int count = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+    int i, written = 0;
+
+    for (i = 0; i < count; i++) {
+        heads[i] = rings[i]->head;
+        tails[i] = __atomic_load_n(&rings[i]->tail, __ATOMIC_ACQUIRE);
+    }
+
+    for (;;) {
+        const log_record_t *oldest = NULL;
+        int oldest_ring = -1;
+
+        for (i = 0; i < count; i++) {
+            const log_record_t *record;
+
+            if (heads[i] == tails[i]) {
+                continue;
+            }
+            record = &rings[i]->records[heads[i] & (LOG_RING_SIZE - 1)];
+            if (oldest == NULL || record->timestamp_ns < oldest->timestamp_ns) {
+                oldest = record;
+                oldest_ring = i;
+            }
+        }
+
+        if (oldest == NULL) {
+            break;
+        }
+        output_record(oldest);
+        heads[oldest_ring]++;
+        written++;
+    }
+
+    for (i = 0; i < count; i++) {
+        log_ring_t *ring = rings[i];
+        unsigned long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+        // Hand the slots back to the producer
+        __atomic_store_n(&ring->head, heads[i], __ATOMIC_RELEASE);
+
+        if (dropped != ring->reported) {
+            log_record_t notice;
+
+            notice.timestamp_ns = logger_now_ns();
+            notice.type = LOG_ERROR;
+            notice.to_stderr = 1;
+            snprintf(notice.message, sizeof(notice.message),
+                     "Logger: %lu message(s) dropped, log ring full", dropped - ring->reported);
+            output_record(&notice);
+            ring->reported = dropped;
+        }
+    }
+
+    output_flush(&stdout_output);
+    output_flush(&stderr_output);
+    return written;
+}
+
+/**
+ * Logger thread: drain rings until asked to stop, sleeping when idle
+ */
+static void *logger_main(void *arg) {
+    struct timespec idle = {0, LOG_IDLE_SLEEP_MS * 1000000L};
+
+    (void)arg;
+
+    for (;;) {
+        int stopping = __atomic_load_n(&logger_stopping, __ATOMIC_ACQUIRE);
+
+        if (drain_rings() == 0) {
+            if (stopping) {
+                break;
+            }
+            nanosleep(&idle, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Start the background logger thread
+ */
+int logger_start(void) {
+    stdout_output.stream = stdout;
+    stderr_output.stream = stderr;
+    logger_stopping = 0;
+
+    if (pthread_create(&logger_thread, NULL, logger_main, NULL) != 0) {
+        return -1;
+    }
+
+    __atomic_store_n(&logger_running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Write out every queued record and stop the logger thread
+ */
+void logger_stop(void) {
+    int i;
+
+    if (!__atomic_load_n(&logger_running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    // New records go out synchronously from here on
+    __atomic_store_n(&logger_running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&logger_stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(logger_thread, NULL);
+
+    // Pick up anything submitted while the thread was exiting
+    drain_rings();
+
+    pthread_mutex_lock(&ring_lock);
+    for (i = 0; i < ring_count; i++) {
+        free(rings[i]);
+        rings[i] = NULL;
+    }
+    ring_count = 0;
+    pthread_mutex_unlock(&ring_lock);
+}
+
+/**
+ * Queue a message for the logger thread
+ */
+int logger_submit(log_type_t type, int to_stderr, const char *message) {
+    log_ring_t *ring;
+    log_record_t *record;
+    unsigned tail;
+    size_t length;
+
+    if (!__atomic_load_n(&logger_running, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+
+    ring = get_thread_ring();
+    if (ring == NULL) {
+        return -1;
+    }
+
+    // Never wait for the consumer; drop the record if the ring is full
+    tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    record = &ring->records[tail & (LOG_RING_SIZE - 1)];
+    record->timestamp_ns = logger_now_ns();
+    record->type = (unsigned char)type;
+    record->to_stderr = (unsigned char)(to_stderr != 0);
+    length = strnlen(message, sizeof(record->message) - 1);
+    memcpy(record->message, message, length);
+    record->message[length] = '\0';
+
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Read the real-time clock in nanoseconds
+ */
+static long long read_clock_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Refresh the calling thread's cached clock
+ */
+void logger_update_clock(void) {
+    cached_clock = read_clock_ns();
+    clock_cached = 1;
+}
+
+/**
+ * Current time for log timestamps in nanoseconds
+ */
+long long logger_now_ns(void) {
+    return clock_cached ? cached_clock : read_clock_ns();
+}
+
+/**
+ * Current time for log timestamps in seconds
+ */
+time_t logger_now(void) {
+    return (time_t)(logger_now_ns() / 1000000000LL);
+}
@@ -0,0 +1,225 @@
+#define _GNU_SOURCE
+#include "../include/mem_pool.h"
+#include "../include/socket_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/**
+ * Map a region, preferring explicit huge pages when requested and falling
+ * back to normal pages (with transparent huge pages advised)
+ */
+static void *map_region(size_t size, int use_huge_pages, int *huge) {
+    void *memory;
+
+    *huge = 0;
+    if (use_huge_pages) {
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory != MAP_FAILED) {
+            *huge = 1;
+            return memory;
+        }
+    }
+
+    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (use_huge_pages) {
+        madvise(memory, size, MADV_HUGEPAGE);
+    }
+    return memory;
+}
+
+/**
+ * Map a new region and push its objects on the free list
+ */
+static int slab_grow(slab_t *slab) {
+    size_t size = SLAB_REGION_SIZE;
+    size_t header, count, i;
+    slab_region_t *region;
+    char *objects;
+    int huge;
+
+    // Objects larger than a region get a region of their own size class
+    header = (sizeof(slab_region_t) + 63) & ~(size_t)63;
+    while (size - header < slab->stats.object_size) {
+        size *= 2;
+    }
+
+    region = map_region(size, slab->use_huge_pages, &huge);
+    if (region == NULL) {
+        print_error("Failed to map slab region");
+        return -1;
+    }
+
+    region->next = slab->regions;
+    region->size = size;
+    region->huge = huge;
+    slab->regions = region;
+
+    // Push in reverse so objects are handed out in address order
+    objects = (char *)region + header;
+    count = (size - header) / slab->stats.object_size;
+    for (i = count; i > 0; i--) {
+        void **object = (void **)(objects + (i - 1) * slab->stats.object_size);
+        *object = slab->free_list;
+        slab->free_list = object;
+    }
+
+    slab->stats.free += count;
+    slab->stats.regions++;
+    slab->stats.huge_regions += (size_t)huge;
+    slab->stats.bytes_mapped += size;
+    return 0;
+}
+
+/**
+ * Initialize an empty slab
+ */
+void slab_init(slab_t *slab, size_t object_size, int use_huge_pages) {
+    memset(slab, 0, sizeof(*slab));
+    if (object_size < sizeof(void *)) {
+        object_size = sizeof(void *);
+    }
+    slab->stats.object_size = (object_size + 15) & ~(size_t)15;
+    slab->use_huge_pages = use_huge_pages;
+}
+
+/**
+ * Release every region of a slab
+ */
+void slab_destroy(slab_t *slab) {
+    slab_region_t *region = slab->regions;
+
+    while (region != NULL) {
+        slab_region_t *next = region->next;
+        munmap(region, region->size);
+        region = next;
+    }
+
+    slab_init(slab, slab->stats.object_size, slab->use_huge_pages);
+}
+
+/**
+ * Take an object from the slab
+ */
+void *slab_alloc(slab_t *slab) {
+    void **object;
+
+    if (slab->free_list == NULL && slab_grow(slab) == -1) {
+        return NULL;
+    }
+
+    object = slab->free_list;
+    slab->free_list = *object;
+    slab->stats.free--;
+    slab->stats.in_use++;
+    slab->stats.allocs++;
+    return object;
+}
+
+/**
+ * Return an object to its slab
+ */
+void slab_free(slab_t *slab, void *object) {
+    if (object == NULL) {
+        return;
+    }
+
+    *(void **)object = slab->free_list;
+    slab->free_list = object;
+    slab->stats.free++;
+    slab->stats.in_use--;
+}
+
+/**
+ * Initialize a buffer pool
+ */
+void buffer_pool_init(buffer_pool_t *pool, int use_huge_pages) {
+    int i;
+
+    for (i = 0; i < POOL_CLASS_COUNT; i++) {
+        slab_init(&pool->classes[i], (size_t)POOL_MIN_CLASS_SIZE << (2 * i), use_huge_pages);
+    }
+    pool->fallback_allocs = 0;
+    pool->fallback_in_use = 0;
+}
+
+/**
+ * Release all memory held by a buffer pool
+ */
+void buffer_pool_destroy(buffer_pool_t *pool) {
+    int i;
+
+    for (i = 0; i < POOL_CLASS_COUNT; i++) {
+        slab_destroy(&pool->classes[i]);
+    }
+}
+
+/**
+ * Get a buffer of at least size bytes
+ */
+void *buffer_pool_alloc(buffer_pool_t *pool, size_t size, size_t *capacity) {
+    void *buffer;
+    int i;
+
+    for (i = 0; i < POOL_CLASS_COUNT; i++) {
+        if (size <= pool->classes[i].stats.object_size) {
+            *capacity = pool->classes[i].stats.object_size;
+            return slab_alloc(&pool->classes[i]);
+        }
+    }
+
+    // Larger than any class: rare, served by malloc()
+    buffer = malloc(size);
+    if (buffer != NULL) {
+        *capacity = size;
+        pool->fallback_allocs++;
+        pool->fallback_in_use++;
+    }
+    return buffer;
+}
+
+/**
+ * Return a buffer to the pool
+ */
+void buffer_pool_free(buffer_pool_t *pool, void *buffer, size_t capacity) {
+    int i;
+
+    if (buffer == NULL) {
+        return;
+    }
+
+    for (i = 0; i < POOL_CLASS_COUNT; i++) {
+        if (capacity == pool->classes[i].stats.object_size) {
+            slab_free(&pool->classes[i], buffer);
+            return;
+        }
+    }
+
+    free(buffer);
+    pool->fallback_in_use--;
+}
+
+/**
+ * Format a one-line summary of pool usage
+ */
+void buffer_pool_describe(const buffer_pool_t *pool, char *buffer, size_t buffer_size) {
+    size_t used = 0;
+    int i;
+
+    for (i = 0; i < POOL_CLASS_COUNT && used < buffer_size; i++) {
+        const slab_stats_t *stats = &pool->classes[i].stats;
+        used += (size_t)snprintf(buffer + used, buffer_size - used,
+                                 "%zuK: %zu used/%zu free (%zu MB%s) ",
+                                 stats->object_size / 1024, stats->in_use, stats->free,
+                                 stats->bytes_mapped >> 20, stats->huge_regions ? ", huge" : "");
+    }
+    if (used < buffer_size) {
+        snprintf(buffer + used, buffer_size - used, "oversized: %zu", pool->fallback_allocs);
+    }
+}
@@ -0,0 +1,196 @@
+#define _POSIX_C_SOURCE 200809L
+#include "../include/metrics.h"
+#include "../include/server.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+// Every worker's metrics, registered at startup
+static worker_metrics_t *registered[MAX_WORKERS];
+static int registered_count = 0;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Counters exported by metrics_format(), in report order
+#define EXPORTED_COUNTERS 22
+
+static const char *disconnect_names[DISCONNECT_REASON_COUNT] = {
+    "peer_closed",
+    "read_error",
+    "write_error",
+    "frame_too_large",
+    "internal_error",
+    "idle_timeout",
+    "read_timeout",
+    "write_timeout",
+    "slow_consumer",
+    "drain_timeout"
+};
+
+/**
+ * Reset a worker's metrics and make them visible to metrics_format()
+ */
+int metrics_register(worker_metrics_t *metrics) {
+    int result = -1;
+
+    memset(metrics, 0, sizeof(*metrics));
+    histogram_init(&metrics->loop_time);
+    histogram_init(&metrics->reply_latency);
+
+    pthread_mutex_lock(&registry_lock);
+    if (registered_count < MAX_WORKERS) {
+        registered[registered_count++] = metrics;
+        result = 0;
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return result;
+}
+
+/**
+ * Stop reporting a worker's metrics
+ */
+void metrics_unregister(worker_metrics_t *metrics) {
+    int i;
+
+    pthread_mutex_lock(&registry_lock);
+    for (i = 0; i < registered_count; i++) {
+        if (registered[i] == metrics) {
+            registered[i] = registered[--registered_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+/**
+ * Monotonic clock used for metric durations
+ */
+uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Record a sample in a histogram owned by the calling thread
+ */
+void metrics_record(histogram_t *histogram, uint64_t value) {
+    // Same update as histogram_record(), with relaxed stores
+    METRIC_ADD(histogram->counts[histogram_bucket(value)], 1);
+    METRIC_ADD(histogram->count, 1);
+    METRIC_ADD(histogram->sum, value);
+    if (value < __atomic_load_n(&histogram->min, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&histogram->min, value, __ATOMIC_RELAXED);
+    }
+    if (value > __atomic_load_n(&histogram->max, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Add a worker's histogram to a snapshot, reading it with relaxed loads
+ */
+static void merge_histogram(histogram_t *target, const histogram_t *source) {
+    uint64_t min = __atomic_load_n(&source->min, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&source->max, __ATOMIC_RELAXED);
+    int i;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        target->counts[i] += __atomic_load_n(&source->counts[i], __ATOMIC_RELAXED);
+    }
+    target->count += __atomic_load_n(&source->count, __ATOMIC_RELAXED);
+    target->sum += __atomic_load_n(&source->sum, __ATOMIC_RELAXED);
+    if (min < target->min) {
+        target->min = min;
+    }
+    if (max > target->max) {
+        target->max = max;
+    }
+}
+
+/**
+ * Append a histogram summary in microseconds
+ */
+static size_t format_histogram(char *buffer, size_t buffer_size, const char *name,
+                               const histogram_t *histogram) {
+    static const double quantiles[] = {50.0, 90.0, 99.0, 99.9};
+    size_t used = 0;
+    size_t i;
+
+    for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]) && used < buffer_size; i++) {
+        used += (size_t)snprintf(buffer + used, buffer_size - used, "%s_us{quantile=\"%g\"} %.1f\n",
+                                 name, quantiles[i] / 100.0,
+                                 (double)histogram_percentile(histogram, quantiles[i]) / 1e3);
+    }
+    if (used < buffer_size) {
+        used += (size_t)snprintf(buffer + used, buffer_size - used, "%s_us_max %.1f\n%s_count %llu\n",
+                                 name, (double)histogram->max / 1e3,
+                                 name, (unsigned long long)histogram->count);
+    }
+    return used;
+}
+
+/**
+ * Merge the metrics of every registered worker and render them as text
+ */
+size_t metrics_format(char *buffer, size_t buffer_size) {
+    static __thread histogram_t loop_time, reply_latency;
+    uint64_t totals[EXPORTED_COUNTERS] = {0};
+    uint64_t disconnects[DISCONNECT_REASON_COUNT] = {0};
+    static const char *names[EXPORTED_COUNTERS] = {
+        "accepts", "rejects", "connections", "bytes_in", "bytes_out", "bytes_spliced",
+        "zerocopy_sends", "zerocopy_copied", "messages_in", "messages_out", "broadcasts",
+        "broadcast_deliveries", "broadcast_drops", "partial_writes", "budget_yields",
+        "rate_limited", "offload_jobs", "offload_inline", "kv_hits", "kv_misses", "kv_evictions",
+        "loop_iterations"
+    };
+    size_t used = 0;
+    int i, j, workers;
+
+    histogram_init(&loop_time);
+    histogram_init(&reply_latency);
+
+    pthread_mutex_lock(&registry_lock);
+    workers = registered_count;
+    for (i = 0; i < registered_count; i++) {
+        const worker_metrics_t *metrics = registered[i];
+        const uint64_t *counters[EXPORTED_COUNTERS] = {
+            &metrics->accepts, &metrics->rejects, &metrics->connections, &metrics->bytes_in,
+            &metrics->bytes_out, &metrics->bytes_spliced, &metrics->zerocopy_sends,
+            &metrics->zerocopy_copied, &metrics->messages_in, &metrics->messages_out,
+            &metrics->broadcasts, &metrics->broadcast_deliveries, &metrics->broadcast_drops,
+            &metrics->partial_writes, &metrics->budget_yields, &metrics->rate_limited,
+            &metrics->offload_jobs, &metrics->offload_inline, &metrics->kv_hits,
+            &metrics->kv_misses, &metrics->kv_evictions, &metrics->loop_iterations
+        };
+
+        for (j = 0; j < EXPORTED_COUNTERS; j++) {
+            totals[j] += __atomic_load_n(counters[j], __ATOMIC_RELAXED);
+        }
+        for (j = 0; j < DISCONNECT_REASON_COUNT; j++) {
+            disconnects[j] += __atomic_load_n(&metrics->disconnects[j], __ATOMIC_RELAXED);
+        }
+        merge_histogram(&loop_time, &metrics->loop_time);
+        merge_histogram(&reply_latency, &metrics->reply_latency);
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    used += (size_t)snprintf(buffer, buffer_size, "workers %d\n", workers);
+    for (j = 0; j < EXPORTED_COUNTERS && used < buffer_size; j++) {
+        used += (size_t)snprintf(buffer + used, buffer_size - used, "%s %llu\n",
+                                 names[j], (unsigned long long)totals[j]);
+    }
+    for (j = 0; j < DISCONNECT_REASON_COUNT && used < buffer_size; j++) {
+        used += (size_t)snprintf(buffer + used, buffer_size - used, "disconnects{reason=\"%s\"} %llu\n",
+                                 disconnect_names[j], (unsigned long long)disconnects[j]);
+    }
+    if (used < buffer_size) {
+        used += format_histogram(buffer + used, buffer_size - used, "loop_time", &loop_time);
+    }
+    if (used < buffer_size) {
+        used += format_histogram(buffer + used, buffer_size - used, "reply_latency", &reply_latency);
+    }
+
+    return used < buffer_size ? used : buffer_size - 1;
+}
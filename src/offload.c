@@ -0,0 +1,392 @@
+#define _GNU_SOURCE
+#include "../include/offload.h"
+#include "../include/server.h"
+#include "../include/socket_utils.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <unistd.h>
+
+#define OFFLOAD_QUEUE_MASK (OFFLOAD_QUEUE_SIZE - 1)
+
+/**
+ * Ring slot. Its sequence number says whose turn it is: equal to a
+ * position, the slot is free for the producer at that position; one past
+ * it, the slot holds that position's job for a consumer.
+ */
+typedef struct {
+    size_t sequence;
+    offload_job_t *job;
+} offload_cell_t;
+
+/**
+ * Bounded submission ring of one worker (Vyukov's MPMC queue). The worker
+ * is the only producer, so enqueueing takes no CAS; pool threads claim
+ * jobs by advancing dequeue_pos with CAS. Each end sits on its own cache
+ * line.
+ */
+typedef struct {
+    size_t enqueue_pos;             // Next position to fill (owning worker)
+    char pad1[64 - sizeof(size_t)];
+    size_t dequeue_pos;             // Next position to take (pool threads)
+    char pad2[64 - sizeof(size_t)];
+    offload_cell_t cells[OFFLOAD_QUEUE_SIZE];
+} offload_queue_t;
+
+static offload_queue_t *queues = NULL;
+static int queue_count = 0;
+static pthread_t threads[OFFLOAD_MAX_THREADS];
+static int thread_count = 0;
+static sem_t queued;                // One post per queued job, plus one per thread to stop
+static int pool_running = 0;        // Accepting jobs
+static int pool_stopping = 0;       // Threads exit once the rings are empty
+
+/**
+ * Queue a job; only the owning worker calls this
+ * @return 0 on success, -1 if the ring is full
+ */
+static int queue_push(offload_queue_t *queue, offload_job_t *job) {
+    size_t position = queue->enqueue_pos;
+    offload_cell_t *cell = &queue->cells[position & OFFLOAD_QUEUE_MASK];
+
+    // The slot is still taken until the consumer of the previous lap is done
+    if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != position) {
+        return -1;
+    }
+    cell->job = job;
+    __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+    queue->enqueue_pos = position + 1;
+    return 0;
+}
+
+/**
+ * Take the oldest job of a ring, competing with the other pool threads
+ * @return Job, NULL if the ring is empty
+ */
+static offload_job_t *queue_pop(offload_queue_t *queue) {
+    size_t position = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+    offload_cell_t *cell;
+    offload_job_t *job;
+
+    for (;;) {
+        intptr_t difference;
+
+        cell = &queue->cells[position & OFFLOAD_QUEUE_MASK];
+        difference = (intptr_t)__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) -
+                     (intptr_t)(position + 1);
+        if (difference == 0) {
+            // On failure position is reloaded with the winner's value
+            if (__atomic_compare_exchange_n(&queue->dequeue_pos, &position, position + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (difference < 0) {
+            return NULL;
+        } else {
+            position = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    job = cell->job;
+    // Free the slot for the producer's next lap
+    __atomic_store_n(&cell->sequence, position + OFFLOAD_QUEUE_SIZE, __ATOMIC_RELEASE);
+    return job;
+}
+
+/**
+ * Find a queued job, home ring first, then stealing from the others. The
+ * caller holds a semaphore token, so one is queued somewhere; another
+ * thread may claim the one that was looked at, in which case the scan
+ * starts over.
+ */
+static offload_job_t *take_job(int home) {
+    offload_job_t *job;
+    int i;
+
+    for (;;) {
+        for (i = 0; i < queue_count; i++) {
+            job = queue_pop(&queues[(home + i) % queue_count]);
+            if (job != NULL) {
+                return job;
+            }
+        }
+        sched_yield();
+    }
+}
+
+/**
+ * Hand a finished job back to its worker: push it on the worker's
+ * completion stack, and write the eventfd unless an earlier push did
+ * since the worker last collected
+ */
+static void complete_job(offload_job_t *job) {
+    server_t *server = job->server;
+    offload_job_t *head = __atomic_load_n(&server->offload_done, __ATOMIC_RELAXED);
+    uint64_t value = 1;
+
+    do {
+        job->next = head;
+    } while (!__atomic_compare_exchange_n(&server->offload_done, &head, job, 1,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+    if (__atomic_exchange_n(&server->offload_signalled, 1, __ATOMIC_SEQ_CST) == 0 &&
+        write(server->offload_fd, &value, sizeof(value)) == -1) {
+        print_error("Failed to signal offload completion");
+    }
+}
+
+/**
+ * Pool thread: run queued jobs until stopped
+ */
+static void *offload_thread_main(void *arg) {
+    int home = (int)(intptr_t)arg;
+    offload_job_t *job;
+
+    for (;;) {
+        while (sem_wait(&queued) == -1 && errno == EINTR) {
+        }
+        // Workers collect their jobs before the pool stops, so no job is
+        // queued once stop tokens are posted
+        if (__atomic_load_n(&pool_stopping, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        job = take_job(home);
+        offload_run(job);
+        complete_job(job);
+    }
+    return NULL;
+}
+
+/**
+ * Start the pool threads
+ */
+int offload_start(int threads_wanted, int workers) {
+    char info_msg[128];
+    int i, j;
+
+    if (threads_wanted <= 0) {
+        return 0;
+    }
+    if (threads_wanted > OFFLOAD_MAX_THREADS) {
+        threads_wanted = OFFLOAD_MAX_THREADS;
+    }
+
+    queues = aligned_alloc(64, (size_t)workers * sizeof(offload_queue_t));
+    if (queues == NULL) {
+        print_error("Failed to allocate offload queues");
+        return -1;
+    }
+    for (i = 0; i < workers; i++) {
+        queues[i].enqueue_pos = 0;
+        queues[i].dequeue_pos = 0;
+        for (j = 0; j < OFFLOAD_QUEUE_SIZE; j++) {
+            queues[i].cells[j].sequence = (size_t)j;
+            queues[i].cells[j].job = NULL;
+        }
+    }
+    queue_count = workers;
+
+    if (sem_init(&queued, 0, 0) == -1) {
+        print_error("Failed to create offload semaphore");
+        free(queues);
+        queues = NULL;
+        return -1;
+    }
+
+    // Threads spread over the rings; each serves its home ring first
+    __atomic_store_n(&pool_stopping, 0, __ATOMIC_RELAXED);
+    for (thread_count = 0; thread_count < threads_wanted; thread_count++) {
+        if (pthread_create(&threads[thread_count], NULL, offload_thread_main,
+                           (void *)(intptr_t)(thread_count % workers)) != 0) {
+            print_error("Failed to start offload thread");
+            break;
+        }
+    }
+    if (thread_count == 0) {
+        sem_destroy(&queued);
+        free(queues);
+        queues = NULL;
+        return -1;
+    }
+
+    __atomic_store_n(&pool_running, 1, __ATOMIC_RELEASE);
+    snprintf(info_msg, sizeof(info_msg), "Offload pool started with %d thread(s)", thread_count);
+    print_server_info(info_msg);
+    return 0;
+}
+
+/**
+ * Stop the pool threads
+ */
+void offload_stop(void) {
+    int i;
+
+    if (!__atomic_load_n(&pool_running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    __atomic_store_n(&pool_running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&pool_stopping, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < thread_count; i++) {
+        sem_post(&queued);
+    }
+    for (i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    thread_count = 0;
+    sem_destroy(&queued);
+    free(queues);
+    queues = NULL;
+    queue_count = 0;
+}
+
+/**
+ * Copy a frame into a new job
+ */
+offload_job_t *offload_job_create(server_t *server, client_info_t *client,
+                                  const frame_view_t *frame, offload_fn run) {
+    offload_job_t *job = malloc(sizeof(*job) + frame->length + 1);
+
+    if (job == NULL) {
+        print_error("Failed to allocate offload job");
+        return NULL;
+    }
+    job->next = NULL;
+    job->server = server;
+    job->client = client;
+    job->run = run;
+    memcpy(job->data, frame->data, frame->length);
+    job->data[frame->length] = '\0';
+    job->frame = *frame;
+    job->frame.data = job->data;
+    job->submitted_ns = metrics_now_ns();
+    job->output = NULL;
+    job->output_length = 0;
+    job->output_capacity = 0;
+    job->status = BINARY_STATUS_OK;
+    job->result = 0;
+    return job;
+}
+
+/**
+ * Release a job and its reply
+ */
+void offload_job_free(offload_job_t *job) {
+    free(job->output);
+    free(job);
+}
+
+/**
+ * Queue a job on its worker's ring and wake a pool thread
+ */
+int offload_submit(offload_job_t *job) {
+    if (!__atomic_load_n(&pool_running, __ATOMIC_ACQUIRE) ||
+        job->server->worker_id >= queue_count ||
+        queue_push(&queues[job->server->worker_id], job) == -1) {
+        return -1;
+    }
+    sem_post(&queued);
+    return 0;
+}
+
+/**
+ * Run a job on the calling thread
+ */
+void offload_run(offload_job_t *job) {
+    job->result = job->run(job, &job->frame);
+}
+
+/**
+ * Take every job the pool finished for a worker, oldest first
+ */
+offload_job_t *offload_collect(server_t *server) {
+    offload_job_t *jobs, *ordered = NULL;
+    uint64_t value;
+
+    if (read(server->offload_fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+        print_error("Failed to read offload eventfd");
+    }
+    // Clear the flag before taking the stack: a push that still saw it set
+    // is already on the stack, and any later push signals again
+    __atomic_store_n(&server->offload_signalled, 0, __ATOMIC_SEQ_CST);
+    jobs = __atomic_exchange_n(&server->offload_done, NULL, __ATOMIC_SEQ_CST);
+
+    // The stack is newest first
+    while (jobs != NULL) {
+        offload_job_t *next = jobs->next;
+
+        jobs->next = ordered;
+        ordered = jobs;
+        jobs = next;
+    }
+    return ordered;
+}
+
+/**
+ * Make room for more reply bytes, doubling the buffer
+ */
+static int reserve_output(offload_job_t *job, size_t length) {
+    size_t capacity = job->output_capacity > 0 ? job->output_capacity : 256;
+    char *output;
+
+    if (job->output_length + length <= job->output_capacity) {
+        return 0;
+    }
+    while (capacity < job->output_length + length) {
+        capacity *= 2;
+    }
+    output = realloc(job->output, capacity);
+    if (output == NULL) {
+        return -1;
+    }
+    job->output = output;
+    job->output_capacity = capacity;
+    return 0;
+}
+
+/**
+ * Append bytes to a job's reply
+ */
+int offload_write(offload_job_t *job, const void *data, size_t length) {
+    if (length == 0) {
+        return 0;
+    }
+    if (reserve_output(job, length) == -1) {
+        return -1;
+    }
+    memcpy(job->output + job->output_length, data, length);
+    job->output_length += length;
+    return 0;
+}
+
+/**
+ * Format text into a job's reply
+ */
+int offload_printf(offload_job_t *job, const char *format, ...) {
+    va_list args;
+    int length;
+
+    va_start(args, format);
+    length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (length < 0 || reserve_output(job, (size_t)length + 1) == -1) {
+        return -1;
+    }
+
+    va_start(args, format);
+    vsnprintf(job->output + job->output_length, (size_t)length + 1, format, args);
+    va_end(args);
+    job->output_length += (size_t)length;
+    return 0;
+}
+
+/**
+ * Set the status of a job's binary reply
+ */
+void offload_set_status(offload_job_t *job, uint16_t status) {
+    job->status = status;
+}
@@ -0,0 +1,343 @@
+#define _POSIX_C_SOURCE 200809L
+#include "../include/output_queue.h"
+#include "../include/socket_utils.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+
+/**
+ * Allocate a shared buffer holding one reference
+ */
+shared_buffer_t *shared_buffer_create(buffer_pool_t *pool, size_t length) {
+    size_t size = sizeof(shared_buffer_t) + length;
+    shared_buffer_t *buffer;
+
+    buffer = pool != NULL ? buffer_pool_alloc(pool, size, &size) : malloc(size);
+    if (buffer == NULL) {
+        print_error("Failed to allocate shared buffer");
+        return NULL;
+    }
+
+    buffer->refs = 1;
+    buffer->length = length;
+    buffer->capacity = size;
+    buffer->pool = pool;
+    return buffer;
+}
+
+/**
+ * Drop one reference, freeing the buffer with the last
+ */
+void shared_buffer_release(shared_buffer_t *buffer) {
+    if (buffer == NULL || --buffer->refs > 0) {
+        return;
+    }
+    if (buffer->pool != NULL) {
+        buffer_pool_free(buffer->pool, buffer, buffer->capacity);
+    } else {
+        free(buffer);
+    }
+}
+
+/**
+ * Initialize an empty output queue
+ */
+void output_queue_init(output_queue_t *queue, buffer_pool_t *pool, slab_t *refs) {
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->bytes = 0;
+    queue->pool = pool;
+    queue->refs = refs;
+}
+
+/**
+ * Allocate a chunk able to hold length bytes, or as close to it as the
+ * largest pool size class allows
+ */
+static out_chunk_t *allocate_chunk(output_queue_t *queue, size_t length) {
+    size_t size = sizeof(out_chunk_t) + length;
+    out_chunk_t *chunk;
+
+    if (size < OUTPUT_CHUNK_SIZE) {
+        size = OUTPUT_CHUNK_SIZE;
+    }
+
+    if (queue->pool != NULL) {
+        // Large appends span several chunks rather than leaving the pool
+        if (size > POOL_MAX_CLASS_SIZE) {
+            size = POOL_MAX_CLASS_SIZE;
+        }
+        chunk = buffer_pool_alloc(queue->pool, size, &size);
+    } else {
+        chunk = malloc(size);
+    }
+    if (chunk == NULL) {
+        return NULL;
+    }
+
+    chunk->next = NULL;
+    chunk->capacity = size - sizeof(*chunk);
+    chunk->length = 0;
+    chunk->offset = 0;
+    chunk->shared = NULL;
+    chunk->base = NULL;
+    chunk->held = NULL;
+    return chunk;
+}
+
+/**
+ * Free storage the way the queue's pool wants it
+ */
+static void release_storage(output_queue_t *queue, void *storage, size_t capacity) {
+    if (queue->pool != NULL) {
+        buffer_pool_free(queue->pool, storage, capacity);
+    } else {
+        free(storage);
+    }
+}
+
+/**
+ * Return a chunk to the pool it came from, dropping its reference if it
+ * is a reference chunk and any storage it holds
+ */
+static void release_chunk(output_queue_t *queue, out_chunk_t *chunk) {
+    if (chunk->held != NULL) {
+        release_storage(queue, chunk->held, chunk->held_capacity);
+    }
+    if (chunk->capacity == 0) {
+        shared_buffer_release(chunk->shared);
+        if (queue->refs != NULL) {
+            slab_free(queue->refs, chunk);
+        } else {
+            free(chunk);
+        }
+    } else {
+        release_storage(queue, chunk, sizeof(*chunk) + chunk->capacity);
+    }
+}
+
+/**
+ * Add a reference chunk to the end of the queue
+ */
+static int append_reference(output_queue_t *queue, shared_buffer_t *shared, const char *base,
+                            size_t length, size_t skip) {
+    out_chunk_t *chunk = queue->refs != NULL ? slab_alloc(queue->refs) : malloc(sizeof(*chunk));
+
+    if (chunk == NULL) {
+        print_error("Failed to allocate output reference");
+        return -1;
+    }
+    chunk->next = NULL;
+    chunk->capacity = 0;
+    chunk->length = length;
+    chunk->offset = skip;
+    chunk->shared = shared;
+    chunk->base = base;
+    chunk->held = NULL;
+
+    if (queue->tail != NULL) {
+        queue->tail->next = chunk;
+    } else {
+        queue->head = chunk;
+    }
+    queue->tail = chunk;
+    queue->bytes += length - skip;
+    return 0;
+}
+
+/**
+ * Copy data to the end of the queue, filling the tail chunk first
+ */
+int output_queue_append(output_queue_t *queue, const char *data, size_t length) {
+    while (length > 0) {
+        out_chunk_t *tail = queue->tail;
+        size_t space, copy;
+
+        if (tail == NULL || tail->base != NULL || tail->length == tail->capacity) {
+            tail = allocate_chunk(queue, length);
+            if (tail == NULL) {
+                print_error("Failed to allocate output buffer");
+                return -1;
+            }
+
+            if (queue->tail != NULL) {
+                queue->tail->next = tail;
+            } else {
+                queue->head = tail;
+            }
+            queue->tail = tail;
+        }
+
+        space = tail->capacity - tail->length;
+        copy = length < space ? length : space;
+        memcpy(tail->data + tail->length, data, copy);
+        tail->length += copy;
+        queue->bytes += copy;
+        data += copy;
+        length -= copy;
+    }
+
+    return 0;
+}
+
+/**
+ * Copy the contents of an iovec array to the end of the queue
+ */
+int output_queue_append_iov(output_queue_t *queue, const struct iovec *iov, int iovcnt, size_t skip) {
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        const char *base = iov[i].iov_base;
+        size_t length = iov[i].iov_len;
+
+        if (skip >= length) {
+            skip -= length;
+            continue;
+        }
+        if (output_queue_append(queue, base + skip, length - skip) == -1) {
+            return -1;
+        }
+        skip = 0;
+    }
+
+    return 0;
+}
+
+/**
+ * Queue a reference to a shared buffer
+ */
+int output_queue_append_shared(output_queue_t *queue, shared_buffer_t *buffer, size_t skip) {
+    if (skip >= buffer->length) {
+        return 0;
+    }
+    if (append_reference(queue, buffer, buffer->data, buffer->length, skip) == -1) {
+        return -1;
+    }
+    buffer->refs++;
+    return 0;
+}
+
+/**
+ * Queue references to an iovec array's bytes
+ */
+int output_queue_append_borrowed(output_queue_t *queue, const struct iovec *iov, int iovcnt) {
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > 0 && append_reference(queue, NULL, iov[i].iov_base, iov[i].iov_len, 0) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Release storage with the newest chunk, or right away if nothing is queued
+ */
+void output_queue_hold(output_queue_t *queue, char *storage, size_t capacity) {
+    if (storage == NULL) {
+        return;
+    }
+    if (queue->tail == NULL) {
+        release_storage(queue, storage, capacity);
+        return;
+    }
+    queue->tail->held = storage;
+    queue->tail->held_capacity = capacity;
+}
+
+/**
+ * Describe the oldest queued bytes as an iovec array, one entry per chunk
+ */
+int output_queue_gather(const output_queue_t *queue, struct iovec *iov, int max_iov, size_t *bytes) {
+    out_chunk_t *chunk = queue->head;
+    int count = 0;
+
+    *bytes = 0;
+    while (chunk != NULL && count < max_iov) {
+        iov[count].iov_base = (char *)(chunk->base != NULL ? chunk->base : chunk->data) + chunk->offset;
+        iov[count].iov_len = chunk->length - chunk->offset;
+        *bytes += iov[count].iov_len;
+        count++;
+        chunk = chunk->next;
+    }
+    return count;
+}
+
+/**
+ * Drop sent bytes from the front of the queue
+ */
+void output_queue_consume(output_queue_t *queue, size_t bytes) {
+    queue->bytes -= bytes;
+
+    // Release fully sent chunks and advance into a partial one
+    while (bytes > 0) {
+        out_chunk_t *chunk = queue->head;
+
+        if (bytes < chunk->length - chunk->offset) {
+            chunk->offset += bytes;
+            break;
+        }
+        bytes -= chunk->length - chunk->offset;
+        queue->head = chunk->next;
+        release_chunk(queue, chunk);
+    }
+    if (queue->head == NULL) {
+        queue->tail = NULL;
+    }
+}
+
+/**
+ * Send as much queued data as the socket accepts without blocking
+ */
+ssize_t output_queue_flush(output_queue_t *queue, int socket_fd) {
+    struct iovec iov[OUTPUT_MAX_IOV];
+    struct msghdr msg;
+    ssize_t total = 0;
+
+    while (queue->head != NULL) {
+        ssize_t sent;
+        size_t requested;
+
+        // Gather consecutive chunks into one sendmsg() call
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (size_t)output_queue_gather(queue, iov, OUTPUT_MAX_IOV, &requested);
+
+        sent = sendmsg(socket_fd, &msg, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+
+        total += sent;
+        output_queue_consume(queue, (size_t)sent);
+        if ((size_t)sent < requested) {
+            // The socket buffer is full
+            break;
+        }
+    }
+
+    return total;
+}
+
+/**
+ * Free all queued chunks
+ */
+void output_queue_clear(output_queue_t *queue) {
+    out_chunk_t *chunk = queue->head;
+
+    while (chunk != NULL) {
+        out_chunk_t *next = chunk->next;
+        release_chunk(queue, chunk);
+        chunk = next;
+    }
+    output_queue_init(queue, queue->pool, queue->refs);
+}
@@ -0,0 +1,39 @@
+#include "../include/protocol.h"
+#include <string.h>
+#include <arpa/inet.h>
+
+/**
+ * Decode a frame header from the wire
+ */
+void binary_header_decode(const void *data, binary_header_t *header) {
+    const unsigned char *bytes = data;
+    uint32_t word;
+    uint16_t half;
+
+    memcpy(&word, bytes, sizeof(word));
+    header->length = ntohl(word);
+    memcpy(&word, bytes + 4, sizeof(word));
+    header->request_id = ntohl(word);
+    memcpy(&half, bytes + 8, sizeof(half));
+    header->opcode = ntohs(half);
+    memcpy(&half, bytes + 10, sizeof(half));
+    header->status = ntohs(half);
+}
+
+/**
+ * Encode a frame header for the wire
+ */
+void binary_header_encode(const binary_header_t *header, void *data) {
+    unsigned char *bytes = data;
+    uint32_t word;
+    uint16_t half;
+
+    word = htonl(header->length);
+    memcpy(bytes, &word, sizeof(word));
+    word = htonl(header->request_id);
+    memcpy(bytes + 4, &word, sizeof(word));
+    half = htons(header->opcode);
+    memcpy(bytes + 8, &half, sizeof(half));
+    half = htons(header->status);
+    memcpy(bytes + 10, &half, sizeof(half));
+}
@@ -0,0 +1,132 @@
+#include "../include/room.h"
+#include "../include/conn_table.h"
+#include "../include/socket_utils.h"
+#include <string.h>
+
+/**
+ * FNV-1a hash of a room name
+ */
+static unsigned hash_name(const char *name, size_t length) {
+    unsigned hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash % ROOM_BUCKETS;
+}
+
+/**
+ * Initialize an empty room table
+ */
+void room_table_init(room_table_t *table) {
+    memset(table->buckets, 0, sizeof(table->buckets));
+    slab_init(&table->rooms, sizeof(room_t), 0);
+    table->count = 0;
+}
+
+/**
+ * Free all rooms
+ */
+void room_table_destroy(room_table_t *table) {
+    slab_destroy(&table->rooms);
+    memset(table->buckets, 0, sizeof(table->buckets));
+    table->count = 0;
+}
+
+/**
+ * Find a room by name, creating it if it does not exist
+ */
+static room_t *find_room(room_table_t *table, const char *name, size_t name_length) {
+    unsigned bucket = hash_name(name, name_length);
+    room_t *room;
+
+    for (room = table->buckets[bucket]; room != NULL; room = room->next) {
+        if (room->name_length == name_length && memcmp(room->name, name, name_length) == 0) {
+            return room;
+        }
+    }
+
+    room = slab_alloc(&table->rooms);
+    if (room == NULL) {
+        print_error("Failed to allocate room");
+        return NULL;
+    }
+    room->members = NULL;
+    room->count = 0;
+    room->name_length = name_length;
+    memcpy(room->name, name, name_length);
+    room->next = table->buckets[bucket];
+    table->buckets[bucket] = room;
+    table->count++;
+    return room;
+}
+
+/**
+ * Move a connection into a room
+ */
+int room_join(room_table_t *table, client_info_t *client, const char *name, size_t name_length) {
+    room_t *room;
+
+    if (name_length > ROOM_NAME_MAX) {
+        return -1;
+    }
+    if (client->room != NULL && client->room->name_length == name_length &&
+        memcmp(client->room->name, name, name_length) == 0) {
+        return 0;
+    }
+
+    room_leave(table, client);
+    room = find_room(table, name, name_length);
+    if (room == NULL) {
+        return -1;
+    }
+
+    client->room = room;
+    client->room_prev = NULL;
+    client->room_next = room->members;
+    if (room->members != NULL) {
+        room->members->room_prev = client;
+    }
+    room->members = client;
+    room->count++;
+    return 0;
+}
+
+/**
+ * Take a connection out of its room
+ */
+void room_leave(room_table_t *table, client_info_t *client) {
+    room_t *room = client->room;
+    room_t **link;
+
+    if (room == NULL) {
+        return;
+    }
+
+    if (client->room_prev != NULL) {
+        client->room_prev->room_next = client->room_next;
+    } else {
+        room->members = client->room_next;
+    }
+    if (client->room_next != NULL) {
+        client->room_next->room_prev = client->room_prev;
+    }
+    client->room = NULL;
+    client->room_next = NULL;
+    client->room_prev = NULL;
+
+    if (--room->count > 0) {
+        return;
+    }
+
+    // Last member gone: unlink and free the room
+    link = &table->buckets[hash_name(room->name, room->name_length)];
+    while (*link != room) {
+        link = &(*link)->next;
+    }
+    *link = room->next;
+    slab_free(&table->rooms, room);
+    table->count--;
+}
@@ -1,231 +1,1017 @@
+#define _GNU_SOURCE
 #include "../include/server.h"
 #include "../include/socket_utils.h"
 #include "../include/client_handler.h"
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <signal.h>
 #include <errno.h>
-
-// Global server instance for signal handling
-static server_t *g_server = NULL;
-
-/**
- * Signal handler for graceful shutdown
- */
-void signal_handler(int sig) {
-    (void)sig;  // Suppress unused parameter warning
-    if (g_server != NULL) {
-        print_server_info("Received shutdown signal, stopping server...");
-        g_server->running = 0;
-    }
-}
+#include <getopt.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include "../include/worker.h"
+#include "../include/upgrade.h"
+#include "../include/offload.h"
+#include "../include/kv_store.h"
+#include "../include/logger.h"
 
 /**
  * Initialize server structure and create listening socket
  */
-int initialize_server(server_t *server, int port) {
-    int i;
+int initialize_server(server_t *server, const server_config_t *config, int worker_id) {
     char info_msg[256];
     
     // Initialize server structure
-    server->port = port;
+    server->port = config->port;
+    server->worker_id = worker_id;
+    server->config = config;
+    server->handler = config->handler;
+    server->wakeup_fd = -1;
+    server->offload_fd = -1;
+    server->offload_done = NULL;
+    server->offload_signalled = 0;
+    server->offload_pending = 0;
+    server->admin_socket = -1;
+    server->unix_socket = -1;
+    server->reserve_fd = -1;
+    server->accept_pending = 0;
+    server->unix_accept_pending = 0;
+    server->ready_head = NULL;
+    server->ready_tail = NULL;
+    server->turn_frames = 0;
+    server->pipe_cache_count = 0;
+    server->orphans = NULL;
+    server->orphans_tail = NULL;
+    timer_entry_init(&server->orphan_timer);
+    timer_entry_init(&server->drain_timer);
     server->running = 1;
-    server->max_fd = 0;
+    server->draining = 0;
+    server->handoff = 0;
+    
+    server->server_socket = -1;
+    server->replies.count = 0;
+    server->replies.frames = 0;
+    server->replies.scratch_used = 0;
+    
+    // Counters start at zero and become visible to the admin endpoint
+    if (metrics_register(&server->metrics) == -1) {
+        return -1;
+    }
     
-    // Initialize all client slots as inactive
-    for (i = 0; i < MAX_CLIENTS; i++) {
-        init_client_info(&server->clients[i]);
+    // Timeouts are measured against the clock read once per loop iteration
+    server->metrics.iteration_start = metrics_now_ns();
+    server->now_tick = server->metrics.iteration_start / TIMER_TICK_NS;
+    timer_wheel_init(&server->timers, server->now_tick);
+    
+    // Start with an empty connection table; connection objects and their
+    // buffers come from this worker's own pools
+    buffer_pool_init(&server->buffers, config->huge_pages);
+    slab_init(&server->zerocopy_records, sizeof(zerocopy_buffer_t), 0);
+    room_table_init(&server->rooms);
+    if (conn_table_init(&server->clients, config->max_clients, &server->buffers,
+                        config->huge_pages) == -1) {
+        metrics_unregister(&server->metrics);
+        return -1;
     }
     
-    // Create server socket
-    server->server_socket = create_server_socket(port);
+    // Create server socket; workers share the port through SO_REUSEPORT.
+    // After an upgrade the previous process's listener is used instead, so
+    // connections already in its accept queue are served, not refused.
+    if (worker_id < config->listen_fd_count) {
+        server->server_socket = config->listen_fds[worker_id];
+    } else {
+        server->server_socket = create_server_socket(config->port, config->workers > 1, config->backlog);
+    }
     if (server->server_socket == -1) {
+        conn_table_destroy(&server->clients);
+        metrics_unregister(&server->metrics);
+        return -1;
+    }
+    
+    // Accepts are drained until EAGAIN, so the listener must not block
+    if (set_socket_nonblocking(server->server_socket) == -1 ||
+        (config->defer_accept > 0 &&
+         set_socket_defer_accept(server->server_socket, config->defer_accept) == -1) ||
+        (config->zerocopy_threshold > 0 && set_socket_zerocopy(server->server_socket) == -1)) {
+        close(server->server_socket);
+        conn_table_destroy(&server->clients);
+        metrics_unregister(&server->metrics);
+        return -1;
+    }
+    
+    // Create the event loop and watch the listening socket. The server
+    // pointer itself tags listener events.
+    if (event_loop_init(&server->loop) == -1) {
+        close(server->server_socket);
+        conn_table_destroy(&server->clients);
+        metrics_unregister(&server->metrics);
         return -1;
     }
     
-    // Initialize file descriptor sets
-    FD_ZERO(&server->master_set);
-    FD_ZERO(&server->read_set);
+    if (event_loop_add(&server->loop, server->server_socket, EVENT_READ | EVENT_ACCEPT, server) == -1) {
+        print_error("Failed to watch server socket");
+        cleanup_server_resources(server);
+        return -1;
+    }
+    
+    // eventfd lets another thread interrupt event_loop_wait()
+    server->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (server->wakeup_fd == -1 ||
+        event_loop_add(&server->loop, server->wakeup_fd, EVENT_READ, &server->wakeup_fd) == -1) {
+        print_error("Failed to create wakeup eventfd");
+        cleanup_server_resources(server);
+        return -1;
+    }
+    
+    // The offload pool signals finished jobs on another eventfd
+    server->offload_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (server->offload_fd == -1 ||
+        event_loop_add(&server->loop, server->offload_fd, EVENT_READ, &server->offload_fd) == -1) {
+        print_error("Failed to create offload eventfd");
+        cleanup_server_resources(server);
+        return -1;
+    }
+    
+    // Keep one descriptor in reserve: when the process runs out, closing it
+    // leaves room to accept and immediately close a pending connection
+    server->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (server->reserve_fd == -1) {
+        print_error("Failed to open reserve descriptor");
+    }
+    
+    // Unix sockets have no SO_REUSEPORT balancing, so every worker watches
+    // its own duplicate of the one listener and whichever accepts first
+    // serves the connection
+    if (config->unix_fd != -1) {
+        server->unix_socket = fcntl(config->unix_fd, F_DUPFD_CLOEXEC, 0);
+        if (server->unix_socket == -1 ||
+            event_loop_add(&server->loop, server->unix_socket, EVENT_READ | EVENT_ACCEPT,
+                           &server->unix_socket) == -1) {
+            print_error("Failed to watch Unix socket");
+            cleanup_server_resources(server);
+            return -1;
+        }
+    }
     
-    // Add server socket to master set
-    FD_SET(server->server_socket, &server->master_set);
-    server->max_fd = server->server_socket;
+    // Worker 0 also serves the merged metrics of every worker
+    if (worker_id == 0 && config->admin_port > 0) {
+        server->admin_socket = config->admin_fd != -1 ? config->admin_fd
+                                                      : create_loopback_socket(config->admin_port);
+        if (server->admin_socket == -1 ||
+            set_socket_nonblocking(server->admin_socket) == -1 ||
+            event_loop_add(&server->loop, server->admin_socket, EVENT_READ, &server->admin_socket) == -1) {
+            print_error("Failed to open admin port");
+            cleanup_server_resources(server);
+            return -1;
+        }
+    }
     
-    snprintf(info_msg, sizeof(info_msg), "Server initialized on port %d", port);
+    snprintf(info_msg, sizeof(info_msg), "Worker %d initialized on port %d (%s backend, %s handler)",
+             worker_id, config->port, event_loop_backend_name(), server->handler->name);
     print_server_info(info_msg);
     
     return 0;
 }
 
 /**
- * Main server loop using select() for I/O multiplexing
+ * How long the next wait may block: until the timer wheel has work, or not
+ * at all when accepts were cut short or clients wait for their next turn
  */
-void run_server(server_t *server) {
-    int i, activity;
-    char info_msg[256];
+static int next_wait_timeout(server_t *server) {
+    uint64_t tick, deadline_ns;
+    
+    if (server->accept_pending || server->unix_accept_pending || server->ready_head != NULL) {
+        return 0;
+    }
+    if (timer_wheel_next_tick(&server->timers, &tick) == -1) {
+        return -1;
+    }
+    
+    deadline_ns = tick * TIMER_TICK_NS;
+    if (deadline_ns <= server->metrics.iteration_start) {
+        return 0;
+    }
+    return (int)((deadline_ns - server->metrics.iteration_start + 999999) / 1000000);
+}
+
+/**
+ * Serve the connections an event loop that accepts by itself took before
+ * the listener left it; other backends leave them to the new process
+ */
+static void take_accepted_connections(server_t *server, int listen_fd) {
+    int *pending = listen_fd == server->unix_socket ? &server->unix_accept_pending
+                                                    : &server->accept_pending;
     
-    g_server = server;
+    if (!EVENT_LOOP_COMPLETIONS) {
+        return;
+    }
+    do {
+        handle_new_connection(server, listen_fd);
+    } while (*pending);
+}
+
+/**
+ * Stop accepting once a new process has taken over the listeners; the
+ * connections still open get until the drain timeout to finish
+ */
+static void begin_server_drain(server_t *server) {
+    char info_msg[128];
     
-    // Setup signal handlers for graceful shutdown
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
+    // The new process shares the listeners, so they must leave this event
+    // loop explicitly; closing them here doesn't close them there
+    if (server->server_socket != -1) {
+        event_loop_remove(&server->loop, server->server_socket);
+        take_accepted_connections(server, server->server_socket);
+        close(server->server_socket);
+        server->server_socket = -1;
+        server->accept_pending = 0;
+    }
+    if (server->unix_socket != -1) {
+        event_loop_remove(&server->loop, server->unix_socket);
+        take_accepted_connections(server, server->unix_socket);
+        close(server->unix_socket);
+        server->unix_socket = -1;
+        server->unix_accept_pending = 0;
+    }
+    if (server->admin_socket != -1) {
+        event_loop_remove(&server->loop, server->admin_socket);
+        close(server->admin_socket);
+        server->admin_socket = -1;
+    }
     
-    snprintf(info_msg, sizeof(info_msg), "Server listening on port %d", server->port);
+    timer_wheel_schedule(&server->timers, &server->drain_timer,
+                         server->now_tick + TIMER_SECONDS_TO_TICKS(server->config->drain_timeout));
+    snprintf(info_msg, sizeof(info_msg), "Worker %d draining %d connection(s)",
+             server->worker_id, get_active_client_count(server));
     print_server_info(info_msg);
-    print_server_info("Press Ctrl+C to stop the server");
+}
+
+/**
+ * The drain timeout is over: close the connections that are left and exit
+ */
+static void end_server_drain(server_t *server) {
+    int fd;
+    
+    for (fd = 0; fd < server->clients.capacity && server->clients.count > 0; fd++) {
+        client_info_t *client = conn_table_lookup(&server->clients, fd);
+        if (client != NULL) {
+            remove_client(server, client, DISCONNECT_DRAIN_TIMEOUT);
+        }
+    }
+    server->running = 0;
+}
+
+/**
+ * Timer wheel callback: the orphan timer, the drain timer or a
+ * connection's timer
+ */
+static void handle_timer(timer_entry_t *timer, void *arg) {
+    server_t *server = arg;
+    
+    if (timer == &server->orphan_timer) {
+        release_zerocopy_orphans(server, 0);
+    } else if (timer == &server->drain_timer) {
+        end_server_drain(server);
+    } else {
+        handle_client_timeout(timer, arg);
+    }
+}
+
+/**
+ * Send the replies of the jobs the offload pool finished, in the order
+ * they finished, and let each connection go on with the frames after its
+ * job
+ */
+static void handle_offload_completions(server_t *server) {
+    offload_job_t *job = offload_collect(server);
+    
+    while (job != NULL) {
+        offload_job_t *next = job->next;
+        client_info_t *client = job->client;
+        
+        server->offload_pending--;
+        if (client != NULL) {
+            client->offload = NULL;
+            if (job->result == -1 || send_offloaded_reply(server, client, job) == -1) {
+                remove_client(server, client, DISCONNECT_WRITE_ERROR);
+            } else {
+                // Frames that arrived meanwhile raise no new edge-triggered
+                // event, so the connection gets a turn on the ready list
+                client->input_backlog = stream_buffer_length(&client->input) > 0;
+                schedule_client_turn(server, client);
+            }
+        }
+        offload_job_free(job);
+        job = next;
+    }
+}
+
+/**
+ * Wait for every job this worker has on the offload pool and send the
+ * replies, before its connections are handed over or closed
+ */
+static void finish_offloaded_jobs(server_t *server) {
+    struct pollfd poll_fd;
+    
+    while (server->offload_pending > 0) {
+        poll_fd.fd = server->offload_fd;
+        poll_fd.events = POLLIN;
+        poll_fd.revents = 0;
+        if (poll(&poll_fd, 1, -1) == -1 && errno != EINTR) {
+            print_error("Failed to wait for offloaded jobs");
+            return;
+        }
+        handle_offload_completions(server);
+    }
+}
+
+/**
+ * Before a handoff, let an event loop that does the socket I/O itself
+ * finish it: sends in flight are reported and their bytes leave the
+ * output queues, connections it accepted are added, and data it received
+ * moves to the connections' input, where the handoff finds all of it
+ */
+static void settle_loop_io(server_t *server) {
+    int i, fd, count;
+    
+    if (!EVENT_LOOP_COMPLETIONS) {
+        return;
+    }
+    
+    do {
+        event_loop_quiesce(&server->loop);
+        count = event_loop_wait(&server->loop, server->events, EVENT_BATCH_SIZE, 0);
+        for (i = 0; i < count; i++) {
+            loop_event_t *event = &server->events[i];
+            client_info_t *client = event->data;
+            
+            if (event->data == server) {
+                if (server->server_socket != -1) {
+                    take_accepted_connections(server, server->server_socket);
+                }
+            } else if (event->data == &server->unix_socket) {
+                if (server->unix_socket != -1) {
+                    take_accepted_connections(server, server->unix_socket);
+                }
+            } else if (event->data != &server->admin_socket && event->data != &server->wakeup_fd &&
+                       event->data != &server->offload_fd &&
+                       client->active && (event->events & EVENT_SENT)) {
+                handle_client_sent(server, client, event->result);
+            }
+        }
+    } while (count > 0);
+    
+    for (fd = 0; fd < server->clients.capacity; fd++) {
+        client_info_t *client = conn_table_lookup(&server->clients, fd);
+        ssize_t received;
+        
+        while (client != NULL && stream_buffer_reserve(&client->input, READ_CHUNK_SIZE) == 0) {
+            received = event_loop_recv(&server->loop, fd, stream_buffer_tail(&client->input),
+                                       stream_buffer_space(&client->input));
+            if (received <= 0) {
+                break;
+            }
+            client->input.end += (size_t)received;
+        }
+    }
+}
+
+/**
+ * Main server loop. Each wakeup handles a batch of ready descriptors whose
+ * connection state is carried in the event itself, so the cost of an
+ * iteration depends on the number of active sockets only.
+ */
+void run_server(server_t *server) {
+    int i, count;
     
     while (server->running) {
-        // Copy master set to working set
-        server->read_set = server->master_set;
+        // Wait for activity on any socket or the next timer
+        count = event_loop_wait(&server->loop, server->events, EVENT_BATCH_SIZE,
+                                next_wait_timeout(server));
         
-        // Wait for activity on any socket
-        activity = select(server->max_fd + 1, &server->read_set, NULL, NULL, NULL);
+        // One clock read per iteration serves every log line and timeout it produces
+        logger_update_clock();
+        server->metrics.iteration_start = metrics_now_ns();
+        server->now_tick = server->metrics.iteration_start / TIMER_TICK_NS;
         
-        if (activity < 0) {
+        if (count < 0) {
             if (errno == EINTR) {
                 // Interrupted by signal, continue
                 continue;
             }
-            print_error("select() failed");
+            print_error("event_loop_wait() failed");
             break;
         }
         
-        // Check if there's activity on the server socket (new connection)
-        if (FD_ISSET(server->server_socket, &server->read_set)) {
-            handle_new_connection(server);
+        // Continue accept batches that stopped at their limit. Listeners
+        // are edge-triggered, so no new event would announce these.
+        if (server->accept_pending) {
+            handle_new_connection(server, server->server_socket);
+        }
+        if (server->unix_accept_pending) {
+            handle_new_connection(server, server->unix_socket);
         }
         
-        // Check all client sockets for activity
-        for (i = 0; i < MAX_CLIENTS; i++) {
-            if (server->clients[i].active && 
-                FD_ISSET(server->clients[i].socket_fd, &server->read_set)) {
-                handle_client_message(server, server->clients[i].socket_fd);
+        // Clients whose last turn ran out of budget go first, in the order
+        // they yielded; those that yield in this batch wait for the next
+        // iteration, so nobody gets two turns in one
+        run_ready_clients(server);
+        
+        for (i = 0; i < count; i++) {
+            loop_event_t *event = &server->events[i];
+            
+            if (event->data == server) {
+                // Activity on the server socket (new connections)
+                handle_new_connection(server, server->server_socket);
+            } else if (event->data == &server->unix_socket) {
+                // New local connections
+                handle_new_connection(server, server->unix_socket);
+            } else if (event->data == &server->admin_socket) {
+                // Stats request on the admin port
+                handle_admin_connection(server);
+            } else if (event->data == &server->wakeup_fd) {
+                // Woken up by stop_server(), where the loop condition ends
+                // the loop, or by drain_server()
+                uint64_t value;
+                if (read(server->wakeup_fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+                    print_error("Failed to read wakeup eventfd");
+                }
+                if (server->draining && !timer_pending(&server->drain_timer)) {
+                    begin_server_drain(server);
+                }
+            } else if (event->data == &server->offload_fd) {
+                // Replies computed on the offload pool
+                handle_offload_completions(server);
+            } else {
+                client_info_t *client = event->data;
+                
+                // Zero-copy completions are reported as socket errors
+                if (client->active && (event->events & EVENT_HANGUP) &&
+                    client->zerocopy_pending != NULL) {
+                    reap_zerocopy_completions(server, client);
+                }
+                
+                // A send the event loop made for the client finished
+                if (client->active && (event->events & EVENT_SENT)) {
+                    handle_client_sent(server, client, event->result);
+                }
+                
+                // Flush queued output first; it may resume paused reads
+                if (client->active && (event->events & EVENT_WRITE)) {
+                    handle_client_writable(server, client);
+                }
+                
+                // Skip events for clients closed earlier in this batch, and
+                // for clients already waiting for a turn on the ready list
+                if (client->active && !client->ready && (event->events & (EVENT_READ | EVENT_HANGUP))) {
+                    handle_client_message(server, client);
+                }
             }
         }
+        
+        // Fire due timeouts; connections active in this batch have already
+        // pushed their deadlines back
+        timer_wheel_advance(&server->timers, server->now_tick, handle_timer, server);
+        
+        // A draining worker is done once its last connection is gone
+        if (server->draining && server->clients.count == 0) {
+            server->running = 0;
+        }
+        
+        METRIC_ADD(server->metrics.loop_iterations, 1);
+        metrics_record(&server->metrics.loop_time,
+                       metrics_now_ns() - server->metrics.iteration_start);
     }
     
-    print_server_info("Server shutting down...");
-    shutdown_server(server);
+    finish_offloaded_jobs(server);
+    
+    // Connections being handed to a new process are sent on from the
+    // stopped worker's state, which is shut down after that
+    if (!server->handoff) {
+        shutdown_server(server);
+    } else {
+        settle_loop_io(server);
+    }
+}
+
+/**
+ * Ask a running server loop to exit. Safe to call from another thread.
+ */
+void stop_server(server_t *server) {
+    uint64_t value = 1;
+    
+    server->running = 0;
+    if (server->wakeup_fd != -1 && write(server->wakeup_fd, &value, sizeof(value)) == -1) {
+        print_error("Failed to wake server loop");
+    }
+}
+
+/**
+ * Ask a running server loop to stop accepting and exit once its
+ * connections are gone (or the drain timeout ends them). Safe to call
+ * from another thread.
+ */
+void drain_server(server_t *server) {
+    uint64_t value = 1;
+    
+    server->draining = 1;
+    if (server->wakeup_fd != -1 && write(server->wakeup_fd, &value, sizeof(value)) == -1) {
+        print_error("Failed to wake server loop");
+    }
 }
 
 /**
- * Handle new client connection
+ * Out of descriptors: use the reserve descriptor to accept and close one
+ * pending connection, so clients are refused instead of left hanging
+ * @return 0 if a connection was shed, -1 otherwise (errno set by accept())
  */
-void handle_new_connection(server_t *server) {
-    int client_fd, client_index;
-    struct sockaddr_in client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
+static int shed_connection(server_t *server, int listen_fd) {
+    int client_fd, saved_errno;
+    
+    if (server->reserve_fd == -1) {
+        return -1;
+    }
+    
+    close(server->reserve_fd);
+    client_fd = accept(listen_fd, NULL, NULL);
+    saved_errno = errno;
+    if (client_fd != -1) {
+        close(client_fd);
+        METRIC_ADD(server->metrics.rejects, 1);
+    }
+    server->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    errno = saved_errno;
+    return client_fd != -1 ? 0 : -1;
+}
+
+/**
+ * Handle new client connections on the TCP or Unix listener. Readiness is
+ * edge-triggered, so pending connections are accepted until EAGAIN, but at
+ * most ACCEPT_BATCH_LIMIT per call; the rest are picked up on the next
+ * loop iteration.
+ */
+void handle_new_connection(server_t *server, int listen_fd) {
+    int client_fd, accepted;
+    int *pending = listen_fd == server->unix_socket ? &server->unix_accept_pending
+                                                    : &server->accept_pending;
+    client_info_t *client;
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len;
     char addr_str[64];
     char info_msg[256];
     
-    // Accept new connection
-    client_fd = accept(server->server_socket, (struct sockaddr*)&client_addr, &client_addr_len);
-    if (client_fd == -1) {
-        print_error("Failed to accept client connection");
+    *pending = 0;
+    
+    // A drain earlier in the same batch closes the listener
+    if (listen_fd == -1) {
         return;
     }
     
-    // Add client to server's client list
-    client_index = add_client(server, client_fd, &client_addr);
-    if (client_index == -1) {
-        // Server is full, reject connection
-        addr_to_string(&client_addr, addr_str, sizeof(addr_str));
-        snprintf(info_msg, sizeof(info_msg), "Server full, rejecting connection from %s", addr_str);
+    for (accepted = 0; accepted < ACCEPT_BATCH_LIMIT; accepted++) {
+        // Accept new connection, already non-blocking
+        client_addr_len = sizeof(client_addr);
+        client_fd = event_loop_accept(&server->loop, listen_fd, (struct sockaddr *)&client_addr,
+                                      &client_addr_len);
+        if (client_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE) {
+                if (shed_connection(server, listen_fd) == 0) {
+                    print_connection_info("Out of file descriptors, shed a pending connection");
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    print_error("Out of file descriptors");
+                }
+                return;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                print_error("Failed to accept client connection");
+            }
+            return;
+        }
+        
+        // Add client to server's client list
+        client = add_client(server, client_fd, (struct sockaddr *)&client_addr, client_addr_len);
+        if (client == NULL) {
+            // Server is full, reject connection
+            addr_to_string((struct sockaddr *)&client_addr, client_addr_len, addr_str, sizeof(addr_str));
+            snprintf(info_msg, sizeof(info_msg), "Server full, rejecting connection from %s", addr_str);
+            print_connection_info(info_msg);
+            close(client_fd);
+            METRIC_ADD(server->metrics.rejects, 1);
+            continue;
+        }
+        
+        // Watch the client socket, carrying its slot in the event data
+        if (event_loop_add(&server->loop, client_fd, EVENT_READ | EVENT_STREAM, client) == -1) {
+            print_error("Failed to watch client socket");
+            cleanup_client(server, client);
+            continue;
+        }
+        client->interest = EVENT_READ;
+        METRIC_ADD(server->metrics.accepts, 1);
+        METRIC_ADD(server->metrics.connections, 1);
+        
+        // Log new connection
+        describe_client(client, addr_str, sizeof(addr_str));
+        snprintf(info_msg, sizeof(info_msg), "New client connected from %s (clients: %d/%d)", 
+                 addr_str, get_active_client_count(server), server->clients.max_clients);
         print_connection_info(info_msg);
-        close(client_fd);
-        return;
     }
     
-    // Add client socket to master set
-    FD_SET(client_fd, &server->master_set);
-    if (client_fd > server->max_fd) {
-        server->max_fd = client_fd;
+    // Limit reached: finish draining the backlog on the next iteration
+    *pending = 1;
+}
+
+/**
+ * Process a client's buffered input, then track its partial frame for the
+ * read timeout
+ * @return 0 on success, -1 if the client was removed
+ */
+static int process_client_frames(server_t *server, client_info_t *client) {
+    size_t received = stream_buffer_length(&client->input);
+    size_t pending;
+    int result;
+    
+    result = process_client_input(server, client);
+    if (result < 0) {
+        remove_client(server, client, result == -2 ? DISCONNECT_FRAME_TOO_LARGE
+                                                   : DISCONNECT_WRITE_ERROR);
+        return -1;
     }
     
-    // Log new connection
-    addr_to_string(&client_addr, addr_str, sizeof(addr_str));
-    snprintf(info_msg, sizeof(info_msg), "New client connected from %s (clients: %d/%d)", 
-             addr_str, get_active_client_count(server), MAX_CLIENTS);
-    print_connection_info(info_msg);
+    // A partial frame has to be completed within the read timeout,
+    // counted from when it started or the previous frame completed
+    pending = stream_buffer_length(&client->input);
+    if (pending == 0) {
+        client->frame_started = 0;
+    } else if (client->frame_started == 0) {
+        client->frame_started = server->now_tick;
+        schedule_client_timeout(server, client);
+    } else if (pending < received) {
+        client->frame_started = server->now_tick;
+    }
+    return 0;
+}
+
+/**
+ * End a client's turn before it ran out of work; it continues from the
+ * back of the ready list
+ */
+static void yield_client_turn(server_t *server, client_info_t *client) {
+    METRIC_ADD(server->metrics.budget_yields, 1);
+    schedule_client_turn(server, client);
+}
+
+/**
+ * Give a client one turn: frames left over from its last turn first, then
+ * reads until the socket has no more data buffered. Reads may hold several
+ * pipelined messages or only part of one; framing is done by
+ * process_client_input(). A turn ends early once the read or frame budget
+ * is spent, and the client goes to the back of the ready list, so one
+ * client streaming data can't hold up the others. A client over its rate
+ * limit isn't read until its tokens are back.
+ */
+void handle_client_message(server_t *server, client_info_t *client) {
+    int bytes_received, result;
+    int client_fd = client->socket_fd;
+    size_t budget = server->config->read_budget;
+    size_t read_size, before;
+    disconnect_reason_t reason;
+    
+    server->turn_frames = 0;
+    
+    // A rate-limited client reads no more than its tokens allow
+    if (server->config->rate_limit > 0) {
+        refill_client_tokens(server, client);
+        if (client->tokens > 0 && (uint64_t)client->tokens < budget) {
+            budget = (size_t)client->tokens;
+        }
+    }
+    
+    // Frames already buffered go before anything new is read
+    if (client->input_backlog) {
+        client->input_backlog = 0;
+        if (process_client_frames(server, client) == -1) {
+            return;
+        }
+        if (client->input_backlog) {
+            yield_client_turn(server, client);
+            return;
+        }
+    }
+    
+    // A connection with a frame on the offload pool reads nothing more
+    // until its reply is out; the socket buffer holds what it sends meanwhile
+    while (client->active && !client->read_paused && !client->throttled && client->offload == NULL) {
+        if (budget == 0) {
+            yield_client_turn(server, client);
+            return;
+        }
+        
+        // Bulk echo payloads bypass user space once nothing is queued ahead of them
+        if (client_can_splice(server, client)) {
+            before = budget;
+            result = splice_client_stream(server, client, &budget, &reason);
+            if (result == -2) {
+                remove_client(server, client, reason);
+                return;
+            }
+            if (charge_client_tokens(server, client, before - budget) == -1) {
+                remove_client(server, client, DISCONNECT_INTERNAL_ERROR);
+                return;
+            }
+            if (result == 1) {
+                return;
+            }
+            if (result == 0 || result == 2) {
+                continue;
+            }
+            // No pipe available: copy this part of the payload instead
+        }
+        
+        // Read straight into the client's input buffer, after any partial
+        // frame, but no more than the budget allows (one byte of the space
+        // is kept for a terminating NUL)
+        if (stream_buffer_reserve(&client->input, READ_CHUNK_SIZE) == -1) {
+            remove_client(server, client, DISCONNECT_INTERNAL_ERROR);
+            return;
+        }
+        read_size = stream_buffer_space(&client->input);
+        if (read_size > budget + 1) {
+            read_size = budget + 1;
+        }
+        bytes_received = read_client_message(&server->loop, client_fd, stream_buffer_tail(&client->input),
+                                             read_size);
+        
+        if (bytes_received == -2) {
+            // Socket drained, wait for the next readiness event
+            return;
+        }
+        
+        if (bytes_received <= 0) {
+            // Client disconnected or error occurred
+            remove_client(server, client, bytes_received == 0 ? DISCONNECT_PEER_CLOSED
+                                                              : DISCONNECT_READ_ERROR);
+            return;
+        }
+        METRIC_ADD(server->metrics.bytes_in, (uint64_t)bytes_received);
+        client->last_active = server->now_tick;
+        budget -= (size_t)bytes_received;
+        if (charge_client_tokens(server, client, (size_t)bytes_received) == -1) {
+            remove_client(server, client, DISCONNECT_INTERNAL_ERROR);
+            return;
+        }
+        
+        // Process every complete message received so far, up to the frame budget
+        client->input.end += (size_t)bytes_received;
+        if (process_client_frames(server, client) == -1) {
+            return;
+        }
+        if (client->input_backlog) {
+            yield_client_turn(server, client);
+            return;
+        }
+    }
 }
 
 /**
- * Handle message from existing client
+ * Give every client on the ready list one more turn, in the order they
+ * were queued. Clients queued again during the pass wait for the next one.
  */
-void handle_client_message(server_t *server, int client_fd) {
-    char buffer[BUFFER_SIZE];
-    int bytes_received, client_index;
+void run_ready_clients(server_t *server) {
+    client_info_t *last = server->ready_tail;
+    client_info_t *client;
+    int final = last == NULL;
+    
+    while (!final && server->ready_head != NULL) {
+        client = server->ready_head;
+        final = client == last;
+        cancel_client_turn(server, client);
+        handle_client_message(server, client);
+    }
+}
+
+/**
+ * Account for output that left a client's queue: metrics, activity, and
+ * reads resumed once the backlog is below the low-water mark
+ */
+static void client_output_sent(server_t *server, client_info_t *client, size_t flushed,
+                               int short_write) {
+    int resumed = 0;
+    
+    METRIC_ADD(server->metrics.bytes_out, (uint64_t)flushed);
+    if (short_write) {
+        METRIC_ADD(server->metrics.partial_writes, 1);
+    }
     
-    // Read message from client
-    bytes_received = read_client_message(client_fd, buffer, sizeof(buffer));
+    // Output moving counts as activity; the write-stall clock restarts
+    if (flushed > 0) {
+        client->last_active = server->now_tick;
+        client->write_progress = client->output.bytes > 0 ? server->now_tick : 0;
+    }
     
-    if (bytes_received <= 0) {
-        // Client disconnected or error occurred
-        client_index = find_client_index(server, client_fd);
-        if (client_index != -1) {
-            remove_client(server, client_index);
+    // Resume reading once the backlog falls below the low-water mark. Time
+    // spent paused doesn't count against a partial frame.
+    if (client->read_paused && client->output.bytes < OUTPUT_LOW_WATER) {
+        client->read_paused = 0;
+        resumed = 1;
+        if (client->frame_started != 0) {
+            client->frame_started = server->now_tick;
+            schedule_client_timeout(server, client);
         }
+    }
+    
+    if (update_client_interest(server, client) == -1) {
+        remove_client(server, client, DISCONNECT_INTERNAL_ERROR);
         return;
     }
     
-    // Process the received message
-    process_client_message(server, client_fd, buffer, bytes_received);
+    // Requests may have arrived while paused, and a spliced payload waits
+    // for the socket to take the rest of its pipe; with edge-triggered
+    // readiness there will be no new event for either. A client on the
+    // ready list gets its turn there.
+    if ((resumed || client->pipe_bytes > 0) && !client->ready) {
+        handle_client_message(server, client);
+    }
 }
 
 /**
- * Find client index by socket file descriptor
+ * Flush queued output to a client whose socket became writable
  */
-int find_client_index(server_t *server, int socket_fd) {
-    int i;
+void handle_client_writable(server_t *server, client_info_t *client) {
+    ssize_t flushed;
     
-    for (i = 0; i < MAX_CLIENTS; i++) {
-        if (server->clients[i].active && server->clients[i].socket_fd == socket_fd) {
-            return i;
+    // The event loop makes the send; handle_client_sent() sees it through
+    if (EVENT_LOOP_COMPLETIONS) {
+        if (start_client_send(server, client) == -1) {
+            remove_client(server, client, DISCONNECT_INTERNAL_ERROR);
         }
+        return;
     }
     
-    return -1;
+    flushed = output_queue_flush(&client->output, client->socket_fd);
+    if (flushed == -1) {
+        if (errno != EPIPE && errno != ECONNRESET) {
+            print_error("Failed to send data to client");
+        }
+        remove_client(server, client, DISCONNECT_WRITE_ERROR);
+        return;
+    }
+    client_output_sent(server, client, (size_t)flushed, client->output.bytes > 0);
 }
 
 /**
- * Remove client from server and clean up resources
+ * See through a send the event loop made from a client's output queue:
+ * drop the bytes it took, then hand it the rest
+ */
+void handle_client_sent(server_t *server, client_info_t *client, long result) {
+    size_t requested = client->sending;
+    size_t sent = result > 0 ? (size_t)result : 0;
+    
+    client->sending = 0;
+    if (result < 0 && result != -EAGAIN) {
+        if (result != -EPIPE && result != -ECONNRESET) {
+            errno = (int)-result;
+            print_error("Failed to send data to client");
+        }
+        remove_client(server, client, DISCONNECT_WRITE_ERROR);
+        return;
+    }
+    output_queue_consume(&client->output, sent);
+    
+    // A short send means the socket is full; the rest goes once it is
+    // writable again, and it has to keep draining meanwhile
+    if (sent < requested) {
+        if (client->write_progress == 0) {
+            client->write_progress = server->now_tick;
+        }
+        schedule_client_timeout(server, client);
+    } else if (start_client_send(server, client) == -1) {
+        remove_client(server, client, DISCONNECT_INTERNAL_ERROR);
+        return;
+    }
+    client_output_sent(server, client, sent, sent < requested);
+}
+
+/**
+ * Timer wheel callback for a connection's timer. Deadlines move with
+ * activity without touching the wheel, so a timer that fires early is
+ * simply re-armed for the current deadline.
  */
-void remove_client(server_t *server, int client_index) {
+void handle_client_timeout(timer_entry_t *timer, void *arg) {
+    server_t *server = arg;
+    client_info_t *client = (client_info_t *)((char *)timer - offsetof(client_info_t, timer));
+    disconnect_reason_t reason;
+    uint64_t deadline;
     char addr_str[64];
     char info_msg[256];
-    int client_fd;
     
-    if (client_index < 0 || client_index >= MAX_CLIENTS || 
-        !server->clients[client_index].active) {
+    // A throttled client's tokens are back. Data it sent meanwhile raises no
+    // new edge-triggered event, so it gets a turn on the ready list. Time
+    // spent throttled doesn't count against a partial frame.
+    if (client->throttled && client->throttle_until <= server->now_tick) {
+        client->throttled = 0;
+        if (client->frame_started != 0) {
+            client->frame_started = server->now_tick;
+        }
+        if (update_client_interest(server, client) == -1) {
+            remove_client(server, client, DISCONNECT_INTERNAL_ERROR);
+            return;
+        }
+        schedule_client_turn(server, client);
+    }
+    
+    deadline = client_timeout_deadline(server, client, &reason);
+    if (deadline == 0) {
+        return;
+    }
+    if (deadline > server->now_tick) {
+        timer_wheel_schedule(&server->timers, timer, deadline);
         return;
     }
     
-    client_fd = server->clients[client_index].socket_fd;
+    describe_client(client, addr_str, sizeof(addr_str));
+    if (client->evicting) {
+        snprintf(info_msg, sizeof(info_msg), "Client %s evicted (%s)", addr_str,
+                 reason == DISCONNECT_SLOW_CONSUMER ? "broadcast backlog" : "send failed");
+    } else {
+        snprintf(info_msg, sizeof(info_msg), "Client %s timed out (%s)", addr_str,
+                 reason == DISCONNECT_IDLE_TIMEOUT ? "idle" :
+                 reason == DISCONNECT_READ_TIMEOUT ? "incomplete message" : "output stalled");
+    }
+    print_connection_info(info_msg);
+    remove_client(server, client, reason);
+}
+
+/**
+ * Find client by socket file descriptor
+ */
+client_info_t *find_client(server_t *server, int socket_fd) {
+    return conn_table_lookup(&server->clients, socket_fd);
+}
+
+/**
+ * Remove client from server and clean up resources
+ */
+void remove_client(server_t *server, client_info_t *client, disconnect_reason_t reason) {
+    char addr_str[64];
+    char info_msg[256];
+    
+    if (!client->active) {
+        return;
+    }
     
     // Log client disconnection
-    addr_to_string(&server->clients[client_index].address, addr_str, sizeof(addr_str));
+    describe_client(client, addr_str, sizeof(addr_str));
     snprintf(info_msg, sizeof(info_msg), "Client %s disconnected (clients: %d/%d)", 
-             addr_str, get_active_client_count(server) - 1, MAX_CLIENTS);
+             addr_str, get_active_client_count(server) - 1, server->clients.max_clients);
     print_connection_info(info_msg);
     
-    // Remove from file descriptor set
-    FD_CLR(client_fd, &server->master_set);
+    METRIC_ADD(server->metrics.disconnects[reason], 1);
+    METRIC_ADD(server->metrics.connections, (uint64_t)-1);
+    
+    // Stop watching the socket
+    event_loop_remove(&server->loop, client->socket_fd);
     
     // Clean up client resources
-    cleanup_client(server, client_index);
-    
-    // Update max_fd if necessary
-    if (client_fd == server->max_fd) {
-        int i;
-        server->max_fd = server->server_socket;
-        for (i = 0; i < MAX_CLIENTS; i++) {
-            if (server->clients[i].active && server->clients[i].socket_fd > server->max_fd) {
-                server->max_fd = server->clients[i].socket_fd;
+    cleanup_client(server, client);
+}
+
+/**
+ * Answer every pending connection on the admin port with a metrics
+ * snapshot, then close it
+ */
+void handle_admin_connection(server_t *server) {
+    char report[ADMIN_RESPONSE_SIZE];
+    size_t length;
+    int admin_fd;
+    
+    for (;;) {
+        admin_fd = accept(server->admin_socket, NULL, NULL);
+        if (admin_fd == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                print_error("Failed to accept admin connection");
             }
+            return;
+        }
+        
+        // The report is small enough for an empty socket buffer
+        length = metrics_format(report, sizeof(report));
+        if (send(admin_fd, report, length, MSG_NOSIGNAL) == -1) {
+            print_error("Failed to send metrics");
         }
+        close(admin_fd);
     }
 }
 
@@ -233,22 +1019,49 @@ void remove_client(server_t *server, int client_index) {
  * Shutdown server and clean up all resources
  */
 void shutdown_server(server_t *server) {
+    char pool_msg[384];
+    char info_msg[512];
+    
+    // Report pool usage while the pools still exist
+    buffer_pool_describe(&server->buffers, pool_msg, sizeof(pool_msg));
+    snprintf(info_msg, sizeof(info_msg), "Worker %d memory: connections %zu MB, buffers %s",
+             server->worker_id,
+             (server->clients.hot.stats.bytes_mapped + server->clients.cold.stats.bytes_mapped) >> 20,
+             pool_msg);
+    print_server_info(info_msg);
+    
     cleanup_server_resources(server);
-    print_server_info("Server shutdown complete");
+    snprintf(info_msg, sizeof(info_msg), "Worker %d shutdown complete", server->worker_id);
+    print_server_info(info_msg);
 }
 
 /**
  * Clean up all server resources
  */
 void cleanup_server_resources(server_t *server) {
-    int i;
+    int fd;
     
     // Close all client connections
-    for (i = 0; i < MAX_CLIENTS; i++) {
-        if (server->clients[i].active) {
-            cleanup_client(server, i);
+    for (fd = 0; fd < server->clients.capacity && server->clients.count > 0; fd++) {
+        client_info_t *client = conn_table_lookup(&server->clients, fd);
+        if (client != NULL) {
+            cleanup_client(server, client);
         }
     }
+    conn_table_destroy(&server->clients);
+    room_table_destroy(&server->rooms);
+    
+    // Exiting: nothing will reuse the orphans' memory
+    release_zerocopy_orphans(server, 1);
+    slab_destroy(&server->zerocopy_records);
+    buffer_pool_destroy(&server->buffers);
+    
+    // Close cached splice pipes
+    while (server->pipe_cache_count > 0) {
+        server->pipe_cache_count--;
+        close(server->pipe_cache[server->pipe_cache_count][0]);
+        close(server->pipe_cache[server->pipe_cache_count][1]);
+    }
     
     // Close server socket
     if (server->server_socket != -1) {
@@ -256,36 +1069,472 @@ void cleanup_server_resources(server_t *server) {
         server->server_socket = -1;
     }
     
-    // Clear file descriptor sets
-    FD_ZERO(&server->master_set);
-    FD_ZERO(&server->read_set);
+    // Close this worker's duplicate of the Unix listener
+    if (server->unix_socket != -1) {
+        close(server->unix_socket);
+        server->unix_socket = -1;
+    }
+    
+    // Release the reserve descriptor
+    if (server->reserve_fd != -1) {
+        close(server->reserve_fd);
+        server->reserve_fd = -1;
+    }
+    
+    // Close admin listener
+    if (server->admin_socket != -1) {
+        close(server->admin_socket);
+        server->admin_socket = -1;
+    }
+    
+    // Close wakeup descriptors
+    if (server->wakeup_fd != -1) {
+        close(server->wakeup_fd);
+        server->wakeup_fd = -1;
+    }
+    if (server->offload_fd != -1) {
+        close(server->offload_fd);
+        server->offload_fd = -1;
+    }
+    
+    // Release the event loop
+    event_loop_destroy(&server->loop);
+    metrics_unregister(&server->metrics);
+}
+
+/**
+ * Print usage information
+ */
+static void print_usage(const char *program_name) {
+    const request_handler_t *handler;
+    int i;
+    
+    fprintf(stderr, "Usage: %s [options] [port]\n", program_name);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -e HANDLER   Request handler serving every connection (default: %s)\n",
+            handler_at(0)->name);
+    fprintf(stderr, "  -w WORKERS   Number of event loop threads (default: %d)\n", DEFAULT_WORKERS);
+    fprintf(stderr, "  -c           Pin each worker thread to its own CPU\n");
+    fprintf(stderr, "  -m CLIENTS   Maximum connections per worker (default: %d)\n", DEFAULT_MAX_CLIENTS);
+    fprintf(stderr, "  -l LEVEL     Log level: debug, info, error or none (default: debug)\n");
+    fprintf(stderr, "  -s N         Log traffic for 1 in N messages (default: 1)\n");
+    fprintf(stderr, "  -H           Back connection and buffer pools with huge pages\n");
+    fprintf(stderr, "  -a PORT      Serve metrics as text on 127.0.0.1:PORT\n");
+    fprintf(stderr, "  -j THREADS   Offload pool threads for CPU-heavy handlers (default: 0, inline)\n");
+    fprintf(stderr, "  -M BYTES     Memory limit of the key-value store (default: %d)\n", KV_DEFAULT_MEMORY);
+    fprintf(stderr, "  -u PATH      Also accept local clients on a Unix socket ('@NAME' for abstract)\n");
+    fprintf(stderr, "  -b BACKLOG   Listen backlog per worker (default: %d)\n", DEFAULT_BACKLOG);
+    fprintf(stderr, "  -D SECONDS   Defer accepting until the client sends data (TCP_DEFER_ACCEPT)\n");
+    fprintf(stderr, "  -n           Copy bulk echo payloads instead of using splice()\n");
+    fprintf(stderr, "  -z BYTES     Send replies of at least BYTES with MSG_ZEROCOPY (default: off)\n");
+    fprintf(stderr, "  -r           Broadcast text lines to the sender's room instead of echoing\n");
+    fprintf(stderr, "  -q BYTES     Queued bytes beyond which a subscriber is backlogged (default: %d)\n",
+            DEFAULT_BROADCAST_LIMIT);
+    fprintf(stderr, "  -P POLICY    Backlogged subscribers: drop messages or disconnect (default: drop)\n");
+    fprintf(stderr, "  -t BYTES     Bytes read from one client per turn (default: %d)\n",
+            DEFAULT_READ_BUDGET);
+    fprintf(stderr, "  -f FRAMES    Messages processed for one client per turn (default: %d)\n",
+            DEFAULT_FRAME_BUDGET);
+    fprintf(stderr, "  -L BYTES     Limit each client to BYTES per second (default: off)\n");
+    fprintf(stderr, "  -k BYTES     Burst allowed under the rate limit (default: one second's worth)\n");
+    fprintf(stderr, "  -U           Hand live connections to the new process on upgrade (SIGUSR2)\n");
+    fprintf(stderr, "  -G SECONDS   Time to drain connections after an upgrade otherwise (default: %d)\n",
+            DEFAULT_DRAIN_TIMEOUT);
+    fprintf(stderr, "  -I SECONDS   Close connections idle this long, 0 to disable (default: %d)\n",
+            DEFAULT_IDLE_TIMEOUT);
+    fprintf(stderr, "  -R SECONDS   Time allowed to finish a started message, 0 to disable (default: %d)\n",
+            DEFAULT_READ_TIMEOUT);
+    fprintf(stderr, "  -W SECONDS   Time queued output may stall, 0 to disable (default: %d)\n",
+            DEFAULT_WRITE_TIMEOUT);
+    fprintf(stderr, "  -?           Show this help message\n");
+    fprintf(stderr, "Port must be between 1 and 65535 (default: %d)\n", DEFAULT_PORT);
+    fprintf(stderr, "Handlers:\n");
+    for (i = 0; (handler = handler_at(i)) != NULL; i++) {
+        fprintf(stderr, "  %-12s %s\n", handler->name, handler->description);
+    }
+}
+
+/**
+ * Parse command line arguments into a server configuration
+ * @return 0 on success, -1 if the program should exit
+ */
+static int parse_arguments(int argc, char *argv[], server_config_t *config) {
+    int opt;
+    
+    config->port = DEFAULT_PORT;
+    config->workers = DEFAULT_WORKERS;
+    config->pin_cpus = 0;
+    config->max_clients = DEFAULT_MAX_CLIENTS;
+    config->huge_pages = 0;
+    config->admin_port = 0;
+    config->backlog = DEFAULT_BACKLOG;
+    config->defer_accept = 0;
+    config->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+    config->read_timeout = DEFAULT_READ_TIMEOUT;
+    config->write_timeout = DEFAULT_WRITE_TIMEOUT;
+    config->splice = 1;
+    config->zerocopy_threshold = 0;
+    config->broadcast = 0;
+    config->broadcast_limit = DEFAULT_BROADCAST_LIMIT;
+    config->slow_policy = SUBSCRIBER_DROP;
+    config->handler = handler_at(0);
+    config->read_budget = DEFAULT_READ_BUDGET;
+    config->frame_budget = DEFAULT_FRAME_BUDGET;
+    config->rate_limit = 0;
+    config->rate_burst = 0;
+    config->handoff = 0;
+    config->drain_timeout = DEFAULT_DRAIN_TIMEOUT;
+    config->offload_threads = 0;
+    config->kv_memory = KV_DEFAULT_MEMORY;
+    config->listen_fds = NULL;
+    config->listen_fd_count = 0;
+    config->admin_fd = -1;
+    config->unix_path = NULL;
+    config->unix_fd = -1;
+    
+    while ((opt = getopt(argc, argv, "e:w:cm:l:s:Ha:j:M:u:b:D:nz:rq:P:t:f:L:k:UG:I:R:W:?")) != -1) {
+        switch (opt) {
+            case 'e':
+                config->handler = handler_find(optarg);
+                if (config->handler == NULL) {
+                    fprintf(stderr, "Unknown request handler: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'w':
+                config->workers = atoi(optarg);
+                if (config->workers <= 0 || config->workers > MAX_WORKERS) {
+                    fprintf(stderr, "Workers must be between 1 and %d\n", MAX_WORKERS);
+                    return -1;
+                }
+                break;
+            case 'c':
+                config->pin_cpus = 1;
+                break;
+            case 'm':
+                config->max_clients = atoi(optarg);
+                if (config->max_clients <= 0) {
+                    fprintf(stderr, "Maximum clients must be positive\n");
+                    return -1;
+                }
+                break;
+            case 'l':
+                log_level = parse_log_level(optarg);
+                if (log_level == -1) {
+                    fprintf(stderr, "Unknown log level: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 's':
+                if (atoi(optarg) <= 0) {
+                    fprintf(stderr, "Sample rate must be positive\n");
+                    return -1;
+                }
+                log_sample_rate = (unsigned)atoi(optarg);
+                break;
+            case 'H':
+                config->huge_pages = 1;
+                break;
+            case 'a':
+                config->admin_port = atoi(optarg);
+                if (config->admin_port <= 0 || config->admin_port > 65535) {
+                    fprintf(stderr, "Admin port must be between 1 and 65535\n");
+                    return -1;
+                }
+                break;
+            case 'j':
+                config->offload_threads = atoi(optarg);
+                if (config->offload_threads < 0 || config->offload_threads > OFFLOAD_MAX_THREADS) {
+                    fprintf(stderr, "Offload threads must be between 0 and %d\n", OFFLOAD_MAX_THREADS);
+                    return -1;
+                }
+                break;
+            case 'M':
+                if (atoll(optarg) <= 0) {
+                    fprintf(stderr, "Key-value memory limit must be positive\n");
+                    return -1;
+                }
+                config->kv_memory = (size_t)atoll(optarg);
+                break;
+            case 'u':
+                config->unix_path = optarg;
+                break;
+            case 'b':
+                config->backlog = atoi(optarg);
+                if (config->backlog <= 0) {
+                    fprintf(stderr, "Backlog must be positive\n");
+                    return -1;
+                }
+                break;
+            case 'D':
+                config->defer_accept = atoi(optarg);
+                if (config->defer_accept <= 0) {
+                    fprintf(stderr, "Defer accept timeout must be positive\n");
+                    return -1;
+                }
+                break;
+            case 'n':
+                config->splice = 0;
+                break;
+            case 'z':
+                if (atoi(optarg) <= 0) {
+                    fprintf(stderr, "Zero-copy threshold must be positive\n");
+                    return -1;
+                }
+                config->zerocopy_threshold = (size_t)atoi(optarg);
+                break;
+            case 'r':
+                config->broadcast = 1;
+                break;
+            case 'q':
+                if (atoi(optarg) <= 0) {
+                    fprintf(stderr, "Broadcast limit must be positive\n");
+                    return -1;
+                }
+                config->broadcast_limit = (size_t)atoi(optarg);
+                break;
+            case 'P':
+                if (strcmp(optarg, "drop") == 0) {
+                    config->slow_policy = SUBSCRIBER_DROP;
+                } else if (strcmp(optarg, "disconnect") == 0) {
+                    config->slow_policy = SUBSCRIBER_DISCONNECT;
+                } else {
+                    fprintf(stderr, "Unknown subscriber policy: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 't':
+                if (atoi(optarg) <= 0) {
+                    fprintf(stderr, "Read budget must be positive\n");
+                    return -1;
+                }
+                config->read_budget = (size_t)atoi(optarg);
+                break;
+            case 'f':
+                config->frame_budget = atoi(optarg);
+                if (config->frame_budget <= 0) {
+                    fprintf(stderr, "Frame budget must be positive\n");
+                    return -1;
+                }
+                break;
+            case 'L':
+            case 'k':
+                if (atoi(optarg) <= 0) {
+                    fprintf(stderr, "Rate limit and burst must be positive\n");
+                    return -1;
+                }
+                if (opt == 'L') {
+                    config->rate_limit = (size_t)atoi(optarg);
+                } else {
+                    config->rate_burst = (size_t)atoi(optarg);
+                }
+                break;
+            case 'U':
+                config->handoff = 1;
+                break;
+            case 'G':
+                config->drain_timeout = atoi(optarg);
+                if (config->drain_timeout < 0) {
+                    fprintf(stderr, "Drain timeout must not be negative\n");
+                    return -1;
+                }
+                break;
+            case 'I':
+            case 'R':
+            case 'W':
+                if (atoi(optarg) < 0) {
+                    fprintf(stderr, "Timeouts must not be negative\n");
+                    return -1;
+                }
+                if (opt == 'I') {
+                    config->idle_timeout = atoi(optarg);
+                } else if (opt == 'R') {
+                    config->read_timeout = atoi(optarg);
+                } else {
+                    config->write_timeout = atoi(optarg);
+                }
+                break;
+            case '?':
+            default:
+                print_usage(argv[0]);
+                return -1;
+        }
+    }
+    
+    // Without an explicit burst, a client may send one second's worth at once
+    if (config->rate_limit > 0 && config->rate_burst == 0) {
+        config->rate_burst = config->rate_limit;
+    }
+    
+    if (optind < argc) {
+        config->port = atoi(argv[optind]);
+        if (config->port <= 0 || config->port > 65535) {
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+/**
+ * Open the Unix listener the workers share, unless an upgrade passed one on
+ * @return 0 on success, -1 on error
+ */
+static int open_unix_listener(server_config_t *config) {
+    if (config->unix_path == NULL || config->unix_fd != -1) {
+        return 0;
+    }
+    
+    config->unix_fd = create_unix_socket(config->unix_path, config->backlog);
+    if (config->unix_fd == -1 || set_socket_nonblocking(config->unix_fd) == -1) {
+        fprintf(stderr, "Failed to listen on Unix socket %s\n", config->unix_path);
+        return -1;
+    }
+    return 0;
 }
 
 /**
  * Main function
  */
 int main(int argc, char *argv[]) {
-    server_t server;
-    int port = DEFAULT_PORT;
+    server_config_t config;
+    worker_t *workers;
+    sigset_t signals;
+    int sig, upgrade_fd;
+    char info_msg[256];
     
     // Parse command line arguments
-    if (argc > 1) {
-        port = atoi(argv[1]);
-        if (port <= 0 || port > 65535) {
-            fprintf(stderr, "Usage: %s [port]\n", argv[0]);
-            fprintf(stderr, "Port must be between 1 and 65535\n");
-            return EXIT_FAILURE;
+    if (parse_arguments(argc, argv, &config) == -1) {
+        return EXIT_FAILURE;
+    }
+    
+    // An event loop that makes the sends itself leaves no readiness for
+    // splice() or the zero-copy error queue to follow
+    if (EVENT_LOOP_COMPLETIONS) {
+        if (config.splice) {
+            fprintf(stderr, "Bulk echo payloads are copied rather than spliced with the %s backend\n",
+                    event_loop_backend_name());
+            config.splice = 0;
         }
+        if (config.zerocopy_threshold > 0) {
+            fprintf(stderr, "Zero-copy sends are not available with the %s backend\n",
+                    event_loop_backend_name());
+            config.zerocopy_threshold = 0;
+        }
+    }
+    
+    // Started by a running server handing over to this one
+    upgrade_fd = upgrade_inherited_socket();
+    
+    // splice() into a socket has no MSG_NOSIGNAL; a peer gone mid-payload
+    // must fail the write, not kill the process
+    signal(SIGPIPE, SIG_IGN);
+    
+    // Block shutdown and upgrade signals before any thread starts so that
+    // they are only ever delivered to sigwait() below
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    
+    // Move log formatting and output off the event loop threads
+    if (logger_start() == -1) {
+        fprintf(stderr, "Failed to start logger thread, logging synchronously\n");
     }
     
-    // Initialize server
-    if (initialize_server(&server, port) == -1) {
+    workers = calloc((size_t)config.workers, sizeof(worker_t));
+    if (workers == NULL) {
+        print_error("Failed to allocate workers");
+        logger_stop();
+        return EXIT_FAILURE;
+    }
+    
+    // Initialize one server per worker, on the previous process's
+    // listeners when upgrading, and take over its connections before the
+    // workers start
+    if ((upgrade_fd != -1 && upgrade_receive_listeners(upgrade_fd, &config) == -1) ||
+        open_unix_listener(&config) == -1 ||
+        init_workers(workers, &config) == -1) {
+        logger_stop();
         fprintf(stderr, "Failed to initialize server\n");
+        free(workers);
+        return EXIT_FAILURE;
+    }
+    
+    // Every worker holds its own duplicate of the Unix listener
+    if (config.unix_fd != -1) {
+        close(config.unix_fd);
+        config.unix_fd = -1;
+    }
+    if (upgrade_fd != -1) {
+        upgrade_adopt_clients(upgrade_fd, workers, &config);
+    }
+    
+    if (kv_start(config.kv_memory) == -1) {
+        logger_stop();
+        fprintf(stderr, "Failed to initialize key-value store\n");
+        free(workers);
+        return EXIT_FAILURE;
+    }
+    
+    // CPU-heavy handler work runs beside the event loops
+    if (offload_start(config.offload_threads, config.workers) == -1) {
+        fprintf(stderr, "Failed to start offload pool, running offloaded work inline\n");
+    }
+    if (start_workers(workers, config.workers) == -1) {
+        offload_stop();
+        kv_stop();
+        logger_stop();
+        fprintf(stderr, "Failed to start workers\n");
+        free(workers);
         return EXIT_FAILURE;
     }
     
-    // Run server
-    run_server(&server);
+    snprintf(info_msg, sizeof(info_msg), "Server listening on port %d with %d worker(s)",
+             config.port, config.workers);
+    print_server_info(info_msg);
+    if (config.unix_path != NULL) {
+        snprintf(info_msg, sizeof(info_msg), "Server listening on Unix socket %s", config.unix_path);
+        print_server_info(info_msg);
+    }
+    print_server_info("Press Ctrl+C to stop the server");
+    
+    // Wait for a shutdown signal; an upgrade that fails leaves this
+    // process serving
+    for (;;) {
+        if (sigwait(&signals, &sig) != 0) {
+            continue;
+        }
+        if (sig != SIGUSR2) {
+            break;
+        }
+        
+        print_server_info("Received upgrade signal, starting new process...");
+        if (upgrade_server(argv, workers, &config, &signals) == 0) {
+            offload_stop();
+            kv_stop();
+            free(workers);
+            print_server_info("Upgrade complete, exiting");
+            logger_stop();
+            return EXIT_SUCCESS;
+        }
+    }
+    
+    print_server_info("Received shutdown signal, stopping server...");
+    print_server_info("Server shutting down...");
+    stop_workers(workers, config.workers);
+    offload_stop();
+    kv_stop();
+    free(workers);
+    
+    // An abstract name disappears with the socket; a socket file does not
+    if (config.unix_path != NULL && config.unix_path[0] != '@') {
+        unlink(config.unix_path);
+    }
+    print_server_info("Server shutdown complete");
+    logger_stop();
     
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -1,49 +1,68 @@
-#define _POSIX_C_SOURCE 200112L
+#define _GNU_SOURCE
 #include "../include/socket_utils.h"
+#include "../include/logger.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
+#include <stddef.h>
 #include <errno.h>
 #include <time.h>
 
 // Global variable to track color support
 static int colors_enabled = -1;  // -1 = not initialized, 0 = disabled, 1 = enabled
 
+// Pending connection queue for loopback-only listeners (admin port)
+#define LOOPBACK_BACKLOG 16
+
+// Runtime log filtering
+int log_level = LOG_LEVEL_DEBUG;
+unsigned log_sample_rate = 1;
+__thread unsigned log_sample_counter = 0;
+
 /**
- * Create and configure a TCP server socket
+ * Create, bind and listen on a stream socket of the address's family
  */
-int create_server_socket(int port) {
+static int create_listening_socket(const struct sockaddr *addr, socklen_t addr_length,
+                                   int reuse_port, int backlog) {
     int server_fd;
-    struct sockaddr_in server_addr;
     
-    // Create socket
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    // Create socket; an upgraded process gets it over the upgrade socket,
+    // never by inheriting it
+    server_fd = socket(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (server_fd == -1) {
         print_error("Failed to create socket");
         return -1;
     }
     
-    // Set socket to be reusable
-    if (set_socket_reusable(server_fd) == -1) {
+    // Set socket to be reusable; Unix sockets have no TIME_WAIT to skip
+    if (addr->sa_family != AF_UNIX && set_socket_reusable(server_fd) == -1) {
         close(server_fd);
         return -1;
     }
     
-    // Setup server address
-    setup_server_address(&server_addr, port);
+    // Let every worker bind its own listener to the same port
+    if (reuse_port && set_socket_reuseport(server_fd) == -1) {
+        close(server_fd);
+        return -1;
+    }
     
     // Bind socket to address
-    if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
+    if (bind(server_fd, addr, addr_length) == -1) {
         print_error("Failed to bind socket");
         close(server_fd);
         return -1;
     }
     
     // Start listening for connections
-    if (listen(server_fd, 10) == -1) {
+    if (listen(server_fd, backlog) == -1) {
         print_error("Failed to listen on socket");
         close(server_fd);
         return -1;
@@ -52,6 +71,86 @@ int create_server_socket(int port) {
     return server_fd;
 }
 
+/**
+ * Create and configure a TCP server socket
+ */
+int create_server_socket(int port, int reuse_port, int backlog) {
+    struct sockaddr_in server_addr;
+    
+    // Setup server address
+    setup_server_address(&server_addr, port);
+    return create_listening_socket((const struct sockaddr *)&server_addr, sizeof(server_addr),
+                                   reuse_port, backlog);
+}
+
+/**
+ * Create a TCP listening socket bound to the loopback interface
+ */
+int create_loopback_socket(int port) {
+    struct sockaddr_in addr;
+    
+    setup_server_address(&addr, port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return create_listening_socket((const struct sockaddr *)&addr, sizeof(addr), 0, LOOPBACK_BACKLOG);
+}
+
+/**
+ * Check whether a Unix socket file was left behind by a process that is
+ * gone: it exists, but nothing accepts connections on it
+ */
+static int unix_socket_is_stale(const struct sockaddr_un *addr, socklen_t addr_length) {
+    struct stat st;
+    int probe_fd, stale;
+    
+    if (stat(addr->sun_path, &st) == -1 || !S_ISSOCK(st.st_mode)) {
+        return 0;
+    }
+    
+    // Non-blocking, so a live listener with a full queue is not waited on
+    probe_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (probe_fd == -1) {
+        return 0;
+    }
+    stale = connect(probe_fd, (const struct sockaddr *)addr, addr_length) == -1 && errno == ECONNREFUSED;
+    close(probe_fd);
+    return stale;
+}
+
+/**
+ * Create a listening Unix domain stream socket
+ */
+int create_unix_socket(const char *path, int backlog) {
+    struct sockaddr_un addr;
+    socklen_t addr_length;
+    
+    if (setup_unix_address(&addr, path, &addr_length) == -1) {
+        print_log(LOG_ERROR, "Unix socket path is empty or too long");
+        return -1;
+    }
+    
+    // Replace a socket file left by a crashed server, never a live one
+    if (addr.sun_path[0] != '\0' && unix_socket_is_stale(&addr, addr_length)) {
+        unlink(addr.sun_path);
+    }
+    return create_listening_socket((const struct sockaddr *)&addr, addr_length, 0, backlog);
+}
+
+/**
+ * Read the credentials of the process on the other end of a Unix socket
+ */
+int get_peer_credentials(int socket_fd, pid_t *pid, uid_t *uid, gid_t *gid) {
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+    
+    if (getsockopt(socket_fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == -1) {
+        return -1;
+    }
+    *pid = credentials.pid;
+    *uid = credentials.uid;
+    *gid = credentials.gid;
+    return 0;
+}
+
 /**
  * Set socket to be reusable (SO_REUSEADDR)
  */
@@ -64,6 +163,53 @@ int set_socket_reusable(int socket_fd) {
     return 0;
 }
 
+/**
+ * Allow several sockets to bind the same port (SO_REUSEPORT)
+ */
+int set_socket_reuseport(int socket_fd) {
+    int opt = 1;
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
+        print_error("Failed to set SO_REUSEPORT");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Defer accept readiness until the client sends data (TCP_DEFER_ACCEPT)
+ */
+int set_socket_defer_accept(int socket_fd, int seconds) {
+    if (setsockopt(socket_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds)) == -1) {
+        print_error("Failed to set TCP_DEFER_ACCEPT");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Allow MSG_ZEROCOPY sends (SO_ZEROCOPY)
+ */
+int set_socket_zerocopy(int socket_fd) {
+    int opt = 1;
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof(opt)) == -1) {
+        print_error("Failed to set SO_ZEROCOPY");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Put socket into non-blocking mode (O_NONBLOCK)
+ */
+int set_socket_nonblocking(int socket_fd) {
+    int flags = fcntl(socket_fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        print_error("Failed to set socket non-blocking");
+        return -1;
+    }
+    return 0;
+}
+
 /**
  * Configure server address structure
  */
@@ -74,6 +220,29 @@ void setup_server_address(struct sockaddr_in *addr, int port) {
     addr->sin_port = htons(port);
 }
 
+/**
+ * Configure a Unix domain socket address
+ */
+int setup_unix_address(struct sockaddr_un *addr, const char *path, socklen_t *addr_length) {
+    size_t path_length = strlen(path);
+    
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (path_length == 0 || path_length >= sizeof(addr->sun_path)) {
+        return -1;
+    }
+    memcpy(addr->sun_path, path, path_length);
+    
+    if (path[0] == '@') {
+        // Abstract names start with a NUL byte and are not NUL-terminated
+        addr->sun_path[0] = '\0';
+    } else {
+        path_length++;
+    }
+    *addr_length = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path_length);
+    return 0;
+}
+
 /**
  * Check if terminal supports colors
  */
@@ -126,32 +295,105 @@ static const char* get_log_prefix(log_type_t type) {
     }
 }
 
+/**
+ * Get severity level for log type
+ */
+static int get_log_level(log_type_t type) {
+    switch (type) {
+        case LOG_ERROR:      return LOG_LEVEL_ERROR;
+        case LOG_MESSAGE:    return LOG_LEVEL_DEBUG;
+        case LOG_SERVER:
+        case LOG_CONNECTION:
+        case LOG_INFO:
+        default:             return LOG_LEVEL_INFO;
+    }
+}
+
+/**
+ * Parse a log level name
+ */
+int parse_log_level(const char *name) {
+    if (strcmp(name, "debug") == 0) {
+        return LOG_LEVEL_DEBUG;
+    }
+    if (strcmp(name, "info") == 0) {
+        return LOG_LEVEL_INFO;
+    }
+    if (strcmp(name, "error") == 0) {
+        return LOG_LEVEL_ERROR;
+    }
+    if (strcmp(name, "none") == 0) {
+        return LOG_LEVEL_NONE;
+    }
+    return -1;
+}
+
+/**
+ * Format one log line exactly as it is printed
+ */
+int format_log_line(char *buffer, size_t buffer_size, log_type_t type, int to_stderr,
+                    time_t timestamp, const char *message) {
+    static __thread time_t cached_time = -1;
+    static __thread char time_str[26];
+    const char *color = get_log_color(type);
+    const char *reset = terminal_supports_colors() ? COLOR_RESET : "";
+    const char *time_color = terminal_supports_colors() ? COLOR_CYAN : "";
+    
+    if (to_stderr) {
+        return snprintf(buffer, buffer_size, "%s[ERROR]%s %s\n", color, reset, message);
+    }
+    
+    // Only re-render the timestamp when the second changes
+    if (timestamp != cached_time) {
+        ctime_r(&timestamp, time_str);
+        // Remove newline from time string
+        time_str[strlen(time_str) - 1] = '\0';
+        cached_time = timestamp;
+    }
+    
+    return snprintf(buffer, buffer_size, "%s[%s]%s %s[%s]%s %s\n",
+                    color, get_log_prefix(type), reset, time_color, time_str, reset, message);
+}
+
 /**
  * Print error message with system error description
  */
 void print_error(const char *message) {
-    const char *color = terminal_supports_colors() ? COLOR_BRIGHT_RED : "";
-    const char *reset = terminal_supports_colors() ? COLOR_RESET : "";
-    fprintf(stderr, "%s[ERROR]%s %s: %s\n", color, reset, message, strerror(errno));
+    char error_msg[512];
+    char line[640];
+    
+    if (LOG_LEVEL_ERROR < log_level) {
+        return;
+    }
+    
+    snprintf(error_msg, sizeof(error_msg), "%s: %s", message, strerror(errno));
+    if (logger_submit(LOG_ERROR, 1, error_msg) == 0) {
+        return;
+    }
+    
+    // Logger not running: print synchronously
+    format_log_line(line, sizeof(line), LOG_ERROR, 1, 0, error_msg);
+    fputs(line, stderr);
 }
 
 /**
  * Print colored log message with timestamp
  */
 void print_log(log_type_t type, const char *message) {
-    time_t now;
-    char time_str[26];
-    const char *color = get_log_color(type);
-    const char *prefix = get_log_prefix(type);
-    const char *reset = terminal_supports_colors() ? COLOR_RESET : "";
-    const char *time_color = terminal_supports_colors() ? COLOR_CYAN : "";
+    char line[1024];
+    int level = get_log_level(type);
     
-    time(&now);
-    ctime_r(&now, time_str);
-    // Remove newline from time string
-    time_str[strlen(time_str) - 1] = '\0';
+    if (level < LOG_COMPILE_LEVEL || level < log_level) {
+        return;
+    }
     
-    printf("%s[%s]%s %s[%s]%s %s\n", color, prefix, reset, time_color, time_str, reset, message);
+    if (logger_submit(type, 0, message) == 0) {
+        return;
+    }
+    
+    // Logger not running: print synchronously
+    format_log_line(line, sizeof(line), type, 0, logger_now(), message);
+    fputs(line, stdout);
     fflush(stdout);
 }
 
@@ -186,13 +428,47 @@ void print_message_info(const char *message) {
 /**
  * Convert socket address to readable string
  */
-void addr_to_string(struct sockaddr_in *addr, char *buffer, size_t buffer_size) {
-    char ip_str[INET_ADDRSTRLEN];
+void addr_to_string(const struct sockaddr *addr, socklen_t addr_length, char *buffer, size_t buffer_size) {
+    char ip_str[INET6_ADDRSTRLEN];
     
-    if (inet_ntop(AF_INET, &addr->sin_addr, ip_str, INET_ADDRSTRLEN) == NULL) {
-        snprintf(buffer, buffer_size, "unknown");
-        return;
+    switch (addr->sa_family) {
+        case AF_INET: {
+            const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+            
+            if (inet_ntop(AF_INET, &in->sin_addr, ip_str, sizeof(ip_str)) != NULL) {
+                snprintf(buffer, buffer_size, "%s:%d", ip_str, ntohs(in->sin_port));
+                return;
+            }
+            break;
+        }
+        case AF_INET6: {
+            const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+            
+            if (inet_ntop(AF_INET6, &in6->sin6_addr, ip_str, sizeof(ip_str)) != NULL) {
+                snprintf(buffer, buffer_size, "[%s]:%d", ip_str, ntohs(in6->sin6_port));
+                return;
+            }
+            break;
+        }
+        case AF_UNIX: {
+            const struct sockaddr_un *un = (const struct sockaddr_un *)addr;
+            size_t name_length = 0;
+            
+            if (addr_length > offsetof(struct sockaddr_un, sun_path)) {
+                name_length = addr_length - offsetof(struct sockaddr_un, sun_path);
+            }
+            if (name_length == 0) {
+                // Connecting sockets are normally unbound
+                snprintf(buffer, buffer_size, "unix");
+            } else if (un->sun_path[0] == '\0') {
+                snprintf(buffer, buffer_size, "unix:@%.*s", (int)(name_length - 1), un->sun_path + 1);
+            } else {
+                snprintf(buffer, buffer_size, "unix:%.*s", (int)name_length, un->sun_path);
+            }
+            return;
+        }
+        default:
+            break;
     }
-    
-    snprintf(buffer, buffer_size, "%s:%d", ip_str, ntohs(addr->sin_port));
+    snprintf(buffer, buffer_size, "unknown");
 }
\ No newline at end of file
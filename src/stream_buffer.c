@@ -0,0 +1,129 @@
+#include "../include/stream_buffer.h"
+#include "../include/socket_utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Smallest allocation made for a buffer
+#define STREAM_BUFFER_MIN_CAPACITY 4096
+
+/**
+ * Initialize an empty buffer
+ */
+void stream_buffer_init(stream_buffer_t *buffer, buffer_pool_t *pool) {
+    buffer->data = NULL;
+    buffer->start = 0;
+    buffer->end = 0;
+    buffer->capacity = 0;
+    buffer->pool = pool;
+}
+
+/**
+ * Return storage to the pool it came from
+ */
+static void release_storage(buffer_pool_t *pool, char *data, size_t capacity) {
+    if (pool != NULL) {
+        buffer_pool_free(pool, data, capacity);
+    } else {
+        free(data);
+    }
+}
+
+/**
+ * Make room for at least min_free bytes after the stored data
+ */
+int stream_buffer_reserve(stream_buffer_t *buffer, size_t min_free) {
+    size_t length = stream_buffer_length(buffer);
+    size_t capacity;
+    char *data;
+
+    if (stream_buffer_space(buffer) >= min_free) {
+        return 0;
+    }
+
+    // Reclaim the consumed prefix if that alone makes enough room
+    if (buffer->capacity - length >= min_free) {
+        memmove(buffer->data, buffer->data + buffer->start, length);
+        buffer->start = 0;
+        buffer->end = length;
+        return 0;
+    }
+
+    capacity = buffer->capacity ? buffer->capacity : STREAM_BUFFER_MIN_CAPACITY;
+    while (capacity - length < min_free) {
+        capacity *= 2;
+    }
+
+    // Move unconsumed bytes to the front while growing. Pool buffers come
+    // in size classes, so the pool may hand out more than was asked for.
+    if (buffer->pool != NULL) {
+        data = buffer_pool_alloc(buffer->pool, capacity, &capacity);
+    } else {
+        data = malloc(capacity);
+    }
+    if (data == NULL) {
+        print_error("Failed to grow stream buffer");
+        return -1;
+    }
+    if (length > 0) {
+        memcpy(data, buffer->data + buffer->start, length);
+    }
+    release_storage(buffer->pool, buffer->data, buffer->capacity);
+
+    buffer->data = data;
+    buffer->start = 0;
+    buffer->end = length;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+/**
+ * Append bytes to the buffer
+ */
+int stream_buffer_append(stream_buffer_t *buffer, const char *data, size_t length) {
+    if (stream_buffer_reserve(buffer, length) == -1) {
+        return -1;
+    }
+
+    memcpy(stream_buffer_tail(buffer), data, length);
+    buffer->end += length;
+    return 0;
+}
+
+/**
+ * Mark bytes at the front of the buffer as consumed
+ */
+void stream_buffer_consume(stream_buffer_t *buffer, size_t length) {
+    buffer->start += length;
+
+    // Rewind for free once everything has been consumed
+    if (buffer->start >= buffer->end) {
+        buffer->start = 0;
+        buffer->end = 0;
+    }
+}
+
+/**
+ * Hand the buffer's storage to the caller
+ */
+int stream_buffer_detach(stream_buffer_t *buffer, char **data, size_t *capacity) {
+    stream_buffer_t fresh;
+    size_t length = stream_buffer_length(buffer);
+
+    stream_buffer_init(&fresh, buffer->pool);
+    if (length > 0 && stream_buffer_append(&fresh, stream_buffer_begin(buffer), length) == -1) {
+        return -1;
+    }
+
+    *data = buffer->data;
+    *capacity = buffer->capacity;
+    *buffer = fresh;
+    return 0;
+}
+
+/**
+ * Release the buffer's memory
+ */
+void stream_buffer_free(stream_buffer_t *buffer) {
+    release_storage(buffer->pool, buffer->data, buffer->capacity);
+    stream_buffer_init(buffer, buffer->pool);
+}
@@ -6,11 +6,17 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <poll.h>
+#include "../include/load_generator.h"
+#include "../include/protocol.h"
 
 #define BUFFER_SIZE 1024
 #define DEFAULT_PORT 8080
 #define DEFAULT_HOST "127.0.0.1"
 
+// Payload of the large binary echo test, well past the server's buffering limit
+#define BINARY_LARGE_PAYLOAD (1024 * 1024)
+
 /**
  * Print error message with system error description
  */
@@ -27,33 +33,20 @@ void print_client_info(const char *message) {
 }
 
 /**
- * Create and connect to server socket
+ * Create and connect to server socket, over TCP or a Unix socket
  */
-int connect_to_server(const char *host, int port) {
+int connect_to_server(const struct sockaddr_storage *server_addr, socklen_t server_addr_len) {
     int client_fd;
-    struct sockaddr_in server_addr;
     
     // Create socket
-    client_fd = socket(AF_INET, SOCK_STREAM, 0);
+    client_fd = socket(server_addr->ss_family, SOCK_STREAM, 0);
     if (client_fd == -1) {
         print_client_error("Failed to create socket");
         return -1;
     }
     
-    // Setup server address
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    
-    // Convert IP address from text to binary form
-    if (inet_pton(AF_INET, host, &server_addr.sin_addr) <= 0) {
-        fprintf(stderr, "[ERROR] Invalid address: %s\n", host);
-        close(client_fd);
-        return -1;
-    }
-    
     // Connect to server
-    if (connect(client_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
+    if (connect(client_fd, (const struct sockaddr*)server_addr, server_addr_len) == -1) {
         print_client_error("Failed to connect to server");
         close(client_fd);
         return -1;
@@ -155,6 +148,168 @@ void automated_test_mode(int client_fd) {
     print_client_info("Automated tests completed");
 }
 
+/**
+ * Send a request and receive a reply of known size at the same time, so
+ * large payloads can't deadlock against the server's flow control. A reply
+ * may be complete before the request is (PING answers from the header), so
+ * both have to finish.
+ */
+static int exchange(int client_fd, const char *request, size_t request_len,
+                    char *reply, size_t reply_len) {
+    size_t sent = 0, received = 0;
+    struct pollfd pfd;
+    ssize_t n;
+    
+    pfd.fd = client_fd;
+    while (received < reply_len || sent < request_len) {
+        pfd.events = (received < reply_len ? POLLIN : 0) | (sent < request_len ? POLLOUT : 0);
+        if (poll(&pfd, 1, 5000) <= 0) {
+            fprintf(stderr, "[ERROR] Timed out waiting for the server\n");
+            return -1;
+        }
+        if ((pfd.revents & POLLOUT) && sent < request_len) {
+            n = send(client_fd, request + sent, request_len - sent, MSG_DONTWAIT);
+            if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                print_client_error("Failed to send frame");
+                return -1;
+            }
+            sent += n > 0 ? (size_t)n : 0;
+        }
+        if ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) && received < reply_len) {
+            n = recv(client_fd, reply + received, reply_len - received, MSG_DONTWAIT);
+            if (n == 0) {
+                print_client_info("Server closed the connection");
+                return -1;
+            }
+            if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                print_client_error("Failed to receive reply");
+                return -1;
+            }
+            received += n > 0 ? (size_t)n : 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Send one binary frame and check the reply's header and payload
+ */
+static int binary_test(int client_fd, uint16_t opcode, uint32_t request_id,
+                       const char *payload, size_t payload_len,
+                       uint16_t expected_status, size_t expected_len) {
+    binary_header_t header;
+    char *request, *reply;
+    int result = -1;
+    
+    request = malloc(BINARY_HEADER_SIZE + payload_len);
+    reply = malloc(BINARY_HEADER_SIZE + expected_len);
+    if (request == NULL || reply == NULL) {
+        free(request);
+        free(reply);
+        return -1;
+    }
+    
+    header.length = (uint32_t)payload_len;
+    header.request_id = request_id;
+    header.opcode = opcode;
+    header.status = 0;
+    binary_header_encode(&header, request);
+    memcpy(request + BINARY_HEADER_SIZE, payload, payload_len);
+    
+    if (exchange(client_fd, request, BINARY_HEADER_SIZE + payload_len,
+                 reply, BINARY_HEADER_SIZE + expected_len) == 0) {
+        binary_header_decode(reply, &header);
+        if (header.request_id == request_id && header.opcode == opcode &&
+            header.status == expected_status && header.length == expected_len &&
+            (expected_len == 0 || memcmp(reply + BINARY_HEADER_SIZE, payload, expected_len) == 0)) {
+            result = 0;
+        }
+    }
+    
+    printf("Opcode %u, id %u, %zu-byte payload: %s\n", (unsigned)opcode, (unsigned)request_id,
+           payload_len, result == 0 ? "ok" : "FAILED");
+    free(request);
+    free(reply);
+    return result;
+}
+
+/**
+ * Join a room from two connections, publish from one and check that the
+ * other receives the message
+ */
+static int room_test(int client_fd, const struct sockaddr_storage *server_addr,
+                     socklen_t server_addr_len) {
+    static const char join[] = "\0test";
+    static const char message[] = "hello room";
+    const unsigned char magic = PROTOCOL_BINARY_MAGIC;
+    char reply[BINARY_HEADER_SIZE + sizeof(message)];
+    binary_header_t header;
+    int peer_fd, result = -1;
+    
+    peer_fd = connect_to_server(server_addr, server_addr_len);
+    if (peer_fd == -1) {
+        return -1;
+    }
+    
+    if (send(peer_fd, &magic, 1, 0) == 1 &&
+        binary_test(peer_fd, BINARY_OP_JOIN, 10, join, sizeof(join) - 1, BINARY_STATUS_OK, 0) == 0 &&
+        binary_test(client_fd, BINARY_OP_JOIN, 11, join, sizeof(join) - 1, BINARY_STATUS_OK, 0) == 0 &&
+        binary_test(client_fd, BINARY_OP_PUBLISH, 12, message, sizeof(message), BINARY_STATUS_OK, 0) == 0 &&
+        exchange(peer_fd, NULL, 0, reply, sizeof(reply)) == 0) {
+        binary_header_decode(reply, &header);
+        if (header.opcode == BINARY_OP_PUBLISH && header.request_id == 12 &&
+            header.length == sizeof(message) &&
+            memcmp(reply + BINARY_HEADER_SIZE, message, sizeof(message)) == 0) {
+            result = 0;
+        }
+    }
+    
+    printf("Room broadcast to a second connection: %s\n", result == 0 ? "ok" : "FAILED");
+    close(peer_fd);
+    return result;
+}
+
+/**
+ * Binary protocol test mode - negotiate binary framing and check replies
+ */
+int binary_test_mode(int client_fd, const struct sockaddr_storage *server_addr,
+                     socklen_t server_addr_len) {
+    static const char blob[] = "binary\0payload\nwith\0zeros";
+    const unsigned char magic = PROTOCOL_BINARY_MAGIC;
+    char *large;
+    size_t i;
+    int failures = 0;
+    
+    print_client_info("Running binary protocol tests...");
+    
+    if (send(client_fd, &magic, 1, 0) != 1) {
+        print_client_error("Failed to send protocol byte");
+        return -1;
+    }
+    
+    failures -= binary_test(client_fd, BINARY_OP_ECHO, 1, blob, sizeof(blob), BINARY_STATUS_OK, sizeof(blob));
+    failures -= binary_test(client_fd, BINARY_OP_PING, 2, blob, sizeof(blob), BINARY_STATUS_OK, 0);
+    failures -= binary_test(client_fd, 99, 3, blob, sizeof(blob), BINARY_STATUS_UNKNOWN_OPCODE, 0);
+    failures -= binary_test(client_fd, BINARY_OP_ECHO, 4, NULL, 0, BINARY_STATUS_OK, 0);
+    
+    large = malloc(BINARY_LARGE_PAYLOAD);
+    if (large == NULL) {
+        return -1;
+    }
+    for (i = 0; i < BINARY_LARGE_PAYLOAD; i++) {
+        large[i] = (char)(i * 31);
+    }
+    failures -= binary_test(client_fd, BINARY_OP_ECHO, 5, large, BINARY_LARGE_PAYLOAD,
+                            BINARY_STATUS_OK, BINARY_LARGE_PAYLOAD);
+    failures -= binary_test(client_fd, BINARY_OP_PING, 6, large, BINARY_LARGE_PAYLOAD, BINARY_STATUS_OK, 0);
+    free(large);
+    
+    failures -= room_test(client_fd, server_addr, server_addr_len);
+    
+    print_client_info(failures == 0 ? "Binary protocol tests passed" : "Binary protocol tests FAILED");
+    return failures == 0 ? 0 : -1;
+}
+
 /**
  * Print usage information
  */
@@ -163,13 +318,27 @@ void print_usage(const char *program_name) {
     printf("Options:\n");
     printf("  -h HOST      Server hostname/IP (default: %s)\n", DEFAULT_HOST);
     printf("  -p PORT      Server port (default: %d)\n", DEFAULT_PORT);
+    printf("  -u PATH      Connect to a Unix socket instead ('@NAME' for abstract)\n");
     printf("  -a           Run automated tests instead of interactive mode\n");
+    printf("  -B           Run binary protocol tests instead of interactive mode\n");
+    printf("  -L           Run a load test instead of interactive mode\n");
     printf("  -?           Show this help message\n");
+    printf("\nLoad test options:\n");
+    printf("  -c CONNS     Concurrent connections (default: %d)\n", LOAD_DEFAULT_CONNECTIONS);
+    printf("  -i CONNS     Extra idle connections held open (default: 0)\n");
+    printf("  -t THREADS   Client threads, one event loop each (default: %d)\n", LOAD_DEFAULT_THREADS);
+    printf("  -d SECONDS   Test duration (default: %d)\n", LOAD_DEFAULT_DURATION);
+    printf("  -r RATE      Total requests per second (open loop); 0 = closed loop (default)\n");
+    printf("  -P DEPTH     Requests in flight per connection (default: %d)\n", LOAD_DEFAULT_DEPTH);
+    printf("  -s BYTES     Request payload size (default: %d)\n", LOAD_DEFAULT_PAYLOAD);
     printf("\nExamples:\n");
     printf("  %s                    # Connect to localhost:8080 (interactive)\n", program_name);
     printf("  %s -p 9090            # Connect to localhost:9090\n", program_name);
     printf("  %s -h 192.168.1.100   # Connect to specific IP\n", program_name);
+    printf("  %s -u /tmp/tcp.sock   # Connect over a Unix socket\n", program_name);
     printf("  %s -a                 # Run automated tests\n", program_name);
+    printf("  %s -L -c 1000 -t 4    # 1000 connections, closed loop\n", program_name);
+    printf("  %s -L -r 50000 -P 8   # 50k req/s open loop, up to 8 in flight\n", program_name);
 }
 
 /**
@@ -178,13 +347,24 @@ void print_usage(const char *program_name) {
 int main(int argc, char *argv[]) {
     char *host = DEFAULT_HOST;
     int port = DEFAULT_PORT;
+    const char *unix_path = NULL;
+    struct sockaddr_storage server_addr;
+    socklen_t server_addr_len;
+    char target[128];
     int automated = 0;
+    int binary = 0;
+    int status = EXIT_SUCCESS;
+    int load_test = 0;
+    load_config_t load;
+    load_result_t result;
     int client_fd;
     int opt;
     char connect_msg[256];
     
+    load_config_init(&load);
+    
     // Parse command line arguments
-    while ((opt = getopt(argc, argv, "h:p:a?")) != -1) {
+    while ((opt = getopt(argc, argv, "h:p:u:aBLc:i:t:d:r:P:s:?")) != -1) {
         switch (opt) {
             case 'h':
                 host = optarg;
@@ -196,9 +376,67 @@ int main(int argc, char *argv[]) {
                     return EXIT_FAILURE;
                 }
                 break;
+            case 'u':
+                unix_path = optarg;
+                break;
             case 'a':
                 automated = 1;
                 break;
+            case 'B':
+                binary = 1;
+                break;
+            case 'L':
+                load_test = 1;
+                break;
+            case 'c':
+                load.connections = atoi(optarg);
+                if (load.connections <= 0) {
+                    fprintf(stderr, "Error: Connections must be positive\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'i':
+                load.idle_connections = atoi(optarg);
+                if (load.idle_connections < 0) {
+                    fprintf(stderr, "Error: Idle connections cannot be negative\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 't':
+                load.threads = atoi(optarg);
+                if (load.threads <= 0 || load.threads > LOAD_MAX_THREADS) {
+                    fprintf(stderr, "Error: Threads must be between 1 and %d\n", LOAD_MAX_THREADS);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'd':
+                load.duration = atoi(optarg);
+                if (load.duration <= 0) {
+                    fprintf(stderr, "Error: Duration must be positive\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'r':
+                load.rate = atof(optarg);
+                if (load.rate < 0) {
+                    fprintf(stderr, "Error: Rate cannot be negative\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'P':
+                load.depth = atoi(optarg);
+                if (load.depth <= 0) {
+                    fprintf(stderr, "Error: Depth must be positive\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 's':
+                load.payload_size = atoi(optarg);
+                if (load.payload_size <= 0 || load.payload_size > LOAD_MAX_PAYLOAD) {
+                    fprintf(stderr, "Error: Payload size must be between 1 and %d\n", LOAD_MAX_PAYLOAD);
+                    return EXIT_FAILURE;
+                }
+                break;
             case '?':
             default:
                 print_usage(argv[0]);
@@ -206,21 +444,48 @@ int main(int argc, char *argv[]) {
         }
     }
     
+    if (load_server_address(host, port, unix_path, &server_addr, &server_addr_len) == -1) {
+        return EXIT_FAILURE;
+    }
+    if (unix_path != NULL) {
+        snprintf(target, sizeof(target), "unix:%s", unix_path);
+    } else {
+        snprintf(target, sizeof(target), "%s:%d", host, port);
+    }
+    
+    // Load test mode manages its own connections
+    if (load_test) {
+        load.host = host;
+        load.port = port;
+        load.unix_path = unix_path;
+        snprintf(connect_msg, sizeof(connect_msg), "Running load test against %s...", target);
+        print_client_info(connect_msg);
+        if (run_load_test(&load, &result) == -1) {
+            return EXIT_FAILURE;
+        }
+        print_load_result(&load, &result);
+        return result.requests > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    
     // Connect to server
-    snprintf(connect_msg, sizeof(connect_msg), "Connecting to %s:%d...", host, port);
+    snprintf(connect_msg, sizeof(connect_msg), "Connecting to %s...", target);
     print_client_info(connect_msg);
     
-    client_fd = connect_to_server(host, port);
+    client_fd = connect_to_server(&server_addr, server_addr_len);
     if (client_fd == -1) {
         fprintf(stderr, "Failed to connect to server\n");
         return EXIT_FAILURE;
     }
     
-    snprintf(connect_msg, sizeof(connect_msg), "Successfully connected to %s:%d", host, port);
+    snprintf(connect_msg, sizeof(connect_msg), "Successfully connected to %s", target);
     print_client_info(connect_msg);
     
     // Run in appropriate mode
-    if (automated) {
+    if (binary) {
+        if (binary_test_mode(client_fd, &server_addr, server_addr_len) == -1) {
+            status = EXIT_FAILURE;
+        }
+    } else if (automated) {
         automated_test_mode(client_fd);
     } else {
         interactive_mode(client_fd);
@@ -230,5 +495,5 @@ int main(int argc, char *argv[]) {
     print_client_info("Closing connection...");
     close(client_fd);
     
-    return EXIT_SUCCESS;
+    return status;
 }
\ No newline at end of file
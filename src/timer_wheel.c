@@ -0,0 +1,206 @@
+#include "../include/timer_wheel.h"
+#include <stddef.h>
+
+#define SLOT_MASK ((uint64_t)TIMER_SLOTS - 1)
+
+// Ticks spanned by one full turn of the wheel
+#define WHEEL_SPAN ((uint64_t)1 << (TIMER_LEVELS * TIMER_LEVEL_BITS))
+
+/**
+ * Rotate a slot bitmap right so that bit `shift` becomes bit 0
+ */
+static uint64_t rotate_right(uint64_t bits, unsigned shift) {
+    shift &= 63;
+    return shift == 0 ? bits : (bits >> shift) | (bits << (64 - shift));
+}
+
+/**
+ * Link a timer into the slot matching its distance from the current tick
+ */
+static void wheel_insert(timer_wheel_t *wheel, timer_entry_t *timer) {
+    uint64_t delta = timer->expires - wheel->current;
+    timer_entry_t *head;
+    int level = 0;
+    unsigned index;
+
+    while (level < TIMER_LEVELS - 1 &&
+           delta >= ((uint64_t)1 << ((level + 1) * TIMER_LEVEL_BITS))) {
+        level++;
+    }
+    index = (unsigned)((timer->expires >> (level * TIMER_LEVEL_BITS)) & SLOT_MASK);
+
+    timer->slot = (unsigned)level * TIMER_SLOTS + index;
+    head = &wheel->slots[timer->slot];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+    wheel->occupied[level] |= (uint64_t)1 << index;
+}
+
+/**
+ * Unlink a timer, clearing its slot's bit once the slot is empty
+ */
+static void wheel_unlink(timer_wheel_t *wheel, timer_entry_t *timer) {
+    timer_entry_t *head = &wheel->slots[timer->slot];
+
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+
+    if (head->next == head) {
+        wheel->occupied[timer->slot / TIMER_SLOTS] &= ~((uint64_t)1 << (timer->slot % TIMER_SLOTS));
+    }
+}
+
+/**
+ * Move every timer of a higher-level slot down to the level it now belongs to
+ */
+static void wheel_cascade(timer_wheel_t *wheel, int level, unsigned index) {
+    timer_entry_t *head = &wheel->slots[level * TIMER_SLOTS + index];
+
+    while (head->next != head) {
+        timer_entry_t *timer = head->next;
+        wheel_unlink(wheel, timer);
+        wheel_insert(wheel, timer);
+    }
+}
+
+/**
+ * Initialize an empty wheel
+ */
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now) {
+    int i;
+
+    for (i = 0; i < TIMER_LEVELS * TIMER_SLOTS; i++) {
+        wheel->slots[i].next = &wheel->slots[i];
+        wheel->slots[i].prev = &wheel->slots[i];
+    }
+    for (i = 0; i < TIMER_LEVELS; i++) {
+        wheel->occupied[i] = 0;
+    }
+    wheel->current = now;
+    wheel->count = 0;
+}
+
+/**
+ * Mark a timer as not scheduled
+ */
+void timer_entry_init(timer_entry_t *timer) {
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->slot = 0;
+}
+
+/**
+ * Check whether a timer is scheduled
+ */
+int timer_pending(const timer_entry_t *timer) {
+    return timer->next != NULL;
+}
+
+/**
+ * Schedule (or reschedule) a timer
+ */
+void timer_wheel_schedule(timer_wheel_t *wheel, timer_entry_t *timer, uint64_t expires) {
+    timer_wheel_cancel(wheel, timer);
+
+    if (expires <= wheel->current) {
+        expires = wheel->current + 1;
+    } else if (expires - wheel->current >= WHEEL_SPAN) {
+        expires = wheel->current + WHEEL_SPAN - 1;
+    }
+
+    timer->expires = expires;
+    wheel_insert(wheel, timer);
+    wheel->count++;
+}
+
+/**
+ * Unschedule a timer
+ */
+void timer_wheel_cancel(timer_wheel_t *wheel, timer_entry_t *timer) {
+    if (!timer_pending(timer)) {
+        return;
+    }
+    wheel_unlink(wheel, timer);
+    wheel->count--;
+}
+
+/**
+ * Process every tick up to now, firing the timers that expire
+ */
+void timer_wheel_advance(timer_wheel_t *wheel, uint64_t now, timer_callback_t callback, void *arg) {
+    // Nothing to fire or cascade: skip the idle ticks entirely
+    if (wheel->count == 0 && now > wheel->current) {
+        wheel->current = now;
+        return;
+    }
+
+    while (wheel->current < now) {
+        timer_entry_t *head;
+        int level, top = 0;
+
+        wheel->current++;
+
+        // When lower levels wrap around, pull the next slot of each higher
+        // level down, highest first so nothing lands in an already emptied slot
+        while (top < TIMER_LEVELS - 1 &&
+               (wheel->current & (((uint64_t)1 << ((top + 1) * TIMER_LEVEL_BITS)) - 1)) == 0) {
+            top++;
+        }
+        for (level = top; level > 0; level--) {
+            wheel_cascade(wheel, level,
+                          (unsigned)((wheel->current >> (level * TIMER_LEVEL_BITS)) & SLOT_MASK));
+        }
+
+        // Every timer left in this level-0 slot expires now
+        head = &wheel->slots[wheel->current & SLOT_MASK];
+        while (head->next != head) {
+            timer_entry_t *timer = head->next;
+            wheel_unlink(wheel, timer);
+            wheel->count--;
+            callback(timer, arg);
+        }
+
+        if (wheel->count == 0) {
+            wheel->current = now;
+        }
+    }
+}
+
+/**
+ * Find the next tick the wheel has work at
+ */
+int timer_wheel_next_tick(const timer_wheel_t *wheel, uint64_t *tick) {
+    uint64_t best = 0;
+    int level, found = 0;
+
+    if (wheel->count == 0) {
+        return -1;
+    }
+
+    for (level = 0; level < TIMER_LEVELS; level++) {
+        unsigned shift = (unsigned)(level * TIMER_LEVEL_BITS);
+        uint64_t position = wheel->current >> shift;
+        uint64_t bits = rotate_right(wheel->occupied[level], (unsigned)(position + 1));
+        uint64_t candidate;
+
+        if (bits == 0) {
+            continue;
+        }
+
+        // The first occupied slot after the current one; a level-0 slot
+        // expires at that tick, a higher-level slot cascades when it starts
+        candidate = (position + (uint64_t)__builtin_ctzll(bits) + 1) << shift;
+        if (!found || candidate < best) {
+            best = candidate;
+            found = 1;
+        }
+    }
+
+    *tick = best;
+    return found ? 0 : -1;
+}
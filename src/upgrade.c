@@ -0,0 +1,740 @@
+#define _GNU_SOURCE
+#include "../include/upgrade.h"
+#include "../include/client_handler.h"
+#include "../include/socket_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+// How often a draining process checks whether its workers are done
+#define UPGRADE_DRAIN_POLL_MS 100
+
+/**
+ * Buffered bytes of one connection on their way to the upgrade socket,
+ * sent in messages of UPGRADE_DATA_SIZE
+ */
+typedef struct {
+    int socket_fd;                  // Upgrade socket
+    size_t used;                    // Bytes waiting in data
+    char data[UPGRADE_DATA_SIZE];
+} upgrade_writer_t;
+
+/**
+ * Make either side give up on the other after UPGRADE_TIMEOUT_SECONDS
+ */
+static int set_upgrade_timeouts(int socket_fd) {
+    struct timeval timeout;
+
+    timeout.tv_sec = UPGRADE_TIMEOUT_SECONDS;
+    timeout.tv_usec = 0;
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1 ||
+        setsockopt(socket_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == -1) {
+        print_error("Failed to set upgrade socket timeouts");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Send one message, with a descriptor attached unless fd is -1
+ */
+static int send_message(int socket_fd, const upgrade_message_t *message, int fd) {
+    union {
+        struct cmsghdr header;
+        char data[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *)message;
+    iov.iov_len = sizeof(*message);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd != -1) {
+        struct cmsghdr *cmsg;
+
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.data;
+        msg.msg_controllen = sizeof(control.data);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    while (sendmsg(socket_fd, &msg, MSG_NOSIGNAL) == -1) {
+        if (errno != EINTR) {
+            print_error("Failed to send upgrade message");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Receive one message and the descriptor attached to it, if any
+ * @return 0 on success, -1 on error or if the other side is gone
+ */
+static int receive_message(int socket_fd, upgrade_message_t *message, int *fd) {
+    union {
+        struct cmsghdr header;
+        char data[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    ssize_t received;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = message;
+    iov.iov_len = sizeof(*message);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data;
+    msg.msg_controllen = sizeof(control.data);
+
+    do {
+        received = recvmsg(socket_fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (received == -1 && errno == EINTR);
+
+    *fd = -1;
+    for (cmsg = CMSG_FIRSTHDR(&msg); received > 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    if (received == -1) {
+        print_error("Failed to receive upgrade message");
+        return -1;
+    }
+    if (received != (ssize_t)sizeof(*message) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        print_log(LOG_ERROR, received == 0 ? "Upgrade peer closed the connection"
+                                           : "Malformed upgrade message");
+        if (*fd != -1) {
+            close(*fd);
+            *fd = -1;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Receive length bytes sent in messages of at most UPGRADE_DATA_SIZE
+ */
+static int receive_data(int socket_fd, char *data, size_t length) {
+    size_t received = 0, want;
+    ssize_t result;
+
+    while (received < length) {
+        want = length - received < UPGRADE_DATA_SIZE ? length - received : UPGRADE_DATA_SIZE;
+        result = recv(socket_fd, data + received, want, 0);
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0 || (size_t)result != want) {
+            print_error("Failed to receive connection data");
+            return -1;
+        }
+        received += want;
+    }
+    return 0;
+}
+
+/**
+ * Send the bytes gathered by a writer as one message
+ */
+static int flush_writer(upgrade_writer_t *writer) {
+    ssize_t sent;
+
+    if (writer->used == 0) {
+        return 0;
+    }
+    do {
+        sent = send(writer->socket_fd, writer->data, writer->used, MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+    if (sent == -1) {
+        print_error("Failed to send connection data");
+        return -1;
+    }
+    writer->used = 0;
+    return 0;
+}
+
+/**
+ * Add bytes to a writer, sending every message it fills
+ */
+static int write_data(upgrade_writer_t *writer, const char *data, size_t length) {
+    size_t part;
+
+    while (length > 0) {
+        part = UPGRADE_DATA_SIZE - writer->used;
+        if (part > length) {
+            part = length;
+        }
+        memcpy(writer->data + writer->used, data, part);
+        writer->used += part;
+        data += part;
+        length -= part;
+        if (writer->used == UPGRADE_DATA_SIZE && flush_writer(writer) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Take the upgrade socket passed by a previous process, if any
+ */
+int upgrade_inherited_socket(void) {
+    const char *value = getenv(UPGRADE_ENV);
+    int socket_fd;
+
+    if (value == NULL) {
+        return -1;
+    }
+    socket_fd = atoi(value);
+    unsetenv(UPGRADE_ENV);
+
+    // Not passed on when this process upgrades in turn
+    if (socket_fd <= STDERR_FILENO || fcntl(socket_fd, F_SETFD, FD_CLOEXEC) == -1) {
+        fprintf(stderr, "Ignoring invalid %s\n", UPGRADE_ENV);
+        return -1;
+    }
+    return socket_fd;
+}
+
+/**
+ * Check whether an inherited Unix listener is bound to the path this
+ * process was told to listen on
+ */
+static int unix_listener_matches(int fd, const char *path) {
+    struct sockaddr_un bound, wanted;
+    socklen_t bound_length = sizeof(bound), wanted_length;
+
+    if (path == NULL || setup_unix_address(&wanted, path, &wanted_length) == -1 ||
+        getsockname(fd, (struct sockaddr *)&bound, &bound_length) == -1) {
+        return 0;
+    }
+    return bound_length == wanted_length && memcmp(&bound, &wanted, wanted_length) == 0;
+}
+
+/**
+ * Receive the previous process's listening sockets
+ */
+int upgrade_receive_listeners(int socket_fd, server_config_t *config) {
+    upgrade_message_t message;
+    int *listen_fds;
+    int i, fd, count;
+    char info_msg[128];
+
+    if (set_upgrade_timeouts(socket_fd) == -1 || receive_message(socket_fd, &message, &fd) == -1) {
+        return -1;
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    if (message.type != UPGRADE_HELLO || message.version != UPGRADE_VERSION) {
+        print_log(LOG_ERROR, "Previous process speaks a different upgrade protocol");
+        return -1;
+    }
+    count = (int)message.count;
+
+    // Worker listeners are sent in worker order, the others last
+    listen_fds = malloc(((size_t)count + 1) * sizeof(int));
+    if (listen_fds == NULL) {
+        print_error("Failed to allocate inherited listeners");
+        return -1;
+    }
+    config->listen_fds = listen_fds;
+    config->listen_fd_count = 0;
+
+    for (i = 0; i < count; i++) {
+        if (receive_message(socket_fd, &message, &fd) == -1) {
+            return -1;
+        }
+        if (message.type != UPGRADE_LISTENER || fd == -1) {
+            print_log(LOG_ERROR, "Expected a listening socket from the previous process");
+            if (fd != -1) {
+                close(fd);
+            }
+            return -1;
+        }
+
+        if (message.listener == UPGRADE_LISTENER_ADMIN) {
+            // This process may not serve metrics; the listener is closed then
+            if (config->admin_port > 0 && config->admin_fd == -1) {
+                config->admin_fd = fd;
+            } else {
+                close(fd);
+            }
+        } else if (message.listener == UPGRADE_LISTENER_UNIX) {
+            // Kept only if this process listens on the same name
+            if (config->unix_fd == -1 && unix_listener_matches(fd, config->unix_path)) {
+                config->unix_fd = fd;
+            } else {
+                close(fd);
+            }
+        } else if ((int)message.worker == config->listen_fd_count) {
+            listen_fds[config->listen_fd_count++] = fd;
+        } else {
+            close(fd);
+        }
+    }
+
+    snprintf(info_msg, sizeof(info_msg), "Inherited %d listener(s) from process %d",
+             config->listen_fd_count, (int)getppid());
+    print_server_info(info_msg);
+    return 0;
+}
+
+/**
+ * Recreate one handed-over connection in a worker. The worker's event
+ * loop is not running yet.
+ * @return 0 on success, -1 if the connection was closed
+ */
+static int adopt_client(server_t *server, int client_fd, const upgrade_message_t *message,
+                        const char *data) {
+    client_info_t *client;
+    char addr_str[64];
+    char info_msg[256];
+
+    // Unix peers' credentials are read again from the socket itself
+    client = add_client(server, client_fd, (const struct sockaddr *)&message->address,
+                        (socklen_t)message->address_length);
+    if (client == NULL) {
+        close(client_fd);
+        return -1;
+    }
+    if (event_loop_add(&server->loop, client_fd, EVENT_READ | EVENT_STREAM, client) == -1) {
+        print_error("Failed to watch client socket");
+        cleanup_client(server, client);
+        return -1;
+    }
+    client->interest = EVENT_READ;
+    METRIC_ADD(server->metrics.connections, 1);
+
+    // Framing continues where the previous process left off; zero-copy
+    // ids continue the socket's own count
+    client->meta->connected_at = (time_t)message->connected_at;
+    client->protocol = (protocol_t)message->protocol;
+    client->frame_remaining = (size_t)message->frame_remaining;
+    client->frame_discard = (int)message->frame_discard;
+    client->zerocopy_next_id = message->zerocopy_next_id;
+
+    if (message->in_room) {
+        if (room_join(&server->rooms, client, message->room, message->room_length) == -1) {
+            remove_client(server, client, DISCONNECT_INTERNAL_ERROR);
+            return -1;
+        }
+        client->room_policy = (subscriber_policy_t)message->room_policy;
+    } else {
+        room_leave(&server->rooms, client);
+    }
+
+    // Unframed input is processed on the first turn; replies the previous
+    // process could not send yet go out first
+    if ((message->input_length > 0 &&
+         stream_buffer_append(&client->input, data, (size_t)message->input_length) == -1) ||
+        (message->output_length > 0 &&
+         queue_client_message(server, client, data + message->input_length,
+                              (size_t)message->output_length) == -1)) {
+        remove_client(server, client, DISCONNECT_INTERNAL_ERROR);
+        return -1;
+    }
+
+    // Requests may already be waiting in the socket, with no new edge to
+    // announce them
+    client->input_backlog = stream_buffer_length(&client->input) > 0;
+    schedule_client_turn(server, client);
+
+    describe_client(client, addr_str, sizeof(addr_str));
+    snprintf(info_msg, sizeof(info_msg), "Adopted client %s from the previous process", addr_str);
+    print_connection_info(info_msg);
+    return 0;
+}
+
+/**
+ * Close the inherited listeners no worker took
+ */
+static void release_inherited_listeners(server_config_t *config) {
+    int i;
+
+    // With fewer workers than before, connections queued on the extra
+    // listeners are lost
+    for (i = config->workers; i < config->listen_fd_count; i++) {
+        close(config->listen_fds[i]);
+    }
+    free((void *)config->listen_fds);
+    config->listen_fds = NULL;
+    config->listen_fd_count = 0;
+    config->admin_fd = -1;
+}
+
+/**
+ * Report readiness and adopt the connections the previous process hands over
+ */
+int upgrade_adopt_clients(int socket_fd, worker_t *workers, server_config_t *config) {
+    upgrade_message_t message;
+    char *data;
+    size_t length;
+    int client_fd, adopted = 0, lost = 0, result = -1;
+    char info_msg[128];
+
+    // Every worker has its listener, so the previous process may stop accepting
+    release_inherited_listeners(config);
+    memset(&message, 0, sizeof(message));
+    message.type = UPGRADE_READY;
+    if (send_message(socket_fd, &message, -1) == -1) {
+        close(socket_fd);
+        return -1;
+    }
+
+    while (receive_message(socket_fd, &message, &client_fd) == 0) {
+        if (message.type == UPGRADE_END) {
+            result = 0;
+            break;
+        }
+        if (message.type != UPGRADE_CLIENT || client_fd == -1) {
+            print_log(LOG_ERROR, "Expected a connection from the previous process");
+            if (client_fd != -1) {
+                close(client_fd);
+            }
+            break;
+        }
+
+        length = (size_t)(message.input_length + message.output_length);
+        data = length > 0 ? malloc(length) : NULL;
+        if (length > 0 && (data == NULL || receive_data(socket_fd, data, length) == -1)) {
+            free(data);
+            close(client_fd);
+            break;
+        }
+
+        // Connections stay with the same worker where there is one
+        if (adopt_client(&workers[message.worker % (uint32_t)config->workers].server, client_fd,
+                         &message, data) == 0) {
+            adopted++;
+        } else {
+            lost++;
+        }
+        free(data);
+    }
+    close(socket_fd);
+
+    snprintf(info_msg, sizeof(info_msg), "Adopted %d connection(s) from the previous process (%d lost)",
+             adopted, lost);
+    print_server_info(info_msg);
+    return result;
+}
+
+/**
+ * Build the new process's environment: this one's plus the upgrade socket
+ */
+static char **upgrade_environment(char *entry) {
+    size_t count = 0, i, used = 0;
+    size_t name_length = strlen(UPGRADE_ENV);
+    char **env;
+
+    while (environ[count] != NULL) {
+        count++;
+    }
+    env = malloc((count + 2) * sizeof(char *));
+    if (env == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < count; i++) {
+        if (strncmp(environ[i], UPGRADE_ENV, name_length) != 0 || environ[i][name_length] != '=') {
+            env[used++] = environ[i];
+        }
+    }
+    env[used++] = entry;
+    env[used] = NULL;
+    return env;
+}
+
+/**
+ * Exec this program again with the other end of the upgrade socket
+ * @return Process id of the new process, -1 on error
+ */
+static pid_t spawn_new_process(char *argv[], int socket_fd) {
+    char entry[64];
+    char **env;
+    pid_t pid;
+
+    snprintf(entry, sizeof(entry), "%s=%d", UPGRADE_ENV, socket_fd);
+    env = upgrade_environment(entry);
+    if (env == NULL) {
+        print_error("Failed to build upgrade environment");
+        return -1;
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        // Only async-signal-safe calls until exec: the socket is the one
+        // descriptor the new process inherits
+        if (fcntl(socket_fd, F_SETFD, 0) == 0) {
+            execvpe(argv[0], argv, env);
+        }
+        _exit(127);
+    }
+    if (pid == -1) {
+        print_error("Failed to fork new process");
+    }
+    free(env);
+    return pid;
+}
+
+/**
+ * Pass every worker's listening socket, and the admin listener, to the
+ * new process
+ */
+static int send_listeners(int socket_fd, worker_t *workers, int count) {
+    upgrade_message_t message;
+    int i, admin_socket = workers[0].server.admin_socket;
+    int unix_socket = workers[0].server.unix_socket;
+
+    memset(&message, 0, sizeof(message));
+    message.type = UPGRADE_HELLO;
+    message.version = UPGRADE_VERSION;
+    message.count = (uint32_t)(count + (admin_socket != -1) + (unix_socket != -1));
+    if (send_message(socket_fd, &message, -1) == -1) {
+        return -1;
+    }
+
+    message.type = UPGRADE_LISTENER;
+    message.version = 0;
+    message.count = 0;
+    message.listener = UPGRADE_LISTENER_WORKER;
+    for (i = 0; i < count; i++) {
+        message.worker = (uint32_t)i;
+        if (send_message(socket_fd, &message, workers[i].server.server_socket) == -1) {
+            return -1;
+        }
+    }
+
+    // Every worker has a duplicate of the same Unix listener; one will do
+    message.worker = 0;
+    if (unix_socket != -1) {
+        message.listener = UPGRADE_LISTENER_UNIX;
+        if (send_message(socket_fd, &message, unix_socket) == -1) {
+            return -1;
+        }
+    }
+    if (admin_socket != -1) {
+        message.listener = UPGRADE_LISTENER_ADMIN;
+        if (send_message(socket_fd, &message, admin_socket) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Append the unsent bytes of a client's output queue and splice pipe
+ */
+static int write_client_output(upgrade_writer_t *writer, client_info_t *client) {
+    out_chunk_t *chunk;
+    char buffer[UPGRADE_DATA_SIZE];
+    size_t left = client->pipe_bytes;
+    ssize_t moved;
+
+    for (chunk = client->output.head; chunk != NULL; chunk = chunk->next) {
+        const char *data = chunk->shared != NULL ? chunk->shared->data : chunk->data;
+
+        if (write_data(writer, data + chunk->offset, chunk->length - chunk->offset) == -1) {
+            return -1;
+        }
+    }
+
+    // A spliced payload's bytes still in the pipe come after the queue
+    while (left > 0) {
+        moved = read(client->pipe_fds[0], buffer, left < sizeof(buffer) ? left : sizeof(buffer));
+        if (moved == -1 && errno == EINTR) {
+            continue;
+        }
+        if (moved <= 0) {
+            print_error("Failed to read spliced payload");
+            return -1;
+        }
+        if (write_data(writer, buffer, (size_t)moved) == -1) {
+            return -1;
+        }
+        left -= (size_t)moved;
+    }
+    return 0;
+}
+
+/**
+ * Hand one connection over: its socket, framing state and buffered bytes
+ */
+static int send_client(upgrade_writer_t *writer, server_t *server, client_info_t *client) {
+    upgrade_message_t message;
+
+    memset(&message, 0, sizeof(message));
+    message.type = UPGRADE_CLIENT;
+    message.worker = (uint32_t)server->worker_id;
+    message.protocol = (uint32_t)client->protocol;
+    message.frame_discard = (uint32_t)client->frame_discard;
+    message.frame_remaining = client->frame_remaining;
+    message.input_length = stream_buffer_length(&client->input);
+    message.output_length = client->output.bytes + client->pipe_bytes;
+    message.zerocopy_next_id = client->zerocopy_next_id;
+    if (client->room != NULL) {
+        message.in_room = 1;
+        message.room_policy = (uint32_t)client->room_policy;
+        message.room_length = (uint32_t)client->room->name_length;
+        memcpy(message.room, client->room->name, client->room->name_length);
+    }
+    message.connected_at = (int64_t)client->meta->connected_at;
+    message.address = client->meta->address;
+    message.address_length = (uint32_t)client->meta->address_length;
+
+    if (send_message(writer->socket_fd, &message, client->socket_fd) == -1 ||
+        write_data(writer, stream_buffer_begin(&client->input), (size_t)message.input_length) == -1 ||
+        write_client_output(writer, client) == -1 ||
+        flush_writer(writer) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Hand every connection of a stopped worker over to the new process
+ */
+static int send_clients(upgrade_writer_t *writer, server_t *server) {
+    int fd, sent = 0;
+    char info_msg[128];
+
+    for (fd = 0; fd < server->clients.capacity; fd++) {
+        client_info_t *client = conn_table_lookup(&server->clients, fd);
+
+        // Clients being evicted are closed instead
+        if (client == NULL || client->evicting) {
+            continue;
+        }
+        if (send_client(writer, server, client) == -1) {
+            return -1;
+        }
+        sent++;
+    }
+
+    snprintf(info_msg, sizeof(info_msg), "Worker %d handed over %d connection(s)",
+             server->worker_id, sent);
+    print_server_info(info_msg);
+    return 0;
+}
+
+/**
+ * Wait until every worker has drained, or a shutdown signal cuts the
+ * drain short
+ */
+static void wait_for_drain(worker_t *workers, int count, const sigset_t *signals) {
+    struct timespec poll_interval;
+    int i, running, sig;
+
+    poll_interval.tv_sec = 0;
+    poll_interval.tv_nsec = UPGRADE_DRAIN_POLL_MS * 1000000L;
+    for (;;) {
+        running = 0;
+        for (i = 0; i < count; i++) {
+            if (workers[i].started && workers[i].server.running) {
+                running++;
+            }
+        }
+        if (running == 0) {
+            return;
+        }
+
+        sig = sigtimedwait(signals, NULL, &poll_interval);
+        if (sig == SIGINT || sig == SIGTERM) {
+            print_server_info("Received shutdown signal, ending drain");
+            return;
+        }
+    }
+}
+
+/**
+ * Start a new process and hand over to it
+ */
+int upgrade_server(char *argv[], worker_t *workers, const server_config_t *config,
+                   const sigset_t *signals) {
+    upgrade_message_t message;
+    upgrade_writer_t *writer;
+    int sockets[2], fd, i, result = 0;
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) == -1) {
+        print_error("Failed to create upgrade socket");
+        return -1;
+    }
+    pid = spawn_new_process(argv, sockets[1]);
+    close(sockets[1]);
+    if (pid == -1) {
+        close(sockets[0]);
+        return -1;
+    }
+
+    // This process keeps serving until the new one reports its workers ready
+    if (set_upgrade_timeouts(sockets[0]) == -1 ||
+        send_listeners(sockets[0], workers, config->workers) == -1 ||
+        receive_message(sockets[0], &message, &fd) == -1 ||
+        message.type != UPGRADE_READY) {
+        print_log(LOG_ERROR, "New process failed to start, upgrade cancelled");
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        close(sockets[0]);
+        return -1;
+    }
+
+    if (config->handoff) {
+        // Stop every worker with its connections intact, then pass them on
+        writer = malloc(sizeof(*writer));
+        for (i = 0; i < config->workers; i++) {
+            workers[i].server.handoff = 1;
+        }
+        stop_workers(workers, config->workers);
+        for (i = 0; i < config->workers; i++) {
+            if (writer == NULL) {
+                result = -1;
+            } else if (result == 0) {
+                writer->socket_fd = sockets[0];
+                writer->used = 0;
+                result = send_clients(writer, &workers[i].server);
+            }
+            shutdown_server(&workers[i].server);
+        }
+        free(writer);
+        if (result == -1) {
+            print_log(LOG_ERROR, "Handing over connections failed, the rest were closed");
+        }
+    }
+
+    memset(&message, 0, sizeof(message));
+    message.type = UPGRADE_END;
+    send_message(sockets[0], &message, -1);
+    close(sockets[0]);
+
+    if (!config->handoff) {
+        // The new process accepts from here on; finish the connections here
+        for (i = 0; i < config->workers; i++) {
+            drain_server(&workers[i].server);
+        }
+        wait_for_drain(workers, config->workers, signals);
+        stop_workers(workers, config->workers);
+    }
+    return 0;
+}
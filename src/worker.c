@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include "../include/worker.h"
+#include "../include/socket_utils.h"
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+
+/**
+ * Pin the calling thread to a single CPU
+ */
+static int pin_to_cpu(int cpu) {
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/**
+ * Worker thread entry point
+ */
+static void *worker_main(void *arg) {
+    worker_t *worker = arg;
+    char info_msg[128];
+
+    if (worker->cpu >= 0) {
+        if (pin_to_cpu(worker->cpu) != 0) {
+            snprintf(info_msg, sizeof(info_msg), "Worker %d could not be pinned to CPU %d",
+                     worker->id, worker->cpu);
+            print_info(info_msg);
+        } else {
+            snprintf(info_msg, sizeof(info_msg), "Worker %d pinned to CPU %d",
+                     worker->id, worker->cpu);
+            print_server_info(info_msg);
+        }
+    }
+
+    run_server(&worker->server);
+    return NULL;
+}
+
+/**
+ * Initialize every worker's server
+ */
+int init_workers(worker_t *workers, const server_config_t *config) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    if (cpus < 1) {
+        cpus = 1;
+    }
+
+    for (i = 0; i < config->workers; i++) {
+        worker_t *worker = &workers[i];
+
+        worker->id = i;
+        worker->cpu = config->pin_cpus ? (int)(i % cpus) : -1;
+
+        if (initialize_server(&worker->server, config, i) == -1) {
+            stop_workers(workers, i);
+            return -1;
+        }
+        worker->initialized = 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Start the thread of every initialized worker
+ */
+int start_workers(worker_t *workers, int count) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        worker_t *worker = &workers[i];
+
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            print_error("Failed to create worker thread");
+            stop_workers(workers, count);
+            return -1;
+        }
+        worker->started = 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Stop all workers and wait for their threads to exit
+ */
+void stop_workers(worker_t *workers, int count) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (workers[i].started) {
+            stop_server(&workers[i].server);
+        } else if (workers[i].initialized) {
+            cleanup_server_resources(&workers[i].server);
+            workers[i].initialized = 0;
+        }
+    }
+
+    wait_workers(workers, count);
+}
+
+/**
+ * Wait for the threads of all workers to exit
+ */
+void wait_workers(worker_t *workers, int count) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
+            workers[i].started = 0;
+            workers[i].initialized = 0;
+        }
+    }
+}